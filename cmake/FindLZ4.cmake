@@ -0,0 +1,69 @@
+#[=======================================================================[.rst:
+
+FindLZ4
+--------
+
+Find the LZ4 include dirs and libraries
+
+Result Variables
+^^^^^^^^^^^^^^^^
+
+``LZ4_FOUND``
+  True if the system has the LZ4 library.
+``LZ4_VERSION``
+  The version of the LZ4 library which was found.
+``LZ4_INCLUDE_DIRS``
+  Include directories needed to use LZ4.
+``LZ4_LIBRARIES``
+  Libraries needed to link to LZ4.
+
+Hints
+^^^^^
+
+``LZ4_ROOT``
+  Preferred installation prefix.
+
+#]=======================================================================]
+
+include(GNUInstallDirs)
+
+if(POLICY CMP0074)
+  cmake_policy(SET CMP0074 NEW)
+endif()
+
+find_path(LZ4_INCLUDE_DIR lz4.h
+  PATH_SUFFIXES ${CMAKE_INSTALL_INCLUDEDIR} include
+)
+
+find_library(LZ4_LIBRARY NAMES lz4 liblz4
+  PATH_SUFFIXES ${CMAKE_INSTALL_LIBDIR} lib64 lib
+)
+
+mark_as_advanced(LZ4_INCLUDE_DIR LZ4_LIBRARY)
+
+if(EXISTS "${LZ4_INCLUDE_DIR}/lz4.h")
+  foreach(_lz4_part MAJOR MINOR RELEASE)
+    file(STRINGS "${LZ4_INCLUDE_DIR}/lz4.h" _lz4_version_string
+      REGEX "#define LZ4_VERSION_${_lz4_part} +[0-9]+"
+    )
+    string(REGEX REPLACE "#define LZ4_VERSION_${_lz4_part} +([0-9]+).*$" "\\1"
+      LZ4_VERSION_${_lz4_part} "${_lz4_version_string}"
+    )
+  endforeach()
+  unset(_lz4_version_string)
+  set(LZ4_VERSION ${LZ4_VERSION_MAJOR}.${LZ4_VERSION_MINOR}.${LZ4_VERSION_RELEASE})
+endif()
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(LZ4
+  FOUND_VAR LZ4_FOUND
+  REQUIRED_VARS
+    LZ4_LIBRARY
+    LZ4_INCLUDE_DIR
+  VERSION_VAR LZ4_VERSION
+)
+
+if(LZ4_FOUND)
+  set(LZ4_LIBRARIES ${LZ4_LIBRARY})
+  set(LZ4_INCLUDE_DIRS ${LZ4_INCLUDE_DIR})
+endif()
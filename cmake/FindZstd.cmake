@@ -0,0 +1,69 @@
+#[=======================================================================[.rst:
+
+FindZstd
+--------
+
+Find the Zstandard include dirs and libraries
+
+Result Variables
+^^^^^^^^^^^^^^^^
+
+``Zstd_FOUND``
+  True if the system has the Zstandard library.
+``Zstd_VERSION``
+  The version of the Zstandard library which was found.
+``Zstd_INCLUDE_DIRS``
+  Include directories needed to use Zstandard.
+``Zstd_LIBRARIES``
+  Libraries needed to link to Zstandard.
+
+Hints
+^^^^^
+
+``Zstd_ROOT``
+  Preferred installation prefix.
+
+#]=======================================================================]
+
+include(GNUInstallDirs)
+
+if(POLICY CMP0074)
+  cmake_policy(SET CMP0074 NEW)
+endif()
+
+find_path(Zstd_INCLUDE_DIR zstd.h
+  PATH_SUFFIXES ${CMAKE_INSTALL_INCLUDEDIR} include
+)
+
+find_library(Zstd_LIBRARY NAMES zstd zstd_static libzstd
+  PATH_SUFFIXES ${CMAKE_INSTALL_LIBDIR} lib64 lib
+)
+
+mark_as_advanced(Zstd_INCLUDE_DIR Zstd_LIBRARY)
+
+if(EXISTS "${Zstd_INCLUDE_DIR}/zstd.h")
+  foreach(_zstd_part MAJOR MINOR RELEASE)
+    file(STRINGS "${Zstd_INCLUDE_DIR}/zstd.h" _zstd_version_string
+      REGEX "#define ZSTD_VERSION_${_zstd_part} +[0-9]+"
+    )
+    string(REGEX REPLACE "#define ZSTD_VERSION_${_zstd_part} +([0-9]+).*$" "\\1"
+      Zstd_VERSION_${_zstd_part} "${_zstd_version_string}"
+    )
+  endforeach()
+  unset(_zstd_version_string)
+  set(Zstd_VERSION ${Zstd_VERSION_MAJOR}.${Zstd_VERSION_MINOR}.${Zstd_VERSION_RELEASE})
+endif()
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(Zstd
+  FOUND_VAR Zstd_FOUND
+  REQUIRED_VARS
+    Zstd_LIBRARY
+    Zstd_INCLUDE_DIR
+  VERSION_VAR Zstd_VERSION
+)
+
+if(Zstd_FOUND)
+  set(Zstd_LIBRARIES ${Zstd_LIBRARY})
+  set(Zstd_INCLUDE_DIRS ${Zstd_INCLUDE_DIR})
+endif()
@@ -13,178 +13,101 @@
 #include "nlohmann/json.hpp"
 #include "zarray/zarray.hpp"
 #include "xtensor-io/xio_binary.hpp"
+#include "xzarr_checksum.hpp"
+#include "xzarr_chunk_stats.hpp"
 #include "xzarr_chunked_array.hpp"
 #include "xzarr_common.hpp"
+#include "xzarr_metadata.hpp"
 
 namespace xt
 {
+    template <class store_type>
+    zarray build_zarr_array(store_type& store, const xzarr_array_metadata& metadata, std::size_t chunk_pool_size, std::size_t codec_threads, bool verify_checksums = true);
+
+    /**
+     * Creates an array in a store, writing its metadata document.
+     * With a checksum (e.g. "crc32c"), the digest of each chunk is written along
+     * with it, and checked when the chunk is read.
+     */
     template <class store_type, class shape_type, class C>
-    zarray create_zarr_array(store_type store, const std::string& path, shape_type shape, shape_type chunk_shape, const std::string& dtype, char chunk_memory_layout, char chunk_separator, const C& compressor, const nlohmann::json& attrs, std::size_t chunk_pool_size, const nlohmann::json& fill_value, const std::size_t zarr_version_major)
+    zarray create_zarr_array(store_type store, const std::string& path, shape_type shape, shape_type chunk_shape, const std::string& dtype, char chunk_memory_layout, char chunk_separator, const C& compressor, const nlohmann::json& attrs, std::size_t chunk_pool_size, const nlohmann::json& fill_value, const std::size_t zarr_version_major, std::size_t codec_threads = 0, const std::string& checksum = "")
     {
-        nlohmann::json j;
-        nlohmann::json compressor_config;
-        switch (zarr_version_major)
+        xzarr_array_metadata m;
+        m.path = path;
+        m.zarr_version = zarr_version_major;
+        m.shape.assign(shape.begin(), shape.end());
+        m.chunk_shape.assign(chunk_shape.begin(), chunk_shape.end());
+        m.dtype = dtype;
+        m.chunk_memory_layout = chunk_memory_layout;
+        if (chunk_separator == 0)
         {
-            case 3:
-                j["chunk_grid"]["type"] = "regular";
-                j["chunk_grid"]["chunk_shape"] = chunk_shape;
-                if (chunk_separator == 0)
-                {
-                    chunk_separator = '/';
-                }
-                j["chunk_grid"]["separator"] = std::string(1, chunk_separator);
-                j["data_type"] = dtype;
-                j["chunk_memory_layout"] = std::string(1, chunk_memory_layout);
-                if (compressor.name != "binary")
-                {
-                    j["compressor"]["codec"] = "https://purl.org/zarr/spec/codec/" + compressor.name + "/1.0";
-                    compressor.write_to(compressor_config);
-                    j["compressor"]["configuration"] = compressor_config;
-                }
-                j["attributes"] = attrs;
-                j["extensions"] = nlohmann::json::array();
-                break;
-            case 2:
-                j["chunks"] = chunk_shape;
-                if (chunk_separator == 0)
-                {
-                    chunk_separator = '.';
-                }
-                else
-                {
-                    j["dimension_separator"] = std::string(1, chunk_separator);
-                }
-                j["dtype"] = dtype;
-                j["order"] = std::string(1, chunk_memory_layout);
-                if (compressor.name == "binary")
-                {
-                    j["compressor"] = nlohmann::json();
-                }
-                else
-                {
-                    compressor.write_to(compressor_config);
-                    j["compressor"] = compressor_config;
-                    j["compressor"]["id"] = compressor.name;
-                }
-                j["filters"] = nlohmann::json();
-                j["zarr_format"] = 2;
-                break;
-            default:
-                break;
+            chunk_separator = (zarr_version_major == 3) ? '/' : '.';
         }
-        j["shape"] = shape;
-        j["fill_value"] = fill_value;
-        std::string full_path;
-        switch (zarr_version_major)
+        m.chunk_separator = chunk_separator;
+        m.compressor = compressor.name;
+        if (compressor.name != "binary")
+        {
+            compressor.write_to(m.compressor_config);
+        }
+        m.attrs = attrs;
+        m.fill_value = fill_value;
+        m.checksum = checksum_name(parse_checksum_type(checksum));
+        write_zarr_array_metadata(store, m);
+        return build_zarr_array(store, m, chunk_pool_size, codec_threads);
+    }
+
+    /**
+     * Opens an array of a store, reading its metadata document only.
+     * On hot read paths, the checksums of the chunks can be left unchecked.
+     * The attributes of a Zarr v2 array live in a separate document, which is
+     * not read: the array has null attributes, and they are loaded on first
+     * access through xzarr_hierarchy::get_attrs (or read_zarr_attrs).
+     */
+    template <class store_type>
+    zarray get_zarr_array(store_type store, const std::string& path, std::size_t chunk_pool_size, const std::size_t zarr_version_major, std::size_t codec_threads = 0, bool verify_checksums = true)
+    {
+        auto m = read_zarr_array_metadata(store, path, zarr_version_major, false);
+        if (zarr_version_major == 2)
         {
-            case 3:
-                store["meta/root" + path + ".array.json"] = j.dump(4);
-                full_path = store.get_root() + "/data/root" + path;
-                break;
-            case 2:
-                store[path + "/.zarray"] = j.dump(4);
-                full_path = store.get_root() + '/' + path;
-                if (!attrs.empty())
-                {
-                    store[path + "/.zattrs"] = attrs.dump(4);
-                }
-                break;
-            default:
-                break;
+            m.attrs = nullptr;
         }
-        return xchunked_array_factory<store_type>::build(store, compressor.name, dtype, chunk_memory_layout, shape, chunk_shape, full_path, chunk_separator, attrs, compressor_config, chunk_pool_size, fill_value, zarr_version_major);
+        return build_zarr_array(store, m, chunk_pool_size, codec_threads, verify_checksums);
     }
 
+    /**
+     * Builds the chunked array of an array whose metadata is already in the store.
+     * @param store the store
+     * @param metadata the metadata of the array
+     * @param chunk_pool_size the number of chunks kept in memory
+     * @param codec_threads the number of internal threads of the codec (0 for automatic)
+     * @param verify_checksums whether the checksums of the chunks are checked when they are read
+     */
     template <class store_type>
-    zarray get_zarr_array(store_type store, const std::string& path, std::size_t chunk_pool_size, const std::size_t zarr_version_major)
+    zarray build_zarr_array(store_type& store, const xzarr_array_metadata& metadata, std::size_t chunk_pool_size, std::size_t codec_threads, bool verify_checksums)
     {
-        std::string s;
-        nlohmann::json attrs;
-        std::vector<std::string> keys;
-        std::vector<std::string> prefixes;
-        switch (zarr_version_major)
+        std::vector<std::size_t> shape = metadata.shape;
+        std::vector<std::size_t> chunk_shape = metadata.chunk_shape;
+        nlohmann::json compressor_config = metadata.compressor_config;
+        // runtime codec settings are not part of the metadata
+        if (codec_threads != 0)
+        {
+            compressor_config["nthreads"] = codec_threads;
+        }
+        if (!metadata.checksum.empty())
         {
-            case 3:
-                s = store[std::string("meta/root") + path + ".array.json"];
-                break;
-            case 2:
-                s = store[path + "/.zarray"];
-                store.list_dir(path, keys, prefixes);
-                if (std::count(keys.begin(), keys.end(), ".zattrs"))
-                {
-                    attrs = std::string(store[path + "/.zattrs"]);
-                }
-                break;
-            default:
-                break;
+            compressor_config[detail::checksum_option] = metadata.checksum;
+            compressor_config[detail::checksum_sidecar_option] = (metadata.zarr_version == 2);
+            compressor_config[detail::verify_checksum_option] = verify_checksums;
         }
-        auto j = nlohmann::json::parse(s);
-        auto json_shape = j["shape"];
-        nlohmann::json json_chunk_shape;
-        std::string dtype;
-        std::string chunk_memory_layout;
-        std::string compressor;
-        nlohmann::json compressor_config;
-        std::string chunk_separator;
-        std::string full_path;
-        switch (zarr_version_major)
+        std::string full_path = store.get_root() + '/' + metadata.data_prefix();
+        // the I/O handlers of the chunk pool find the recorder while the array is built, and keep it alive
+        std::shared_ptr<detail::chunk_stats_sink> stats;
+        if (!metadata.shape.empty())
         {
-            case 3:
-                json_chunk_shape = j["chunk_grid"]["chunk_shape"];
-                dtype = j["data_type"];
-                chunk_memory_layout = j["chunk_memory_layout"];
-                if (j.contains("compressor"))
-                {
-                    compressor = j["compressor"]["codec"];
-                    std::size_t i;
-                    i = compressor.rfind('/');
-                    compressor = compressor.substr(0, i);
-                    i = compressor.rfind('/') + 1;
-                    compressor = compressor.substr(i, std::string::npos);
-                    compressor_config = j["compressor"]["configuration"];
-                }
-                else
-                {
-                    compressor = "binary";
-                }
-                chunk_separator = j["chunk_grid"]["separator"];
-                full_path = store.get_root() + "/data/root" + path;
-                attrs = j["attributes"];
-                break;
-            case 2:
-                json_chunk_shape = j["chunks"];
-                dtype = j["dtype"];
-                chunk_memory_layout = j["order"];
-                if (j["compressor"].is_null())
-                {
-                    compressor = "binary";
-                }
-                else
-                {
-                    compressor = j["compressor"]["id"];
-                    compressor_config = j["compressor"];
-                    compressor_config.erase("id");
-                }
-                if (j.contains("dimension_separator"))
-                {
-                    chunk_separator = j["dimension_separator"];
-                }
-                else
-                {
-                    chunk_separator = '.';
-                }
-                full_path = store.get_root() + '/' + path;
-                break;
-            default:
-                break;
+            stats = std::make_shared<xzarr_chunk_stats_recorder<store_type>>(store, metadata);
+            compressor_config[detail::chunk_stats_option] = detail::register_chunk_stats_sink(stats);
         }
-        std::vector<std::size_t> shape(json_shape.size());
-        std::vector<std::size_t> chunk_shape(json_chunk_shape.size());
-        std::transform(json_shape.begin(), json_shape.end(), shape.begin(),
-                       [](nlohmann::json& size) -> int { return stoi(size.dump()); });
-        std::transform(json_chunk_shape.begin(), json_chunk_shape.end(), chunk_shape.begin(),
-                       [](nlohmann::json& size) -> int { return stoi(size.dump()); });
-        return xchunked_array_factory<store_type>::build(store, compressor, dtype, chunk_memory_layout[0], shape, chunk_shape, full_path, chunk_separator[0], attrs, compressor_config, chunk_pool_size, j["fill_value"], zarr_version_major);
+        return xchunked_array_factory<store_type>::build(store, metadata.compressor, metadata.dtype, metadata.chunk_memory_layout, shape, chunk_shape, full_path, metadata.chunk_separator, metadata.attrs, compressor_config, chunk_pool_size, metadata.fill_value, metadata.zarr_version);
     }
 }
 
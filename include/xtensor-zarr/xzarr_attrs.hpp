@@ -0,0 +1,362 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_ATTRS_HPP
+#define XTENSOR_ZARR_ATTRS_HPP
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+#include "xzarr_common.hpp"
+#include "xzarr_threading.hpp"
+
+namespace xt
+{
+    template <class store_type>
+    nlohmann::json read_zarr_attrs(store_type& store, const std::string& path, std::size_t zarr_version);
+
+    template <class store_type>
+    void write_zarr_attrs(store_type& store, const std::string& path, const nlohmann::json& attrs, std::size_t zarr_version);
+
+    template <class store_type>
+    std::map<std::string, nlohmann::json> read_zarr_attrs(store_type& store, const std::vector<std::string>& paths, std::size_t zarr_version, std::size_t nthreads = 0);
+
+    template <class store_type>
+    void update_zarr_attrs(store_type& store, const std::map<std::string, nlohmann::json>& updates, std::size_t zarr_version, std::size_t nthreads = 0);
+
+    /**
+     * @class xzarr_attrs_cache
+     * @brief Lazily filled attributes of the nodes of a store.
+     *
+     * The attributes of a node are read from the store on first access and
+     * kept afterwards, so that opening an array does not read them. Copies of
+     * a cache share its entries; the entries of the nodes written through the
+     * cache are kept up to date, but changes made by other writers are not seen.
+     *
+     * @tparam store_type The type of the store (e.g. xzarr_file_system_store)
+     */
+    template <class store_type>
+    class xzarr_attrs_cache
+    {
+    public:
+
+        xzarr_attrs_cache(store_type& store, std::size_t zarr_version);
+
+        nlohmann::json get(const std::string& path);
+        std::map<std::string, nlohmann::json> get(const std::vector<std::string>& paths, std::size_t nthreads = 0);
+        void set(const std::string& path, const nlohmann::json& attrs);
+        void update(const std::map<std::string, nlohmann::json>& updates, std::size_t nthreads = 0);
+        void forget(const std::string& path);
+        void clear();
+
+    private:
+
+        struct cache_state
+        {
+            std::mutex mutex;
+            std::map<std::string, nlohmann::json> entries;
+        };
+
+        bool find(const std::string& key, nlohmann::json& attrs);
+        void insert(const std::string& key, const nlohmann::json& attrs);
+
+        store_type m_store;
+        std::size_t m_zarr_version;
+        std::shared_ptr<cache_state> p_state;
+    };
+
+    /**********************************
+     * zarr attributes implementation *
+     **********************************/
+
+    namespace detail
+    {
+        inline std::string zarr_attrs_node_path(const std::string& path)
+        {
+            std::string p = path;
+            while (!p.empty() && p.back() == '/')
+            {
+                p.pop_back();
+            }
+            return p;
+        }
+
+        /// key of a Zarr v2 document (e.g. ``.zattrs``) of a node, which is at the top level for the root
+        inline std::string zarr_v2_node_key(const std::string& path, const std::string& name)
+        {
+            std::string p = zarr_attrs_node_path(path);
+            return p.empty() ? name : p + '/' + name;
+        }
+
+        /// reads the metadata document of a Zarr v3 node, returning false for implicit groups
+        template <class store_type>
+        inline bool read_zarr_node_document(store_type& store, const std::string& path, std::string& key, nlohmann::json& j)
+        {
+            std::string bytes;
+            for (const char* suffix: {".array.json", ".group.json"})
+            {
+                key = "meta/root" + path + suffix;
+                if (xt::read_store_value(store, key, bytes))
+                {
+                    j = nlohmann::json::parse(bytes);
+                    return true;
+                }
+            }
+            return false;
+        }
+    }
+
+    /**
+     * Reads the attributes of a node (array or group) of a hierarchy.
+     * The attributes of a Zarr v2 node are read from its ``.zattrs`` document,
+     * with a single request; the attributes of a Zarr v3 node are part of its
+     * metadata document. A node without attributes has an empty object.
+     * @param store the store
+     * @param path the path of the node in the hierarchy
+     * @param zarr_version the major version of the Zarr specification
+     */
+    template <class store_type>
+    inline nlohmann::json read_zarr_attrs(store_type& store, const std::string& path, std::size_t zarr_version)
+    {
+        std::string p = detail::zarr_attrs_node_path(path);
+        nlohmann::json attrs = nlohmann::json::object();
+        if (zarr_version == 3)
+        {
+            std::string key;
+            nlohmann::json j;
+            if (detail::read_zarr_node_document(store, p, key, j) && j.contains("attributes"))
+            {
+                attrs = j["attributes"];
+            }
+        }
+        else
+        {
+            std::string bytes;
+            if (read_store_value(store, detail::zarr_v2_node_key(p, ".zattrs"), bytes))
+            {
+                attrs = nlohmann::json::parse(bytes);
+            }
+        }
+        return attrs;
+    }
+
+    /**
+     * Replaces the attributes of a node (array or group) of a hierarchy.
+     * The metadata document of a Zarr v3 node is rewritten, so that the node
+     * must exist as an array or an explicit group.
+     * @param store the store
+     * @param path the path of the node in the hierarchy
+     * @param attrs the new attributes
+     * @param zarr_version the major version of the Zarr specification
+     */
+    template <class store_type>
+    inline void write_zarr_attrs(store_type& store, const std::string& path, const nlohmann::json& attrs, std::size_t zarr_version)
+    {
+        std::string p = detail::zarr_attrs_node_path(path);
+        if (zarr_version == 3)
+        {
+            std::string key;
+            nlohmann::json j;
+            if (!detail::read_zarr_node_document(store, p, key, j))
+            {
+                XTENSOR_THROW(std::runtime_error, "No array or explicit group at path: " + path);
+            }
+            j["attributes"] = attrs;
+            store[key] = j.dump(4);
+        }
+        else
+        {
+            store[detail::zarr_v2_node_key(p, ".zattrs")] = attrs.dump(4);
+        }
+    }
+
+    /**
+     * Reads the attributes of many nodes of a hierarchy concurrently.
+     * @param store the store
+     * @param paths the paths of the nodes in the hierarchy
+     * @param zarr_version the major version of the Zarr specification
+     * @param nthreads the number of threads (0 means the thread budget)
+     *
+     * @return returns the attributes of the nodes, by path.
+     */
+    template <class store_type>
+    inline std::map<std::string, nlohmann::json> read_zarr_attrs(store_type& store, const std::vector<std::string>& paths, std::size_t zarr_version, std::size_t nthreads)
+    {
+        std::vector<nlohmann::json> attrs(paths.size());
+        xzarr_parallel_for(paths.size(), nthreads, [&](std::size_t i)
+        {
+            attrs[i] = read_zarr_attrs(store, paths[i], zarr_version);
+        });
+        std::map<std::string, nlohmann::json> res;
+        for (std::size_t i = 0; i < paths.size(); ++i)
+        {
+            res[paths[i]] = std::move(attrs[i]);
+        }
+        return res;
+    }
+
+    /**
+     * Updates the attributes of many nodes of a hierarchy concurrently.
+     * Each update is applied as a JSON merge patch (RFC 7386) to the current
+     * attributes of its node: its members replace the existing ones, and its
+     * null members remove them.
+     * @param store the store
+     * @param updates the patches of the attributes, by path
+     * @param zarr_version the major version of the Zarr specification
+     * @param nthreads the number of threads (0 means the thread budget)
+     */
+    template <class store_type>
+    inline void update_zarr_attrs(store_type& store, const std::map<std::string, nlohmann::json>& updates, std::size_t zarr_version, std::size_t nthreads)
+    {
+        std::vector<std::map<std::string, nlohmann::json>::const_iterator> items;
+        for (auto it = updates.begin(); it != updates.end(); ++it)
+        {
+            items.push_back(it);
+        }
+        xzarr_parallel_for(items.size(), nthreads, [&](std::size_t i)
+        {
+            const std::string& path = items[i]->first;
+            nlohmann::json attrs = read_zarr_attrs(store, path, zarr_version);
+            attrs.merge_patch(items[i]->second);
+            write_zarr_attrs(store, path, attrs, zarr_version);
+        });
+    }
+
+    /************************************
+     * xzarr_attrs_cache implementation *
+     ************************************/
+
+    template <class store_type>
+    inline xzarr_attrs_cache<store_type>::xzarr_attrs_cache(store_type& store, std::size_t zarr_version)
+        : m_store(store)
+        , m_zarr_version(zarr_version)
+        , p_state(std::make_shared<cache_state>())
+    {
+    }
+
+    /**
+     * Returns the attributes of a node, reading them on first access.
+     * @param path the path of the node in the hierarchy
+     */
+    template <class store_type>
+    inline nlohmann::json xzarr_attrs_cache<store_type>::get(const std::string& path)
+    {
+        std::string key = detail::zarr_attrs_node_path(path);
+        nlohmann::json attrs;
+        if (!find(key, attrs))
+        {
+            attrs = read_zarr_attrs(m_store, key, m_zarr_version);
+            insert(key, attrs);
+        }
+        return attrs;
+    }
+
+    /**
+     * Returns the attributes of many nodes, reading the ones that are not
+     * loaded yet concurrently.
+     * @param paths the paths of the nodes in the hierarchy
+     * @param nthreads the number of threads (0 means the thread budget)
+     *
+     * @return returns the attributes of the nodes, by path.
+     */
+    template <class store_type>
+    inline std::map<std::string, nlohmann::json> xzarr_attrs_cache<store_type>::get(const std::vector<std::string>& paths, std::size_t nthreads)
+    {
+        std::map<std::string, nlohmann::json> res;
+        std::vector<std::string> missing;
+        for (const auto& path: paths)
+        {
+            if (!find(detail::zarr_attrs_node_path(path), res[path]))
+            {
+                missing.push_back(path);
+            }
+        }
+        for (auto& loaded: read_zarr_attrs(m_store, missing, m_zarr_version, nthreads))
+        {
+            insert(detail::zarr_attrs_node_path(loaded.first), loaded.second);
+            res[loaded.first] = std::move(loaded.second);
+        }
+        return res;
+    }
+
+    /**
+     * Replaces the attributes of a node (see write_zarr_attrs).
+     * @param path the path of the node in the hierarchy
+     * @param attrs the new attributes
+     */
+    template <class store_type>
+    inline void xzarr_attrs_cache<store_type>::set(const std::string& path, const nlohmann::json& attrs)
+    {
+        write_zarr_attrs(m_store, path, attrs, m_zarr_version);
+        insert(detail::zarr_attrs_node_path(path), attrs);
+    }
+
+    /**
+     * Applies merge patches to the attributes of many nodes concurrently
+     * (see update_zarr_attrs); the updated nodes are read again on next access.
+     * @param updates the patches of the attributes, by path
+     * @param nthreads the number of threads (0 means the thread budget)
+     */
+    template <class store_type>
+    inline void xzarr_attrs_cache<store_type>::update(const std::map<std::string, nlohmann::json>& updates, std::size_t nthreads)
+    {
+        for (const auto& u: updates)
+        {
+            forget(u.first);
+        }
+        update_zarr_attrs(m_store, updates, m_zarr_version, nthreads);
+    }
+
+    /**
+     * Drops the loaded attributes of a node, e.g. when the node is created again.
+     * @param path the path of the node in the hierarchy
+     */
+    template <class store_type>
+    inline void xzarr_attrs_cache<store_type>::forget(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(p_state->mutex);
+        p_state->entries.erase(detail::zarr_attrs_node_path(path));
+    }
+
+    /**
+     * Drops the loaded attributes of all the nodes, e.g. when many nodes are written.
+     */
+    template <class store_type>
+    inline void xzarr_attrs_cache<store_type>::clear()
+    {
+        std::lock_guard<std::mutex> lock(p_state->mutex);
+        p_state->entries.clear();
+    }
+
+    template <class store_type>
+    inline bool xzarr_attrs_cache<store_type>::find(const std::string& key, nlohmann::json& attrs)
+    {
+        std::lock_guard<std::mutex> lock(p_state->mutex);
+        auto it = p_state->entries.find(key);
+        if (it == p_state->entries.end())
+        {
+            return false;
+        }
+        attrs = it->second;
+        return true;
+    }
+
+    template <class store_type>
+    inline void xzarr_attrs_cache<store_type>::insert(const std::string& key, const nlohmann::json& attrs)
+    {
+        std::lock_guard<std::mutex> lock(p_state->mutex);
+        p_state->entries[key] = attrs;
+    }
+}
+
+#endif
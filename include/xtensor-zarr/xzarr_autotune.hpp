@@ -0,0 +1,408 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_AUTOTUNE_HPP
+#define XTENSOR_ZARR_AUTOTUNE_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <typeindex>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+#include "xtensor/xarray.hpp"
+#include "xtensor/xstrided_view.hpp"
+#include "xtensor-io/xio_gzip.hpp"
+#include "xzarr_array.hpp"
+#include "xzarr_blosc.hpp"
+#include "xzarr_common.hpp"
+#include "xzarr_lz4.hpp"
+#include "xzarr_zstd.hpp"
+
+namespace xt
+{
+    /**
+     * @class xzarr_any_compressor
+     * @brief Compressor described by its name and its JSON configuration.
+     *
+     * It can be used wherever a compressor configuration is expected when
+     * creating an array; the actual codec is looked up by name in the
+     * xcompressor_factory, as when opening an existing array.
+     */
+    struct xzarr_any_compressor
+    {
+        std::string name;
+        nlohmann::json config;
+
+        xzarr_any_compressor()
+            : name("binary")
+            , config(nlohmann::json::object())
+        {
+        }
+
+        xzarr_any_compressor(const std::string& n, const nlohmann::json& c)
+            : name(n)
+            , config(c)
+        {
+        }
+
+        template <class T>
+        void write_to(T& j) const
+        {
+            for (auto it = config.begin(); it != config.end(); ++it)
+            {
+                j[it.key()] = it.value();
+            }
+        }
+    };
+
+    /**
+     * @class xzarr_autotune_options
+     * @brief Constraints and objective of the compressor auto-tuning.
+     *
+     * Throughputs are expressed in MB/s of uncompressed data.
+     */
+    struct xzarr_autotune_options
+    {
+        enum class objective { ratio, throughput };
+
+        objective goal;
+        double min_ratio;
+        double min_encode_throughput;
+        double min_decode_throughput;
+        std::size_t max_sample_chunks;
+        std::size_t repeats;
+
+        xzarr_autotune_options()
+            : goal(objective::ratio)
+            , min_ratio(0.)
+            , min_encode_throughput(0.)
+            , min_decode_throughput(0.)
+            , max_sample_chunks(8)
+            , repeats(1)
+        {
+        }
+    };
+
+    /**
+     * @class xzarr_autotune_candidates
+     * @brief Set of compressor configurations to trial.
+     *
+     * @tparam T the data type of the array
+     */
+    template <class T>
+    class xzarr_autotune_candidates
+    {
+    public:
+
+        using chunk_type = xarray<T>;
+        using encoder_type = std::function<std::string(const chunk_type&)>;
+        using decoder_type = std::function<void(const std::string&, chunk_type&)>;
+
+        struct candidate
+        {
+            xzarr_any_compressor compressor;
+            std::type_index config_type = std::type_index(typeid(void));
+            encoder_type encode;
+            decoder_type decode;
+        };
+
+        template <class C>
+        void add(const C& config);
+
+        template <class C>
+        void add(const C& config, const std::string& parameter, const std::vector<nlohmann::json>& values);
+
+        template <class P>
+        void remove_if(P pred);
+
+        const std::vector<candidate>& get() const;
+
+    private:
+
+        std::vector<candidate> m_candidates;
+    };
+
+    /**
+     * @class xzarr_autotune_result
+     * @brief Selected compressor and the measurements it was selected from.
+     */
+    struct xzarr_autotune_result
+    {
+        xzarr_any_compressor compressor;
+        nlohmann::json measurements;
+    };
+
+    /********************************************
+     * xzarr_autotune_candidates implementation *
+     ********************************************/
+
+    template <class T>
+    template <class C>
+    inline void xzarr_autotune_candidates<T>::add(const C& config)
+    {
+        nlohmann::json j = nlohmann::json::object();
+        config.write_to(j);
+        candidate c;
+        c.compressor = xzarr_any_compressor(config.name, j);
+        c.config_type = std::type_index(typeid(C));
+        c.encode = [config](const chunk_type& chunk)
+        {
+            std::ostringstream stream;
+            dump_file(stream, chunk, config);
+            return stream.str();
+        };
+        c.decode = [config](const std::string& bytes, chunk_type& chunk)
+        {
+            std::istringstream stream(bytes);
+            load_file(stream, chunk, config);
+        };
+        m_candidates.push_back(std::move(c));
+    }
+
+    /**
+     * Adds one candidate per value of a configuration parameter.
+     * @param config the base configuration
+     * @param parameter the name of the parameter in the compressor metadata (e.g. "level")
+     * @param values the values to trial
+     */
+    template <class T>
+    template <class C>
+    inline void xzarr_autotune_candidates<T>::add(const C& config, const std::string& parameter, const std::vector<nlohmann::json>& values)
+    {
+        for (const auto& value: values)
+        {
+            nlohmann::json j = nlohmann::json::object();
+            config.write_to(j);
+            j[parameter] = value;
+            C c = config;
+            c.read_from(j);
+            add(c);
+        }
+    }
+
+    template <class T>
+    template <class P>
+    inline void xzarr_autotune_candidates<T>::remove_if(P pred)
+    {
+        m_candidates.erase(std::remove_if(m_candidates.begin(), m_candidates.end(), pred), m_candidates.end());
+    }
+
+    template <class T>
+    inline auto xzarr_autotune_candidates<T>::get() const -> const std::vector<candidate>&
+    {
+        return m_candidates;
+    }
+
+    /**
+     * Returns the default set of candidates: gzip, zstd, lz4 and blosc at several levels.
+     */
+    template <class T>
+    inline xzarr_autotune_candidates<T> default_autotune_candidates()
+    {
+        xzarr_autotune_candidates<T> candidates;
+        candidates.add(xio_gzip_config(), "level", {1, 5, 9});
+        candidates.add(xzarr_zstd_config(), "level", {1, 3, 9, 19});
+        candidates.add(xzarr_lz4_config(), "acceleration", {1, 8});
+        xzarr_blosc_config blosc;
+        for (const char* cname: {"lz4", "zstd", "blosclz"})
+        {
+            blosc.cname = cname;
+            candidates.add(blosc, "clevel", {1, 5, 9});
+        }
+        return candidates;
+    }
+
+    namespace detail
+    {
+        template <class E>
+        inline std::vector<xstrided_slice_vector> autotune_sample_slices(const E& e, const std::vector<std::size_t>& chunk_shape, std::size_t max_chunks)
+        {
+            std::size_t ndim = chunk_shape.size();
+            std::vector<std::size_t> grid(ndim);
+            std::size_t nchunks = 1;
+            for (std::size_t d = 0; d < ndim; ++d)
+            {
+                grid[d] = (e.shape()[d] + chunk_shape[d] - 1) / chunk_shape[d];
+                nchunks *= grid[d];
+            }
+            std::size_t nsamples = std::min(std::max<std::size_t>(max_chunks, 1), nchunks);
+            std::vector<xstrided_slice_vector> slices;
+            for (std::size_t k = 0; k < nsamples; ++k)
+            {
+                // spread the samples evenly over the chunk grid
+                std::size_t flat = k * nchunks / nsamples;
+                xstrided_slice_vector sv(ndim);
+                for (std::size_t d = ndim; d-- > 0;)
+                {
+                    std::size_t start = (flat % grid[d]) * chunk_shape[d];
+                    flat /= grid[d];
+                    sv[d] = range(start, std::min(start + chunk_shape[d], static_cast<std::size_t>(e.shape()[d])));
+                }
+                slices.push_back(sv);
+            }
+            return slices;
+        }
+
+        inline double autotune_elapsed(std::chrono::steady_clock::time_point start)
+        {
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    /**
+     * Trial-compresses representative chunks of a sample and selects a compressor.
+     *
+     * Chunks are sampled evenly over the chunk grid of ``sample``, and every candidate
+     * is used to encode and decode them. Among the candidates that satisfy the
+     * constraints of ``options``, the one with the best objective is selected; if
+     * none does, the best candidate overall is selected and the measurements report
+     * that the constraints were not met.
+     *
+     * @param sample data representative of the array
+     * @param chunk_shape the chunk shape of the array
+     * @param options the constraints and objective
+     * @param candidates the compressor configurations to trial
+     *
+     * @return returns the selected compressor and the measurements.
+     */
+    template <class E, class T = typename E::value_type>
+    inline xzarr_autotune_result autotune_compressor(const xexpression<E>& sample, const std::vector<std::size_t>& chunk_shape,
+                                                     const xzarr_autotune_options& options = xzarr_autotune_options(),
+                                                     const xzarr_autotune_candidates<T>& candidates = default_autotune_candidates<T>())
+    {
+        const E& e = sample.derived_cast();
+        if (e.dimension() != chunk_shape.size())
+        {
+            XTENSOR_THROW(std::runtime_error, "Sample and chunk shape dimensions do not match");
+        }
+        if (candidates.get().empty())
+        {
+            XTENSOR_THROW(std::runtime_error, "No compressor candidate to trial");
+        }
+        std::vector<xarray<T>> chunks;
+        std::size_t raw_bytes = 0;
+        for (const auto& sv: detail::autotune_sample_slices(e, chunk_shape, options.max_sample_chunks))
+        {
+            chunks.emplace_back(strided_view(e, sv));
+            raw_bytes += chunks.back().size() * sizeof(T);
+        }
+        std::size_t repeats = std::max<std::size_t>(options.repeats, 1);
+        double mega_bytes = static_cast<double>(raw_bytes * repeats) / 1e6;
+
+        nlohmann::json trials = nlohmann::json::array();
+        std::ptrdiff_t best = -1;
+        std::ptrdiff_t best_any = -1;
+        double best_score = 0.;
+        double best_any_score = 0.;
+        const auto& cands = candidates.get();
+        for (std::size_t i = 0; i < cands.size(); ++i)
+        {
+            std::size_t compressed_bytes = 0;
+            double encode_time = 0.;
+            double decode_time = 0.;
+            for (const auto& chunk: chunks)
+            {
+                std::string bytes;
+                auto start = std::chrono::steady_clock::now();
+                for (std::size_t r = 0; r < repeats; ++r)
+                {
+                    bytes = cands[i].encode(chunk);
+                }
+                encode_time += detail::autotune_elapsed(start);
+                compressed_bytes += bytes.size();
+                xarray<T> decoded(chunk.shape());
+                start = std::chrono::steady_clock::now();
+                for (std::size_t r = 0; r < repeats; ++r)
+                {
+                    cands[i].decode(bytes, decoded);
+                }
+                decode_time += detail::autotune_elapsed(start);
+            }
+            double ratio = static_cast<double>(raw_bytes) / static_cast<double>(std::max<std::size_t>(compressed_bytes, 1));
+            double encode_throughput = mega_bytes / std::max(encode_time, 1e-9);
+            double decode_throughput = mega_bytes / std::max(decode_time, 1e-9);
+
+            nlohmann::json trial;
+            trial["compressor"] = cands[i].compressor.name;
+            trial["configuration"] = cands[i].compressor.config;
+            trial["ratio"] = ratio;
+            trial["encode_throughput"] = encode_throughput;
+            trial["decode_throughput"] = decode_throughput;
+            trials.push_back(trial);
+
+            double score = (options.goal == xzarr_autotune_options::objective::ratio) ? ratio : decode_throughput;
+            bool valid = (ratio >= options.min_ratio)
+                      && (encode_throughput >= options.min_encode_throughput)
+                      && (decode_throughput >= options.min_decode_throughput);
+            if (valid && (best < 0 || score > best_score))
+            {
+                best = static_cast<std::ptrdiff_t>(i);
+                best_score = score;
+            }
+            if (best_any < 0 || score > best_any_score)
+            {
+                best_any = static_cast<std::ptrdiff_t>(i);
+                best_any_score = score;
+            }
+        }
+
+        xzarr_autotune_result result;
+        std::size_t selected = static_cast<std::size_t>(best >= 0 ? best : best_any);
+        result.compressor = cands[selected].compressor;
+        result.measurements["selected"] = selected;
+        result.measurements["constraints_met"] = (best >= 0);
+        result.measurements["objective"] = (options.goal == xzarr_autotune_options::objective::ratio) ? "ratio" : "throughput";
+        result.measurements["sample_chunks"] = chunks.size();
+        result.measurements["sample_bytes"] = raw_bytes;
+        result.measurements["trials"] = trials;
+        return result;
+    }
+
+    /**
+     * Creates an array whose compressor is selected by trial-compressing a sample.
+     * Only the candidates whose codec is the one registered under their name for
+     * the store and the data type are trialed.
+     * The measurements are recorded in the ``compressor_tuning`` attribute of the array.
+     *
+     * @param sample data representative of the array, whose value type matches ``dtype``
+     * @param tuning the constraints and objective of the auto-tuning
+     * @param o the array creation options; the compressor is replaced by the selected one
+     *
+     * @sa autotune_compressor
+     */
+    template <class store_type, class shape_type, class E>
+    zarray create_zarr_array_autotuned(store_type store, const std::string& path, shape_type shape, shape_type chunk_shape, const std::string& dtype,
+                                       const xexpression<E>& sample, const xzarr_autotune_options& tuning,
+                                       xzarr_create_array_options<xzarr_any_compressor> o, const std::size_t zarr_version_major)
+    {
+        using value_type = typename E::value_type;
+        xzarr_array_metadata m;
+        m.zarr_version = zarr_version_major;
+        m.dtype = dtype;
+        detail::check_value_type<value_type>(m);
+        auto candidates = default_autotune_candidates<value_type>();
+        candidates.remove_if([](const typename xzarr_autotune_candidates<value_type>::candidate& c)
+        {
+            // another codec may be registered under the same name (e.g. xio_blosc_config)
+            return !xcompressor_factory<store_type, value_type>::has_compressor(c.compressor.name, c.config_type);
+        });
+        std::vector<std::size_t> cs(chunk_shape.begin(), chunk_shape.end());
+        xzarr_autotune_result r = autotune_compressor(sample, cs, tuning, candidates);
+        o.compressor = r.compressor;
+        o.attrs["compressor_tuning"] = r.measurements;
+        return create_zarr_array(store, path, shape, chunk_shape, dtype, o.chunk_memory_layout, o.chunk_separator, o.compressor, o.attrs, o.chunk_pool_size, o.fill_value, zarr_version_major, o.codec_threads, o.checksum);
+    }
+}
+
+#endif
@@ -10,43 +10,79 @@
 #ifndef XTENSOR_ZARR_AWS_STORE_HPP
 #define XTENSOR_ZARR_AWS_STORE_HPP
 
+#include <algorithm>
 #include <iomanip>
-#include <fstream>
 #include <iostream>
+#include <memory>
 #include <vector>
 #include <string>
 
-#include "xtensor-io/xio_aws_handler.hpp"
+#include <aws/core/client/ClientConfiguration.h>
+#include <aws/core/client/DefaultRetryStrategy.h>
+#include <aws/s3/S3Client.h>
+#include <aws/s3/model/AbortMultipartUploadRequest.h>
+#include <aws/s3/model/CompleteMultipartUploadRequest.h>
+#include <aws/s3/model/CompletedMultipartUpload.h>
+#include <aws/s3/model/CommonPrefix.h>
+#include <aws/s3/model/CompletedPart.h>
+#include <aws/s3/model/CreateMultipartUploadRequest.h>
 #include <aws/s3/model/DeleteObjectRequest.h>
-#include <aws/s3/model/ListObjectsRequest.h>
+#include <aws/s3/model/GetObjectRequest.h>
+#include <aws/s3/model/ListObjectsV2Request.h>
 #include <aws/s3/model/Object.h>
+#include <aws/s3/model/PutObjectRequest.h>
+#include <aws/s3/model/UploadPartRequest.h>
 #include "xzarr_common.hpp"
+#include "xzarr_request_limiter.hpp"
+#include "xzarr_store_handler.hpp"
+#include "xzarr_threading.hpp"
 
 namespace xt
 {
     class xzarr_aws_stream
     {
     public:
-        xzarr_aws_stream(const Aws::String& path, const Aws::String& bucket,  const Aws::S3::S3Client& client);
+        xzarr_aws_stream(const Aws::String& path, const Aws::String& bucket,  const Aws::S3::S3Client& client, const std::shared_ptr<xzarr_request_limiter>& limiter);
         operator std::string() const;
+        bool read(std::string& bytes) const;
         xzarr_aws_stream& operator=(const std::vector<char>& value);
         xzarr_aws_stream& operator=(const std::string& value);
+        void erase();
 
     private:
         void assign(const char* value, std::size_t size);
+        void assign_parts(const char* value, std::size_t size);
 
         Aws::String m_path;
         Aws::String m_bucket;
         const Aws::S3::S3Client& m_client;
+        std::shared_ptr<xzarr_request_limiter> p_limiter;
     };
 
+    /**
+     * @class xzarr_aws_store
+     * @brief Zarr store handler for AWS S3.
+     *
+     * The xzarr_aws_store class implements a Zarr store in an S3 bucket. Chunks
+     * go through the store, which bounds the number of requests in flight,
+     * retries the transient errors with a jittered exponential backoff, and
+     * uploads values from memory. Values larger than ``multipart_threshold`` are
+     * sent as multipart uploads whose parts are uploaded and retried in parallel.
+     * The copies of a store share these limits.
+     *
+     * The connection pool of the client should hold at least ``max_connections``
+     * connections, and the retries of the client should be disabled, which is
+     * what xzarr_aws_client_configuration does.
+     *
+     * @sa xzarr_request_config
+     */
     class xzarr_aws_store
     {
     public:
         template <class C>
-        using io_handler = xio_aws_handler<C>;
+        using io_handler = xzarr_store_handler<xzarr_aws_store, C>;
 
-        xzarr_aws_store(const std::string& root, const Aws::S3::S3Client& client);
+        xzarr_aws_store(const std::string& root, const Aws::S3::S3Client& client, const xzarr_request_config& config = xzarr_request_config());
         xzarr_aws_stream operator[](const std::string& key) const;
         void set(const std::string& key, const std::vector<char>& value);
         void set(const std::string& key, const std::string& value);
@@ -54,78 +90,262 @@ namespace xt
         void list_dir(const std::string& prefix, std::vector<std::string>& keys, std::vector<std::string>& prefixes) const;
         std::vector<std::string> list() const;
         std::vector<std::string> list_prefix(const std::string& prefix) const;
+        template <class F>
+        void visit_prefix(const std::string& prefix, F&& f) const;
         void erase(const std::string& key);
         void erase_prefix(const std::string& prefix);
         const std::string& get_root() const;
-        xio_aws_config get_io_config() const;
+        xzarr_aws_store get_io_config() const;
 
     private:
+        template <class F>
+        void list_pages(const std::string& full_prefix, const char* delimiter, F&& f) const;
+        std::string get_full_prefix(const std::string& prefix) const;
+        std::string get_relative_key(const Aws::String& key) const;
+
         std::string m_root;
         Aws::String m_bucket;
         const Aws::S3::S3Client& m_client;
+        std::shared_ptr<xzarr_request_limiter> p_limiter;
     };
 
+    Aws::Client::ClientConfiguration xzarr_aws_client_configuration(const xzarr_request_config& config, Aws::Client::ClientConfiguration client_config = Aws::Client::ClientConfiguration());
+
+    namespace detail
+    {
+        template <class O>
+        bool aws_retryable(const O& outcome);
+
+        template <class O>
+        [[noreturn]] void aws_throw(const char* request, const O& outcome);
+    }
+
+    /*************************************************
+     * xzarr_aws_client_configuration implementation *
+     *************************************************/
+
+    /**
+     * Returns a client configuration suited to a store with the given request
+     * configuration: a connection pool of ``max_connections`` connections, and
+     * no retries in the client since the store retries the requests itself.
+     * @param config the request configuration of the store
+     * @param client_config the client configuration to start from
+     */
+    inline Aws::Client::ClientConfiguration xzarr_aws_client_configuration(const xzarr_request_config& config, Aws::Client::ClientConfiguration client_config)
+    {
+        client_config.maxConnections = static_cast<unsigned>(config.max_connections);
+        client_config.retryStrategy = Aws::MakeShared<Aws::Client::DefaultRetryStrategy>("xtensor-zarr", 0);
+        return client_config;
+    }
+
+    namespace detail
+    {
+        template <class O>
+        inline bool aws_retryable(const O& outcome)
+        {
+            return !outcome.IsSuccess() && outcome.GetError().ShouldRetry();
+        }
+
+        template <class O>
+        [[noreturn]] inline void aws_throw(const char* request, const O& outcome)
+        {
+            auto err = outcome.GetError();
+            XTENSOR_THROW(std::runtime_error, std::string("Error: ") + request + ": " + err.GetExceptionName().c_str() + ": " + err.GetMessage().c_str());
+        }
+    }
+
     /***********************************
      * xzarr_aws_stream implementation *
      ***********************************/
 
-    xzarr_aws_stream::xzarr_aws_stream(const Aws::String& path, const Aws::String& bucket, const Aws::S3::S3Client& client)
+    inline xzarr_aws_stream::xzarr_aws_stream(const Aws::String& path, const Aws::String& bucket, const Aws::S3::S3Client& client, const std::shared_ptr<xzarr_request_limiter>& limiter)
         : m_path(path)
         , m_bucket(bucket)
         , m_client(client)
+        , p_limiter(limiter)
     {
     }
 
-    xzarr_aws_stream::operator std::string() const
+    inline xzarr_aws_stream::operator std::string() const
+    {
+        std::string bytes;
+        if (!read(bytes))
+        {
+            XTENSOR_THROW(std::runtime_error, std::string("Error: GetObject: key not found: ") + m_path.c_str());
+        }
+        return bytes;
+    }
+
+    inline bool xzarr_aws_stream::read(std::string& bytes) const
     {
         Aws::S3::Model::GetObjectRequest object_request;
         object_request.SetBucket(m_bucket);
         object_request.SetKey(m_path);
 
-        Aws::S3::Model::GetObjectOutcome outcome = m_client.GetObject(object_request);
+        Aws::S3::Model::GetObjectOutcome outcome = p_limiter->run(
+            [&]() { return m_client.GetObject(object_request); },
+            [](const auto& o) { return detail::aws_retryable(o); });
 
         if (!outcome.IsSuccess())
         {
-            auto err = outcome.GetError();
-            XTENSOR_THROW(std::runtime_error, std::string("Error: GetObject: ") + err.GetExceptionName().c_str() + ": " + err.GetMessage().c_str());
+            const auto& err = outcome.GetError();
+            if (err.GetErrorType() == Aws::S3::S3Errors::NO_SUCH_KEY || err.GetResponseCode() == Aws::Http::HttpResponseCode::NOT_FOUND)
+            {
+                return false;
+            }
+            detail::aws_throw("GetObject", outcome);
         }
 
-        auto& reader = outcome.GetResultWithOwnership().GetBody();
-        std::string bytes(std::istreambuf_iterator<char>(reader), {});
+        Aws::S3::Model::GetObjectResult result = outcome.GetResultWithOwnership();
+        auto& reader = result.GetBody();
+        bytes.resize(static_cast<std::size_t>(result.GetContentLength()));
+        reader.read(&bytes[0], static_cast<std::streamsize>(bytes.size()));
+        bytes.resize(static_cast<std::size_t>(reader.gcount()));
+        return true;
+    }
 
-        return bytes;
+    /**
+     * Deletes the object; a missing object is not an error.
+     */
+    inline void xzarr_aws_stream::erase()
+    {
+        Aws::S3::Model::DeleteObjectRequest request;
+        request.WithKey(m_path).WithBucket(m_bucket);
+        Aws::S3::Model::DeleteObjectOutcome outcome = p_limiter->run(
+            [&]() { return m_client.DeleteObject(request); },
+            [](const auto& o) { return detail::aws_retryable(o); });
+        if (!outcome.IsSuccess())
+        {
+            const auto& err = outcome.GetError();
+            if (err.GetErrorType() == Aws::S3::S3Errors::NO_SUCH_KEY || err.GetResponseCode() == Aws::Http::HttpResponseCode::NOT_FOUND)
+            {
+                return;
+            }
+            detail::aws_throw("DeleteObject", outcome);
+        }
     }
 
-    xzarr_aws_stream& xzarr_aws_stream::operator=(const std::vector<char>& value)
+    inline xzarr_aws_stream& xzarr_aws_stream::operator=(const std::vector<char>& value)
     {
         assign(value.data(), value.size());
         return *this;
     }
 
-    xzarr_aws_stream& xzarr_aws_stream::operator=(const std::string& value)
+    inline xzarr_aws_stream& xzarr_aws_stream::operator=(const std::string& value)
     {
         assign(value.c_str(), value.size());
         return *this;
     }
 
-    void xzarr_aws_stream::assign(const char* value, std::size_t size)
+    inline void xzarr_aws_stream::assign(const char* value, std::size_t size)
     {
-        Aws::S3::Model::PutObjectRequest request;
-        request.SetBucket(m_bucket);
-        request.SetKey(m_path);
+        std::size_t threshold = p_limiter->config().multipart_threshold;
+        if (threshold != 0 && size >= threshold && size > p_limiter->config().part_size)
+        {
+            assign_parts(value, size);
+            return;
+        }
 
-        std::shared_ptr<Aws::IOStream> writer = Aws::MakeShared<Aws::FStream>("SampleAllocationTag", m_path.c_str(), std::ios_base::in | std::ios_base::binary);
-        writer->write(value, static_cast<std::streamsize>(size));
-        writer->flush();
+        Aws::S3::Model::PutObjectOutcome outcome = p_limiter->run(
+            [&]()
+            {
+                Aws::S3::Model::PutObjectRequest request;
+                request.SetBucket(m_bucket);
+                request.SetKey(m_path);
 
-        request.SetBody(writer);
+                // the body is rebuilt for each attempt, since a failed upload consumes it
+                std::shared_ptr<Aws::IOStream> body = Aws::MakeShared<Aws::StringStream>("xtensor-zarr");
+                body->write(value, static_cast<std::streamsize>(size));
+                request.SetBody(body);
+                request.SetContentLength(static_cast<long long>(size));
 
-        Aws::S3::Model::PutObjectOutcome outcome = m_client.PutObject(request);
+                return m_client.PutObject(request);
+            },
+            [](const auto& o) { return detail::aws_retryable(o); });
 
         if (!outcome.IsSuccess())
         {
-            auto err = outcome.GetError();
-            XTENSOR_THROW(std::runtime_error, std::string("Error: PutObject: ") + err.GetExceptionName().c_str() + ": " + err.GetMessage().c_str());
+            detail::aws_throw("PutObject", outcome);
+        }
+    }
+
+    inline void xzarr_aws_stream::assign_parts(const char* value, std::size_t size)
+    {
+        const auto& config = p_limiter->config();
+        // S3 parts are at least 5 MiB (except the last one) and at most 10000
+        std::size_t part_size = std::max(config.part_size, std::size_t(5) << 20);
+        part_size = std::max(part_size, (size + 9999) / 10000);
+        std::size_t nparts = (size + part_size - 1) / part_size;
+
+        Aws::S3::Model::CreateMultipartUploadRequest create_request;
+        create_request.SetBucket(m_bucket);
+        create_request.SetKey(m_path);
+        auto create_outcome = p_limiter->run(
+            [&]() { return m_client.CreateMultipartUpload(create_request); },
+            [](const auto& o) { return detail::aws_retryable(o); });
+        if (!create_outcome.IsSuccess())
+        {
+            detail::aws_throw("CreateMultipartUpload", create_outcome);
+        }
+        Aws::String upload_id = create_outcome.GetResult().GetUploadId();
+
+        Aws::Vector<Aws::S3::Model::CompletedPart> parts(nparts);
+        try
+        {
+            xzarr_parallel_for(nparts, config.upload_threads, [&](std::size_t i)
+            {
+                std::size_t offset = i * part_size;
+                std::size_t length = std::min(part_size, size - offset);
+                int part_number = static_cast<int>(i + 1);
+                auto outcome = p_limiter->run(
+                    [&]()
+                    {
+                        Aws::S3::Model::UploadPartRequest request;
+                        request.SetBucket(m_bucket);
+                        request.SetKey(m_path);
+                        request.SetUploadId(upload_id);
+                        request.SetPartNumber(part_number);
+                        std::shared_ptr<Aws::IOStream> body = Aws::MakeShared<Aws::StringStream>("xtensor-zarr");
+                        body->write(value + offset, static_cast<std::streamsize>(length));
+                        request.SetBody(body);
+                        request.SetContentLength(static_cast<long long>(length));
+                        return m_client.UploadPart(request);
+                    },
+                    [](const auto& o) { return detail::aws_retryable(o); });
+                if (!outcome.IsSuccess())
+                {
+                    detail::aws_throw("UploadPart", outcome);
+                }
+                parts[i].SetPartNumber(part_number);
+                parts[i].SetETag(outcome.GetResult().GetETag());
+            });
+
+            Aws::S3::Model::CompletedMultipartUpload upload;
+            upload.SetParts(parts);
+            Aws::S3::Model::CompleteMultipartUploadRequest complete_request;
+            complete_request.SetBucket(m_bucket);
+            complete_request.SetKey(m_path);
+            complete_request.SetUploadId(upload_id);
+            complete_request.SetMultipartUpload(upload);
+            auto complete_outcome = p_limiter->run(
+                [&]() { return m_client.CompleteMultipartUpload(complete_request); },
+                [](const auto& o) { return detail::aws_retryable(o); });
+            if (!complete_outcome.IsSuccess())
+            {
+                detail::aws_throw("CompleteMultipartUpload", complete_outcome);
+            }
+        }
+        catch (...)
+        {
+            // the uploaded parts are billed until the upload is aborted
+            Aws::S3::Model::AbortMultipartUploadRequest abort_request;
+            abort_request.SetBucket(m_bucket);
+            abort_request.SetKey(m_path);
+            abort_request.SetUploadId(upload_id);
+            p_limiter->run(
+                [&]() { return m_client.AbortMultipartUpload(abort_request); },
+                [](const auto& o) { return detail::aws_retryable(o); });
+            throw;
         }
     }
 
@@ -133,9 +353,16 @@ namespace xt
      * xzarr_aws_store implementation *
      **********************************/
 
-    xzarr_aws_store::xzarr_aws_store(const std::string& root, const Aws::S3::S3Client& client)
+    /**
+     * Builds an S3 store.
+     * @param root the bucket, optionally followed by the path of the root of the store in the bucket
+     * @param client the S3 client, which must outlive the store
+     * @param config the request configuration
+     */
+    inline xzarr_aws_store::xzarr_aws_store(const std::string& root, const Aws::S3::S3Client& client, const xzarr_request_config& config)
         : m_root(root)
         , m_client(client)
+        , p_limiter(std::make_shared<xzarr_request_limiter>(config))
     {
         if (m_root.empty())
         {
@@ -158,115 +385,156 @@ namespace xt
         }
     }
 
-    xzarr_aws_stream xzarr_aws_store::operator[](const std::string& key) const
+    inline xzarr_aws_stream xzarr_aws_store::operator[](const std::string& key) const
     {
         std::string key2 = ensure_startswith_slash(key);
-        return xzarr_aws_stream((m_root + key2).c_str(), m_bucket, m_client);
+        return xzarr_aws_stream((m_root + key2).c_str(), m_bucket, m_client, p_limiter);
     }
 
-    void xzarr_aws_store::set(const std::string& key, const std::vector<char>& value)
+    inline void xzarr_aws_store::set(const std::string& key, const std::vector<char>& value)
     {
         std::string key2 = ensure_startswith_slash(key);
-        xzarr_aws_stream((m_root + key2).c_str(), m_bucket, m_client) = value;
+        xzarr_aws_stream((m_root + key2).c_str(), m_bucket, m_client, p_limiter) = value;
     }
 
-    void xzarr_aws_store::set(const std::string& key, const std::string& value)
+    inline void xzarr_aws_store::set(const std::string& key, const std::string& value)
     {
         std::string key2 = ensure_startswith_slash(key);
-        xzarr_aws_stream((m_root + key2).c_str(), m_bucket, m_client) = value;
+        xzarr_aws_stream((m_root + key2).c_str(), m_bucket, m_client, p_limiter) = value;
     }
 
-    std::string xzarr_aws_store::get(const std::string& key) const
+    inline std::string xzarr_aws_store::get(const std::string& key) const
     {
         std::string key2 = ensure_startswith_slash(key);
-        return xzarr_aws_stream((m_root + key2).c_str(), m_bucket, m_client);
+        return xzarr_aws_stream((m_root + key2).c_str(), m_bucket, m_client, p_limiter);
     }
 
-    void xzarr_aws_store::list_dir(const std::string& prefix, std::vector<std::string>& keys, std::vector<std::string>& prefixes) const
+    /**
+     * Retrieve the keys and the common prefixes right under a prefix, with a
+     * delimited listing of all its pages. The prefixes end with ``/``.
+     * @param prefix the prefix
+     * @param keys set of keys to be returned by reference
+     * @param prefixes set of prefixes to be returned by reference
+     */
+    inline void xzarr_aws_store::list_dir(const std::string& prefix, std::vector<std::string>& keys, std::vector<std::string>& prefixes) const
     {
-        std::string full_prefix = prefix;
-        if (!m_root.empty())
-        {
-            std::string prefix2 = ensure_startswith_slash(prefix);
-            full_prefix = m_root + prefix2;
-        }
-        Aws::S3::Model::ListObjectsRequest request;
-        request.WithBucket(m_bucket).WithPrefix(full_prefix.c_str());
-        auto outcome = m_client.ListObjects(request);
-        if (!outcome.IsSuccess())
+        std::string full_prefix = get_full_prefix(prefix);
+        if (!full_prefix.empty() && full_prefix.back() != '/')
         {
-            auto err = outcome.GetError();
-            XTENSOR_THROW(std::runtime_error, std::string("Error: ListObjects: ") + err.GetExceptionName().c_str() + ": " + err.GetMessage().c_str());
+            full_prefix.push_back('/');
         }
-        Aws::Vector<Aws::S3::Model::Object> objects = outcome.GetResult().GetContents();
-
-        for (Aws::S3::Model::Object& object: objects)
+        list_pages(full_prefix, "/", [&](const Aws::S3::Model::ListObjectsV2Result& page)
         {
-            auto key = object.GetKey();
-            std::size_t i = key.find('/');
-            if (i == std::string::npos)
+            for (const auto& object: page.GetContents())
             {
-                keys.push_back(key.c_str());
+                keys.push_back(get_relative_key(object.GetKey()));
             }
-            else
+            for (const auto& common_prefix: page.GetCommonPrefixes())
             {
-                key = key.substr(0, i + 1);
-                if (prefixes.empty())
-                {
-                    prefixes.push_back(key.c_str());
-                }
-                else
-                {
-                    if (prefixes.back() != key.c_str())
-                    {
-                        prefixes.push_back(key.c_str());
-                    }
-                }
+                prefixes.push_back(get_relative_key(common_prefix.GetPrefix()));
             }
-        }
+        });
     }
 
-    std::vector<std::string> xzarr_aws_store::list() const
+    inline std::vector<std::string> xzarr_aws_store::list() const
     {
         return list_prefix("");
     }
 
-    std::vector<std::string> xzarr_aws_store::list_prefix(const std::string& prefix) const
+    /**
+     * Retrieve all keys with a given prefix from the store.
+     * @param prefix the prefix
+     *
+     * @return returns a set of keys with a given prefix.
+     */
+    inline std::vector<std::string> xzarr_aws_store::list_prefix(const std::string& prefix) const
+    {
+        std::vector<std::string> keys;
+        visit_prefix(prefix, [&keys](const std::string& key) { keys.push_back(key); });
+        return keys;
+    }
+
+    /**
+     * Calls ``f(key)`` for each key with a given prefix, in lexicographic order.
+     * The keys are listed one page at a time, so that only one page is held in memory.
+     * @param prefix the prefix
+     * @param f the function to call
+     */
+    template <class F>
+    inline void xzarr_aws_store::visit_prefix(const std::string& prefix, F&& f) const
+    {
+        list_pages(get_full_prefix(prefix), nullptr, [&](const Aws::S3::Model::ListObjectsV2Result& page)
+        {
+            for (const auto& object: page.GetContents())
+            {
+                f(get_relative_key(object.GetKey()));
+            }
+        });
+    }
+
+    template <class F>
+    inline void xzarr_aws_store::list_pages(const std::string& full_prefix, const char* delimiter, F&& f) const
     {
-        std::string full_prefix = prefix;
-        if (!m_root.empty())
+        Aws::String token;
+        do
         {
-            std::string prefix2 = ensure_startswith_slash(prefix);
-            full_prefix = m_root + prefix2;
+            Aws::S3::Model::ListObjectsV2Request request;
+            request.WithBucket(m_bucket).WithPrefix(full_prefix.c_str());
+            if (delimiter != nullptr)
+            {
+                request.SetDelimiter(delimiter);
+            }
+            if (!token.empty())
+            {
+                request.SetContinuationToken(token);
+            }
+            auto outcome = p_limiter->run(
+                [&]() { return m_client.ListObjectsV2(request); },
+                [](const auto& o) { return detail::aws_retryable(o); });
+            if (!outcome.IsSuccess())
+            {
+                detail::aws_throw("ListObjectsV2", outcome);
+            }
+            const auto& page = outcome.GetResult();
+            f(page);
+            token = page.GetIsTruncated() ? page.GetNextContinuationToken() : Aws::String();
         }
-        Aws::S3::Model::ListObjectsRequest request;
-        request.WithBucket(m_bucket).WithPrefix(full_prefix.c_str());
-        auto outcome = m_client.ListObjects(request);
-        if (!outcome.IsSuccess())
+        while (!token.empty());
+    }
+
+    inline std::string xzarr_aws_store::get_full_prefix(const std::string& prefix) const
+    {
+        if (m_root.empty())
         {
-            auto err = outcome.GetError();
-            XTENSOR_THROW(std::runtime_error, std::string("Error: ListObjects: ") + err.GetExceptionName().c_str() + ": " + err.GetMessage().c_str());
+            return prefix;
+        }
+        if (prefix.empty())
+        {
+            return m_root + '/';
         }
-        Aws::Vector<Aws::S3::Model::Object> objects = outcome.GetResult().GetContents();
+        return m_root + ensure_startswith_slash(prefix);
+    }
 
-        std::vector<std::string> keys(objects.size());
-        std::transform(objects.begin(), objects.end(), keys.begin(), [](const auto& k) { return k.GetKey().c_str(); });
-        return keys;
+    inline std::string xzarr_aws_store::get_relative_key(const Aws::String& key) const
+    {
+        std::size_t n = m_root.empty() ? 0 : m_root.size() + 1;
+        return std::string(key.c_str() + std::min(n, key.size()), key.c_str() + key.size());
     }
 
-    void xzarr_aws_store::erase(const std::string& key)
+    inline void xzarr_aws_store::erase(const std::string& key)
     {
         Aws::S3::Model::DeleteObjectRequest request;
         request.WithKey((m_root + '/' + key).c_str()).WithBucket(m_bucket);
-        Aws::S3::Model::DeleteObjectOutcome outcome = m_client.DeleteObject(request);
+        Aws::S3::Model::DeleteObjectOutcome outcome = p_limiter->run(
+            [&]() { return m_client.DeleteObject(request); },
+            [](const auto& o) { return detail::aws_retryable(o); });
         if (!outcome.IsSuccess())
         {
-            auto err = outcome.GetError();
-            XTENSOR_THROW(std::runtime_error, std::string("Error: DeleteObject: ") + err.GetExceptionName().c_str() + ": " + err.GetMessage().c_str());
+            detail::aws_throw("DeleteObject", outcome);
         }
     }
 
-    void xzarr_aws_store::erase_prefix(const std::string& prefix)
+    inline void xzarr_aws_store::erase_prefix(const std::string& prefix)
     {
         for (const auto& key: list_prefix(prefix))
         {
@@ -274,15 +542,14 @@ namespace xt
         }
     }
 
-    const std::string& xzarr_aws_store::get_root() const
+    inline const std::string& xzarr_aws_store::get_root() const
     {
         return m_root;
     }
 
-    xio_aws_config xzarr_aws_store::get_io_config() const
+    inline xzarr_aws_store xzarr_aws_store::get_io_config() const
     {
-        xio_aws_config c = {m_client, m_bucket};
-        return c;
+        return *this;
     }
 
 }
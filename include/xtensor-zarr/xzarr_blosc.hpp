@@ -0,0 +1,174 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_BLOSC_HPP
+#define XTENSOR_ZARR_BLOSC_HPP
+
+#include <sstream>
+#include <string>
+
+#include <blosc.h>
+
+#include "xtensor-io/xio_binary.hpp"
+#include "xzarr_common.hpp"
+#include "xzarr_threading.hpp"
+
+namespace xt
+{
+    /**
+     * @class xzarr_blosc_config
+     * @brief Blosc compressor configuration with per-array threading control.
+     *
+     * The metadata is compatible with the numcodecs ``blosc`` codec (``cname``,
+     * ``clevel``, ``shuffle``, ``blocksize``). Compression and decompression use
+     * the blosc context API, so that each chunk can be processed with its own
+     * number of internal threads. ``nthreads`` is a runtime setting that is not
+     * stored in the metadata: 0 lets xzarr_thread_policy decide, depending on
+     * the number of chunks processed in parallel.
+     *
+     * This codec is registered under the ``blosc`` name, like the
+     * xio_blosc_config codec of xtensor-io, whose metadata it reads and writes.
+     * Both are available, but only one of them can be registered for a store:
+     * registering the other one then throws.
+     */
+    struct xzarr_blosc_config
+    {
+        std::string name;
+        std::string version;
+        bool big_endian;
+        std::string cname;
+        int clevel;
+        int shuffle;
+        std::size_t blocksize;
+        std::size_t nthreads;
+
+        xzarr_blosc_config()
+            : name("blosc")
+            , version(BLOSC_VERSION_STRING)
+            , big_endian(false)
+            , cname("lz4")
+            , clevel(5)
+            , shuffle(1)
+            , blocksize(0)
+            , nthreads(0)
+        {
+        }
+
+        template <class T>
+        void write_to(T& j) const
+        {
+            j["cname"] = cname;
+            j["clevel"] = clevel;
+            j["shuffle"] = shuffle;
+            j["blocksize"] = blocksize;
+        }
+
+        template <class T>
+        void read_from(T& j)
+        {
+            if (j.contains("cname"))
+            {
+                cname = j["cname"].template get<std::string>();
+            }
+            if (j.contains("clevel"))
+            {
+                clevel = j["clevel"];
+            }
+            if (j.contains("shuffle"))
+            {
+                shuffle = j["shuffle"];
+            }
+            if (j.contains("blocksize"))
+            {
+                blocksize = j["blocksize"];
+            }
+            if (j.contains("nthreads"))
+            {
+                nthreads = j["nthreads"];
+            }
+        }
+
+        bool will_dump(xfile_dirty& dirty)
+        {
+            return dirty.data_dirty;
+        }
+    };
+
+    namespace detail
+    {
+        inline int blosc_threads(const xzarr_blosc_config& config)
+        {
+            return static_cast<int>(xzarr_thread_policy::codec_threads(config.nthreads));
+        }
+
+        inline std::string blosc_compress(const std::string& raw, std::size_t typesize, const xzarr_blosc_config& config)
+        {
+            int shuffle = config.shuffle;
+            if (shuffle == -1)
+            {
+                // numcodecs AUTOSHUFFLE: bit-shuffle for single-byte items, byte-shuffle otherwise
+                shuffle = (typesize == 1) ? 2 : 1;
+            }
+            std::string compressed(raw.size() + BLOSC_MAX_OVERHEAD, '\0');
+            xzarr_thread_policy::codec_scope scope;
+            int size = blosc_compress_ctx(config.clevel, shuffle, typesize, raw.size(),
+                                          raw.data(), &compressed[0], compressed.size(),
+                                          config.cname.c_str(), config.blocksize, blosc_threads(config));
+            if (size <= 0)
+            {
+                XTENSOR_THROW(std::runtime_error, "blosc compression failed with compressor " + config.cname);
+            }
+            compressed.resize(static_cast<std::size_t>(size));
+            return compressed;
+        }
+
+        inline std::string blosc_decompress(const std::string& compressed, const xzarr_blosc_config& config)
+        {
+            std::size_t nbytes = 0;
+            if (blosc_cbuffer_validate(compressed.data(), compressed.size(), &nbytes) != 0)
+            {
+                XTENSOR_THROW(std::runtime_error, "blosc decompression failed: invalid buffer");
+            }
+            std::string raw(nbytes, '\0');
+            if (nbytes == 0)
+            {
+                return raw;
+            }
+            xzarr_thread_policy::codec_scope scope;
+            int size = blosc_decompress_ctx(compressed.data(), &raw[0], raw.size(), blosc_threads(config));
+            if (size < 0 || static_cast<std::size_t>(size) != nbytes)
+            {
+                XTENSOR_THROW(std::runtime_error, "blosc decompression failed");
+            }
+            return raw;
+        }
+    }
+
+    template <class E>
+    void load_file(std::istream& stream, xexpression<E>& e, const xzarr_blosc_config& config)
+    {
+        std::istringstream raw(detail::blosc_decompress(read_stream(stream), config));
+        xio_binary_config binary_config;
+        binary_config.big_endian = config.big_endian;
+        load_file(raw, e, binary_config);
+    }
+
+    template <class E>
+    void dump_file(std::ostream& stream, const xexpression<E>& e, const xzarr_blosc_config& config)
+    {
+        std::ostringstream raw;
+        xio_binary_config binary_config;
+        binary_config.big_endian = config.big_endian;
+        dump_file(raw, e, binary_config);
+        std::string compressed = detail::blosc_compress(raw.str(), sizeof(typename E::value_type), config);
+        stream.write(compressed.data(), static_cast<std::streamsize>(compressed.size()));
+    }
+}
+
+#endif
@@ -0,0 +1,542 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_CHECKSUM_HPP
+#define XTENSOR_ZARR_CHECKSUM_HPP
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+#include "nlohmann/json.hpp"
+#include "xzarr_common.hpp"
+
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define XTENSOR_ZARR_CRC32C_SSE42 1
+#include <nmmintrin.h>
+#endif
+
+namespace xt
+{
+    template <class store_type, class C>
+    class xzarr_store_handler;
+
+    template <class C>
+    class xzarr_file_system_handler;
+
+    /**
+     * Checksum of the stored chunks of an array.
+     * - ``none``: chunks are not checksummed
+     * - ``crc32c``: CRC-32C (Castagnoli), as in the crc32c codec of Zarr v3
+     * - ``xxhash64``: 64-bit xxHash, with a seed of zero
+     */
+    enum class xzarr_checksum_type { none, crc32c, xxhash64 };
+
+    xzarr_checksum_type parse_checksum_type(const std::string& name);
+    std::string checksum_name(xzarr_checksum_type type);
+    std::size_t checksum_size(xzarr_checksum_type type);
+
+    std::uint32_t crc32c(const char* data, std::size_t size, std::uint32_t crc = 0);
+    std::uint64_t xxhash64(const char* data, std::size_t size, std::uint64_t seed = 0);
+    std::string checksum_digest(xzarr_checksum_type type, const char* data, std::size_t size);
+
+    /**
+     * @class xzarr_checksum_options
+     * @brief Checksum settings of the chunk I/O handlers of an array.
+     *
+     * The digest of a chunk is computed on its encoded bytes. It is appended to
+     * them for Zarr v3, like the crc32c codec does, and stored in a sidecar key
+     * next to the chunk for Zarr v2, whose readers would not strip it.
+     */
+    struct xzarr_checksum_options
+    {
+        xzarr_checksum_type type;
+        /// whether the digest is stored in a sidecar key instead of after the chunk
+        bool sidecar;
+        /// whether the digest is checked when a chunk is read
+        bool verify;
+
+        xzarr_checksum_options();
+
+        void read_from(const nlohmann::json& config);
+    };
+
+    /**
+     * @class xzarr_checksum_config
+     * @brief Format configuration of a compressor, with the checksum settings of the array.
+     *
+     * The checksum settings are read from the reserved ``xzarr.checksum``,
+     * ``xzarr.checksum_sidecar`` and ``xzarr.verify_checksum`` keys of the runtime
+     * compressor configuration, which build_zarr_array sets from the metadata of
+     * the array, along with the chunk statistics recorder of the array
+     * (``xzarr.chunk_stats``), which the I/O handlers give the statistics of
+     * the chunks they write. These keys are stripped from the configuration
+     * read by the compressor, whose own keys (e.g. the boolean ``checksum`` of
+     * numcodecs zstd) may clash with unprefixed names.
+     *
+     * @tparam C The format configuration (e.g. xio_gzip_config)
+     */
+    template <class C>
+    struct xzarr_checksum_config : C
+    {
+        xzarr_checksum_options checksum;
+        /// identifier of the chunk statistics recorder of the array (0 if none)
+        std::size_t chunk_stats_sink = 0;
+
+        template <class T>
+        void read_from(T& config);
+    };
+
+    /**************************************
+     * xzarr_checksum_type implementation *
+     **************************************/
+
+    inline xzarr_checksum_type parse_checksum_type(const std::string& name)
+    {
+        if (name.empty() || name == "none")
+        {
+            return xzarr_checksum_type::none;
+        }
+        if (name == "crc32c")
+        {
+            return xzarr_checksum_type::crc32c;
+        }
+        if (name == "xxhash64")
+        {
+            return xzarr_checksum_type::xxhash64;
+        }
+        XTENSOR_THROW(std::runtime_error, "Unknown checksum: " + name);
+    }
+
+    inline std::string checksum_name(xzarr_checksum_type type)
+    {
+        switch (type)
+        {
+            case xzarr_checksum_type::crc32c:
+                return "crc32c";
+            case xzarr_checksum_type::xxhash64:
+                return "xxhash64";
+            default:
+                return "";
+        }
+    }
+
+    /**
+     * Returns the size in bytes of the digest of a checksum.
+     */
+    inline std::size_t checksum_size(xzarr_checksum_type type)
+    {
+        switch (type)
+        {
+            case xzarr_checksum_type::crc32c:
+                return 4;
+            case xzarr_checksum_type::xxhash64:
+                return 8;
+            default:
+                return 0;
+        }
+    }
+
+    /*************************************
+     * checksum functions implementation *
+     *************************************/
+
+    namespace detail
+    {
+        using crc32c_table_type = std::array<std::array<std::uint32_t, 256>, 8>;
+
+        // tables of the slicing-by-8 algorithm, for the reflected polynomial 0x82F63B78
+        inline const crc32c_table_type& crc32c_table()
+        {
+            static const crc32c_table_type table = []()
+            {
+                crc32c_table_type t;
+                for (std::uint32_t i = 0; i < 256; ++i)
+                {
+                    std::uint32_t crc = i;
+                    for (int k = 0; k < 8; ++k)
+                    {
+                        crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78u : (crc >> 1);
+                    }
+                    t[0][i] = crc;
+                }
+                for (std::size_t s = 1; s < 8; ++s)
+                {
+                    for (std::size_t i = 0; i < 256; ++i)
+                    {
+                        t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xff];
+                    }
+                }
+                return t;
+            }();
+            return table;
+        }
+
+        inline std::uint32_t crc32c_portable(std::uint32_t crc, const unsigned char* p, std::size_t n)
+        {
+            const crc32c_table_type& t = crc32c_table();
+            while (n >= 8)
+            {
+                std::uint32_t lo = crc ^ (std::uint32_t(p[0]) | (std::uint32_t(p[1]) << 8) | (std::uint32_t(p[2]) << 16) | (std::uint32_t(p[3]) << 24));
+                crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+                    ^ t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+                p += 8;
+                n -= 8;
+            }
+            while (n-- != 0)
+            {
+                crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+            }
+            return crc;
+        }
+
+#if defined(XTENSOR_ZARR_CRC32C_SSE42)
+        // compiled for SSE 4.2 regardless of the target flags, called after a CPU check
+        __attribute__((target("sse4.2")))
+        inline std::uint32_t crc32c_sse42(std::uint32_t crc, const unsigned char* p, std::size_t n)
+        {
+            std::uint64_t crc64 = crc;
+            while (n >= 8)
+            {
+                std::uint64_t word;
+                std::memcpy(&word, p, 8);
+                crc64 = _mm_crc32_u64(crc64, word);
+                p += 8;
+                n -= 8;
+            }
+            std::uint32_t crc32 = static_cast<std::uint32_t>(crc64);
+            while (n-- != 0)
+            {
+                crc32 = _mm_crc32_u8(crc32, *p++);
+            }
+            return crc32;
+        }
+
+        inline bool has_sse42()
+        {
+            static const bool supported = __builtin_cpu_supports("sse4.2");
+            return supported;
+        }
+#endif
+
+        inline std::uint64_t rotl64(std::uint64_t x, int r)
+        {
+            return (x << r) | (x >> (64 - r));
+        }
+
+        inline std::uint64_t load_le64(const unsigned char* p)
+        {
+            std::uint64_t v = 0;
+            for (int i = 7; i >= 0; --i)
+            {
+                v = (v << 8) | p[i];
+            }
+            return v;
+        }
+
+        inline std::uint32_t load_le32(const unsigned char* p)
+        {
+            return std::uint32_t(p[0]) | (std::uint32_t(p[1]) << 8) | (std::uint32_t(p[2]) << 16) | (std::uint32_t(p[3]) << 24);
+        }
+
+        constexpr std::uint64_t xxh64_prime1 = 11400714785074694791ULL;
+        constexpr std::uint64_t xxh64_prime2 = 14029467366897019727ULL;
+        constexpr std::uint64_t xxh64_prime3 = 1609587929392839161ULL;
+        constexpr std::uint64_t xxh64_prime4 = 9650029242287828579ULL;
+        constexpr std::uint64_t xxh64_prime5 = 2870177450012600261ULL;
+
+        inline std::uint64_t xxh64_round(std::uint64_t acc, std::uint64_t input)
+        {
+            acc += input * xxh64_prime2;
+            return rotl64(acc, 31) * xxh64_prime1;
+        }
+
+        inline std::uint64_t xxh64_merge(std::uint64_t acc, std::uint64_t v)
+        {
+            acc ^= xxh64_round(0, v);
+            return acc * xxh64_prime1 + xxh64_prime4;
+        }
+    }
+
+    /**
+     * Computes the CRC-32C (Castagnoli) of a buffer.
+     * The SSE 4.2 ``crc32`` instruction is used when the CPU supports it, and
+     * a slicing-by-8 table otherwise.
+     * @param data the buffer
+     * @param size the size of the buffer
+     * @param crc the CRC of the preceding data, to compute the CRC of a buffer in pieces
+     */
+    inline std::uint32_t crc32c(const char* data, std::size_t size, std::uint32_t crc)
+    {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+        crc = ~crc;
+#if defined(XTENSOR_ZARR_CRC32C_SSE42)
+        if (detail::has_sse42())
+        {
+            return ~detail::crc32c_sse42(crc, p, size);
+        }
+#endif
+        return ~detail::crc32c_portable(crc, p, size);
+    }
+
+    /**
+     * Computes the 64-bit xxHash (XXH64) of a buffer.
+     * @param data the buffer
+     * @param size the size of the buffer
+     * @param seed the seed of the hash
+     */
+    inline std::uint64_t xxhash64(const char* data, std::size_t size, std::uint64_t seed)
+    {
+        using namespace detail;
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+        const unsigned char* end = p + size;
+        std::uint64_t h;
+        if (size >= 32)
+        {
+            // four independent lanes, which the CPU runs in parallel
+            std::uint64_t v1 = seed + xxh64_prime1 + xxh64_prime2;
+            std::uint64_t v2 = seed + xxh64_prime2;
+            std::uint64_t v3 = seed;
+            std::uint64_t v4 = seed - xxh64_prime1;
+            const unsigned char* limit = end - 32;
+            do
+            {
+                v1 = xxh64_round(v1, load_le64(p));
+                v2 = xxh64_round(v2, load_le64(p + 8));
+                v3 = xxh64_round(v3, load_le64(p + 16));
+                v4 = xxh64_round(v4, load_le64(p + 24));
+                p += 32;
+            }
+            while (p <= limit);
+            h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+            h = xxh64_merge(h, v1);
+            h = xxh64_merge(h, v2);
+            h = xxh64_merge(h, v3);
+            h = xxh64_merge(h, v4);
+        }
+        else
+        {
+            h = seed + xxh64_prime5;
+        }
+        h += static_cast<std::uint64_t>(size);
+        while (p + 8 <= end)
+        {
+            h ^= xxh64_round(0, load_le64(p));
+            h = rotl64(h, 27) * xxh64_prime1 + xxh64_prime4;
+            p += 8;
+        }
+        if (p + 4 <= end)
+        {
+            h ^= std::uint64_t(load_le32(p)) * xxh64_prime1;
+            h = rotl64(h, 23) * xxh64_prime2 + xxh64_prime3;
+            p += 4;
+        }
+        while (p < end)
+        {
+            h ^= (*p++) * xxh64_prime5;
+            h = rotl64(h, 11) * xxh64_prime1;
+        }
+        h ^= h >> 33;
+        h *= xxh64_prime2;
+        h ^= h >> 29;
+        h *= xxh64_prime3;
+        h ^= h >> 32;
+        return h;
+    }
+
+    /**
+     * Returns the digest of a buffer, as the little-endian bytes of its checksum.
+     * @param type the checksum
+     * @param data the buffer
+     * @param size the size of the buffer
+     */
+    inline std::string checksum_digest(xzarr_checksum_type type, const char* data, std::size_t size)
+    {
+        std::uint64_t value = 0;
+        switch (type)
+        {
+            case xzarr_checksum_type::crc32c:
+                value = crc32c(data, size);
+                break;
+            case xzarr_checksum_type::xxhash64:
+                value = xxhash64(data, size);
+                break;
+            default:
+                break;
+        }
+        std::string digest(checksum_size(type), '\0');
+        for (std::size_t i = 0; i < digest.size(); ++i)
+        {
+            digest[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+        }
+        return digest;
+    }
+
+    namespace detail
+    {
+        // reserved keys of the runtime compressor configuration
+        constexpr const char* checksum_option = "xzarr.checksum";
+        constexpr const char* checksum_sidecar_option = "xzarr.checksum_sidecar";
+        constexpr const char* verify_checksum_option = "xzarr.verify_checksum";
+        constexpr const char* chunk_stats_option = "xzarr.chunk_stats";
+
+        inline void erase_runtime_options(nlohmann::json& config)
+        {
+            config.erase(checksum_option);
+            config.erase(checksum_sidecar_option);
+            config.erase(verify_checksum_option);
+            config.erase(chunk_stats_option);
+        }
+
+        template <class C>
+        inline const xzarr_checksum_options* chunk_checksum(const C&)
+        {
+            return nullptr;
+        }
+
+        template <class C>
+        inline const xzarr_checksum_options* chunk_checksum(const xzarr_checksum_config<C>& config)
+        {
+            return config.checksum.type == xzarr_checksum_type::none ? nullptr : &config.checksum;
+        }
+
+        template <class C>
+        inline std::size_t chunk_stats_sink_id(const C&)
+        {
+            return 0;
+        }
+
+        template <class C>
+        inline std::size_t chunk_stats_sink_id(const xzarr_checksum_config<C>& config)
+        {
+            return config.chunk_stats_sink;
+        }
+
+        // the chunk I/O handlers that write and check the digests
+        template <class H>
+        struct supports_chunk_checksum : std::false_type
+        {
+        };
+
+        template <class store_type, class C>
+        struct supports_chunk_checksum<xzarr_store_handler<store_type, C>> : std::true_type
+        {
+        };
+
+        template <class C>
+        struct supports_chunk_checksum<xzarr_file_system_handler<C>> : std::true_type
+        {
+        };
+
+        inline std::string checksum_sidecar_key(const std::string& key, xzarr_checksum_type type)
+        {
+            return key + '.' + checksum_name(type);
+        }
+
+        /**
+         * Appends the digest of an encoded chunk to it, or returns it for
+         * the sidecar key.
+         */
+        inline std::string seal_chunk(std::string& bytes, const xzarr_checksum_options& checksum)
+        {
+            std::string digest = checksum_digest(checksum.type, bytes.data(), bytes.size());
+            if (checksum.sidecar)
+            {
+                return digest;
+            }
+            bytes += digest;
+            return std::string();
+        }
+
+        /**
+         * Checks the digest of an encoded chunk, and strips it if it is appended.
+         * @param bytes the stored chunk
+         * @param checksum the checksum settings
+         * @param sidecar the content of the sidecar key, if the digest is stored there
+         * @param key the key of the chunk, for error messages
+         */
+        inline void open_chunk(std::string& bytes, const xzarr_checksum_options& checksum, const std::string* sidecar, const std::string& key)
+        {
+            std::size_t n = checksum_size(checksum.type);
+            std::size_t size = bytes.size();
+            if (!checksum.sidecar)
+            {
+                if (size < n)
+                {
+                    XTENSOR_THROW(std::runtime_error, "Corrupted chunk: " + key);
+                }
+                size -= n;
+            }
+            if (checksum.verify)
+            {
+                if (checksum.sidecar && sidecar == nullptr)
+                {
+                    XTENSOR_THROW(std::runtime_error, "Missing checksum of chunk: " + key);
+                }
+                std::string digest = checksum_digest(checksum.type, bytes.data(), size);
+                const char* expected = checksum.sidecar ? sidecar->data() : bytes.data() + size;
+                std::size_t expected_size = checksum.sidecar ? sidecar->size() : n;
+                if (expected_size != n || std::memcmp(digest.data(), expected, n) != 0)
+                {
+                    XTENSOR_THROW(std::runtime_error, "Checksum mismatch in chunk: " + key);
+                }
+            }
+            bytes.resize(size);
+        }
+    }
+
+    /*****************************************
+     * xzarr_checksum_options implementation *
+     *****************************************/
+
+    inline xzarr_checksum_options::xzarr_checksum_options()
+        : type(xzarr_checksum_type::none)
+        , sidecar(false)
+        , verify(true)
+    {
+    }
+
+    inline void xzarr_checksum_options::read_from(const nlohmann::json& config)
+    {
+        if (config.contains(detail::checksum_option))
+        {
+            type = parse_checksum_type(config[detail::checksum_option].get<std::string>());
+        }
+        if (config.contains(detail::checksum_sidecar_option))
+        {
+            sidecar = config[detail::checksum_sidecar_option].get<bool>();
+        }
+        if (config.contains(detail::verify_checksum_option))
+        {
+            verify = config[detail::verify_checksum_option].get<bool>();
+        }
+    }
+
+    /****************************************
+     * xzarr_checksum_config implementation *
+     ****************************************/
+
+    template <class C>
+    template <class T>
+    inline void xzarr_checksum_config<C>::read_from(T& config)
+    {
+        nlohmann::json codec_config = config;
+        detail::erase_runtime_options(codec_config);
+        C::read_from(codec_config);
+        checksum.read_from(config);
+        if (config.contains(detail::chunk_stats_option))
+        {
+            chunk_stats_sink = config[detail::chunk_stats_option].template get<std::size_t>();
+        }
+    }
+}
+
+#endif
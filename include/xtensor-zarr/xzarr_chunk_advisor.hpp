@@ -0,0 +1,359 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_CHUNK_ADVISOR_HPP
+#define XTENSOR_ZARR_CHUNK_ADVISOR_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+#include "xzarr_common.hpp"
+#include "xzarr_metadata.hpp"
+
+namespace xt
+{
+    enum class xzarr_access_pattern { row_scan, column_scan, random_point, time_series };
+
+    enum class xzarr_store_kind { file_system, object_store, gdal, memory };
+
+    /**
+     * @class xzarr_store_cost_model
+     * @brief Cost of one request to a store: a fixed latency plus a transfer time.
+     *
+     * The default models come from measurements of typical deployments (local NVMe,
+     * cloud object stores accessed from the same region, GDAL virtual file systems
+     * on network mounts); a model for a given store can be measured with calibrate.
+     */
+    struct xzarr_store_cost_model
+    {
+        double latency;
+        double bandwidth;
+        std::size_t min_chunk_bytes;
+        std::size_t max_chunk_bytes;
+        std::size_t target_shard_bytes;
+
+        static xzarr_store_cost_model for_store(xzarr_store_kind kind);
+
+        template <class store_type>
+        static xzarr_store_cost_model calibrate(store_type& store, xzarr_store_kind kind, std::size_t repeats = 8);
+
+        double request_time(std::size_t bytes) const;
+    };
+
+    /**
+     * @class xzarr_access
+     * @brief An expected access pattern and its relative frequency.
+     */
+    struct xzarr_access
+    {
+        xzarr_access_pattern pattern;
+        double weight;
+
+        xzarr_access(xzarr_access_pattern p, double w = 1.)
+            : pattern(p)
+            , weight(w)
+        {
+        }
+    };
+
+    /**
+     * @class xzarr_chunk_advice
+     * @brief Recommended chunk and shard shapes, with the projected cost of each access pattern.
+     */
+    struct xzarr_chunk_advice
+    {
+        std::vector<std::size_t> chunk_shape;
+        std::vector<std::size_t> shard_shape;
+        std::size_t chunk_bytes;
+        double cost;
+        nlohmann::json projections;
+    };
+
+    /*****************************************
+     * xzarr_store_cost_model implementation *
+     *****************************************/
+
+    inline xzarr_store_cost_model xzarr_store_cost_model::for_store(xzarr_store_kind kind)
+    {
+        xzarr_store_cost_model m;
+        switch (kind)
+        {
+            case xzarr_store_kind::file_system:
+                m.latency = 50e-6;
+                m.bandwidth = 2e9;
+                m.min_chunk_bytes = 64 * 1024;
+                m.max_chunk_bytes = 64 * 1024 * 1024;
+                m.target_shard_bytes = 0;
+                break;
+            case xzarr_store_kind::object_store:
+                m.latency = 30e-3;
+                m.bandwidth = 100e6;
+                m.min_chunk_bytes = 1024 * 1024;
+                m.max_chunk_bytes = 128 * 1024 * 1024;
+                m.target_shard_bytes = 512 * 1024 * 1024;
+                break;
+            case xzarr_store_kind::gdal:
+                m.latency = 5e-3;
+                m.bandwidth = 200e6;
+                m.min_chunk_bytes = 256 * 1024;
+                m.max_chunk_bytes = 64 * 1024 * 1024;
+                m.target_shard_bytes = 256 * 1024 * 1024;
+                break;
+            case xzarr_store_kind::memory:
+                m.latency = 1e-6;
+                m.bandwidth = 10e9;
+                m.min_chunk_bytes = 16 * 1024;
+                m.max_chunk_bytes = 16 * 1024 * 1024;
+                m.target_shard_bytes = 0;
+                break;
+        }
+        return m;
+    }
+
+    /**
+     * Measures the latency and the bandwidth of a store.
+     * Small and large values are written to and read back from the store under the
+     * ``.xzarr_calibration`` prefix, which is erased afterwards. The chunk size bounds
+     * are the defaults for the kind of store.
+     *
+     * @param store the store to measure
+     * @param kind the kind of store
+     * @param repeats the number of reads of each size
+     */
+    template <class store_type>
+    inline xzarr_store_cost_model xzarr_store_cost_model::calibrate(store_type& store, xzarr_store_kind kind, std::size_t repeats)
+    {
+        xzarr_store_cost_model m = for_store(kind);
+        const std::size_t small_size = 4 * 1024;
+        const std::size_t large_size = 4 * 1024 * 1024;
+        const std::string prefix = ".xzarr_calibration";
+        store[prefix + "/small"] = std::string(small_size, 'x');
+        store[prefix + "/large"] = std::string(large_size, 'x');
+        auto time_reads = [&](const std::string& key)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for (std::size_t i = 0; i < repeats; ++i)
+            {
+                std::string value = store[key];
+            }
+            return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / static_cast<double>(repeats);
+        };
+        double small_time = time_reads(prefix + "/small");
+        double large_time = time_reads(prefix + "/large");
+        store.erase_prefix(prefix);
+        double transfer = std::max(large_time - small_time, 1e-9);
+        m.bandwidth = static_cast<double>(large_size - small_size) / transfer;
+        m.latency = std::max(small_time - static_cast<double>(small_size) / m.bandwidth, 0.);
+        return m;
+    }
+
+    inline double xzarr_store_cost_model::request_time(std::size_t bytes) const
+    {
+        return latency + static_cast<double>(bytes) / bandwidth;
+    }
+
+    /**************************************
+     * chunk shape advisor implementation *
+     **************************************/
+
+    namespace detail
+    {
+        // axis along which an access pattern reads, or ndim for point accesses
+        inline std::size_t access_axis(xzarr_access_pattern pattern, std::size_t ndim)
+        {
+            switch (pattern)
+            {
+                case xzarr_access_pattern::row_scan:
+                    return ndim - 1;
+                case xzarr_access_pattern::column_scan:
+                    return ndim >= 2 ? ndim - 2 : 0;
+                case xzarr_access_pattern::time_series:
+                    return 0;
+                default:
+                    return ndim;
+            }
+        }
+
+        inline const char* access_name(xzarr_access_pattern pattern)
+        {
+            switch (pattern)
+            {
+                case xzarr_access_pattern::row_scan:
+                    return "row_scan";
+                case xzarr_access_pattern::column_scan:
+                    return "column_scan";
+                case xzarr_access_pattern::time_series:
+                    return "time_series";
+                default:
+                    return "random_point";
+            }
+        }
+
+        inline std::size_t chunk_bytes(const std::vector<std::size_t>& chunk_shape, std::size_t itemsize)
+        {
+            std::size_t n = itemsize;
+            for (auto c: chunk_shape)
+            {
+                n *= c;
+            }
+            return n;
+        }
+
+        struct access_projection
+        {
+            std::size_t requests;
+            std::size_t bytes_per_request;
+            double seconds;
+        };
+
+        inline access_projection project_access(xzarr_access_pattern pattern, const std::vector<std::size_t>& shape,
+                                                const std::vector<std::size_t>& chunk_shape, std::size_t itemsize,
+                                                const xzarr_store_cost_model& model)
+        {
+            access_projection p;
+            std::size_t axis = access_axis(pattern, shape.size());
+            p.bytes_per_request = chunk_bytes(chunk_shape, itemsize);
+            p.requests = (axis == shape.size()) ? 1 : (shape[axis] + chunk_shape[axis] - 1) / chunk_shape[axis];
+            p.seconds = static_cast<double>(p.requests) * model.request_time(p.bytes_per_request);
+            return p;
+        }
+
+        inline double advice_cost(const std::vector<std::size_t>& shape, const std::vector<std::size_t>& chunk_shape,
+                                  std::size_t itemsize, const std::vector<xzarr_access>& accesses,
+                                  const xzarr_store_cost_model& model)
+        {
+            double cost = 0.;
+            for (const auto& a: accesses)
+            {
+                cost += a.weight * project_access(a.pattern, shape, chunk_shape, itemsize, model).seconds;
+            }
+            // chunks smaller than the store's sweet spot multiply the number of keys
+            std::size_t bytes = chunk_bytes(chunk_shape, itemsize);
+            std::size_t total = chunk_bytes(shape, itemsize);
+            if (bytes < model.min_chunk_bytes && bytes < total)
+            {
+                cost *= static_cast<double>(model.min_chunk_bytes) / static_cast<double>(bytes);
+            }
+            return cost;
+        }
+    }
+
+    /**
+     * Recommends a chunk shape and a shard shape for an array.
+     *
+     * The chunk shape minimizes the weighted cost of the access patterns under the
+     * cost model of the store, as a sum over accesses of (number of requests) times
+     * (latency + chunk size / bandwidth), subject to the chunk size bounds of the model.
+     * The search is a coordinate descent over power-of-two chunk extents. The shard
+     * shape groups chunks (along the last axes first) up to the target shard size of
+     * the model; it equals the chunk shape for stores that do not benefit from sharding.
+     *
+     * @param shape the shape of the array
+     * @param dtype the Zarr data type (e.g. "<f8")
+     * @param accesses the expected access patterns with their weights
+     * @param model the cost model of the store
+     *
+     * @return returns the recommended shapes and the projected cost of each access.
+     */
+    template <class shape_type>
+    inline xzarr_chunk_advice advise_chunk_shape(const shape_type& shape, const std::string& dtype,
+                                                 const std::vector<xzarr_access>& accesses,
+                                                 const xzarr_store_cost_model& model)
+    {
+        std::vector<std::size_t> s(shape.begin(), shape.end());
+        std::size_t ndim = s.size();
+        if (ndim == 0)
+        {
+            XTENSOR_THROW(std::runtime_error, "Cannot advise a chunk shape for a 0-D array");
+        }
+        std::size_t itemsize = dtype_itemsize(dtype);
+        std::vector<std::size_t> c(ndim, 1);
+        double cost = detail::advice_cost(s, c, itemsize, accesses, model);
+        bool improved = true;
+        while (improved)
+        {
+            improved = false;
+            std::vector<std::size_t> best = c;
+            double best_cost = cost;
+            for (std::size_t d = 0; d < ndim; ++d)
+            {
+                for (int dir = 0; dir < 2; ++dir)
+                {
+                    std::vector<std::size_t> candidate = c;
+                    if (dir == 0)
+                    {
+                        candidate[d] = std::min(c[d] * 2, s[d]);
+                    }
+                    else
+                    {
+                        candidate[d] = std::max<std::size_t>(c[d] / 2, 1);
+                    }
+                    if (candidate[d] == c[d] || detail::chunk_bytes(candidate, itemsize) > model.max_chunk_bytes)
+                    {
+                        continue;
+                    }
+                    double candidate_cost = detail::advice_cost(s, candidate, itemsize, accesses, model);
+                    if (candidate_cost < best_cost)
+                    {
+                        best = candidate;
+                        best_cost = candidate_cost;
+                    }
+                }
+            }
+            if (best_cost < cost)
+            {
+                c = best;
+                cost = best_cost;
+                improved = true;
+            }
+        }
+
+        xzarr_chunk_advice advice;
+        advice.chunk_shape = c;
+        advice.chunk_bytes = detail::chunk_bytes(c, itemsize);
+        advice.cost = cost;
+        advice.shard_shape = c;
+        if (model.target_shard_bytes > advice.chunk_bytes)
+        {
+            for (std::size_t d = ndim; d-- > 0;)
+            {
+                while (advice.shard_shape[d] < s[d] &&
+                       detail::chunk_bytes(advice.shard_shape, itemsize) * 2 <= model.target_shard_bytes)
+                {
+                    advice.shard_shape[d] = std::min(advice.shard_shape[d] * 2, ((s[d] + c[d] - 1) / c[d]) * c[d]);
+                }
+            }
+        }
+        advice.projections = nlohmann::json::object();
+        for (const auto& a: accesses)
+        {
+            auto p = detail::project_access(a.pattern, s, c, itemsize, model);
+            nlohmann::json j;
+            j["requests"] = p.requests;
+            j["bytes_per_request"] = p.bytes_per_request;
+            j["seconds"] = p.seconds;
+            j["weight"] = a.weight;
+            advice.projections[detail::access_name(a.pattern)] = j;
+        }
+        return advice;
+    }
+
+    template <class shape_type>
+    inline xzarr_chunk_advice advise_chunk_shape(const shape_type& shape, const std::string& dtype,
+                                                 const std::vector<xzarr_access>& accesses,
+                                                 xzarr_store_kind kind = xzarr_store_kind::file_system)
+    {
+        return advise_chunk_shape(shape, dtype, accesses, xzarr_store_cost_model::for_store(kind));
+    }
+}
+
+#endif
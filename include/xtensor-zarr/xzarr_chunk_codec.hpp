@@ -0,0 +1,476 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_CHUNK_CODEC_HPP
+#define XTENSOR_ZARR_CHUNK_CODEC_HPP
+
+#include <map>
+#include <sstream>
+#include <string>
+#include <typeindex>
+#include <typeinfo>
+#include <type_traits>
+
+#include "nlohmann/json.hpp"
+#include "xtensor/xarray.hpp"
+#include "xtensor-io/xio_binary.hpp"
+#include "xtl/xhalf_float.hpp"
+#include "xzarr_checksum.hpp"
+#include "xzarr_common.hpp"
+#include "xzarr_metadata.hpp"
+
+namespace xt
+{
+    template <class data_type, class format_config>
+    std::string encode_chunk_with_compressor(const xarray<data_type>& chunk, const nlohmann::json& config_json, bool big_endian)
+    {
+        format_config config;
+        config.read_from(config_json);
+        config.big_endian = big_endian;
+        std::ostringstream stream;
+        dump_file(stream, chunk, config);
+        return stream.str();
+    }
+
+    template <class data_type, class format_config>
+    void decode_chunk_with_compressor(const std::string& bytes, xarray<data_type>& chunk, const nlohmann::json& config_json, bool big_endian)
+    {
+        format_config config;
+        config.read_from(config_json);
+        config.big_endian = big_endian;
+        std::istringstream stream(bytes);
+        load_file(stream, chunk, config);
+    }
+
+    /**
+     * @class xchunk_codec_factory
+     * @brief Encoders and decoders of stored chunks, by compressor name.
+     *
+     * Chunks are flat arrays in the memory layout of the array. The codecs are
+     * registered alongside the chunked array builders by xzarr_register_compressor;
+     * since they do not depend on the store, registering the same codec for several
+     * stores registers it once, while registering another codec under the same name
+     * throws.
+     */
+    template <class data_type>
+    class xchunk_codec_factory
+    {
+    public:
+
+        template <class format_config>
+        static void add_codec(const format_config& c)
+        {
+            auto& codecs = instance().m_codecs;
+            auto it = codecs.find(c.name);
+            if (it != codecs.end())
+            {
+                if (it->second.config_type != std::type_index(typeid(format_config)))
+                {
+                    XTENSOR_THROW(std::runtime_error, "Codec already registered: " + std::string(c.name));
+                }
+                return;
+            }
+            codecs.insert(std::make_pair(c.name, make_codec<format_config>()));
+        }
+
+        static bool has_codec(const std::string& compressor)
+        {
+            return instance().m_codecs.find(compressor) != instance().m_codecs.end();
+        }
+
+        static std::string encode(const std::string& compressor, const xarray<data_type>& chunk, const nlohmann::json& config, bool big_endian)
+        {
+            return get(compressor).encode(chunk, config, big_endian);
+        }
+
+        static void decode(const std::string& compressor, const std::string& bytes, xarray<data_type>& chunk, const nlohmann::json& config, bool big_endian)
+        {
+            get(compressor).decode(bytes, chunk, config, big_endian);
+        }
+
+    private:
+
+        struct codec_type
+        {
+            std::string (*encode)(const xarray<data_type>&, const nlohmann::json&, bool);
+            void (*decode)(const std::string&, xarray<data_type>&, const nlohmann::json&, bool);
+            std::type_index config_type;
+        };
+
+        template <class format_config>
+        static codec_type make_codec()
+        {
+            return codec_type{&encode_chunk_with_compressor<data_type, format_config>,
+                              &decode_chunk_with_compressor<data_type, format_config>,
+                              std::type_index(typeid(format_config))};
+        }
+
+        using self_type = xchunk_codec_factory;
+
+        static self_type& instance()
+        {
+            static self_type instance;
+            return instance;
+        }
+
+        static const codec_type& get(const std::string& compressor)
+        {
+            auto it = instance().m_codecs.find(compressor);
+            if (it == instance().m_codecs.end())
+            {
+                XTENSOR_THROW(std::runtime_error, "Unkown compressor type: " + compressor);
+            }
+            return it->second;
+        }
+
+        xchunk_codec_factory()
+        {
+            using format_config = xio_binary_config;
+            m_codecs.insert(std::make_pair(format_config().name, make_codec<format_config>()));
+        }
+
+        std::map<std::string, codec_type> m_codecs;
+    };
+
+    template <class T>
+    struct xzarr_dtype_tag
+    {
+        using type = T;
+    };
+
+    /**
+     * Calls ``f(xzarr_dtype_tag<T>())`` where ``T`` is the C++ type of a Zarr data type.
+     * @param dtype the data type without its endianness (e.g. "f8")
+     * @param f the function to call
+     */
+    template <class F>
+    inline void xzarr_dispatch_dtype(const std::string& dtype, F&& f)
+    {
+        if (dtype == "bool" || dtype == "b1")
+        {
+            f(xzarr_dtype_tag<bool>());
+        }
+        else if (dtype == "i1")
+        {
+            f(xzarr_dtype_tag<int8_t>());
+        }
+        else if (dtype == "i2")
+        {
+            f(xzarr_dtype_tag<int16_t>());
+        }
+        else if (dtype == "i4")
+        {
+            f(xzarr_dtype_tag<int32_t>());
+        }
+        else if (dtype == "i8")
+        {
+            f(xzarr_dtype_tag<int64_t>());
+        }
+        else if (dtype == "u1")
+        {
+            f(xzarr_dtype_tag<uint8_t>());
+        }
+        else if (dtype == "u2")
+        {
+            f(xzarr_dtype_tag<uint16_t>());
+        }
+        else if (dtype == "u4")
+        {
+            f(xzarr_dtype_tag<uint32_t>());
+        }
+        else if (dtype == "u8")
+        {
+            f(xzarr_dtype_tag<uint64_t>());
+        }
+        else if (dtype == "f2")
+        {
+            f(xzarr_dtype_tag<xtl::half_float>());
+        }
+        else if (dtype == "f4")
+        {
+            f(xzarr_dtype_tag<float>());
+        }
+        else if (dtype == "f8")
+        {
+            f(xzarr_dtype_tag<double>());
+        }
+        else
+        {
+            XTENSOR_THROW(std::runtime_error, "Unknown data type: " + dtype);
+        }
+    }
+
+    template <class T>
+    std::string encode_zarr_chunk(const xzarr_array_metadata& metadata, const xarray<T>& chunk);
+
+    template <class store_type, class I>
+    void write_zarr_chunk(store_type& store, const xzarr_array_metadata& metadata, const I& index, const std::string& bytes);
+
+    template <class T, class store_type, class I>
+    bool read_zarr_chunk(store_type& store, const xzarr_array_metadata& metadata, const I& index, xarray<T>& chunk, bool verify_checksum = true);
+
+    template <class T, class store_type>
+    void read_zarr_chunks(store_type& store, const xzarr_array_metadata& metadata, const std::vector<std::vector<std::size_t>>& indices,
+                          std::vector<xarray<T>>& chunks, std::vector<bool>& found, bool verify_checksum = true, std::size_t nthreads = 0);
+
+    template <class store_type>
+    void write_zarr_chunks(store_type& store, const xzarr_array_metadata& metadata, const std::vector<std::vector<std::size_t>>& indices,
+                           const std::vector<std::string>& bytes, std::size_t nthreads = 0);
+
+    template <class store_type, class I>
+    void erase_zarr_chunk(store_type& store, const xzarr_array_metadata& metadata, const I& index);
+
+    /*******************************
+     * stored chunk implementation *
+     *******************************/
+
+    namespace detail
+    {
+        inline xzarr_checksum_options metadata_checksum(const xzarr_array_metadata& metadata, bool verify = true)
+        {
+            xzarr_checksum_options checksum;
+            checksum.type = parse_checksum_type(metadata.checksum);
+            checksum.sidecar = (metadata.zarr_version == 2);
+            checksum.verify = verify;
+            return checksum;
+        }
+
+        template <class T>
+        inline void check_value_type(const xzarr_array_metadata& metadata)
+        {
+            bool matches = false;
+            xzarr_dispatch_dtype(metadata.dtype_noendian(), [&matches](auto tag)
+            {
+                matches = std::is_same<typename decltype(tag)::type, T>::value;
+            });
+            if (!matches)
+            {
+                XTENSOR_THROW(std::runtime_error, "Value type does not match the data type of the array: " + metadata.dtype);
+            }
+        }
+
+        // checks the digest of a stored chunk, if any, and decodes it
+        template <class T>
+        inline void decode_stored_chunk(const xzarr_array_metadata& metadata, const xzarr_checksum_options& checksum, const std::string& key,
+                                        std::string& bytes, const std::string* digest, xarray<T>& chunk)
+        {
+            if (checksum.type != xzarr_checksum_type::none)
+            {
+                open_chunk(bytes, checksum, digest, key);
+            }
+            xchunk_codec_factory<T>::decode(metadata.compressor, bytes, chunk, metadata.compressor_config, metadata.endianness() == '>');
+            if (chunk.size() != metadata.chunk_size())
+            {
+                XTENSOR_THROW(std::runtime_error, "Corrupted chunk: " + key);
+            }
+        }
+
+        // number of chunks read, processed and written in one batch by the chunk-parallel helpers
+        inline std::size_t chunk_batch_size(std::size_t nthreads)
+        {
+            return 4 * ((nthreads == 0) ? xzarr_thread_policy::max_threads() : nthreads);
+        }
+
+        // chunk writes leaving the chunk statistics index alone, for the writers
+        // that update or erase it once for all their chunks
+        template <class store_type, class I>
+        inline void store_zarr_chunk(store_type& store, const xzarr_array_metadata& metadata, const I& index, const std::string& bytes)
+        {
+            std::string key = metadata.chunk_key(index);
+            store[key] = bytes;
+            auto checksum = metadata_checksum(metadata);
+            if (checksum.type != xzarr_checksum_type::none && checksum.sidecar)
+            {
+                store[checksum_sidecar_key(key, checksum.type)] = checksum_digest(checksum.type, bytes.data(), bytes.size());
+            }
+        }
+
+        template <class store_type>
+        inline void store_zarr_chunks(store_type& store, const xzarr_array_metadata& metadata, const std::vector<std::vector<std::size_t>>& indices,
+                                      const std::vector<std::string>& bytes, std::size_t nthreads)
+        {
+            auto checksum = metadata_checksum(metadata);
+            const bool sidecar = checksum.type != xzarr_checksum_type::none && checksum.sidecar;
+            std::vector<std::string> keys;
+            std::vector<std::string> values;
+            keys.reserve(sidecar ? 2 * indices.size() : indices.size());
+            for (std::size_t i = 0; i < indices.size(); ++i)
+            {
+                keys.push_back(metadata.chunk_key(indices[i]));
+            }
+            if (sidecar)
+            {
+                values = bytes;
+                for (std::size_t i = 0; i < indices.size(); ++i)
+                {
+                    keys.push_back(checksum_sidecar_key(keys[i], checksum.type));
+                    values.push_back(checksum_digest(checksum.type, bytes[i].data(), bytes[i].size()));
+                }
+            }
+            xt::write_store_values(store, keys, sidecar ? values : bytes, nthreads);
+        }
+
+        template <class store_type, class I>
+        inline void erase_stored_zarr_chunk(store_type& store, const xzarr_array_metadata& metadata, const I& index)
+        {
+            std::string key = metadata.chunk_key(index);
+            store[key].erase();
+            auto checksum = metadata_checksum(metadata);
+            if (checksum.type != xzarr_checksum_type::none && checksum.sidecar)
+            {
+                store[checksum_sidecar_key(key, checksum.type)].erase();
+            }
+        }
+    }
+
+    /**
+     * Encodes a chunk of an array, in the form it is stored.
+     * The digest of the chunk is appended to the encoded bytes if the array
+     * has a Zarr v3 checksum; for Zarr v2, it is written by write_zarr_chunk.
+     * @param metadata the metadata of the array
+     * @param chunk the chunk, a flat array in the memory layout of the array
+     */
+    template <class T>
+    inline std::string encode_zarr_chunk(const xzarr_array_metadata& metadata, const xarray<T>& chunk)
+    {
+        std::string bytes = xchunk_codec_factory<T>::encode(metadata.compressor, chunk, metadata.compressor_config, metadata.endianness() == '>');
+        auto checksum = detail::metadata_checksum(metadata);
+        if (checksum.type != xzarr_checksum_type::none && !checksum.sidecar)
+        {
+            detail::seal_chunk(bytes, checksum);
+        }
+        return bytes;
+    }
+
+    /**
+     * Writes a chunk encoded by encode_zarr_chunk to a store, with the
+     * sidecar digest of a Zarr v2 checksum. The chunk statistics index of
+     * the array, if any, is erased; many chunks are better written with
+     * write_zarr_chunks or an xzarr_concurrent_writer, which only update
+     * the index once.
+     * @param store the store
+     * @param metadata the metadata of the array
+     * @param index the index of the chunk in the chunk grid
+     * @param bytes the encoded chunk
+     */
+    template <class store_type, class I>
+    inline void write_zarr_chunk(store_type& store, const xzarr_array_metadata& metadata, const I& index, const std::string& bytes)
+    {
+        detail::invalidate_chunk_stats(store, metadata);
+        detail::store_zarr_chunk(store, metadata, index, bytes);
+    }
+
+    /**
+     * Reads and decodes a chunk of an array, checking its digest if the array
+     * has a checksum.
+     * @param store the store
+     * @param metadata the metadata of the array
+     * @param index the index of the chunk in the chunk grid
+     * @param chunk the decoded chunk, a flat array in the memory layout of the array
+     * @param verify_checksum whether the digest of the chunk is checked
+     *
+     * @return returns false if the chunk is not in the store.
+     */
+    template <class T, class store_type, class I>
+    inline bool read_zarr_chunk(store_type& store, const xzarr_array_metadata& metadata, const I& index, xarray<T>& chunk, bool verify_checksum)
+    {
+        std::string key = metadata.chunk_key(index);
+        std::string bytes;
+        if (!read_store_value(store, key, bytes))
+        {
+            return false;
+        }
+        auto checksum = detail::metadata_checksum(metadata, verify_checksum);
+        std::string digest;
+        bool has_digest = checksum.type != xzarr_checksum_type::none && checksum.sidecar && checksum.verify
+                       && read_store_value(store, detail::checksum_sidecar_key(key, checksum.type), digest);
+        detail::decode_stored_chunk(metadata, checksum, key, bytes, has_digest ? &digest : nullptr, chunk);
+        return true;
+    }
+
+    /**
+     * Reads and decodes chunks of an array in one batch, checking their digests if
+     * the array has a checksum. The stored chunks (and their sidecar digests) are
+     * read with read_store_values, so that stores with batched I/O read them at
+     * once, and are decoded in parallel.
+     * @param store the store
+     * @param metadata the metadata of the array
+     * @param indices the indices of the chunks in the chunk grid
+     * @param chunks the decoded chunks, flat arrays in the memory layout of the array,
+     * with the chunk size; the chunks that are not in the store are left uninitialized
+     * @param found whether the chunks are in the store, returned by reference
+     * @param verify_checksum whether the digests of the chunks are checked
+     * @param nthreads the number of threads (0 means the thread budget)
+     */
+    template <class T, class store_type>
+    inline void read_zarr_chunks(store_type& store, const xzarr_array_metadata& metadata, const std::vector<std::vector<std::size_t>>& indices,
+                                 std::vector<xarray<T>>& chunks, std::vector<bool>& found, bool verify_checksum, std::size_t nthreads)
+    {
+        const std::size_t n = indices.size();
+        auto checksum = detail::metadata_checksum(metadata, verify_checksum);
+        const bool sidecar = checksum.type != xzarr_checksum_type::none && checksum.sidecar && checksum.verify;
+        std::vector<std::string> keys(sidecar ? 2 * n : n);
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            keys[i] = metadata.chunk_key(indices[i]);
+            if (sidecar)
+            {
+                keys[n + i] = detail::checksum_sidecar_key(keys[i], checksum.type);
+            }
+        }
+        std::vector<std::string> values;
+        std::vector<bool> exists;
+        read_store_values(store, keys, values, exists, nthreads);
+        found.assign(exists.begin(), exists.begin() + std::ptrdiff_t(n));
+        chunks.resize(n);
+        xzarr_parallel_for(n, nthreads, [&](std::size_t i)
+        {
+            chunks[i].resize(std::vector<std::size_t>{metadata.chunk_size()});
+            if (exists[i])
+            {
+                const std::string* digest = (sidecar && exists[n + i]) ? &values[n + i] : nullptr;
+                detail::decode_stored_chunk(metadata, checksum, keys[i], values[i], digest, chunks[i]);
+            }
+        });
+    }
+
+    /**
+     * Writes chunks encoded by encode_zarr_chunk to a store in one batch, with
+     * the sidecar digests of a Zarr v2 checksum, using write_store_values. The
+     * chunk statistics index of the array, if any, is erased.
+     * @param store the store
+     * @param metadata the metadata of the array
+     * @param indices the indices of the chunks in the chunk grid
+     * @param bytes the encoded chunks
+     * @param nthreads the number of threads (0 means the thread budget)
+     */
+    template <class store_type>
+    inline void write_zarr_chunks(store_type& store, const xzarr_array_metadata& metadata, const std::vector<std::vector<std::size_t>>& indices,
+                                  const std::vector<std::string>& bytes, std::size_t nthreads)
+    {
+        detail::invalidate_chunk_stats(store, metadata);
+        detail::store_zarr_chunks(store, metadata, indices, bytes, nthreads);
+    }
+
+    /**
+     * Erases a chunk of an array from a store, with its sidecar digest, and
+     * the chunk statistics index of the array.
+     * @param store the store
+     * @param metadata the metadata of the array
+     * @param index the index of the chunk in the chunk grid
+     */
+    template <class store_type, class I>
+    inline void erase_zarr_chunk(store_type& store, const xzarr_array_metadata& metadata, const I& index)
+    {
+        detail::invalidate_chunk_stats(store, metadata);
+        detail::erase_stored_zarr_chunk(store, metadata, index);
+    }
+}
+
+#endif
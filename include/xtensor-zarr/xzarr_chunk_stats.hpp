@@ -0,0 +1,751 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_CHUNK_STATS_HPP
+#define XTENSOR_ZARR_CHUNK_STATS_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+#include "xtensor/xarray.hpp"
+#include "xzarr_chunk_codec.hpp"
+#include "xzarr_common.hpp"
+#include "xzarr_metadata.hpp"
+#include "xzarr_rechunk.hpp"
+#include "xzarr_threading.hpp"
+
+namespace xt
+{
+    /**
+     * @class xzarr_chunk_stats
+     * @brief Statistics of the elements of a chunk within the array shape.
+     *
+     * The minimum and maximum ignore NaN values, and are infinite if they are
+     * unknown (e.g. the chunk has no other value than NaN).
+     */
+    struct xzarr_chunk_stats
+    {
+        double min;
+        double max;
+        std::size_t count;
+        std::size_t nan_count;
+
+        xzarr_chunk_stats();
+
+        bool may_contain(double lo, double hi) const;
+    };
+
+    /**
+     * @class xzarr_chunk_stats_index
+     * @brief Statistics of all the chunks of an array.
+     *
+     * The index is a snapshot of the chunks of an array, taken by
+     * build_zarr_chunk_stats, and stored in a ``.zstats`` key under the data
+     * prefix of the array. The chunks are in row-major order of the chunk grid.
+     * The shape, chunk shape, data type and fill value of the array are kept
+     * along with the statistics, so that an index that no longer matches the
+     * array can be detected. Since matches() cannot detect chunk writes, the
+     * writers keep the index up to date: the chunked arrays of the file system
+     * and key-value stores and the xzarr_concurrent_writer merge the statistics
+     * of the chunks they write into it when they are flushed (see
+     * xzarr_chunk_stats_recorder), map_zarr_chunks and build_zarr_pyramid store
+     * the statistics of the chunks they compute, finalize_partitions merges the
+     * statistics committed by the workers, and the other writers
+     * (write_zarr_chunk, resize_zarr_array, rechunk_zarr_array, etc.) erase it
+     * once, so that it must be built again.
+     */
+    struct xzarr_chunk_stats_index
+    {
+        std::vector<std::size_t> shape;
+        std::vector<std::size_t> chunk_shape;
+        std::string dtype;
+        nlohmann::json fill_value;
+        std::vector<xzarr_chunk_stats> chunks;
+
+        static xzarr_chunk_stats_index parse(const nlohmann::json& j);
+        nlohmann::json dump() const;
+
+        bool matches(const xzarr_array_metadata& metadata) const;
+    };
+
+    /**
+     * @class xzarr_query_result
+     * @brief Elements of an array within a range of values.
+     *
+     * The elements are identified by their flat index in the row-major order of
+     * the array, in increasing order.
+     */
+    struct xzarr_query_result
+    {
+        std::vector<std::size_t> indices;
+        std::vector<double> values;
+        std::size_t scanned_chunks;
+        std::size_t skipped_chunks;
+
+        xzarr_query_result();
+    };
+
+    namespace detail
+    {
+        /**
+         * Receiver of the statistics of the chunks written by a writer.
+         * begin_write is called before each chunk write, and record once the
+         * chunk is written; the I/O handlers of a chunk pool, which only know
+         * the paths of the chunks, call record_path instead.
+         */
+        class chunk_stats_sink
+        {
+        public:
+
+            virtual ~chunk_stats_sink() = default;
+
+            virtual void begin_write() = 0;
+            virtual void record(const std::vector<std::size_t>& index, const xzarr_chunk_stats& stats) = 0;
+            virtual void record_path(const std::string& path, const xzarr_chunk_stats& stats) = 0;
+            virtual void flush() = 0;
+        };
+    }
+
+    /**
+     * @class xzarr_chunk_stats_recorder
+     * @brief Keeps the chunk statistics index of an array up to date across chunk writes.
+     *
+     * Before the first chunk write since the last flush, the recorder reads the
+     * index of the array and erases it from the store, if there is one, so that
+     * queries never rely on it while chunks are written. The statistics of the
+     * written chunks are recorded, and flush merges them into the index read
+     * (or into an index of unknown statistics, which never let a query skip a
+     * chunk) and stores it. The recorder is flushed when it is destroyed.
+     *
+     * A recorder is shared by the I/O handlers of the chunk pool of an array
+     * opened with build_zarr_array, and by the copies of an
+     * xzarr_concurrent_writer. The index is only consistent if a single
+     * recorder writes the array at a time.
+     *
+     * @tparam store_type the type of the store
+     */
+    template <class store_type>
+    class xzarr_chunk_stats_recorder : public detail::chunk_stats_sink
+    {
+    public:
+
+        xzarr_chunk_stats_recorder(store_type store, const xzarr_array_metadata& metadata);
+        ~xzarr_chunk_stats_recorder() override;
+
+        void begin_write() override;
+        void record(const std::vector<std::size_t>& index, const xzarr_chunk_stats& stats) override;
+        void record_path(const std::string& path, const xzarr_chunk_stats& stats) override;
+        void flush() override;
+
+    private:
+
+        store_type m_store;
+        xzarr_array_metadata m_metadata;
+        std::mutex m_mutex;
+        bool m_writing;
+        bool m_indexed;
+        xzarr_chunk_stats_index m_index;
+        std::map<std::vector<std::size_t>, xzarr_chunk_stats> m_chunks;
+    };
+
+    template <class store_type>
+    xzarr_chunk_stats_index build_zarr_chunk_stats(store_type store, const std::string& path, std::size_t zarr_version_major, std::size_t nthreads = 0);
+
+    template <class store_type>
+    bool read_zarr_chunk_stats(store_type store, const std::string& path, std::size_t zarr_version_major, xzarr_chunk_stats_index& index);
+
+    template <class store_type>
+    xzarr_query_result query_zarr_array(store_type store, const std::string& path, std::size_t zarr_version_major, double lo, double hi, std::size_t nthreads = 0);
+
+    /************************************
+     * xzarr_chunk_stats implementation *
+     ************************************/
+
+    inline xzarr_chunk_stats::xzarr_chunk_stats()
+        : min(std::numeric_limits<double>::infinity())
+        , max(-std::numeric_limits<double>::infinity())
+        , count(0)
+        , nan_count(0)
+    {
+    }
+
+    /**
+     * Returns false if no element of the chunk can be in the range [lo, hi].
+     */
+    inline bool xzarr_chunk_stats::may_contain(double lo, double hi) const
+    {
+        return count > nan_count && max >= lo && min <= hi;
+    }
+
+    /******************************************
+     * xzarr_chunk_stats_index implementation *
+     ******************************************/
+
+    namespace detail
+    {
+        // infinite bounds have no JSON representation, and are stored as null
+        inline double stats_bound(const nlohmann::json& j, double unknown)
+        {
+            return j.is_null() ? unknown : j.get<double>();
+        }
+
+        inline nlohmann::json stats_bound_json(double value)
+        {
+            return (std::abs(value) == std::numeric_limits<double>::infinity()) ? nlohmann::json() : nlohmann::json(value);
+        }
+    }
+
+    inline xzarr_chunk_stats_index xzarr_chunk_stats_index::parse(const nlohmann::json& j)
+    {
+        xzarr_chunk_stats_index index;
+        index.shape = j["shape"].get<std::vector<std::size_t>>();
+        index.chunk_shape = j["chunk_shape"].get<std::vector<std::size_t>>();
+        index.dtype = j["dtype"].get<std::string>();
+        index.fill_value = j["fill_value"];
+        const auto& min = j["min"];
+        const auto& max = j["max"];
+        const auto& count = j["count"];
+        const auto& nan_count = j["nan_count"];
+        if (min.size() != count.size() || max.size() != count.size() || nan_count.size() != count.size())
+        {
+            XTENSOR_THROW(std::runtime_error, "Invalid chunk statistics: lists of different sizes");
+        }
+        index.chunks.resize(count.size());
+        for (std::size_t i = 0; i < index.chunks.size(); ++i)
+        {
+            auto& stats = index.chunks[i];
+            stats.min = detail::stats_bound(min[i], -std::numeric_limits<double>::infinity());
+            stats.max = detail::stats_bound(max[i], std::numeric_limits<double>::infinity());
+            stats.count = count[i].get<std::size_t>();
+            stats.nan_count = nan_count[i].get<std::size_t>();
+        }
+        return index;
+    }
+
+    inline nlohmann::json xzarr_chunk_stats_index::dump() const
+    {
+        nlohmann::json j;
+        j["shape"] = shape;
+        j["chunk_shape"] = chunk_shape;
+        j["dtype"] = dtype;
+        j["fill_value"] = fill_value;
+        nlohmann::json min = nlohmann::json::array();
+        nlohmann::json max = nlohmann::json::array();
+        nlohmann::json count = nlohmann::json::array();
+        nlohmann::json nan_count = nlohmann::json::array();
+        for (const auto& stats: chunks)
+        {
+            min.push_back(detail::stats_bound_json(stats.min));
+            max.push_back(detail::stats_bound_json(stats.max));
+            count.push_back(stats.count);
+            nan_count.push_back(stats.nan_count);
+        }
+        j["min"] = min;
+        j["max"] = max;
+        j["count"] = count;
+        j["nan_count"] = nan_count;
+        return j;
+    }
+
+    /**
+     * Returns true if the index was built for an array with the given metadata.
+     */
+    inline bool xzarr_chunk_stats_index::matches(const xzarr_array_metadata& metadata) const
+    {
+        return shape == metadata.shape && chunk_shape == metadata.chunk_shape && dtype == metadata.dtype
+            && fill_value == metadata.fill_value && chunks.size() == metadata.chunk_count();
+    }
+
+    /*************************************
+     * xzarr_query_result implementation *
+     *************************************/
+
+    inline xzarr_query_result::xzarr_query_result()
+        : scanned_chunks(0)
+        , skipped_chunks(0)
+    {
+    }
+
+    /***********************************
+     * zarr chunk stats implementation *
+     ***********************************/
+
+    namespace detail
+    {
+        inline std::vector<std::size_t> chunk_grid_index(std::size_t i, const std::vector<std::size_t>& grid)
+        {
+            std::vector<std::size_t> index(grid.size());
+            for (std::size_t d = grid.size(); d-- > 0;)
+            {
+                index[d] = i % grid[d];
+                i /= grid[d];
+            }
+            return index;
+        }
+
+        /**
+         * Calls f(s, d, n, step) for each row of the elements of a chunk within
+         * the array shape, where s is the offset of the row in the chunk, d the
+         * flat row-major index of its first element in the array, n its length
+         * and step the distance of its elements in the array. Rows run along the
+         * contiguous axis of the chunk.
+         */
+        template <class F>
+        inline void for_each_chunk_row(const xzarr_array_metadata& metadata, const std::vector<std::size_t>& index, F&& f)
+        {
+            const std::size_t ndim = metadata.shape.size();
+            std::vector<std::size_t> origin(ndim);
+            std::vector<std::size_t> extent(ndim);
+            for (std::size_t d = 0; d < ndim; ++d)
+            {
+                origin[d] = index[d] * metadata.chunk_shape[d];
+                extent[d] = std::min(metadata.chunk_shape[d], metadata.shape[d] - origin[d]);
+            }
+            auto chunk_strides = rechunk_strides(metadata.chunk_shape, metadata.chunk_memory_layout);
+            auto array_strides = rechunk_strides(metadata.shape, 'C');
+            if (metadata.chunk_memory_layout == 'F')
+            {
+                std::reverse(origin.begin(), origin.end());
+                std::reverse(extent.begin(), extent.end());
+                std::reverse(chunk_strides.begin(), chunk_strides.end());
+                std::reverse(array_strides.begin(), array_strides.end());
+            }
+            const std::vector<std::size_t> zero(ndim, 0);
+            const std::size_t n = extent.back();
+            const std::size_t step = array_strides.back();
+            for_each_block_row(extent, chunk_strides, zero, array_strides, origin, [&](std::size_t s, std::size_t d)
+            {
+                f(s, d, n, step);
+            });
+        }
+
+        template <class T>
+        inline void add_row_stats(const T* p, std::size_t n, xzarr_chunk_stats& stats)
+        {
+            double lo = stats.min;
+            double hi = stats.max;
+            std::size_t nans = 0;
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                double x = static_cast<double>(p[i]);
+                lo = (x < lo) ? x : lo;
+                hi = (x > hi) ? x : hi;
+                nans += (x != x);
+            }
+            stats.min = lo;
+            stats.max = hi;
+            stats.count += n;
+            stats.nan_count += nans;
+        }
+
+        template <class T>
+        inline xzarr_chunk_stats chunk_stats(const xzarr_array_metadata& metadata, const std::vector<std::size_t>& index, const T* data)
+        {
+            xzarr_chunk_stats stats;
+            for_each_chunk_row(metadata, index, [&](std::size_t s, std::size_t, std::size_t n, std::size_t)
+            {
+                add_row_stats(data + s, n, stats);
+            });
+            return stats;
+        }
+
+        inline void check_chunk_stats_rank(const xzarr_array_metadata& metadata)
+        {
+            if (metadata.shape.empty())
+            {
+                XTENSOR_THROW(std::runtime_error, "Cannot index the chunks of a zero-dimensional array: " + metadata.path);
+            }
+        }
+
+        // statistics of all the elements of a chunk, including the ones beyond the
+        // array shape, which can only widen its bounds
+        template <class E>
+        inline xzarr_chunk_stats expression_stats(const xexpression<E>& expression)
+        {
+            xzarr_chunk_stats stats;
+            for (const auto& value: expression.derived_cast())
+            {
+                double x = static_cast<double>(value);
+                stats.min = (x < stats.min) ? x : stats.min;
+                stats.max = (x > stats.max) ? x : stats.max;
+                stats.nan_count += (x != x);
+                ++stats.count;
+            }
+            return stats;
+        }
+
+        // statistics of a chunk that was not looked at, which never let a query skip it
+        inline xzarr_chunk_stats unknown_chunk_stats()
+        {
+            xzarr_chunk_stats stats;
+            stats.min = -std::numeric_limits<double>::infinity();
+            stats.max = std::numeric_limits<double>::infinity();
+            stats.count = 1;
+            return stats;
+        }
+
+        // index of an array with the statistics of some chunks replaced, starting
+        // from a previous index of the array if there is one
+        inline xzarr_chunk_stats_index merge_chunk_stats(const xzarr_array_metadata& metadata, const xzarr_chunk_stats_index* base,
+                                                         const std::map<std::vector<std::size_t>, xzarr_chunk_stats>& chunks)
+        {
+            xzarr_chunk_stats_index index;
+            if (base != nullptr)
+            {
+                index = *base;
+            }
+            else
+            {
+                index.shape = metadata.shape;
+                index.chunk_shape = metadata.chunk_shape;
+                index.dtype = metadata.dtype;
+                index.fill_value = metadata.fill_value;
+                index.chunks.assign(metadata.chunk_count(), unknown_chunk_stats());
+            }
+            const auto grid = metadata.grid_shape();
+            for (const auto& chunk: chunks)
+            {
+                std::size_t i = 0;
+                for (std::size_t d = 0; d < grid.size(); ++d)
+                {
+                    i = i * grid[d] + chunk.first[d];
+                }
+                index.chunks[i] = chunk.second;
+            }
+            return index;
+        }
+
+        // reads the index of an array, if there is one that matches the array
+        template <class store_type>
+        inline bool read_matching_chunk_stats(store_type& store, const xzarr_array_metadata& metadata, xzarr_chunk_stats_index& index)
+        {
+            std::string bytes;
+            if (!xt::read_store_value(store, chunk_stats_key(metadata), bytes))
+            {
+                return false;
+            }
+            index = xzarr_chunk_stats_index::parse(nlohmann::json::parse(bytes));
+            return index.matches(metadata);
+        }
+
+        struct chunk_stats_sinks
+        {
+            std::mutex mutex;
+            std::size_t last_id = 0;
+            std::map<std::size_t, std::weak_ptr<chunk_stats_sink>> sinks;
+        };
+
+        // sinks of the arrays being opened, found by the I/O handlers of their chunks
+        inline chunk_stats_sinks& chunk_stats_sink_registry()
+        {
+            static chunk_stats_sinks registry;
+            return registry;
+        }
+
+        inline std::size_t register_chunk_stats_sink(const std::shared_ptr<chunk_stats_sink>& sink)
+        {
+            auto& registry = chunk_stats_sink_registry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            for (auto it = registry.sinks.begin(); it != registry.sinks.end();)
+            {
+                it = it->second.expired() ? registry.sinks.erase(it) : std::next(it);
+            }
+            registry.sinks[++registry.last_id] = sink;
+            return registry.last_id;
+        }
+
+        inline std::shared_ptr<chunk_stats_sink> find_chunk_stats_sink(std::size_t id)
+        {
+            auto& registry = chunk_stats_sink_registry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            auto it = registry.sinks.find(id);
+            return (it == registry.sinks.end()) ? nullptr : it->second.lock();
+        }
+    }
+
+    /*********************************************
+     * xzarr_chunk_stats_recorder implementation *
+     *********************************************/
+
+    /**
+     * Builds a recorder of the chunk statistics of an array of a store.
+     * No request is made before the first chunk write.
+     * @param store the store
+     * @param metadata the metadata of the array
+     */
+    template <class store_type>
+    inline xzarr_chunk_stats_recorder<store_type>::xzarr_chunk_stats_recorder(store_type store, const xzarr_array_metadata& metadata)
+        : m_store(store)
+        , m_metadata(metadata)
+        , m_writing(false)
+        , m_indexed(false)
+    {
+        detail::check_chunk_stats_rank(m_metadata);
+    }
+
+    template <class store_type>
+    inline xzarr_chunk_stats_recorder<store_type>::~xzarr_chunk_stats_recorder()
+    {
+        try
+        {
+            flush();
+        }
+        catch (...)
+        {
+            // the index stays erased, and must be built again
+        }
+    }
+
+    /**
+     * Reads and erases the index of the array, on the first call since the last flush.
+     */
+    template <class store_type>
+    inline void xzarr_chunk_stats_recorder<store_type>::begin_write()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_writing)
+        {
+            std::string bytes;
+            if (xt::read_store_value(m_store, detail::chunk_stats_key(m_metadata), bytes))
+            {
+                m_index = xzarr_chunk_stats_index::parse(nlohmann::json::parse(bytes));
+                m_indexed = m_index.matches(m_metadata);
+                detail::invalidate_chunk_stats(m_store, m_metadata);
+            }
+            m_writing = true;
+        }
+    }
+
+    /**
+     * Records the statistics of a written chunk.
+     * @param index the index of the chunk in the chunk grid
+     * @param stats the statistics of the chunk
+     */
+    template <class store_type>
+    inline void xzarr_chunk_stats_recorder<store_type>::record(const std::vector<std::size_t>& index, const xzarr_chunk_stats& stats)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_chunks[index] = stats;
+    }
+
+    /**
+     * Records the statistics of a written chunk, identified by its path in the
+     * store (with or without the root of the store); other paths are ignored.
+     * @param path the path of the chunk
+     * @param stats the statistics of the chunk
+     */
+    template <class store_type>
+    inline void xzarr_chunk_stats_recorder<store_type>::record_path(const std::string& path, const xzarr_chunk_stats& stats)
+    {
+        const std::string root = m_store.get_root();
+        std::string key = path;
+        if (!root.empty() && key.compare(0, root.size(), root) == 0)
+        {
+            key = key.substr(root.size());
+        }
+        std::vector<std::size_t> index;
+        if (m_metadata.parse_chunk_key(key, index))
+        {
+            record(index, stats);
+        }
+    }
+
+    /**
+     * Stores the index of the array, with the statistics of the chunks written
+     * since the last flush, if any.
+     */
+    template <class store_type>
+    inline void xzarr_chunk_stats_recorder<store_type>::flush()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_writing)
+        {
+            return;
+        }
+        auto index = detail::merge_chunk_stats(m_metadata, m_indexed ? &m_index : nullptr, m_chunks);
+        m_store[detail::chunk_stats_key(m_metadata)] = index.dump().dump();
+        m_writing = false;
+        m_indexed = false;
+        m_index = xzarr_chunk_stats_index();
+        m_chunks.clear();
+    }
+
+    /**
+     * Computes the statistics of all the chunks of an array of a store, and
+     * stores them in its index, replacing any previous one.
+     *
+     * Each chunk is read and decoded once by one of up to ``nthreads`` workers,
+     * in batches read with read_zarr_chunks. Only the elements within the array
+     * shape are taken into account; missing chunks count as filled with the
+     * fill value. The writers of the array keep the index up to date, or erase
+     * it (see xzarr_chunk_stats_index).
+     *
+     * @param store the store
+     * @param path the path of the array
+     * @param zarr_version_major the major version of the Zarr specification
+     * @param nthreads the number of threads (0 means the thread budget)
+     */
+    template <class store_type>
+    inline xzarr_chunk_stats_index build_zarr_chunk_stats(store_type store, const std::string& path, std::size_t zarr_version_major, std::size_t nthreads)
+    {
+        auto m = read_zarr_array_metadata(store, path, zarr_version_major, false);
+        detail::check_chunk_stats_rank(m);
+        xzarr_chunk_stats_index index;
+        index.shape = m.shape;
+        index.chunk_shape = m.chunk_shape;
+        index.dtype = m.dtype;
+        index.fill_value = m.fill_value;
+        index.chunks.resize(m.chunk_count());
+        const auto grid = m.grid_shape();
+        xzarr_dispatch_dtype(m.dtype_noendian(), [&](auto tag)
+        {
+            using value_type = typename decltype(tag)::type;
+            const value_type fill = fill_value_as<value_type>(m.fill_value);
+            const std::size_t batch = detail::chunk_batch_size(nthreads);
+            for (std::size_t begin = 0; begin < index.chunks.size(); begin += batch)
+            {
+                std::vector<std::vector<std::size_t>> indices;
+                for (std::size_t i = begin; i < std::min(begin + batch, index.chunks.size()); ++i)
+                {
+                    indices.push_back(detail::chunk_grid_index(i, grid));
+                }
+                std::vector<xarray<value_type>> chunks;
+                std::vector<bool> found;
+                read_zarr_chunks(store, m, indices, chunks, found, true, nthreads);
+                xzarr_parallel_for(indices.size(), nthreads, [&](std::size_t i)
+                {
+                    if (!found[i])
+                    {
+                        chunks[i].fill(fill);
+                    }
+                    index.chunks[begin + i] = detail::chunk_stats(m, indices[i], chunks[i].data());
+                });
+            }
+        });
+        store[detail::chunk_stats_key(m)] = index.dump().dump();
+        return index;
+    }
+
+    /**
+     * Reads the chunk statistics of an array of a store.
+     * @param store the store
+     * @param path the path of the array
+     * @param zarr_version_major the major version of the Zarr specification
+     * @param index the index to fill
+     * @return false if the array has no index, or if its index no longer matches
+     * the array (e.g. it was resized since)
+     */
+    template <class store_type>
+    inline bool read_zarr_chunk_stats(store_type store, const std::string& path, std::size_t zarr_version_major, xzarr_chunk_stats_index& index)
+    {
+        auto m = read_zarr_array_metadata(store, path, zarr_version_major, false);
+        return detail::read_matching_chunk_stats(store, m, index);
+    }
+
+    /**
+     * Returns the elements of an array of a store whose value is in the range
+     * [lo, hi]; NaN values never match. Bounds can be infinite, and strict
+     * bounds obtained with ``std::nextafter``.
+     *
+     * If the array has a chunk statistics index matching it, the chunks that
+     * cannot hold a matching element are skipped without being read. Otherwise,
+     * all the chunks are scanned. The remaining chunks are read in batches with
+     * read_zarr_chunks, and decoded once by up to ``nthreads`` workers.
+     *
+     * @param store the store
+     * @param path the path of the array
+     * @param zarr_version_major the major version of the Zarr specification
+     * @param lo the lower bound of the range
+     * @param hi the upper bound of the range
+     * @param nthreads the number of threads (0 means the thread budget)
+     */
+    template <class store_type>
+    inline xzarr_query_result query_zarr_array(store_type store, const std::string& path, std::size_t zarr_version_major, double lo, double hi, std::size_t nthreads)
+    {
+        auto m = read_zarr_array_metadata(store, path, zarr_version_major, false);
+        detail::check_chunk_stats_rank(m);
+        xzarr_chunk_stats_index index;
+        const bool indexed = read_zarr_chunk_stats(store, path, zarr_version_major, index);
+        const std::size_t nchunks = m.chunk_count();
+        std::vector<std::size_t> candidates;
+        candidates.reserve(nchunks);
+        for (std::size_t i = 0; i < nchunks; ++i)
+        {
+            if (!indexed || index.chunks[i].may_contain(lo, hi))
+            {
+                candidates.push_back(i);
+            }
+        }
+
+        xzarr_query_result result;
+        result.scanned_chunks = candidates.size();
+        result.skipped_chunks = nchunks - candidates.size();
+        std::vector<std::pair<std::size_t, double>> matches;
+        std::mutex mutex;
+        const auto grid = m.grid_shape();
+        xzarr_dispatch_dtype(m.dtype_noendian(), [&](auto tag)
+        {
+            using value_type = typename decltype(tag)::type;
+            const value_type fill = fill_value_as<value_type>(m.fill_value);
+            const std::size_t batch = detail::chunk_batch_size(nthreads);
+            for (std::size_t begin = 0; begin < candidates.size(); begin += batch)
+            {
+                std::vector<std::vector<std::size_t>> indices;
+                for (std::size_t c = begin; c < std::min(begin + batch, candidates.size()); ++c)
+                {
+                    indices.push_back(detail::chunk_grid_index(candidates[c], grid));
+                }
+                std::vector<xarray<value_type>> chunks;
+                std::vector<bool> found;
+                read_zarr_chunks(store, m, indices, chunks, found, true, nthreads);
+                xzarr_parallel_for(indices.size(), nthreads, [&](std::size_t c)
+                {
+                    if (!found[c])
+                    {
+                        chunks[c].fill(fill);
+                    }
+                    std::vector<std::pair<std::size_t, double>> local;
+                    const value_type* data = chunks[c].data();
+                    detail::for_each_chunk_row(m, indices[c], [&](std::size_t s, std::size_t d, std::size_t n, std::size_t step)
+                    {
+                        for (std::size_t i = 0; i < n; ++i)
+                        {
+                            double x = static_cast<double>(data[s + i]);
+                            if (x >= lo && x <= hi)
+                            {
+                                local.emplace_back(d + i * step, x);
+                            }
+                        }
+                    });
+                    std::lock_guard<std::mutex> lock(mutex);
+                    matches.insert(matches.end(), local.begin(), local.end());
+                });
+            }
+        });
+        std::sort(matches.begin(), matches.end());
+        result.indices.reserve(matches.size());
+        result.values.reserve(matches.size());
+        for (const auto& match: matches)
+        {
+            result.indices.push_back(match.first);
+            result.values.push_back(match.second);
+        }
+        return result;
+    }
+}
+
+#endif
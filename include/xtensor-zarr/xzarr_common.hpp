@@ -10,9 +10,19 @@
 #ifndef XTENSOR_ZARR_COMMON_HPP
 #define XTENSOR_ZARR_COMMON_HPP
 
+#include <algorithm>
+#include <istream>
+#include <iterator>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
 #include <xtensor-io/xio_binary.hpp>
 #include <nlohmann/json.hpp>
 
+#include "xzarr_threading.hpp"
+
 namespace xt
 {
     template <class C = xio_binary_config>
@@ -24,6 +34,9 @@ namespace xt
         nlohmann::json attrs;
         std::size_t chunk_pool_size;
         nlohmann::json fill_value;
+        std::size_t codec_threads;
+        /// checksum of the stored chunks ("crc32c", "xxhash64", or empty for none)
+        std::string checksum;
 
         xzarr_create_array_options()
             : chunk_memory_layout('C')
@@ -32,6 +45,7 @@ namespace xt
             , attrs(nlohmann::json::object())
             , chunk_pool_size(1)
             , fill_value(nlohmann::json())
+            , codec_threads(0)
         {
         }
     };
@@ -64,6 +78,343 @@ namespace xt
         return '/' + s;
     }
 
+    /**
+     * Turns a key into a relative path without empty components,
+     * as listed by the file system store (e.g. "/a//b/" becomes "a/b").
+     */
+    inline std::string normalize_key(const std::string& key)
+    {
+        std::string res;
+        res.reserve(key.size());
+        for (char c: key)
+        {
+            if (c != '/' || (!res.empty() && res.back() != '/'))
+            {
+                res.push_back(c);
+            }
+        }
+        if (!res.empty() && res.back() == '/')
+        {
+            res.pop_back();
+        }
+        return res;
+    }
+
+    /**
+     * Lists the keys and the prefixes right under a prefix, in a map sorted
+     * by normalized keys. Used by the stores that keep an index of their keys.
+     */
+    template <class M>
+    inline void list_dir_sorted(const M& index, const std::string& prefix, std::vector<std::string>& keys, std::vector<std::string>& prefixes)
+    {
+        std::string p = normalize_key(prefix);
+        if (!p.empty())
+        {
+            p.push_back('/');
+        }
+        auto it = index.lower_bound(p);
+        while (it != index.end() && it->first.compare(0, p.size(), p) == 0)
+        {
+            std::size_t i = it->first.find('/', p.size());
+            if (i == std::string::npos)
+            {
+                keys.push_back(it->first);
+                ++it;
+            }
+            else
+            {
+                // skip the keys of the sub-prefix, which sort right before the next character after '/'
+                std::string sub = it->first.substr(0, i);
+                prefixes.push_back(sub);
+                it = index.lower_bound(sub + char('/' + 1));
+            }
+        }
+    }
+
+    /**
+     * Lists the keys under a prefix, in a map sorted by normalized keys.
+     */
+    template <class M>
+    inline std::vector<std::string> list_prefix_sorted(const M& index, const std::string& prefix)
+    {
+        std::string p = normalize_key(prefix);
+        if (!p.empty())
+        {
+            p.push_back('/');
+        }
+        std::vector<std::string> keys;
+        for (auto it = index.lower_bound(p); it != index.end() && it->first.compare(0, p.size(), p) == 0; ++it)
+        {
+            keys.push_back(it->first);
+        }
+        return keys;
+    }
+
+    namespace detail
+    {
+        template <class S, class = void>
+        struct has_visit_prefix : std::false_type
+        {
+        };
+
+        template <class S>
+        struct has_visit_prefix<S, decltype(std::declval<S&>().visit_prefix(std::string(), std::declval<void (*)(const std::string&)>()), void())>
+            : std::true_type
+        {
+        };
+
+        template <class S, class F>
+        inline void visit_store_prefix(S& store, const std::string& prefix, F&& f, std::true_type)
+        {
+            store.visit_prefix(prefix, std::forward<F>(f));
+        }
+
+        template <class S, class F>
+        inline void visit_store_prefix(S& store, const std::string& prefix, F&& f, std::false_type)
+        {
+            std::vector<std::string> keys = store.list_prefix(prefix);
+            std::sort(keys.begin(), keys.end());
+            for (const auto& key: keys)
+            {
+                f(key);
+            }
+        }
+
+        template <class S, class = void>
+        struct has_stream_read : std::false_type
+        {
+        };
+
+        template <class S>
+        struct has_stream_read<S, decltype(std::declval<S&>()[std::string()].read(std::declval<std::string&>()), void())>
+            : std::true_type
+        {
+        };
+
+        template <class S, class = void>
+        struct has_get_many : std::false_type
+        {
+        };
+
+        template <class S>
+        struct has_get_many<S, decltype(std::declval<S&>().get_many(std::declval<const std::vector<std::string>&>(),
+                                                                     std::declval<std::vector<std::string>&>(),
+                                                                     std::declval<std::vector<bool>&>()), void())>
+            : std::true_type
+        {
+        };
+
+        template <class S, class = void>
+        struct has_set_many : std::false_type
+        {
+        };
+
+        template <class S>
+        struct has_set_many<S, decltype(std::declval<S&>().set_many(std::declval<const std::vector<std::string>&>(),
+                                                                     std::declval<const std::vector<std::string>&>()), void())>
+            : std::true_type
+        {
+        };
+
+        template <class S>
+        inline bool read_store_value(S& store, const std::string& key, std::string& bytes, std::true_type)
+        {
+            return store[key].read(bytes);
+        }
+
+        template <class S>
+        inline bool read_store_value(S& store, const std::string& key, std::string& bytes, std::false_type)
+        {
+            auto stream = store[key];
+            if (!stream.exists())
+            {
+                return false;
+            }
+            bytes = std::string(stream);
+            return true;
+        }
+    }
+
+    /**
+     * Calls ``f(key)`` for each key of a store with a given prefix, in
+     * lexicographic order. Stores listing their keys page by page provide a
+     * ``visit_prefix`` method, so that the keys are never all held in memory;
+     * the keys of the other stores are listed and sorted.
+     */
+    template <class S, class F>
+    inline void visit_store_prefix(S& store, const std::string& prefix, F&& f)
+    {
+        detail::visit_store_prefix(store, prefix, std::forward<F>(f), detail::has_visit_prefix<S>());
+    }
+
+    /**
+     * Reads the value of a key of a store, returning false if the key does not
+     * exist. Stores whose streams provide a ``read`` method answer with a
+     * single request; the key of the other stores is probed first.
+     */
+    template <class S>
+    inline bool read_store_value(S& store, const std::string& key, std::string& bytes)
+    {
+        return detail::read_store_value(store, key, bytes, detail::has_stream_read<S>());
+    }
+
+    namespace detail
+    {
+        template <class S>
+        inline void read_store_values(S& store, const std::vector<std::string>& keys, std::vector<std::string>& values,
+                                      std::vector<bool>& found, std::size_t, std::true_type)
+        {
+            store.get_many(keys, values, found);
+        }
+
+        template <class S>
+        inline void read_store_values(S& store, const std::vector<std::string>& keys, std::vector<std::string>& values,
+                                      std::vector<bool>& found, std::size_t nthreads, std::false_type)
+        {
+            values.resize(keys.size());
+            // std::vector<bool> cannot be written concurrently
+            std::vector<char> exists(keys.size(), 0);
+            xzarr_parallel_for(keys.size(), nthreads, [&](std::size_t i)
+            {
+                exists[i] = xt::read_store_value(store, keys[i], values[i]) ? 1 : 0;
+            });
+            found.assign(exists.begin(), exists.end());
+        }
+
+        template <class S>
+        inline void write_store_values(S& store, const std::vector<std::string>& keys, const std::vector<std::string>& values,
+                                       std::size_t, std::true_type)
+        {
+            store.set_many(keys, values);
+        }
+
+        template <class S>
+        inline void write_store_values(S& store, const std::vector<std::string>& keys, const std::vector<std::string>& values,
+                                       std::size_t nthreads, std::false_type)
+        {
+            xzarr_parallel_for(keys.size(), nthreads, [&](std::size_t i)
+            {
+                store[keys[i]] = values[i];
+            });
+        }
+    }
+
+    /**
+     * Reads the values of several keys of a store in one batch. Stores providing
+     * ``get_many`` (e.g. xzarr_file_system_store, whose batches go through its I/O
+     * engine) read them at once; the keys of the other stores are read in parallel.
+     * @param store the store
+     * @param keys the keys
+     * @param values the values, returned by reference
+     * @param found whether the keys exist, returned by reference
+     * @param nthreads the number of threads of the parallel reads (0 means the thread budget)
+     */
+    template <class S>
+    inline void read_store_values(S& store, const std::vector<std::string>& keys, std::vector<std::string>& values,
+                                  std::vector<bool>& found, std::size_t nthreads = 0)
+    {
+        detail::read_store_values(store, keys, values, found, nthreads, detail::has_get_many<S>());
+    }
+
+    /**
+     * Writes the values of several keys of a store in one batch, with ``set_many``
+     * if the store provides it, in parallel otherwise.
+     * @param store the store
+     * @param keys the keys
+     * @param values the values
+     * @param nthreads the number of threads of the parallel writes (0 means the thread budget)
+     */
+    template <class S>
+    inline void write_store_values(S& store, const std::vector<std::string>& keys, const std::vector<std::string>& values,
+                                   std::size_t nthreads = 0)
+    {
+        detail::write_store_values(store, keys, values, nthreads, detail::has_set_many<S>());
+    }
+
+    /**
+     * Reads the remaining content of a stream in a single allocation.
+     * Falls back to character-wise reading for non-seekable streams.
+     */
+    inline std::string read_stream(std::istream& stream)
+    {
+        std::string bytes;
+        std::istream::pos_type start = stream.tellg();
+        if (start != std::istream::pos_type(-1) && stream.seekg(0, std::ios::end))
+        {
+            std::istream::pos_type end = stream.tellg();
+            stream.seekg(start);
+            bytes.resize(static_cast<std::size_t>(end - start));
+            stream.read(&bytes[0], static_cast<std::streamsize>(bytes.size()));
+            bytes.resize(static_cast<std::size_t>(stream.gcount()));
+        }
+        else
+        {
+            stream.clear();
+            bytes.assign(std::istreambuf_iterator<char>{stream}, {});
+        }
+        return bytes;
+    }
+
+    inline std::string base64_encode(const std::string& bytes)
+    {
+        static const char* table = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        std::string out;
+        out.reserve(((bytes.size() + 2) / 3) * 4);
+        std::size_t i = 0;
+        for (; i + 2 < bytes.size(); i += 3)
+        {
+            unsigned int n = (static_cast<unsigned char>(bytes[i]) << 16)
+                           | (static_cast<unsigned char>(bytes[i + 1]) << 8)
+                           | static_cast<unsigned char>(bytes[i + 2]);
+            out.push_back(table[(n >> 18) & 63]);
+            out.push_back(table[(n >> 12) & 63]);
+            out.push_back(table[(n >> 6) & 63]);
+            out.push_back(table[n & 63]);
+        }
+        if (i < bytes.size())
+        {
+            unsigned int n = static_cast<unsigned char>(bytes[i]) << 16;
+            if (i + 1 < bytes.size())
+            {
+                n |= static_cast<unsigned char>(bytes[i + 1]) << 8;
+            }
+            out.push_back(table[(n >> 18) & 63]);
+            out.push_back(table[(n >> 12) & 63]);
+            out.push_back(i + 1 < bytes.size() ? table[(n >> 6) & 63] : '=');
+            out.push_back('=');
+        }
+        return out;
+    }
+
+    inline std::string base64_decode(const std::string& text)
+    {
+        static const std::string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        std::string out;
+        out.reserve((text.size() / 4) * 3);
+        unsigned int n = 0;
+        int bits = -8;
+        for (char c: text)
+        {
+            if (c == '=')
+            {
+                break;
+            }
+            std::size_t v = alphabet.find(c);
+            if (v == std::string::npos)
+            {
+                XTENSOR_THROW(std::runtime_error, "Invalid base64 character: " + std::string(1, c));
+            }
+            n = (n << 6) | static_cast<unsigned int>(v);
+            bits += 6;
+            if (bits >= 0)
+            {
+                out.push_back(static_cast<char>((n >> bits) & 0xFF));
+                bits -= 8;
+            }
+        }
+        return out;
+    }
+
     /********************************
      * xzarr_index_path declaration *
      ********************************/
@@ -10,7 +10,13 @@
 #ifndef XTENSOR_ZARR_COMPRESSOR_HPP
 #define XTENSOR_ZARR_COMPRESSOR_HPP
 
+#include <map>
+#include <typeindex>
+#include <typeinfo>
+
+#include "xzarr_checksum.hpp"
 #include "xzarr_common.hpp"
+#include "xzarr_chunk_codec.hpp"
 #include "xtensor-io/xchunk_store_manager.hpp"
 #include "xtensor-io/xio_binary.hpp"
 #include "zarray/zarray.hpp"
@@ -101,8 +107,14 @@ namespace xt
     template <class store_type, class data_type, class format_config>
     zarray build_chunked_array_with_compressor(store_type& store, char chunk_memory_layout, std::vector<std::size_t>& shape, std::vector<std::size_t>& chunk_shape, const std::string& path, char separator, const nlohmann::json& attrs, char endianness, nlohmann::json& config, std::size_t chunk_pool_size, const nlohmann::json& fill_value_json, std::size_t zarr_version)
     {
-        using io_handler = typename store_type::template io_handler<format_config>;
-        return build_chunked_array_impl<store_type, data_type, io_handler>(store, chunk_memory_layout, shape, chunk_shape, path, separator, attrs, endianness, format_config(), config, chunk_pool_size, fill_value_json, zarr_version);
+        // the checksum settings of the array are read with the compressor configuration
+        using checked_config = xzarr_checksum_config<format_config>;
+        using io_handler = typename store_type::template io_handler<checked_config>;
+        if (config.contains(detail::checksum_option) && !detail::supports_chunk_checksum<io_handler>::value)
+        {
+            XTENSOR_THROW(std::runtime_error, "Chunk checksums are not supported by the store of array: " + path);
+        }
+        return build_chunked_array_impl<store_type, data_type, io_handler>(store, chunk_memory_layout, shape, chunk_shape, path, separator, attrs, endianness, checked_config(), config, chunk_pool_size, fill_value_json, zarr_version);
     }
 
     template <class store_type, class data_type>
@@ -119,6 +131,18 @@ namespace xt
                 XTENSOR_THROW(std::runtime_error, "Compressor already registered: " + std::string(c.name));
             }
             instance().m_builders.insert(std::make_pair(c.name, &build_chunked_array_with_compressor<store_type, data_type, format_config>));
+            instance().m_types.insert(std::make_pair(c.name, std::type_index(typeid(format_config))));
+        }
+
+        static bool has_compressor(const std::string& compressor)
+        {
+            return instance().m_builders.find(compressor) != instance().m_builders.end();
+        }
+
+        static bool has_compressor(const std::string& compressor, std::type_index config_type)
+        {
+            auto type = instance().m_types.find(compressor);
+            return type != instance().m_types.end() && type->second == config_type;
         }
 
         static zarray build(store_type& store, const std::string& compressor, char chunk_memory_layout, std::vector<std::size_t>& shape, std::vector<std::size_t>& chunk_shape, const std::string& path, char separator, const nlohmann::json& attrs, char endianness, nlohmann::json& config, std::size_t chunk_pool_size, const nlohmann::json& fill_value_json, std::size_t zarr_version)
@@ -149,9 +173,11 @@ namespace xt
         {
             using format_config = xio_binary_config;
             m_builders.insert(std::make_pair(format_config().name, &build_chunked_array_with_compressor<store_type, data_type, format_config>));
+            m_types.insert(std::make_pair(format_config().name, std::type_index(typeid(format_config))));
         }
 
         std::map<std::string, zarray (*)(store_type& store, char chunk_memory_layout, std::vector<std::size_t>& shape, std::vector<std::size_t>& chunk_shape, const std::string& path, char separator, const nlohmann::json& attrs, char endianness, nlohmann::json& config, std::size_t chunk_pool_size, const nlohmann::json& fill_value_json, std::size_t zarr_version)> m_builders;
+        std::map<std::string, std::type_index> m_types;
     };
 
     template <class store_type, class format_config>
@@ -169,6 +195,18 @@ namespace xt
         xcompressor_factory<store_type, xtl::half_float>::add_compressor(format_config());
         xcompressor_factory<store_type, float>::add_compressor(format_config());
         xcompressor_factory<store_type, double>::add_compressor(format_config());
+        xchunk_codec_factory<bool>::add_codec(format_config());
+        xchunk_codec_factory<int8_t>::add_codec(format_config());
+        xchunk_codec_factory<int16_t>::add_codec(format_config());
+        xchunk_codec_factory<int32_t>::add_codec(format_config());
+        xchunk_codec_factory<int64_t>::add_codec(format_config());
+        xchunk_codec_factory<uint8_t>::add_codec(format_config());
+        xchunk_codec_factory<uint16_t>::add_codec(format_config());
+        xchunk_codec_factory<uint32_t>::add_codec(format_config());
+        xchunk_codec_factory<uint64_t>::add_codec(format_config());
+        xchunk_codec_factory<xtl::half_float>::add_codec(format_config());
+        xchunk_codec_factory<float>::add_codec(format_config());
+        xchunk_codec_factory<double>::add_codec(format_config());
     }
 
 }
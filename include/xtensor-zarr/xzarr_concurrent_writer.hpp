@@ -0,0 +1,234 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_CONCURRENT_WRITER_HPP
+#define XTENSOR_ZARR_CONCURRENT_WRITER_HPP
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "xtensor/xarray.hpp"
+#include "xzarr_chunk_codec.hpp"
+#include "xzarr_chunk_stats.hpp"
+#include "xzarr_common.hpp"
+#include "xzarr_metadata.hpp"
+#include "xzarr_rechunk.hpp"
+#include "xzarr_resize.hpp"
+
+namespace xt
+{
+    /**
+     * @class xzarr_concurrent_writer
+     * @brief Thread-safe writer of blocks of a Zarr array.
+     *
+     * The chunked arrays built by build_chunked_array_impl hold their chunks in a
+     * pool that is not thread-safe, so that several threads cannot write to the
+     * same zarray. The xzarr_concurrent_writer class writes blocks of an array
+     * straight to the chunks of the store instead, bypassing any pool:
+     *
+     * - a chunk fully covered by a block is encoded and written as is;
+     * - a chunk partially covered by a block is read, updated and written back.
+     *
+     * Each chunk is written under one of ``nstripes`` locks, chosen by hashing its
+     * key, so that threads writing overlapping blocks never lose each other's
+     * updates, while threads writing disjoint sets of chunks rarely contend. A
+     * writer can be used (or copied) by any number of threads of a process; the
+     * copies share their locks. Chunked arrays opened before the writes keep the
+     * chunks of their pool, and must be opened again to see the written data.
+     *
+     * The chunk statistics index of the array is erased by the first write, and
+     * stored again with the statistics of the written chunks by flush, or when
+     * the last copy of the writer is destroyed (see xzarr_chunk_stats_recorder).
+     *
+     * @tparam T the value type of the array, matching its data type
+     * @tparam store_type the type of the store
+     */
+    template <class T, class store_type>
+    class xzarr_concurrent_writer
+    {
+    public:
+
+        xzarr_concurrent_writer(store_type store, const std::string& path, std::size_t zarr_version_major, std::size_t nstripes = 256);
+
+        template <class E, class S>
+        void write(const xexpression<E>& data, const S& offset);
+
+        void flush();
+
+        const xzarr_array_metadata& metadata() const;
+
+    private:
+
+        std::mutex& chunk_mutex(const std::string& key);
+
+        store_type m_store;
+        xzarr_array_metadata m_metadata;
+        std::vector<std::size_t> m_chunk_strides;
+        T m_fill_value;
+        std::shared_ptr<std::vector<std::mutex>> p_stripes;
+        std::shared_ptr<detail::chunk_stats_sink> p_stats;
+
+        template <class U, class S>
+        friend class xzarr_partition_writer;
+    };
+
+    /******************************************
+     * xzarr_concurrent_writer implementation *
+     ******************************************/
+
+    /**
+     * Builds a writer to an array of a store.
+     * @param store the store
+     * @param path the path of the array
+     * @param zarr_version_major the major version of the Zarr specification
+     * @param nstripes the number of chunk locks
+     */
+    template <class T, class store_type>
+    inline xzarr_concurrent_writer<T, store_type>::xzarr_concurrent_writer(store_type store, const std::string& path, std::size_t zarr_version_major, std::size_t nstripes)
+        : m_store(store)
+        , m_metadata(read_zarr_array_metadata(store, path, zarr_version_major, false))
+        , p_stripes(std::make_shared<std::vector<std::mutex>>(std::max<std::size_t>(nstripes, 1)))
+    {
+        detail::check_value_type<T>(m_metadata);
+        m_chunk_strides = detail::rechunk_strides(m_metadata.chunk_shape, m_metadata.chunk_memory_layout);
+        m_fill_value = fill_value_as<T>(m_metadata.fill_value);
+        if (!m_metadata.shape.empty())
+        {
+            p_stats = std::make_shared<xzarr_chunk_stats_recorder<store_type>>(store, m_metadata);
+        }
+    }
+
+    /**
+     * Writes a block of the array.
+     * @param data the block
+     * @param offset the position of the first element of the block in the array
+     */
+    template <class T, class store_type>
+    template <class E, class S>
+    inline void xzarr_concurrent_writer<T, store_type>::write(const xexpression<E>& data, const S& offset)
+    {
+        const E& e = data.derived_cast();
+        const xzarr_array_metadata& m = m_metadata;
+        const std::size_t ndim = m.shape.size();
+        std::vector<std::size_t> lo(offset.begin(), offset.end());
+        std::vector<std::size_t> extent(e.shape().begin(), e.shape().end());
+        if (lo.size() != ndim || extent.size() != ndim)
+        {
+            XTENSOR_THROW(std::runtime_error, "Cannot write: block does not match the array dimension");
+        }
+        std::vector<std::size_t> hi(ndim);
+        for (std::size_t d = 0; d < ndim; ++d)
+        {
+            hi[d] = lo[d] + extent[d];
+            if (hi[d] > m.shape[d])
+            {
+                XTENSOR_THROW(std::runtime_error, "Cannot write: block exceeds the array shape");
+            }
+            if (extent[d] == 0)
+            {
+                return;
+            }
+        }
+        xarray<T> values(extent);
+        std::copy(e.begin(), e.end(), values.begin());
+        const auto value_strides = detail::rechunk_strides(extent, 'C');
+
+        std::vector<std::size_t> first(ndim);
+        std::vector<std::size_t> last(ndim);
+        for (std::size_t d = 0; d < ndim; ++d)
+        {
+            first[d] = lo[d] / m.chunk_shape[d];
+            last[d] = (hi[d] - 1) / m.chunk_shape[d];
+        }
+        std::vector<std::size_t> chunk_offset(ndim);
+        std::vector<std::size_t> value_offset(ndim);
+        std::vector<std::size_t> count(ndim);
+        xarray<T> chunk(std::vector<std::size_t>{m.chunk_size()});
+        detail::for_each_chunk_index(first, last, [&](const std::vector<std::size_t>& index)
+        {
+            bool full = true;
+            for (std::size_t d = 0; d < ndim; ++d)
+            {
+                std::size_t origin = index[d] * m.chunk_shape[d];
+                std::size_t begin = std::max(lo[d], origin);
+                std::size_t end = std::min(hi[d], origin + m.chunk_shape[d]);
+                chunk_offset[d] = begin - origin;
+                value_offset[d] = begin - lo[d];
+                count[d] = end - begin;
+                // elements beyond the array shape are not part of the chunk
+                full = full && (begin == origin) && (end == std::min(origin + m.chunk_shape[d], m.shape[d]));
+            }
+            std::string key = m.chunk_key(index);
+            xzarr_chunk_stats stats;
+            if (p_stats)
+            {
+                p_stats->begin_write();
+            }
+            if (full)
+            {
+                // encoded outside of the lock, which only orders the writes
+                chunk.fill(m_fill_value);
+                detail::copy_block(values.data(), value_strides, value_offset, chunk.data(), m_chunk_strides, chunk_offset, count);
+                std::string bytes = encode_zarr_chunk(m, chunk);
+                stats = p_stats ? detail::chunk_stats(m, index, chunk.data()) : stats;
+                std::lock_guard<std::mutex> lock(chunk_mutex(key));
+                detail::store_zarr_chunk(m_store, m, index, bytes);
+                if (p_stats)
+                {
+                    p_stats->record(index, stats);
+                }
+            }
+            else
+            {
+                std::lock_guard<std::mutex> lock(chunk_mutex(key));
+                detail::read_chunk_or_fill(m_store, m, index, chunk, m_fill_value);
+                detail::copy_block(values.data(), value_strides, value_offset, chunk.data(), m_chunk_strides, chunk_offset, count);
+                detail::store_zarr_chunk(m_store, m, index, encode_zarr_chunk(m, chunk));
+                if (p_stats)
+                {
+                    p_stats->record(index, detail::chunk_stats(m, index, chunk.data()));
+                }
+            }
+        });
+    }
+
+    /**
+     * Stores the chunk statistics index of the array, updated with the chunks
+     * written since the last flush.
+     */
+    template <class T, class store_type>
+    inline void xzarr_concurrent_writer<T, store_type>::flush()
+    {
+        if (p_stats)
+        {
+            p_stats->flush();
+        }
+    }
+
+    /**
+     * Returns the metadata of the array.
+     */
+    template <class T, class store_type>
+    inline const xzarr_array_metadata& xzarr_concurrent_writer<T, store_type>::metadata() const
+    {
+        return m_metadata;
+    }
+
+    template <class T, class store_type>
+    inline std::mutex& xzarr_concurrent_writer<T, store_type>::chunk_mutex(const std::string& key)
+    {
+        return (*p_stripes)[std::hash<std::string>()(key) % p_stripes->size()];
+    }
+}
+
+#endif
@@ -0,0 +1,399 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_COPY_HPP
+#define XTENSOR_ZARR_COPY_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+#include "xtensor/xarray.hpp"
+#include "xzarr_chunk_codec.hpp"
+#include "xzarr_common.hpp"
+#include "xzarr_group.hpp"
+#include "xzarr_metadata.hpp"
+#include "xzarr_node.hpp"
+#include "xzarr_threading.hpp"
+
+namespace xt
+{
+    /**
+     * @class xzarr_copy_options
+     * @brief Options of the array and hierarchy copy.
+     */
+    struct xzarr_copy_options
+    {
+        /// compressor of the destination (empty means the compressor of the source)
+        std::string compressor;
+        /// configuration of the destination compressor
+        nlohmann::json compressor_config;
+        /// chunk separator of the destination (0 means the one of the source, or the default of the destination version)
+        char chunk_separator;
+        /// skip the chunks that are already in the destination
+        bool resume;
+        /// number of workers (0 means the thread budget of xzarr_thread_policy)
+        std::size_t nthreads;
+
+        xzarr_copy_options()
+            : compressor_config(nlohmann::json::object())
+            , chunk_separator(0)
+            , resume(false)
+            , nthreads(0)
+        {
+        }
+    };
+
+    /**
+     * @class xzarr_copy_stats
+     * @brief Number of chunks copied verbatim, transcoded and skipped by a copy.
+     */
+    struct xzarr_copy_stats
+    {
+        std::size_t copied;
+        std::size_t transcoded;
+        std::size_t skipped;
+
+        xzarr_copy_stats()
+            : copied(0)
+            , transcoded(0)
+            , skipped(0)
+        {
+        }
+
+        xzarr_copy_stats& operator+=(const xzarr_copy_stats& rhs)
+        {
+            copied += rhs.copied;
+            transcoded += rhs.transcoded;
+            skipped += rhs.skipped;
+            return *this;
+        }
+    };
+
+    namespace detail
+    {
+        // single-byte data types have no endianness prefix in Zarr v3 and a "|" prefix in Zarr v2
+        inline std::string convert_dtype(const std::string& dtype, std::size_t from, std::size_t to)
+        {
+            if (from == to)
+            {
+                return dtype;
+            }
+            if (to == 3)
+            {
+                if (dtype == "|b1")
+                {
+                    return "bool";
+                }
+                return (dtype[0] == '|') ? dtype.substr(1) : dtype;
+            }
+            if (dtype == "bool")
+            {
+                return "|b1";
+            }
+            return ((dtype[0] == '<') || (dtype[0] == '>')) ? dtype : '|' + dtype;
+        }
+
+        inline nlohmann::json persistent_config(nlohmann::json config)
+        {
+            // runtime codec settings are not part of the encoding
+            config.erase("nthreads");
+            erase_runtime_options(config);
+            return config;
+        }
+
+        template <class T, class src_store_type, class dst_store_type>
+        inline void transcode_chunks(src_store_type& src_store, const xzarr_array_metadata& src,
+                                     dst_store_type& dst_store, const xzarr_array_metadata& dst,
+                                     const std::vector<std::vector<std::size_t>>& indices, std::size_t nthreads)
+        {
+            std::vector<xarray<T>> chunks;
+            std::vector<bool> found;
+            read_zarr_chunks(src_store, src, indices, chunks, found, true, nthreads);
+            // the chunks of the batch that were found, in the order of indices
+            std::vector<std::size_t> positions;
+            std::vector<std::vector<std::size_t>> written;
+            for (std::size_t i = 0; i < indices.size(); ++i)
+            {
+                if (found[i])
+                {
+                    positions.push_back(i);
+                    written.push_back(indices[i]);
+                }
+            }
+            std::vector<std::string> bytes(written.size());
+            xzarr_parallel_for(written.size(), nthreads, [&](std::size_t j)
+            {
+                bytes[j] = encode_zarr_chunk(dst, chunks[positions[j]]);
+            });
+            store_zarr_chunks(dst_store, dst, written, bytes, nthreads);
+        }
+
+        // copies the stored bytes of chunks, with their sidecar digests
+        template <class src_store_type, class dst_store_type>
+        inline void copy_chunk_bytes(src_store_type& src_store, const xzarr_array_metadata& src,
+                                     dst_store_type& dst_store, const xzarr_array_metadata& dst,
+                                     const std::vector<std::vector<std::size_t>>& indices, std::size_t nthreads)
+        {
+            auto checksum = metadata_checksum(src);
+            const bool sidecar = checksum.type != xzarr_checksum_type::none && checksum.sidecar;
+            std::vector<std::string> src_keys;
+            std::vector<std::string> dst_keys;
+            for (const auto& index: indices)
+            {
+                src_keys.push_back(src.chunk_key(index));
+                dst_keys.push_back(dst.chunk_key(index));
+            }
+            if (sidecar)
+            {
+                for (std::size_t i = 0; i < indices.size(); ++i)
+                {
+                    src_keys.push_back(checksum_sidecar_key(src_keys[i], checksum.type));
+                    dst_keys.push_back(checksum_sidecar_key(dst_keys[i], checksum.type));
+                }
+            }
+            std::vector<std::string> values;
+            std::vector<bool> found;
+            xt::read_store_values(src_store, src_keys, values, found, nthreads);
+            for (std::size_t i = 0; i < src_keys.size(); ++i)
+            {
+                if (!found[i])
+                {
+                    XTENSOR_THROW(std::runtime_error, "Could not read key: " + src_keys[i]);
+                }
+            }
+            xt::write_store_values(dst_store, dst_keys, values, nthreads);
+        }
+    }
+
+    /**
+     * Copies an array to another store, Zarr version or compressor.
+     *
+     * The chunk grid is preserved. When the destination uses the same compressor
+     * (with the same configuration), data type and memory layout as the source, the
+     * stored chunks are copied verbatim, only their keys being renamed; otherwise
+     * they are decoded and re-encoded. The destination keeps the checksum of the
+     * source; since the digests are stored differently in Zarr v2 and v3, chunks
+     * of checksummed arrays copied across versions are re-encoded, and their
+     * digests checked on the way. Chunks are processed in parallel, in batches read
+     * and written with read_store_values and write_store_values, and the
+     * metadata of the destination is written last, so that an interrupted copy
+     * does not leave a readable but incomplete array. With ``resume``, chunks that
+     * are already in the destination are skipped.
+     *
+     * @param src_store the source store
+     * @param src_path the path of the source array
+     * @param src_version the Zarr major version of the source hierarchy
+     * @param dst_store the destination store
+     * @param dst_path the path of the destination array
+     * @param dst_version the Zarr major version of the destination hierarchy
+     * @param options the copy options
+     */
+    template <class src_store_type, class dst_store_type>
+    inline xzarr_copy_stats copy_zarr_array(src_store_type& src_store, const std::string& src_path, std::size_t src_version,
+                                            dst_store_type& dst_store, const std::string& dst_path, std::size_t dst_version,
+                                            const xzarr_copy_options& options = xzarr_copy_options())
+    {
+        auto src = read_zarr_array_metadata(src_store, src_path, src_version);
+        auto dst = src;
+        dst.path = dst_path;
+        dst.zarr_version = dst_version;
+        dst.dtype = detail::convert_dtype(src.dtype, src_version, dst_version);
+        if (options.chunk_separator != 0)
+        {
+            dst.chunk_separator = options.chunk_separator;
+        }
+        else if (src_version != dst_version)
+        {
+            dst.chunk_separator = (dst_version == 3) ? '/' : '.';
+        }
+        if (!options.compressor.empty())
+        {
+            dst.compressor = options.compressor;
+            dst.compressor_config = options.compressor_config;
+        }
+        dst.compressor_config = detail::persistent_config(dst.compressor_config);
+        bool verbatim = (dst.compressor == src.compressor)
+                     && (dst.compressor_config == detail::persistent_config(src.compressor_config))
+                     && (dst.endianness() == src.endianness() || dst.itemsize() == 1)
+                     && (src.checksum.empty() || src_version == dst_version);
+
+        auto chunks = list_zarr_chunks(src_store, src);
+        xzarr_copy_stats stats;
+        if (options.resume)
+        {
+            auto done = list_zarr_chunks(dst_store, dst);
+            std::set<std::vector<std::size_t>> done_set(done.begin(), done.end());
+            std::vector<std::vector<std::size_t>> remaining;
+            for (const auto& index: chunks)
+            {
+                if (done_set.count(index) == 0)
+                {
+                    remaining.push_back(index);
+                }
+            }
+            stats.skipped = chunks.size() - remaining.size();
+            chunks.swap(remaining);
+        }
+
+        // erased once for all the batches of chunks below
+        detail::invalidate_chunk_stats(dst_store, dst);
+        const std::size_t batch = detail::chunk_batch_size(options.nthreads);
+        auto batch_indices = [&](std::size_t begin)
+        {
+            return std::vector<std::vector<std::size_t>>(chunks.begin() + std::ptrdiff_t(begin),
+                                                         chunks.begin() + std::ptrdiff_t(std::min(begin + batch, chunks.size())));
+        };
+        if (verbatim)
+        {
+            for (std::size_t begin = 0; begin < chunks.size(); begin += batch)
+            {
+                detail::copy_chunk_bytes(src_store, src, dst_store, dst, batch_indices(begin), options.nthreads);
+            }
+            stats.copied = chunks.size();
+        }
+        else
+        {
+            xzarr_dispatch_dtype(src.dtype_noendian(), [&](auto tag)
+            {
+                using value_type = typename decltype(tag)::type;
+                if (!xchunk_codec_factory<value_type>::has_codec(dst.compressor))
+                {
+                    XTENSOR_THROW(std::runtime_error, "Unkown compressor type: " + dst.compressor);
+                }
+                for (std::size_t begin = 0; begin < chunks.size(); begin += batch)
+                {
+                    detail::transcode_chunks<value_type>(src_store, src, dst_store, dst, batch_indices(begin), options.nthreads);
+                }
+            });
+            stats.transcoded = chunks.size();
+        }
+        write_zarr_array_metadata(dst_store, dst);
+        return stats;
+    }
+
+    /**
+     * Copies all the arrays and groups of a hierarchy to another hierarchy.
+     * Arrays are copied with copy_zarr_array, with the same options.
+     *
+     * @param src_store the source store
+     * @param src_version the Zarr major version of the source hierarchy
+     * @param dst_store the destination store
+     * @param dst_version the Zarr major version of the destination hierarchy
+     * @param options the copy options
+     */
+    template <class src_store_type, class dst_store_type>
+    inline xzarr_copy_stats copy_zarr_hierarchy(src_store_type& src_store, std::size_t src_version,
+                                                dst_store_type& dst_store, std::size_t dst_version,
+                                                const xzarr_copy_options& options = xzarr_copy_options())
+    {
+        std::vector<std::string> arrays;
+        std::vector<std::pair<std::string, nlohmann::json>> groups;
+        if (src_version == 3)
+        {
+            const std::string prefix = "meta/root";
+            std::vector<std::string> keys = src_store.list_prefix(prefix);
+            // the document of the root group is next to the prefix, which directory stores do not list
+            const std::string root_key = prefix + ".group.json";
+            std::string bytes;
+            if (std::find(keys.begin(), keys.end(), root_key) == keys.end() && read_store_value(src_store, root_key, bytes))
+            {
+                keys.push_back(root_key);
+            }
+            for (const auto& key: keys)
+            {
+                if (endswith(key, ".array.json"))
+                {
+                    arrays.push_back(key.substr(prefix.size(), key.size() - 11 - prefix.size()));
+                }
+                else if (endswith(key, ".group.json"))
+                {
+                    auto j = nlohmann::json::parse(std::string(src_store[key]));
+                    nlohmann::json attrs = j.contains("attributes") ? j["attributes"] : nlohmann::json::object();
+                    groups.push_back(std::make_pair(key.substr(prefix.size(), key.size() - 11 - prefix.size()), attrs));
+                }
+            }
+        }
+        else
+        {
+            for (const auto& key: src_store.list())
+            {
+                if (endswith(key, "/.zarray"))
+                {
+                    arrays.push_back(ensure_startswith_slash(key.substr(0, key.size() - 8)));
+                }
+                else if (endswith(key, ".zgroup"))
+                {
+                    std::string path = key.substr(0, key.size() - 7);
+                    while (!path.empty() && path.back() == '/')
+                    {
+                        path.pop_back();
+                    }
+                    nlohmann::json attrs = read_zarr_attrs(src_store, path, 2);
+                    groups.push_back(std::make_pair(path.empty() ? path : ensure_startswith_slash(path), attrs));
+                }
+            }
+        }
+
+        if (dst_version == 2)
+        {
+            // Zarr v2 has no implicit group: the parents of the nodes must have a .zgroup
+            std::set<std::string> explicit_groups;
+            for (const auto& group: groups)
+            {
+                explicit_groups.insert(detail::zarr_attrs_node_path(group.first));
+            }
+            std::set<std::string> parents;
+            auto add_parents = [&parents](const std::string& path)
+            {
+                std::string p = detail::zarr_attrs_node_path(path);
+                while (!p.empty())
+                {
+                    p = p.substr(0, p.find_last_of('/'));
+                    parents.insert(p);
+                }
+            };
+            for (const auto& path: arrays)
+            {
+                add_parents(path);
+            }
+            for (const auto& group: groups)
+            {
+                add_parents(group.first);
+            }
+            for (const auto& path: parents)
+            {
+                if (explicit_groups.find(path) == explicit_groups.end())
+                {
+                    groups.push_back(std::make_pair(path, nlohmann::json::object()));
+                }
+            }
+        }
+        for (const auto& group: groups)
+        {
+            xzarr_group<dst_store_type> g(dst_store, group.first, dst_version);
+            g.create_group(group.second);
+            if (dst_version == 2 && !group.second.empty())
+            {
+                write_zarr_attrs(dst_store, group.first, group.second, dst_version);
+            }
+        }
+        xzarr_copy_stats stats;
+        for (const auto& path: arrays)
+        {
+            stats += copy_zarr_array(src_store, path, src_version, dst_store, path, dst_version, options);
+        }
+        return stats;
+    }
+}
+
+#endif
@@ -0,0 +1,591 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_FILE_SYSTEM_HANDLER_HPP
+#define XTENSOR_ZARR_FILE_SYSTEM_HANDLER_HPP
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <cerrno>
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "ghc/filesystem.hpp"
+#include "xtensor-io/xio_binary.hpp"
+#include "xzarr_checksum.hpp"
+#include "xzarr_chunk_stats.hpp"
+#include "xzarr_common.hpp"
+#include "xzarr_store_handler.hpp"
+
+namespace xt
+{
+    /**
+     * When written files are flushed to stable storage.
+     * - ``none``: never, the operating system decides
+     * - ``per_write``: before each write returns
+     * - ``batched``: every ``fsync_batch_size`` writes, and on xzarr_fsync_batch::sync
+     */
+    enum class xzarr_fsync_policy { none, per_write, batched };
+
+    /**
+     * Access hint given to the operating system when reading files.
+     * - ``normal``: no hint
+     * - ``sequential``: files are read whole, favor read-ahead
+     * - ``no_cache``: drop the pages of a file from the page cache once read,
+     *   for single-pass scans that would otherwise evict useful data
+     */
+    enum class xzarr_read_advice { normal, sequential, no_cache };
+
+    /**
+     * @class xzarr_directory_cache
+     * @brief Directories known to exist, so that writes do not check them again.
+     */
+    class xzarr_directory_cache
+    {
+    public:
+
+        bool contains(const std::string& directory);
+        void insert(const std::string& directory);
+        void clear();
+
+    private:
+
+        std::mutex m_mutex;
+        std::set<std::string> m_directories;
+    };
+
+    /**
+     * @class xzarr_fsync_batch
+     * @brief Files written since the last flush to stable storage.
+     */
+    class xzarr_fsync_batch
+    {
+    public:
+
+        explicit xzarr_fsync_batch(std::size_t max_pending = 64);
+
+        void add(const std::string& path);
+        void sync();
+
+    private:
+
+        static void sync_files(const std::vector<std::string>& files);
+
+        std::mutex m_mutex;
+        std::vector<std::string> m_files;
+        std::size_t m_max_pending;
+    };
+
+    /**
+     * @class xzarr_file_system_config
+     * @brief I/O configuration of the file system store and its chunk handler.
+     *
+     * With ``atomic_writes``, a file is written to a temporary file in the same
+     * directory which is then renamed over the target, so that concurrent readers
+     * see either the previous or the new content, never a truncated one.
+     */
+    struct xzarr_file_system_config
+    {
+        bool create_directories;
+        bool atomic_writes;
+        xzarr_fsync_policy fsync;
+        std::size_t fsync_batch_size;
+        xzarr_read_advice read_advice;
+        std::size_t queue_depth;
+        std::shared_ptr<xzarr_fsync_batch> batch;
+        std::shared_ptr<xzarr_directory_cache> directories;
+
+        xzarr_file_system_config()
+            : create_directories(true)
+            , atomic_writes(true)
+            , fsync(xzarr_fsync_policy::none)
+            , fsync_batch_size(64)
+            , read_advice(xzarr_read_advice::normal)
+            , queue_depth(64)
+        {
+        }
+    };
+
+    namespace detail
+    {
+#if defined(_WIN32)
+        inline void fsync_path(const std::string& path, bool directory)
+        {
+            // directories cannot be flushed on Windows, renames are journaled by NTFS
+            if (!directory)
+            {
+                int fd = _open(path.c_str(), _O_RDWR | _O_BINARY);
+                if (fd != -1)
+                {
+                    _commit(fd);
+                    _close(fd);
+                }
+            }
+        }
+#else
+        inline void fsync_fd(int fd, const std::string& path)
+        {
+            if (::fsync(fd) != 0)
+            {
+                XTENSOR_THROW(std::runtime_error, "fsync failed: " + path);
+            }
+        }
+
+        inline void fsync_path(const std::string& path, bool directory)
+        {
+            int fd = ::open(path.c_str(), directory ? O_RDONLY | O_DIRECTORY | O_CLOEXEC : O_RDONLY | O_CLOEXEC);
+            if (fd == -1)
+            {
+                XTENSOR_THROW(std::runtime_error, "Could not open file for fsync: " + path);
+            }
+            int res = ::fsync(fd);
+            ::close(fd);
+            if (res != 0)
+            {
+                XTENSOR_THROW(std::runtime_error, "fsync failed: " + path);
+            }
+        }
+#endif
+
+        inline std::string parent_directory(const std::string& path)
+        {
+            std::size_t i = path.rfind('/');
+            return (i == std::string::npos) ? std::string(".") : path.substr(0, i);
+        }
+
+        inline void create_parent_directories(const std::string& path, const xzarr_file_system_config& config)
+        {
+            std::size_t i = path.rfind('/');
+            if (i == std::string::npos)
+            {
+                return;
+            }
+            std::string directory = path.substr(0, i);
+            if (config.directories && config.directories->contains(directory))
+            {
+                return;
+            }
+            if (ghc::filesystem::exists(directory))
+            {
+                if (!ghc::filesystem::is_directory(directory))
+                {
+                    XTENSOR_THROW(std::runtime_error, "Path is not a directory: " + directory);
+                }
+            }
+            else
+            {
+                ghc::filesystem::create_directories(directory);
+            }
+            if (config.directories)
+            {
+                config.directories->insert(directory);
+            }
+        }
+
+        /**
+         * Returns a name for the temporary file of an atomic write. The name holds the
+         * process id, which differs in forked children that share the static state of
+         * their parent, a counter unique among threads and a random part drawn for each
+         * call; temporary files are also created exclusively (see write_bytes).
+         */
+        inline std::string temporary_path(const std::string& path)
+        {
+            static std::atomic<unsigned long long> counter(0);
+            static thread_local std::mt19937_64 generator(std::random_device{}());
+#if defined(_WIN32)
+            unsigned long long process_id = static_cast<unsigned long long>(::_getpid());
+#else
+            unsigned long long process_id = static_cast<unsigned long long>(::getpid());
+#endif
+            return path + '.' + std::to_string(process_id) + '-' + std::to_string(counter++) + '-' + std::to_string(generator()) + ".partial";
+        }
+
+        /**
+         * Reads a whole file into a buffer, resized to the size of the file.
+         * Returns false if the file does not exist.
+         */
+        inline bool read_file(const std::string& path, std::string& buffer, xzarr_read_advice advice = xzarr_read_advice::normal)
+        {
+#if defined(_WIN32)
+            (void)advice;
+            std::ifstream stream(path, std::ifstream::binary | std::ifstream::ate);
+            if (!stream.is_open())
+            {
+                return false;
+            }
+            buffer.resize(std::size_t(stream.tellg()));
+            stream.seekg(0);
+            stream.read(&buffer[0], std::streamsize(buffer.size()));
+            buffer.resize(std::size_t(stream.gcount()));
+            return true;
+#else
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1)
+            {
+                if (errno == ENOENT || errno == ENOTDIR)
+                {
+                    return false;
+                }
+                XTENSOR_THROW(std::runtime_error, "Could not read file: " + path);
+            }
+            struct stat st;
+            if (::fstat(fd, &st) != 0)
+            {
+                ::close(fd);
+                XTENSOR_THROW(std::runtime_error, "Could not read file: " + path);
+            }
+#if defined(POSIX_FADV_SEQUENTIAL)
+            if (advice == xzarr_read_advice::sequential)
+            {
+                ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            }
+#endif
+            std::size_t size = std::size_t(st.st_size);
+            buffer.resize(size);
+            std::size_t offset = 0;
+            while (offset < size)
+            {
+                ssize_t n = ::pread(fd, &buffer[offset], size - offset, off_t(offset));
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (n <= 0)
+                {
+                    break;
+                }
+                offset += std::size_t(n);
+            }
+#if defined(POSIX_FADV_DONTNEED)
+            if (advice == xzarr_read_advice::no_cache)
+            {
+                ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            }
+#endif
+            ::close(fd);
+            if (offset < size)
+            {
+                XTENSOR_THROW(std::runtime_error, "Could not read file: " + path);
+            }
+            return true;
+#endif
+        }
+
+        // exclusive writes fail if the file exists, instead of truncating it
+        inline void write_bytes(const std::string& path, const char* data, std::size_t size, bool sync, bool exclusive = false)
+        {
+#if defined(_WIN32)
+            (void)exclusive;
+            {
+                std::ofstream stream(path, std::ofstream::binary);
+                if (!stream.is_open())
+                {
+                    XTENSOR_THROW(std::runtime_error, "Could not write file: " + path);
+                }
+                stream.write(data, std::streamsize(size));
+                stream.flush();
+                if (!stream)
+                {
+                    stream.close();
+                    ghc::filesystem::remove(path);
+                    XTENSOR_THROW(std::runtime_error, "Could not write file: " + path);
+                }
+            }
+            if (sync)
+            {
+                fsync_path(path, false);
+            }
+#else
+            int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | (exclusive ? O_EXCL : O_TRUNC) | O_CLOEXEC, 0666);
+            if (fd == -1)
+            {
+                XTENSOR_THROW(std::runtime_error, "Could not write file: " + path);
+            }
+            std::size_t offset = 0;
+            while (offset < size)
+            {
+                ssize_t n = ::pwrite(fd, data + offset, size - offset, off_t(offset));
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (n <= 0)
+                {
+                    break;
+                }
+                offset += std::size_t(n);
+            }
+            bool ok = offset == size && (!sync || ::fsync(fd) == 0);
+            ok = (::close(fd) == 0) && ok;
+            if (!ok)
+            {
+                ::unlink(path.c_str());
+                XTENSOR_THROW(std::runtime_error, "Could not write file: " + path);
+            }
+#endif
+        }
+
+        /**
+         * Writes a file following the I/O configuration for directory
+         * creation, atomicity and flushing to stable storage.
+         */
+        inline void write_file(const std::string& path, const xzarr_file_system_config& config, const char* data, std::size_t size)
+        {
+            if (config.create_directories)
+            {
+                create_parent_directories(path, config);
+            }
+            std::string target = config.atomic_writes ? temporary_path(path) : path;
+            // with per_write, the content must be durable before the rename makes it visible
+            bool sync = config.fsync == xzarr_fsync_policy::per_write;
+            try
+            {
+                write_bytes(target, data, size, sync, config.atomic_writes);
+            }
+            catch (std::runtime_error&)
+            {
+                // the directory may have been removed behind the cache
+                if (!config.create_directories || !config.directories)
+                {
+                    throw;
+                }
+                config.directories->clear();
+                create_parent_directories(path, config);
+                write_bytes(target, data, size, sync, config.atomic_writes);
+            }
+            if (config.atomic_writes)
+            {
+                std::error_code ec;
+                ghc::filesystem::rename(target, path, ec);
+                if (ec)
+                {
+                    ghc::filesystem::remove(target);
+                    XTENSOR_THROW(std::runtime_error, "Could not rename " + target + " to " + path + ": " + ec.message());
+                }
+            }
+            if (sync)
+            {
+                fsync_path(parent_directory(path), true);
+            }
+            else if (config.fsync == xzarr_fsync_policy::batched && config.batch)
+            {
+                config.batch->add(path);
+            }
+        }
+    }
+
+    /**
+     * @class xzarr_file_system_handler
+     * @brief Chunk I/O handler of the file system store.
+     *
+     * The xzarr_file_system_handler class reads and writes chunks like
+     * ``xio_disk_handler``, and writes them according to a xzarr_file_system_config.
+     * Files are read and written whole with ``pread`` and ``pwrite`` through a
+     * buffer owned by the handler, which is reused from one chunk to the next.
+     * With an xzarr_checksum_config, the digest of each chunk is written and
+     * checked along with it, and the statistics of each written chunk are
+     * given to the xzarr_chunk_stats_recorder of the array.
+     *
+     * @tparam C The format configuration (e.g. xio_gzip_config)
+     */
+    template <class C>
+    class xzarr_file_system_handler
+    {
+    public:
+
+        using io_config = xzarr_file_system_config;
+
+        template <class E>
+        void write(const xexpression<E>& expression, const std::string& path, xfile_dirty dirty);
+
+        template <class ET>
+        void read(ET& array, const std::string& path);
+
+        void configure(const C& format_config, const xzarr_file_system_config& io_config);
+        void configure_io(const xzarr_file_system_config& io_config);
+
+    private:
+
+        C m_format_config;
+        xzarr_file_system_config m_io_config;
+        std::string m_buffer;
+        std::shared_ptr<detail::chunk_stats_sink> p_stats;
+    };
+
+    /****************************************
+     * xzarr_directory_cache implementation *
+     ****************************************/
+
+    inline bool xzarr_directory_cache::contains(const std::string& directory)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_directories.find(directory) != m_directories.end();
+    }
+
+    inline void xzarr_directory_cache::insert(const std::string& directory)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_directories.insert(directory);
+    }
+
+    inline void xzarr_directory_cache::clear()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_directories.clear();
+    }
+
+    /************************************
+     * xzarr_fsync_batch implementation *
+     ************************************/
+
+    inline xzarr_fsync_batch::xzarr_fsync_batch(std::size_t max_pending)
+        : m_max_pending(max_pending)
+    {
+    }
+
+    inline void xzarr_fsync_batch::add(const std::string& path)
+    {
+        std::vector<std::string> files;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_files.push_back(path);
+            if (m_files.size() < m_max_pending)
+            {
+                return;
+            }
+            files.swap(m_files);
+        }
+        sync_files(files);
+    }
+
+    /**
+     * Flushes the files written since the last flush, and their directories.
+     */
+    inline void xzarr_fsync_batch::sync()
+    {
+        std::vector<std::string> files;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            files.swap(m_files);
+        }
+        sync_files(files);
+    }
+
+    inline void xzarr_fsync_batch::sync_files(const std::vector<std::string>& files)
+    {
+        std::set<std::string> directories;
+        for (const auto& file: files)
+        {
+            // the file may have been replaced or erased since it was written
+            if (ghc::filesystem::exists(file))
+            {
+                detail::fsync_path(file, false);
+            }
+            directories.insert(detail::parent_directory(file));
+        }
+        for (const auto& directory: directories)
+        {
+            detail::fsync_path(directory, true);
+        }
+    }
+
+    /********************************************
+     * xzarr_file_system_handler implementation *
+     ********************************************/
+
+    template <class C>
+    template <class E>
+    inline void xzarr_file_system_handler<C>::write(const xexpression<E>& expression, const std::string& path, xfile_dirty dirty)
+    {
+        if (m_format_config.will_dump(dirty))
+        {
+            m_buffer.clear();
+            {
+                detail::xzarr_output_streambuf buffer(m_buffer);
+                std::ostream stream(&buffer);
+                dump_file(stream, expression, m_format_config);
+            }
+            xzarr_chunk_stats stats;
+            if (p_stats)
+            {
+                stats = detail::expression_stats(expression);
+                p_stats->begin_write();
+            }
+            const xzarr_checksum_options* checksum = detail::chunk_checksum(m_format_config);
+            if (checksum == nullptr)
+            {
+                detail::write_file(path, m_io_config, m_buffer.data(), m_buffer.size());
+            }
+            else
+            {
+                std::string digest = detail::seal_chunk(m_buffer, *checksum);
+                detail::write_file(path, m_io_config, m_buffer.data(), m_buffer.size());
+                if (checksum->sidecar)
+                {
+                    detail::write_file(detail::checksum_sidecar_key(path, checksum->type), m_io_config, digest.data(), digest.size());
+                }
+            }
+            if (p_stats)
+            {
+                p_stats->record_path(path, stats);
+            }
+        }
+    }
+
+    template <class C>
+    template <class ET>
+    inline void xzarr_file_system_handler<C>::read(ET& array, const std::string& path)
+    {
+        // a missing chunk keeps the fill value
+        if (detail::read_file(path, m_buffer, m_io_config.read_advice))
+        {
+            const xzarr_checksum_options* checksum = detail::chunk_checksum(m_format_config);
+            if (checksum != nullptr)
+            {
+                std::string digest;
+                bool has_digest = checksum->sidecar && checksum->verify && detail::read_file(detail::checksum_sidecar_key(path, checksum->type), digest);
+                detail::open_chunk(m_buffer, *checksum, has_digest ? &digest : nullptr, path);
+            }
+            detail::xzarr_input_streambuf buffer(m_buffer);
+            std::istream stream(&buffer);
+            load_file<ET>(stream, array, m_format_config);
+        }
+    }
+
+    template <class C>
+    inline void xzarr_file_system_handler<C>::configure(const C& format_config, const xzarr_file_system_config& io_config)
+    {
+        m_format_config = format_config;
+        m_io_config = io_config;
+        p_stats = detail::find_chunk_stats_sink(detail::chunk_stats_sink_id(m_format_config));
+    }
+
+    template <class C>
+    inline void xzarr_file_system_handler<C>::configure_io(const xzarr_file_system_config& io_config)
+    {
+        m_io_config = io_config;
+    }
+}
+
+#endif
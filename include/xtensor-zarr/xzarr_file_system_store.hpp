@@ -17,7 +17,8 @@
 #include <string>
 
 #include "ghc/filesystem.hpp"
-#include "xtensor-io/xio_disk_handler.hpp"
+#include "xzarr_file_system_handler.hpp"
+#include "xzarr_io_engine.hpp"
 
 namespace fs = ghc::filesystem;
 
@@ -26,7 +27,7 @@ namespace xt
     class xzarr_file_system_stream
     {
     public:
-        xzarr_file_system_stream(const std::string& path);
+        xzarr_file_system_stream(const std::string& path, const xzarr_file_system_config& config = xzarr_file_system_config());
         operator std::string() const;
         void operator=(const std::vector<char>& value);
         void operator=(const std::string& value);
@@ -37,6 +38,7 @@ namespace xt
         void assign(const char* value, std::size_t size);
 
         std::string m_path;
+        xzarr_file_system_config m_config;
     };
 
     /**
@@ -44,7 +46,9 @@ namespace xt
      * @brief Zarr store handler for a local file system.
      *
      * The xzarr_file_system_store class implements a handler to a Zarr store,
-     * and supports the read, write and list operations.
+     * and supports the read, write and list operations. By default, values
+     * and chunks are written atomically (to a temporary file renamed over the
+     * target), so that readers never see partially written files.
      *
      * @sa xzarr_hierarchy
      */
@@ -52,9 +56,9 @@ namespace xt
     {
     public:
         template <class C>
-        using io_handler = xio_disk_handler<C>;
+        using io_handler = xzarr_file_system_handler<C>;
 
-        xzarr_file_system_store(const std::string& root);
+        xzarr_file_system_store(const std::string& root, const xzarr_file_system_config& config = xzarr_file_system_config());
         xzarr_file_system_stream operator[](const std::string& key);
         void list_dir(const std::string& prefix, std::vector<std::string>& keys, std::vector<std::string>& prefixes);
         std::vector<std::string> list();
@@ -64,20 +68,26 @@ namespace xt
         void set(const std::string& key, const std::vector<char>& value);
         void set(const std::string& key, const std::string& value);
         std::string get(const std::string& key);
+        void get_many(const std::vector<std::string>& keys, std::vector<std::string>& values, std::vector<bool>& found);
+        void set_many(const std::vector<std::string>& keys, const std::vector<std::string>& values);
 
-        xio_disk_config get_io_config();
+        xzarr_file_system_config get_io_config();
         std::string get_root();
+        void sync();
 
     private:
         std::string m_root;
+        xzarr_file_system_config m_config;
+        std::shared_ptr<xzarr_io_engine> m_engine;
     };
 
     /*******************************************
      * xzarr_file_system_stream implementation *
      *******************************************/
 
-    inline xzarr_file_system_stream::xzarr_file_system_stream(const std::string& path)
+    inline xzarr_file_system_stream::xzarr_file_system_stream(const std::string& path, const xzarr_file_system_config& config)
         : m_path(path)
+        , m_config(config)
     {
     }
 
@@ -94,12 +104,11 @@ namespace xt
 
     inline xzarr_file_system_stream::operator std::string() const
     {
-        std::ifstream stream(m_path);
-        if (!stream.is_open())
+        std::string bytes;
+        if (!detail::read_file(m_path, bytes, m_config.read_advice))
         {
             XTENSOR_THROW(std::runtime_error, "Could not read file: " + m_path);
         }
-        std::string bytes{std::istreambuf_iterator<char>{stream}, {}};
         return bytes;
     }
 
@@ -115,34 +124,21 @@ namespace xt
 
     inline void xzarr_file_system_stream::assign(const char* value, std::size_t size)
     {
-        // maybe create directories
-        std::size_t i = m_path.rfind('/');
-        if (i != std::string::npos)
-        {
-            fs::path directory = m_path.substr(0, i);
-            if (fs::exists(directory))
-            {
-                if (!fs::is_directory(directory))
-                {
-                    XTENSOR_THROW(std::runtime_error, "Path is not a directory: " + std::string(directory.string()));
-                }
-            }
-            else
-            {
-                fs::create_directories(directory);
-            }
-        }
-        std::ofstream stream(m_path, std::ofstream::binary);
-        stream.write(value, std::streamsize(size));
-        stream.flush();
+        detail::write_file(m_path, m_config, value, size);
     }
 
     /******************************************
      * xzarr_file_system_store implementation *
      ******************************************/
 
-    inline xzarr_file_system_store::xzarr_file_system_store(const std::string& root)
+    /**
+     * Builds a file system store.
+     * @param root the root directory of the store
+     * @param config the I/O configuration (atomic writes and fsync policy)
+     */
+    inline xzarr_file_system_store::xzarr_file_system_store(const std::string& root, const xzarr_file_system_config& config)
         : m_root(root)
+        , m_config(config)
     {
         if (m_root.empty())
         {
@@ -152,16 +148,26 @@ namespace xt
         {
             m_root.pop_back();
         }
+        if (m_config.fsync == xzarr_fsync_policy::batched && !m_config.batch)
+        {
+            // shared by the copies of the store and the chunk handlers
+            m_config.batch = std::make_shared<xzarr_fsync_batch>(m_config.fsync_batch_size);
+        }
+        if (!m_config.directories)
+        {
+            m_config.directories = std::make_shared<xzarr_directory_cache>();
+        }
+        m_engine = std::make_shared<xzarr_io_engine>(m_config.queue_depth);
     }
 
     inline xzarr_file_system_stream xzarr_file_system_store::operator[](const std::string& key)
     {
-        return xzarr_file_system_stream(m_root + '/' + key);
+        return xzarr_file_system_stream(m_root + '/' + key, m_config);
     }
 
     inline void xzarr_file_system_store::set(const std::string& key, const std::vector<char>& value)
     {
-        xzarr_file_system_stream(m_root + '/' + key) = value;
+        xzarr_file_system_stream(m_root + '/' + key, m_config) = value;
     }
 
     /**
@@ -171,7 +177,7 @@ namespace xt
      */
     inline void xzarr_file_system_store::set(const std::string& key, const std::string& value)
     {
-        xzarr_file_system_stream(m_root + '/' + key) = value;
+        xzarr_file_system_stream(m_root + '/' + key, m_config) = value;
     }
 
     /**
@@ -182,7 +188,42 @@ namespace xt
      */
     inline std::string xzarr_file_system_store::get(const std::string& key)
     {
-        return xzarr_file_system_stream(m_root + '/' + key);
+        return xzarr_file_system_stream(m_root + '/' + key, m_config);
+    }
+
+    /**
+     * Retrieve the values associated with several keys in one batch. With
+     * io_uring support, the files are read from the calling thread with deep
+     * queues; otherwise they are read in parallel.
+     * @param keys the keys to get the values from
+     * @param values the values, returned by reference
+     * @param found whether the keys exist, returned by reference
+     */
+    inline void xzarr_file_system_store::get_many(const std::vector<std::string>& keys, std::vector<std::string>& values, std::vector<bool>& found)
+    {
+        std::vector<std::string> paths;
+        paths.reserve(keys.size());
+        for (const auto& key: keys)
+        {
+            paths.push_back(m_root + '/' + key);
+        }
+        m_engine->read(paths, values, found, m_config.read_advice);
+    }
+
+    /**
+     * Store several (key, value) pairs in one batch.
+     * @param keys the keys
+     * @param values the values
+     */
+    inline void xzarr_file_system_store::set_many(const std::vector<std::string>& keys, const std::vector<std::string>& values)
+    {
+        std::vector<std::string> paths;
+        paths.reserve(keys.size());
+        for (const auto& key: keys)
+        {
+            paths.push_back(m_root + '/' + key);
+        }
+        m_engine->write(paths, values, m_config);
     }
 
     inline std::string xzarr_file_system_store::get_root()
@@ -190,11 +231,21 @@ namespace xt
         return m_root;
     }
 
-    inline xio_disk_config xzarr_file_system_store::get_io_config()
+    inline xzarr_file_system_config xzarr_file_system_store::get_io_config()
     {
-        xio_disk_config c;
-        c.create_directories = true;
-        return c;
+        return m_config;
+    }
+
+    /**
+     * Flushes the files written since the last flush to stable storage,
+     * with the ``batched`` fsync policy. This is a no-op with other policies.
+     */
+    inline void xzarr_file_system_store::sync()
+    {
+        if (m_config.batch)
+        {
+            m_config.batch->sync();
+        }
     }
 
     /**
@@ -236,12 +287,16 @@ namespace xt
      *
      * @param prefix the prefix
      *
-     * @return returns a set of keys with a given prefix.
+     * @return returns a set of keys with a given prefix, empty if there is none.
      */
     inline std::vector<std::string> xzarr_file_system_store::list_prefix(const std::string& prefix)
     {
         std::string path = m_root + '/' + prefix;
         std::vector<std::string> keys;
+        if (!fs::exists(path))
+        {
+            return keys;
+        }
         for (const auto& entry: fs::recursive_directory_iterator(path))
         {
             std::string p = entry.path().string();
@@ -266,6 +321,7 @@ namespace xt
     inline void xzarr_file_system_store::erase_prefix(const std::string& prefix)
     {
         fs::remove_all(m_root + '/' + prefix);
+        m_config.directories->clear();
     }
 }
 
@@ -11,39 +11,67 @@
 #define XTENSOR_ZARR_GCS_STORE_HPP
 
 #include <iomanip>
-#include <fstream>
 #include <iostream>
+#include <exception>
+#include <memory>
+#include <random>
 #include <vector>
 #include <string>
 
-#include "xtensor-io/xio_gcs_handler.hpp"
+#include "google/cloud/storage/client.h"
 #include "xzarr_common.hpp"
+#include "xzarr_request_limiter.hpp"
+#include "xzarr_store_handler.hpp"
+#include "xzarr_threading.hpp"
+
+namespace gcs = google::cloud::storage;
 
 namespace xt
 {
     class xzarr_gcs_stream
     {
     public:
-        xzarr_gcs_stream(const std::string& path, const std::string& bucket, gcs::Client& client);
+        xzarr_gcs_stream(const std::string& path, const std::string& bucket, gcs::Client& client, const std::shared_ptr<xzarr_request_limiter>& limiter);
         operator std::string() const;
+        bool read(std::string& bytes) const;
         xzarr_gcs_stream& operator=(const std::vector<char>& value);
         xzarr_gcs_stream& operator=(const std::string& value);
+        void erase();
 
     private:
         void assign(const char* value, std::size_t size);
+        void assign_parts(const char* value, std::size_t size);
 
         std::string m_path;
         std::string m_bucket;
         gcs::Client& m_client;
+        std::shared_ptr<xzarr_request_limiter> p_limiter;
     };
 
+    /**
+     * @class xzarr_gcs_store
+     * @brief Zarr store handler for Google Cloud Storage.
+     *
+     * The xzarr_gcs_store class implements a Zarr store in a GCS bucket. Chunks
+     * go through the store, which bounds the number of requests in flight,
+     * retries the transient errors with a jittered exponential backoff, and
+     * uploads values from memory in a single request. Values larger than
+     * ``multipart_threshold`` are uploaded in parallel as temporary objects,
+     * which are then composed into the value and deleted. The copies of a store
+     * share these limits.
+     *
+     * The connection pool of the client should hold at least ``max_connections``
+     * connections, which is what xzarr_gcs_client_options does.
+     *
+     * @sa xzarr_request_config
+     */
     class xzarr_gcs_store
     {
     public:
         template <class C>
-        using io_handler = xio_gcs_handler<C>;
+        using io_handler = xzarr_store_handler<xzarr_gcs_store, C>;
 
-        xzarr_gcs_store(const std::string& root, gcs::Client& client);
+        xzarr_gcs_store(const std::string& root, gcs::Client& client, const xzarr_request_config& config = xzarr_request_config());
         xzarr_gcs_stream operator[](const std::string& key) const;
         void set(const std::string& key, const std::vector<char>& value);
         void set(const std::string& key, const std::string& value);
@@ -51,65 +79,227 @@ namespace xt
         void list_dir(const std::string& prefix, std::vector<std::string>& keys, std::vector<std::string>& prefixes) const;
         std::vector<std::string> list() const;
         std::vector<std::string> list_prefix(const std::string& prefix) const;
+        template <class F>
+        void visit_prefix(const std::string& prefix, F&& f) const;
         void erase(const std::string& key);
         void erase_prefix(const std::string& prefix);
         std::string get_root() const;
-        xio_gcs_config get_io_config() const;
+        xzarr_gcs_store get_io_config() const;
 
     private:
         std::string m_root;
         std::string m_bucket;
         gcs::Client& m_client;
+        std::shared_ptr<xzarr_request_limiter> p_limiter;
     };
 
+    gcs::ClientOptions xzarr_gcs_client_options(const xzarr_request_config& config, gcs::ClientOptions options);
+
+    namespace detail
+    {
+        bool gcs_retryable(const google::cloud::Status& status);
+    }
+
+    /*******************************************
+     * xzarr_gcs_client_options implementation *
+     *******************************************/
+
+    /**
+     * Returns client options suited to a store with the given request
+     * configuration, with a connection pool of ``max_connections`` connections.
+     * The retry policy of the client applies to each attempt of the store.
+     * @param config the request configuration of the store
+     * @param options the client options to start from
+     */
+    inline gcs::ClientOptions xzarr_gcs_client_options(const xzarr_request_config& config, gcs::ClientOptions options)
+    {
+        options.set_connection_pool_size(config.max_connections);
+        return options;
+    }
+
+    namespace detail
+    {
+        inline bool gcs_retryable(const google::cloud::Status& status)
+        {
+            switch (status.code())
+            {
+                case google::cloud::StatusCode::kUnavailable:
+                case google::cloud::StatusCode::kDeadlineExceeded:
+                case google::cloud::StatusCode::kResourceExhausted:
+                case google::cloud::StatusCode::kInternal:
+                case google::cloud::StatusCode::kAborted:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+    }
+
     /***********************************
      * xzarr_gcs_stream implementation *
      ***********************************/
 
-    xzarr_gcs_stream::xzarr_gcs_stream(const std::string& path, const std::string& bucket, gcs::Client& client)
+    inline xzarr_gcs_stream::xzarr_gcs_stream(const std::string& path, const std::string& bucket, gcs::Client& client, const std::shared_ptr<xzarr_request_limiter>& limiter)
         : m_path(path)
         , m_bucket(bucket)
         , m_client(client)
+        , p_limiter(limiter)
     {
     }
 
-    xzarr_gcs_stream::operator std::string() const
+    inline xzarr_gcs_stream::operator std::string() const
     {
-        auto reader = m_client.ReadObject(m_bucket, m_path);
-        if (!reader)
+        std::string bytes;
+        if (!read(bytes))
         {
-            XTENSOR_THROW(std::runtime_error, reader.status().message());
+            XTENSOR_THROW(std::runtime_error, "Key not found: " + m_path);
         }
-        std::string bytes{std::istreambuf_iterator<char>{reader}, {}};
         return bytes;
     }
 
-    xzarr_gcs_stream& xzarr_gcs_stream::operator=(const std::vector<char>& value)
+    inline bool xzarr_gcs_stream::read(std::string& bytes) const
+    {
+        google::cloud::Status status = p_limiter->run(
+            [&]()
+            {
+                auto reader = m_client.ReadObject(m_bucket, m_path);
+                bytes.assign(std::istreambuf_iterator<char>{reader}, {});
+                return reader.status();
+            },
+            detail::gcs_retryable);
+        if (status.code() == google::cloud::StatusCode::kNotFound)
+        {
+            return false;
+        }
+        if (!status.ok())
+        {
+            XTENSOR_THROW(std::runtime_error, status.message());
+        }
+        return true;
+    }
+
+    /**
+     * Deletes the object; a missing object is not an error.
+     */
+    inline void xzarr_gcs_stream::erase()
+    {
+        google::cloud::Status status = p_limiter->run(
+            [&]() { return m_client.DeleteObject(m_bucket, m_path); },
+            detail::gcs_retryable);
+        if (!status.ok() && status.code() != google::cloud::StatusCode::kNotFound)
+        {
+            XTENSOR_THROW(std::runtime_error, status.message());
+        }
+    }
+
+    inline xzarr_gcs_stream& xzarr_gcs_stream::operator=(const std::vector<char>& value)
     {
         assign(value.data(), value.size());
         return *this;
     }
 
-    xzarr_gcs_stream& xzarr_gcs_stream::operator=(const std::string& value)
+    inline xzarr_gcs_stream& xzarr_gcs_stream::operator=(const std::string& value)
     {
         assign(value.c_str(), value.size());
         return *this;
     }
 
-    void xzarr_gcs_stream::assign(const char* value, std::size_t size)
+    inline void xzarr_gcs_stream::assign(const char* value, std::size_t size)
     {
-        auto writer = m_client.WriteObject(m_bucket, m_path);
-        writer.write(value, static_cast<std::streamsize>(size));
-        writer.flush();
+        std::size_t threshold = p_limiter->config().multipart_threshold;
+        if (threshold != 0 && size >= threshold && size > p_limiter->config().part_size)
+        {
+            assign_parts(value, size);
+            return;
+        }
+
+        google::cloud::Status status = p_limiter->run(
+            [&]()
+            {
+                // a single request from memory, instead of a resumable upload session
+                return m_client.InsertObject(m_bucket, m_path, std::string(value, size)).status();
+            },
+            detail::gcs_retryable);
+        if (!status.ok())
+        {
+            XTENSOR_THROW(std::runtime_error, status.message());
+        }
+    }
+
+    inline void xzarr_gcs_stream::assign_parts(const char* value, std::size_t size)
+    {
+        const auto& config = p_limiter->config();
+        // a compose request takes at most 32 source objects
+        std::size_t part_size = std::max(config.part_size, (size + 31) / 32);
+        std::size_t nparts = (size + part_size - 1) / part_size;
+        std::string part_prefix = m_path + ".part-" + std::to_string(std::random_device{}()) + "-";
+
+        std::vector<gcs::ComposeSourceObject> sources(nparts);
+        for (std::size_t i = 0; i < nparts; ++i)
+        {
+            sources[i].object_name = part_prefix + std::to_string(i);
+        }
+
+        std::vector<char> uploaded(nparts, 0);
+        std::exception_ptr error;
+        try
+        {
+            xzarr_parallel_for(nparts, config.upload_threads, [&](std::size_t i)
+            {
+                std::size_t offset = i * part_size;
+                std::size_t length = std::min(part_size, size - offset);
+                google::cloud::Status status = p_limiter->run(
+                    [&]() { return m_client.InsertObject(m_bucket, sources[i].object_name, std::string(value + offset, length)).status(); },
+                    detail::gcs_retryable);
+                if (!status.ok())
+                {
+                    XTENSOR_THROW(std::runtime_error, status.message());
+                }
+                uploaded[i] = 1;
+            });
+            google::cloud::Status status = p_limiter->run(
+                [&]() { return m_client.ComposeObject(m_bucket, sources, m_path).status(); },
+                detail::gcs_retryable);
+            if (!status.ok())
+            {
+                XTENSOR_THROW(std::runtime_error, status.message());
+            }
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        // the temporary objects are deleted whatever happened
+        for (std::size_t i = 0; i < nparts; ++i)
+        {
+            if (uploaded[i])
+            {
+                p_limiter->run(
+                    [&]() { return m_client.DeleteObject(m_bucket, sources[i].object_name); },
+                    detail::gcs_retryable);
+            }
+        }
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
     }
 
     /**********************************
      * xzarr_gcs_store implementation *
      **********************************/
 
-    xzarr_gcs_store::xzarr_gcs_store(const std::string& root, gcs::Client& client)
+    /**
+     * Builds a GCS store.
+     * @param root the bucket, optionally followed by the path of the root of the store in the bucket
+     * @param client the GCS client, which must outlive the store
+     * @param config the request configuration
+     */
+    inline xzarr_gcs_store::xzarr_gcs_store(const std::string& root, gcs::Client& client, const xzarr_request_config& config)
         : m_root(root)
         , m_client(client)
+        , p_limiter(std::make_shared<xzarr_request_limiter>(config))
     {
         if (m_root.empty())
         {
@@ -132,96 +322,143 @@ namespace xt
         }
     }
 
-    xzarr_gcs_stream xzarr_gcs_store::operator[](const std::string& key) const
+    inline xzarr_gcs_stream xzarr_gcs_store::operator[](const std::string& key) const
     {
         std::string key2 = ensure_startswith_slash(key);
-        return xzarr_gcs_stream(m_root + key2, m_bucket, m_client);
+        return xzarr_gcs_stream(m_root + key2, m_bucket, m_client, p_limiter);
     }
 
-    void xzarr_gcs_store::set(const std::string& key, const std::vector<char>& value)
+    inline void xzarr_gcs_store::set(const std::string& key, const std::vector<char>& value)
     {
         std::string key2 = ensure_startswith_slash(key);
-        xzarr_gcs_stream(m_root + key2, m_bucket, m_client) = value;
+        xzarr_gcs_stream(m_root + key2, m_bucket, m_client, p_limiter) = value;
     }
 
-    void xzarr_gcs_store::set(const std::string& key, const std::string& value)
+    inline void xzarr_gcs_store::set(const std::string& key, const std::string& value)
     {
         std::string key2 = ensure_startswith_slash(key);
-        xzarr_gcs_stream(m_root + key2, m_bucket, m_client) = value;
+        xzarr_gcs_stream(m_root + key2, m_bucket, m_client, p_limiter) = value;
     }
 
-    std::string xzarr_gcs_store::get(const std::string& key) const
+    inline std::string xzarr_gcs_store::get(const std::string& key) const
     {
         std::string key2 = ensure_startswith_slash(key);
-        return xzarr_gcs_stream(m_root + key2, m_bucket, m_client);
+        return xzarr_gcs_stream(m_root + key2, m_bucket, m_client, p_limiter);
     }
 
-    void xzarr_gcs_store::list_dir(const std::string& prefix, std::vector<std::string>& keys, std::vector<std::string>& prefixes) const
+    inline void xzarr_gcs_store::list_dir(const std::string& prefix, std::vector<std::string>& keys, std::vector<std::string>& prefixes) const
     {
         std::string prefix2 = ensure_startswith_slash(prefix);
-        for (auto&& object_metadata: m_client.ListObjects(m_bucket, gcs::Prefix(m_root + prefix2)))
-        {
-            if (!object_metadata)
-            {
-                XTENSOR_THROW(std::runtime_error, object_metadata.status().message());
-            }
-            auto key = object_metadata->name();
-            key = key.substr(m_root.size() + 1);
-            std::size_t i = key.find('/');
-            if (i == std::string::npos)
-            {
-                keys.push_back(key);
-            }
-            else
+        std::size_t nkeys = keys.size();
+        std::size_t nprefixes = prefixes.size();
+        google::cloud::Status status = p_limiter->run(
+            [&]()
             {
-                key = key.substr(0, i + 1);
-                if (prefixes.size() == 0)
-                {
-                    prefixes.push_back(key);
-                }
-                else
+                keys.resize(nkeys);
+                prefixes.resize(nprefixes);
+                for (auto&& object_metadata: m_client.ListObjects(m_bucket, gcs::Prefix(m_root + prefix2)))
                 {
-                    if (prefixes[prefixes.size() - 1] != key)
+                    if (!object_metadata)
+                    {
+                        return object_metadata.status();
+                    }
+                    auto key = object_metadata->name();
+                    key = key.substr(m_root.size() + 1);
+                    std::size_t i = key.find('/');
+                    if (i == std::string::npos)
+                    {
+                        keys.push_back(key);
+                    }
+                    else
                     {
-                        prefixes.push_back(key);
+                        key = key.substr(0, i + 1);
+                        if (prefixes.size() == nprefixes)
+                        {
+                            prefixes.push_back(key);
+                        }
+                        else
+                        {
+                            if (prefixes[prefixes.size() - 1] != key)
+                            {
+                                prefixes.push_back(key);
+                            }
+                        }
                     }
                 }
-            }
+                return google::cloud::Status();
+            },
+            detail::gcs_retryable);
+        if (!status.ok())
+        {
+            XTENSOR_THROW(std::runtime_error, status.message());
         }
     }
 
-    std::vector<std::string> xzarr_gcs_store::list() const
+    inline std::vector<std::string> xzarr_gcs_store::list() const
     {
         return list_prefix("");
     }
 
-    std::vector<std::string> xzarr_gcs_store::list_prefix(const std::string& prefix) const
+    inline std::vector<std::string> xzarr_gcs_store::list_prefix(const std::string& prefix) const
     {
-        std::string prefix2 = ensure_startswith_slash(prefix);
         std::vector<std::string> keys;
-        for (auto&& object_metadata: m_client.ListObjects(m_bucket, gcs::Prefix(m_root + prefix2)))
-        {
-            if (!object_metadata)
+        visit_prefix(prefix, [&keys](const std::string& key) { keys.push_back(key); });
+        return keys;
+    }
+
+    /**
+     * Calls ``f(key)`` for each key with a given prefix, in lexicographic order.
+     * The keys are listed one page at a time, so that only one page is held in
+     * memory. A failed page request is retried from the start of the listing,
+     * skipping the keys already visited.
+     * @param prefix the prefix
+     * @param f the function to call
+     */
+    template <class F>
+    inline void xzarr_gcs_store::visit_prefix(const std::string& prefix, F&& f) const
+    {
+        std::string prefix2 = ensure_startswith_slash(prefix);
+        std::string last;
+        bool visited = false;
+        google::cloud::Status status = p_limiter->run(
+            [&]()
             {
-                XTENSOR_THROW(std::runtime_error, object_metadata.status().message());
-            }
-            auto key = object_metadata->name();
-            key = key.substr(m_root.size() + 1);
-            keys.push_back(key);
+                gcs::StartOffset start = visited ? gcs::StartOffset(last) : gcs::StartOffset();
+                for (auto&& object_metadata: m_client.ListObjects(m_bucket, gcs::Prefix(m_root + prefix2), start))
+                {
+                    if (!object_metadata)
+                    {
+                        return object_metadata.status();
+                    }
+                    if (visited && object_metadata->name() <= last)
+                    {
+                        continue;
+                    }
+                    last = object_metadata->name();
+                    visited = true;
+                    f(last.substr(m_root.size() + 1));
+                }
+                return google::cloud::Status();
+            },
+            detail::gcs_retryable);
+        if (!status.ok())
+        {
+            XTENSOR_THROW(std::runtime_error, status.message());
         }
-        return keys;
     }
 
-    void xzarr_gcs_store::erase(const std::string& key)
+    inline void xzarr_gcs_store::erase(const std::string& key)
     {
-        google::cloud::Status status = m_client.DeleteObject(m_bucket, m_root + '/' + key);
+        google::cloud::Status status = p_limiter->run(
+            [&]() { return m_client.DeleteObject(m_bucket, m_root + '/' + key); },
+            detail::gcs_retryable);
         if (!status.ok())
         {
             XTENSOR_THROW(std::runtime_error, status.message());
         }
     }
 
-    void xzarr_gcs_store::erase_prefix(const std::string& prefix)
+    inline void xzarr_gcs_store::erase_prefix(const std::string& prefix)
     {
         for (const auto& key: list_prefix(prefix))
         {
@@ -229,15 +466,14 @@ namespace xt
         }
     }
 
-    std::string xzarr_gcs_store::get_root() const
+    inline std::string xzarr_gcs_store::get_root() const
     {
         return m_root;
     }
 
-    xio_gcs_config xzarr_gcs_store::get_io_config() const
+    inline xzarr_gcs_store xzarr_gcs_store::get_io_config() const
     {
-        xio_gcs_config c = {m_client, m_bucket};
-        return c;
+        return *this;
     }
 
 }
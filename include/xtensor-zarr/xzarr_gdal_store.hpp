@@ -264,16 +264,22 @@ namespace xt
      *
      * @param prefix the prefix
      *
-     * @return returns a set of keys with a given prefix.
+     * @return returns a set of keys with a given prefix, empty if there is none.
      */
     inline std::vector<std::string> xzarr_gdal_store::list_prefix(const std::string& prefix)
     {
         std::string path = m_root + '/' + prefix;
         std::vector<std::string> keys;
+        VSIStatBufL sStat;
+        if (VSIStatL(path.c_str(), &sStat) != 0)
+        {
+            return keys;
+        }
         char** names = VSIReadDirRecursive(path.c_str());
         if (names == NULL)
         {
-            XTENSOR_THROW(std::runtime_error, "Directory does not exist: " + path);
+            // empty directory
+            return keys;
         }
         std::size_t i = 0;
         while (true)
@@ -11,6 +11,7 @@
 #define XTENSOR_ZARR_GROUP_HPP
 
 #include "nlohmann/json.hpp"
+#include "xzarr_attrs.hpp"
 
 namespace xt
 {
@@ -23,11 +24,14 @@ namespace xt
         xzarr_group create_group(const nlohmann::json& attrs=nlohmann::json::object(), const nlohmann::json& extensions=nlohmann::json::array());
 
         nlohmann::json attrs();
+        void set_attrs(const nlohmann::json& attrs);
         std::string name();
         std::string path();
     private:
         store_type& m_store;
         nlohmann::json m_json;
+        nlohmann::json m_attrs;
+        bool m_attrs_loaded;
         std::string m_path;
         std::size_t m_zarr_version_major;
     };
@@ -35,17 +39,10 @@ namespace xt
     template <class store_type>
     xzarr_group<store_type>::xzarr_group(store_type& store, const std::string& path, const std::size_t zarr_version_major)
         : m_store(store)
+        , m_attrs_loaded(false)
         , m_path(path)
         , m_zarr_version_major(zarr_version_major)
     {
-        if (zarr_version_major == 3)
-        {
-            auto f = m_store["meta/root" + m_path + ".group.json"];
-            if (f.exists())
-            {
-                m_json = nlohmann::json::parse(std::string(f));
-            }
-        }
     }
 
     template <class store_type>
@@ -58,10 +55,12 @@ namespace xt
                 m_json["attributes"] = attrs;
                 m_json["extensions"] = extensions;
                 m_store["meta/root" + m_path + ".group.json"] = m_json.dump(4);
+                m_attrs = attrs;
+                m_attrs_loaded = true;
                 break;
             case 2:
                 m_json["zarr_format"] = 2;
-                m_store[m_path + ".zgroup"] = m_json.dump(4);
+                m_store[detail::zarr_v2_node_key(m_path, ".zgroup")] = m_json.dump(4);
                 break;
             default:
                 break;
@@ -69,10 +68,29 @@ namespace xt
         return *this;
     }
 
+    /**
+     * Returns the attributes of the group, read from the store on first access.
+     */
     template <class store_type>
     nlohmann::json xzarr_group<store_type>::attrs()
     {
-        return m_json["attributes"];
+        if (!m_attrs_loaded)
+        {
+            m_attrs = read_zarr_attrs(m_store, m_path, m_zarr_version_major);
+            m_attrs_loaded = true;
+        }
+        return m_attrs;
+    }
+
+    /**
+     * Replaces the attributes of the group.
+     */
+    template <class store_type>
+    void xzarr_group<store_type>::set_attrs(const nlohmann::json& attrs)
+    {
+        write_zarr_attrs(m_store, m_path, attrs, m_zarr_version_major);
+        m_attrs = attrs;
+        m_attrs_loaded = true;
     }
 
     template <class store_type>
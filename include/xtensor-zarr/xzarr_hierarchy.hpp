@@ -14,10 +14,25 @@
 #include "zarray/zarray.hpp"
 #include "xzarr_node.hpp"
 #include "xzarr_array.hpp"
+#include "xzarr_attrs.hpp"
+#include "xzarr_autotune.hpp"
+#include "xzarr_chunk_stats.hpp"
+#include "xzarr_concurrent_writer.hpp"
+#include "xzarr_copy.hpp"
+#include "xzarr_map.hpp"
+#include "xzarr_partition.hpp"
+#include "xzarr_pyramid.hpp"
+#include "xzarr_rechunk.hpp"
+#include "xzarr_reduce.hpp"
+#include "xzarr_resize.hpp"
 #include "xzarr_group.hpp"
 #include "xzarr_common.hpp"
+#include "xzarr_zstd.hpp"
+#include "xzarr_lz4.hpp"
+#include "xzarr_blosc.hpp"
 #include "xzarr_file_system_store.hpp"
 #include "xzarr_gdal_store.hpp"
+#include "xzarr_memory_store.hpp"
 #include "xtensor_zarr_config.hpp"
 #include "xtensor-io/xio_gzip.hpp"
 #include "xtensor-io/xio_zlib.hpp"
@@ -47,18 +62,72 @@ namespace xt
         template <class shape_type, class O = xzarr_create_array_options<xio_binary_config>>
         zarray create_array(const std::string& path, shape_type shape, shape_type chunk_shape, const std::string& dtype, O o=O());
 
-        zarray get_array(const std::string& path, std::size_t chunk_pool_size=1);
+        template <class shape_type, class E>
+        zarray create_array_autotuned(const std::string& path, shape_type shape, shape_type chunk_shape, const std::string& dtype, const xexpression<E>& sample, const xzarr_autotune_options& tuning=xzarr_autotune_options(), xzarr_create_array_options<xzarr_any_compressor> o=xzarr_create_array_options<xzarr_any_compressor>());
+
+        zarray get_array(const std::string& path, std::size_t chunk_pool_size=1, std::size_t codec_threads=0, bool verify_checksums=true);
+
+        template <class T>
+        xzarr_concurrent_writer<T, store_type> get_concurrent_writer(const std::string& path, std::size_t nstripes=256);
+
+        template <class T>
+        xzarr_partition_writer<T, store_type> get_partition_writer(const std::string& path, std::size_t worker, std::size_t nworkers, std::size_t axis=0);
+
+        xzarr_partition_report finalize_partitions(const std::string& path, std::size_t nworkers, std::size_t axis=0);
+
+        template <class shape_type>
+        zarray rechunk(const std::string& source_path, const std::string& target_path, shape_type chunk_shape, const xzarr_rechunk_options& options=xzarr_rechunk_options(), std::size_t chunk_pool_size=1);
+
+        template <class dest_store_type, class shape_type>
+        zarray rechunk(const std::string& source_path, xzarr_hierarchy<dest_store_type>& dest, const std::string& target_path, shape_type chunk_shape, const xzarr_rechunk_options& options=xzarr_rechunk_options(), std::size_t chunk_pool_size=1);
+
+        template <class shape_type>
+        zarray resize(const std::string& path, shape_type new_shape, std::size_t chunk_pool_size=1);
+
+        template <class E>
+        zarray append(const std::string& path, const xexpression<E>& data, std::size_t axis, std::size_t chunk_pool_size=1);
+
+        xarray<double> reduce(const std::string& path, xzarr_reducer reducer, const std::vector<std::size_t>& axes=std::vector<std::size_t>(), std::size_t nthreads=0);
+
+        template <class T, class R = T, class F>
+        void map_chunks(const std::string& source_path, const std::string& target_path, F&& fn, std::size_t nthreads=0);
+
+        template <class T, class R = T, class dest_store_type, class F>
+        void map_chunks(const std::string& source_path, xzarr_hierarchy<dest_store_type>& dest, const std::string& target_path, F&& fn, std::size_t nthreads=0);
+
+        xzarr_chunk_stats_index build_chunk_stats(const std::string& path, std::size_t nthreads=0);
+
+        xzarr_query_result query(const std::string& path, double lo, double hi, std::size_t nthreads=0);
+
+        std::vector<std::string> build_pyramid(const std::string& path, const xzarr_pyramid_options& options=xzarr_pyramid_options());
+
+        template <class dest_store_type>
+        xzarr_copy_stats copy_array(const std::string& path, xzarr_hierarchy<dest_store_type>& dest, const std::string& dest_path="", const xzarr_copy_options& options=xzarr_copy_options());
+
+        template <class dest_store_type>
+        xzarr_copy_stats copy_hierarchy(xzarr_hierarchy<dest_store_type>& dest, const xzarr_copy_options& options=xzarr_copy_options());
 
         xzarr_group<store_type> create_group(const std::string& path, const nlohmann::json& attrs=nlohmann::json::object(), const nlohmann::json& extensions=nlohmann::json::array());
 
         xzarr_node<store_type> operator[](const std::string& path);
 
+        nlohmann::json get_attrs(const std::string& path);
+        std::map<std::string, nlohmann::json> get_attrs(const std::vector<std::string>& paths, std::size_t nthreads=0);
+        void set_attrs(const std::string& path, const nlohmann::json& attrs);
+        void update_attrs(const std::map<std::string, nlohmann::json>& updates, std::size_t nthreads=0);
+
         nlohmann::json get_children(const std::string& path="/");
         nlohmann::json get_nodes(const std::string& path="/");
+        template <class F>
+        void walk(const std::string& path, F&& visitor, std::size_t nthreads=0, bool read_metadata=true);
 
     private:
         store_type m_store;
         std::size_t m_zarr_version_major;
+        xzarr_attrs_cache<store_type> m_attrs;
+
+        template <class S>
+        friend class xzarr_hierarchy;
     };
 
     /**********************************
@@ -69,6 +138,7 @@ namespace xt
     xzarr_hierarchy<store_type>::xzarr_hierarchy(store_type& store, const std::string& zarr_version)
         : m_store(store)
         , m_zarr_version_major(get_zarr_version_major(zarr_version))
+        , m_attrs(m_store, m_zarr_version_major)
     {
     }
 
@@ -106,19 +176,218 @@ namespace xt
     template <class shape_type, class O>
     zarray xzarr_hierarchy<store_type>::create_array(const std::string& path, shape_type shape, shape_type chunk_shape, const std::string& dtype, O o)
     {
-        return create_zarr_array(m_store, path, shape, chunk_shape, dtype, o.chunk_memory_layout, o.chunk_separator, o.compressor, o.attrs, o.chunk_pool_size, o.fill_value, m_zarr_version_major);
+        m_attrs.forget(path);
+        return create_zarr_array(m_store, path, shape, chunk_shape, dtype, o.chunk_memory_layout, o.chunk_separator, o.compressor, o.attrs, o.chunk_pool_size, o.fill_value, m_zarr_version_major, o.codec_threads, o.checksum);
+    }
+
+    /**
+     * Creates an array whose compressor is selected by trial-compressing a sample of its data.
+     * @sa create_zarr_array_autotuned
+     */
+    template <class store_type>
+    template <class shape_type, class E>
+    zarray xzarr_hierarchy<store_type>::create_array_autotuned(const std::string& path, shape_type shape, shape_type chunk_shape, const std::string& dtype, const xexpression<E>& sample, const xzarr_autotune_options& tuning, xzarr_create_array_options<xzarr_any_compressor> o)
+    {
+        m_attrs.forget(path);
+        return create_zarr_array_autotuned(m_store, path, shape, chunk_shape, dtype, sample, tuning, o, m_zarr_version_major);
     }
 
+    template <class store_type>
+    zarray xzarr_hierarchy<store_type>::get_array(const std::string& path, std::size_t chunk_pool_size, std::size_t codec_threads, bool verify_checksums)
+    {
+        return get_zarr_array(m_store, path, chunk_pool_size, m_zarr_version_major, codec_threads, verify_checksums);
+    }
 
+    /**
+     * Returns a writer to an array that can be used by several threads at once.
+     * @sa xzarr_concurrent_writer
+     */
     template <class store_type>
-    zarray xzarr_hierarchy<store_type>::get_array(const std::string& path, std::size_t chunk_pool_size)
+    template <class T>
+    xzarr_concurrent_writer<T, store_type> xzarr_hierarchy<store_type>::get_concurrent_writer(const std::string& path, std::size_t nstripes)
     {
-        return get_zarr_array(m_store, path, chunk_pool_size, m_zarr_version_major);
+        return xzarr_concurrent_writer<T, store_type>(m_store, path, m_zarr_version_major, nstripes);
+    }
+
+    /**
+     * Returns the writer of the partition of an array owned by a worker process.
+     * @sa xzarr_partition_writer
+     */
+    template <class store_type>
+    template <class T>
+    xzarr_partition_writer<T, store_type> xzarr_hierarchy<store_type>::get_partition_writer(const std::string& path, std::size_t worker, std::size_t nworkers, std::size_t axis)
+    {
+        return xzarr_partition_writer<T, store_type>(m_store, path, m_zarr_version_major, worker, nworkers, axis);
+    }
+
+    /**
+     * Checks that all the workers of a partitioned write committed their partition.
+     * @sa xt::finalize_partitions
+     */
+    template <class store_type>
+    xzarr_partition_report xzarr_hierarchy<store_type>::finalize_partitions(const std::string& path, std::size_t nworkers, std::size_t axis)
+    {
+        return xt::finalize_partitions(m_store, path, m_zarr_version_major, nworkers, axis);
+    }
+
+    /**
+     * Copies an array to a new array with a different chunk shape.
+     * @sa rechunk_zarr_array
+     */
+    template <class store_type>
+    template <class shape_type>
+    zarray xzarr_hierarchy<store_type>::rechunk(const std::string& source_path, const std::string& target_path, shape_type chunk_shape, const xzarr_rechunk_options& options, std::size_t chunk_pool_size)
+    {
+        m_attrs.forget(target_path);
+        rechunk_zarr_array(m_store, source_path, target_path, chunk_shape, m_zarr_version_major, options);
+        return get_array(target_path, chunk_pool_size);
+    }
+
+    /**
+     * Copies an array to a new array of another hierarchy, with a different chunk shape.
+     * Both hierarchies must have the same Zarr version.
+     * @sa rechunk_zarr_array
+     */
+    template <class store_type>
+    template <class dest_store_type, class shape_type>
+    zarray xzarr_hierarchy<store_type>::rechunk(const std::string& source_path, xzarr_hierarchy<dest_store_type>& dest, const std::string& target_path, shape_type chunk_shape, const xzarr_rechunk_options& options, std::size_t chunk_pool_size)
+    {
+        if (dest.m_zarr_version_major != m_zarr_version_major)
+        {
+            XTENSOR_THROW(std::runtime_error, "Cannot rechunk: the hierarchies have different Zarr versions");
+        }
+        dest.m_attrs.forget(target_path);
+        rechunk_zarr_array(m_store, source_path, dest.m_store, target_path, chunk_shape, m_zarr_version_major, options);
+        return dest.get_array(target_path, chunk_pool_size);
+    }
+
+    /**
+     * Changes the shape of an array, and returns it opened again.
+     * @sa resize_zarr_array
+     */
+    template <class store_type>
+    template <class shape_type>
+    zarray xzarr_hierarchy<store_type>::resize(const std::string& path, shape_type new_shape, std::size_t chunk_pool_size)
+    {
+        resize_zarr_array(m_store, path, new_shape, m_zarr_version_major);
+        return get_array(path, chunk_pool_size);
+    }
+
+    /**
+     * Appends data to an array along an axis, and returns it opened again.
+     * @sa append_zarr_array
+     */
+    template <class store_type>
+    template <class E>
+    zarray xzarr_hierarchy<store_type>::append(const std::string& path, const xexpression<E>& data, std::size_t axis, std::size_t chunk_pool_size)
+    {
+        append_zarr_array(m_store, path, data, axis, m_zarr_version_major);
+        return get_array(path, chunk_pool_size);
+    }
+
+    /**
+     * Reduces an array along some of its axes, chunk by chunk.
+     * @sa reduce_zarr_array
+     */
+    template <class store_type>
+    xarray<double> xzarr_hierarchy<store_type>::reduce(const std::string& path, xzarr_reducer reducer, const std::vector<std::size_t>& axes, std::size_t nthreads)
+    {
+        return reduce_zarr_array(m_store, path, m_zarr_version_major, reducer, axes, nthreads);
+    }
+
+    /**
+     * Computes an array from another one of the hierarchy, chunk by chunk.
+     * @sa map_zarr_chunks
+     */
+    template <class store_type>
+    template <class T, class R, class F>
+    void xzarr_hierarchy<store_type>::map_chunks(const std::string& source_path, const std::string& target_path, F&& fn, std::size_t nthreads)
+    {
+        m_attrs.forget(target_path);
+        map_zarr_chunks<T, R>(m_store, source_path, target_path, m_zarr_version_major, std::forward<F>(fn), nthreads);
+    }
+
+    /**
+     * Computes an array of another hierarchy from an array of the hierarchy, chunk by chunk.
+     * Both hierarchies must have the same Zarr version.
+     * @sa map_zarr_chunks
+     */
+    template <class store_type>
+    template <class T, class R, class dest_store_type, class F>
+    void xzarr_hierarchy<store_type>::map_chunks(const std::string& source_path, xzarr_hierarchy<dest_store_type>& dest, const std::string& target_path, F&& fn, std::size_t nthreads)
+    {
+        if (dest.m_zarr_version_major != m_zarr_version_major)
+        {
+            XTENSOR_THROW(std::runtime_error, "Cannot map chunks: the hierarchies have different Zarr versions");
+        }
+        dest.m_attrs.forget(target_path);
+        map_zarr_chunks<T, R>(m_store, source_path, dest.m_store, target_path, m_zarr_version_major, std::forward<F>(fn), nthreads);
+    }
+
+    /**
+     * Computes and stores the statistics of the chunks of an array.
+     * @sa build_zarr_chunk_stats
+     */
+    template <class store_type>
+    xzarr_chunk_stats_index xzarr_hierarchy<store_type>::build_chunk_stats(const std::string& path, std::size_t nthreads)
+    {
+        return build_zarr_chunk_stats(m_store, path, m_zarr_version_major, nthreads);
+    }
+
+    /**
+     * Returns the elements of an array within a range of values, skipping the
+     * chunks that cannot hold any of them according to the chunk statistics.
+     * @sa query_zarr_array
+     */
+    template <class store_type>
+    xzarr_query_result xzarr_hierarchy<store_type>::query(const std::string& path, double lo, double hi, std::size_t nthreads)
+    {
+        return query_zarr_array(m_store, path, m_zarr_version_major, lo, hi, nthreads);
+    }
+
+    /**
+     * Builds a multiscale pyramid of an array, whose levels are sibling arrays.
+     * @sa build_zarr_pyramid
+     */
+    template <class store_type>
+    std::vector<std::string> xzarr_hierarchy<store_type>::build_pyramid(const std::string& path, const xzarr_pyramid_options& options)
+    {
+        m_attrs.clear();
+        return build_zarr_pyramid(m_store, path, m_zarr_version_major, options);
+    }
+
+    /**
+     * Copies an array to another hierarchy, possibly in another store or Zarr version.
+     * @param path the path of the array
+     * @param dest the destination hierarchy
+     * @param dest_path the path of the copy (empty means the same path)
+     * @param options the copy options
+     * @sa copy_zarr_array
+     */
+    template <class store_type>
+    template <class dest_store_type>
+    xzarr_copy_stats xzarr_hierarchy<store_type>::copy_array(const std::string& path, xzarr_hierarchy<dest_store_type>& dest, const std::string& dest_path, const xzarr_copy_options& options)
+    {
+        dest.m_attrs.forget(dest_path.empty() ? path : dest_path);
+        return copy_zarr_array(m_store, path, m_zarr_version_major, dest.m_store, dest_path.empty() ? path : dest_path, dest.m_zarr_version_major, options);
+    }
+
+    /**
+     * Copies all the groups and arrays of the hierarchy to another hierarchy.
+     * @sa copy_zarr_hierarchy
+     */
+    template <class store_type>
+    template <class dest_store_type>
+    xzarr_copy_stats xzarr_hierarchy<store_type>::copy_hierarchy(xzarr_hierarchy<dest_store_type>& dest, const xzarr_copy_options& options)
+    {
+        dest.m_attrs.clear();
+        return copy_zarr_hierarchy(m_store, m_zarr_version_major, dest.m_store, dest.m_zarr_version_major, options);
     }
 
     template <class store_type>
     xzarr_group<store_type> xzarr_hierarchy<store_type>::create_group(const std::string& path, const nlohmann::json& attrs, const nlohmann::json& extensions)
     {
+        m_attrs.forget(path);
         xzarr_group<store_type> g(m_store, path, m_zarr_version_major);
         return g.create_group(attrs, extensions);
     }
@@ -129,6 +398,54 @@ namespace xt
         return xzarr_node<store_type>(m_store, path, m_zarr_version_major);
     }
 
+    /**
+     * Returns the attributes of a node, which are read (see read_zarr_attrs)
+     * on first access and kept by the hierarchy afterwards.
+     * @param path the path of the node
+     */
+    template <class store_type>
+    nlohmann::json xzarr_hierarchy<store_type>::get_attrs(const std::string& path)
+    {
+        return m_attrs.get(path);
+    }
+
+    /**
+     * Returns the attributes of many nodes, reading the ones that are not
+     * loaded yet concurrently.
+     * @param paths the paths of the nodes
+     * @param nthreads the number of threads (0 means the thread budget)
+     *
+     * @return returns the attributes of the nodes, by path.
+     */
+    template <class store_type>
+    std::map<std::string, nlohmann::json> xzarr_hierarchy<store_type>::get_attrs(const std::vector<std::string>& paths, std::size_t nthreads)
+    {
+        return m_attrs.get(paths, nthreads);
+    }
+
+    /**
+     * Replaces the attributes of a node (see write_zarr_attrs).
+     * @param path the path of the node
+     * @param attrs the new attributes
+     */
+    template <class store_type>
+    void xzarr_hierarchy<store_type>::set_attrs(const std::string& path, const nlohmann::json& attrs)
+    {
+        m_attrs.set(path, attrs);
+    }
+
+    /**
+     * Applies merge patches to the attributes of many nodes concurrently
+     * (see update_zarr_attrs).
+     * @param updates the patches of the attributes, by path
+     * @param nthreads the number of threads (0 means the thread budget)
+     */
+    template <class store_type>
+    void xzarr_hierarchy<store_type>::update_attrs(const std::map<std::string, nlohmann::json>& updates, std::size_t nthreads)
+    {
+        m_attrs.update(updates, nthreads);
+    }
+
     template <class store_type>
     nlohmann::json xzarr_hierarchy<store_type>::get_children(const std::string& path)
     {
@@ -141,6 +458,20 @@ namespace xt
         return xzarr_node<store_type>(m_store, path, m_zarr_version_major).get_nodes();
     }
 
+    /**
+     * Walks the nodes under a path in parallel (see xzarr_node::walk).
+     * @param path the path of the node to walk from
+     * @param visitor the function called with the name, the type and the metadata of each node
+     * @param nthreads the number of threads (0 means the thread budget)
+     * @param read_metadata whether to read the metadata documents of the nodes
+     */
+    template <class store_type>
+    template <class F>
+    void xzarr_hierarchy<store_type>::walk(const std::string& path, F&& visitor, std::size_t nthreads, bool read_metadata)
+    {
+        xzarr_node<store_type>(m_store, path, m_zarr_version_major).walk(std::forward<F>(visitor), nthreads, read_metadata);
+    }
+
     /************************************
      * zarr hierarchy factory functions *
      ************************************/
@@ -230,12 +561,26 @@ namespace xt
     extern template void xzarr_register_compressor<xzarr_gdal_store, xio_gzip_config>();
     extern template void xzarr_register_compressor<xzarr_gdal_store, xio_zlib_config>();
     extern template void xzarr_register_compressor<xzarr_gdal_store, xio_blosc_config>();
+    extern template void xzarr_register_compressor<xzarr_gdal_store, xzarr_zstd_config>();
+    extern template void xzarr_register_compressor<xzarr_gdal_store, xzarr_lz4_config>();
+    extern template void xzarr_register_compressor<xzarr_gdal_store, xzarr_blosc_config>();
     extern template class xchunked_array_factory<xzarr_gdal_store>;
 
     extern template void xzarr_register_compressor<xzarr_file_system_store, xio_gzip_config>();
     extern template void xzarr_register_compressor<xzarr_file_system_store, xio_zlib_config>();
     extern template void xzarr_register_compressor<xzarr_file_system_store, xio_blosc_config>();
+    extern template void xzarr_register_compressor<xzarr_file_system_store, xzarr_zstd_config>();
+    extern template void xzarr_register_compressor<xzarr_file_system_store, xzarr_lz4_config>();
+    extern template void xzarr_register_compressor<xzarr_file_system_store, xzarr_blosc_config>();
     extern template class xchunked_array_factory<xzarr_file_system_store>;
+
+    extern template void xzarr_register_compressor<xzarr_memory_store, xio_gzip_config>();
+    extern template void xzarr_register_compressor<xzarr_memory_store, xio_zlib_config>();
+    extern template void xzarr_register_compressor<xzarr_memory_store, xio_blosc_config>();
+    extern template void xzarr_register_compressor<xzarr_memory_store, xzarr_zstd_config>();
+    extern template void xzarr_register_compressor<xzarr_memory_store, xzarr_lz4_config>();
+    extern template void xzarr_register_compressor<xzarr_memory_store, xzarr_blosc_config>();
+    extern template class xchunked_array_factory<xzarr_memory_store>;
 }
 
 #endif
@@ -0,0 +1,585 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_IO_ENGINE_HPP
+#define XTENSOR_ZARR_IO_ENGINE_HPP
+
+#include <algorithm>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#if defined(XTENSOR_ZARR_USE_IO_URING)
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <liburing.h>
+#endif
+
+#include "xzarr_common.hpp"
+#include "xzarr_file_system_handler.hpp"
+#include "xzarr_threading.hpp"
+
+namespace xt
+{
+    /**
+     * @class xzarr_io_engine
+     * @brief Batched reads and writes of whole files.
+     *
+     * When xtensor-zarr is built with ``XTENSOR_ZARR_USE_IO_URING`` and the kernel
+     * supports it, the files of a batch are opened, stat'ed, read or written and
+     * closed through an io_uring submission queue from the calling thread, with up
+     * to ``queue_depth`` files in flight. Otherwise, or if the ring cannot be set
+     * up (e.g. io_uring is disabled by a seccomp policy), the files of a batch are
+     * spread over ``nthreads`` threads doing ``pread`` and ``pwrite``.
+     *
+     * The ring is set up on the first batch, and set up again by the first batch
+     * of a forked child, which must not use the ring of its parent. It is not
+     * shared between threads: concurrent batches on the same engine are serialized.
+     */
+    class xzarr_io_engine
+    {
+    public:
+
+        explicit xzarr_io_engine(std::size_t queue_depth = 64, std::size_t nthreads = 0);
+        ~xzarr_io_engine();
+
+        xzarr_io_engine(const xzarr_io_engine&) = delete;
+        xzarr_io_engine& operator=(const xzarr_io_engine&) = delete;
+
+        bool uses_io_uring();
+
+        void read(const std::vector<std::string>& paths, std::vector<std::string>& values, std::vector<bool>& found,
+                  xzarr_read_advice advice = xzarr_read_advice::normal);
+        void write(const std::vector<std::string>& paths, const std::vector<std::string>& values,
+                   const xzarr_file_system_config& config);
+
+    private:
+
+        std::size_t m_queue_depth;
+        std::size_t m_nthreads;
+
+#if defined(XTENSOR_ZARR_USE_IO_URING)
+        struct uring_file
+        {
+            enum stage_type { open_file, stat_file, transfer, sync_file, close_file, rename_file, done };
+
+            const std::string* path = nullptr;
+            const std::string* target = nullptr;
+            std::string* buffer = nullptr;
+            const char* data = nullptr;
+            std::size_t size = 0;
+            std::size_t offset = 0;
+            bool writing = false;
+            bool sync = false;
+            bool found = true;
+            int fd = -1;
+            int error = 0;
+            stage_type stage = open_file;
+            struct statx stx;
+        };
+
+        bool init_ring();
+        void exit_ring();
+        void submit(unsigned wait_nr, int& res);
+        void prepare(uring_file& file);
+        void advance(uring_file& file, int res);
+        void drain(std::vector<uring_file>& files);
+        void run(std::vector<uring_file>& files);
+
+        struct io_uring m_ring;
+        bool m_ring_ready;
+        bool m_use_uring;
+        pid_t m_pid;
+        // operations prepared in the submission queue, and submitted but not completed
+        std::size_t m_queued;
+        std::size_t m_in_flight;
+        std::mutex m_mutex;
+#endif
+    };
+
+    /**********************************
+     * xzarr_io_engine implementation *
+     **********************************/
+
+    /**
+     * Builds an I/O engine.
+     * @param queue_depth the maximum number of files in flight with io_uring
+     * @param nthreads the number of threads of the fallback (0 means the thread budget)
+     */
+    inline xzarr_io_engine::xzarr_io_engine(std::size_t queue_depth, std::size_t nthreads)
+        : m_queue_depth(queue_depth == 0 ? 1 : queue_depth)
+        , m_nthreads(nthreads)
+#if defined(XTENSOR_ZARR_USE_IO_URING)
+        , m_ring_ready(false)
+        , m_use_uring(false)
+        , m_pid(0)
+        , m_queued(0)
+        , m_in_flight(0)
+#endif
+    {
+    }
+
+    inline xzarr_io_engine::~xzarr_io_engine()
+    {
+#if defined(XTENSOR_ZARR_USE_IO_URING)
+        // the ring of a parent process is released by the parent
+        if (m_pid == ::getpid())
+        {
+            exit_ring();
+        }
+#endif
+    }
+
+    /**
+     * Returns true if batches go through io_uring, false if they go through the thread pool.
+     */
+    inline bool xzarr_io_engine::uses_io_uring()
+    {
+#if defined(XTENSOR_ZARR_USE_IO_URING)
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return init_ring();
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * Reads whole files.
+     * @param paths the paths of the files
+     * @param values the contents of the files, returned by reference
+     * @param found whether the files exist, returned by reference
+     * @param advice the access hint, used by the thread pool only
+     */
+    inline void xzarr_io_engine::read(const std::vector<std::string>& paths, std::vector<std::string>& values, std::vector<bool>& found,
+                                      xzarr_read_advice advice)
+    {
+        values.resize(paths.size());
+        found.assign(paths.size(), false);
+#if defined(XTENSOR_ZARR_USE_IO_URING)
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (init_ring())
+        {
+            std::vector<uring_file> files(paths.size());
+            for (std::size_t i = 0; i < paths.size(); ++i)
+            {
+                files[i].path = &paths[i];
+                files[i].buffer = &values[i];
+            }
+            run(files);
+            for (std::size_t i = 0; i < paths.size(); ++i)
+            {
+                if (files[i].error != 0)
+                {
+                    XTENSOR_THROW(std::runtime_error, "Could not read file: " + paths[i] + ": " + std::strerror(files[i].error));
+                }
+                found[i] = files[i].found;
+            }
+            return;
+        }
+        lock.unlock();
+#endif
+        // std::vector<bool> cannot be written concurrently
+        std::vector<char> exists(paths.size(), 0);
+        xzarr_parallel_for(paths.size(), m_nthreads, [&](std::size_t i)
+        {
+            exists[i] = detail::read_file(paths[i], values[i], advice) ? 1 : 0;
+        });
+        for (std::size_t i = 0; i < paths.size(); ++i)
+        {
+            found[i] = exists[i] != 0;
+        }
+    }
+
+    /**
+     * Writes whole files, following the I/O configuration for directory
+     * creation, atomicity and flushing to stable storage.
+     * @param paths the paths of the files
+     * @param values the contents of the files
+     * @param config the I/O configuration
+     */
+    inline void xzarr_io_engine::write(const std::vector<std::string>& paths, const std::vector<std::string>& values,
+                                       const xzarr_file_system_config& config)
+    {
+        if (paths.size() != values.size())
+        {
+            XTENSOR_THROW(std::runtime_error, "Number of paths and values differ");
+        }
+#if defined(XTENSOR_ZARR_USE_IO_URING)
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (init_ring())
+        {
+            std::vector<std::string> temporaries(paths.size());
+            std::vector<uring_file> files(paths.size());
+            for (std::size_t i = 0; i < paths.size(); ++i)
+            {
+                if (config.create_directories)
+                {
+                    detail::create_parent_directories(paths[i], config);
+                }
+                uring_file& file = files[i];
+                file.writing = true;
+                file.data = values[i].data();
+                file.size = values[i].size();
+                file.sync = config.fsync == xzarr_fsync_policy::per_write;
+                if (config.atomic_writes)
+                {
+                    temporaries[i] = detail::temporary_path(paths[i]);
+                    file.path = &temporaries[i];
+                    file.target = &paths[i];
+                }
+                else
+                {
+                    file.path = &paths[i];
+                }
+            }
+            run(files);
+            std::string message;
+            for (std::size_t i = 0; i < paths.size(); ++i)
+            {
+                if (files[i].error != 0)
+                {
+                    if (config.atomic_writes)
+                    {
+                        ::unlink(temporaries[i].c_str());
+                    }
+                    if (message.empty())
+                    {
+                        message = "Could not write file: " + paths[i] + ": " + std::strerror(files[i].error);
+                    }
+                }
+            }
+            if (!message.empty())
+            {
+                XTENSOR_THROW(std::runtime_error, message);
+            }
+            if (config.fsync == xzarr_fsync_policy::per_write)
+            {
+                std::set<std::string> directories;
+                for (const auto& path: paths)
+                {
+                    directories.insert(detail::parent_directory(path));
+                }
+                for (const auto& directory: directories)
+                {
+                    detail::fsync_path(directory, true);
+                }
+            }
+            else if (config.fsync == xzarr_fsync_policy::batched && config.batch)
+            {
+                for (const auto& path: paths)
+                {
+                    config.batch->add(path);
+                }
+            }
+            return;
+        }
+        lock.unlock();
+#endif
+        xzarr_parallel_for(paths.size(), m_nthreads, [&](std::size_t i)
+        {
+            detail::write_file(paths[i], config, values[i].data(), values[i].size());
+        });
+    }
+
+#if defined(XTENSOR_ZARR_USE_IO_URING)
+    // sets up the ring on first use, or in a forked child; returns false if io_uring is not usable
+    inline bool xzarr_io_engine::init_ring()
+    {
+        pid_t pid = ::getpid();
+        if (m_ring_ready && m_pid == pid)
+        {
+            return m_use_uring;
+        }
+        if (m_ring_ready && m_use_uring)
+        {
+            // the mappings of the ring of the parent are released in the child only
+            io_uring_queue_exit(&m_ring);
+        }
+        m_ring_ready = true;
+        m_pid = pid;
+        m_use_uring = io_uring_queue_init(unsigned(m_queue_depth), &m_ring, 0) == 0;
+        if (m_use_uring)
+        {
+            // opening, closing and renaming through the ring need Linux 5.11
+            struct io_uring_probe* probe = io_uring_get_probe_ring(&m_ring);
+            const int ops[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE,
+                               IORING_OP_FSYNC, IORING_OP_CLOSE, IORING_OP_RENAMEAT};
+            for (int op: ops)
+            {
+                m_use_uring = m_use_uring && probe != nullptr && io_uring_opcode_supported(probe, op);
+            }
+            if (probe != nullptr)
+            {
+                io_uring_free_probe(probe);
+            }
+            if (!m_use_uring)
+            {
+                io_uring_queue_exit(&m_ring);
+            }
+        }
+        return m_use_uring;
+    }
+
+    inline void xzarr_io_engine::exit_ring()
+    {
+        if (m_ring_ready && m_use_uring)
+        {
+            io_uring_queue_exit(&m_ring);
+        }
+        m_ring_ready = false;
+        m_use_uring = false;
+    }
+
+    inline void xzarr_io_engine::submit(unsigned wait_nr, int& res)
+    {
+        res = (wait_nr == 0) ? io_uring_submit(&m_ring) : io_uring_submit_and_wait(&m_ring, wait_nr);
+        if (res > 0)
+        {
+            m_queued -= std::size_t(res);
+            m_in_flight += std::size_t(res);
+        }
+    }
+
+    inline void xzarr_io_engine::prepare(uring_file& file)
+    {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(&m_ring);
+        while (sqe == nullptr)
+        {
+            // the submission queue is full of prepared entries
+            int res = 0;
+            submit(0, res);
+            if (res < 0 && res != -EINTR && res != -EAGAIN && res != -EBUSY)
+            {
+                XTENSOR_THROW(std::runtime_error, std::string("io_uring submission failed: ") + std::strerror(-res));
+            }
+            sqe = io_uring_get_sqe(&m_ring);
+        }
+        ++m_queued;
+        switch (file.stage)
+        {
+            case uring_file::open_file:
+                // temporary files of atomic writes are created exclusively
+                io_uring_prep_openat(sqe, AT_FDCWD, file.path->c_str(),
+                                     file.writing ? O_WRONLY | O_CREAT | (file.target ? O_EXCL : O_TRUNC) | O_CLOEXEC : O_RDONLY | O_CLOEXEC, 0666);
+                break;
+            case uring_file::stat_file:
+                io_uring_prep_statx(sqe, file.fd, "", AT_EMPTY_PATH, STATX_SIZE, &file.stx);
+                break;
+            case uring_file::transfer:
+                if (file.writing)
+                {
+                    io_uring_prep_write(sqe, file.fd, file.data + file.offset, unsigned(std::min(file.size - file.offset, std::size_t(1) << 30)), file.offset);
+                }
+                else
+                {
+                    io_uring_prep_read(sqe, file.fd, &(*file.buffer)[file.offset], unsigned(std::min(file.size - file.offset, std::size_t(1) << 30)), file.offset);
+                }
+                break;
+            case uring_file::sync_file:
+                io_uring_prep_fsync(sqe, file.fd, 0);
+                break;
+            case uring_file::close_file:
+                io_uring_prep_close(sqe, file.fd);
+                break;
+            case uring_file::rename_file:
+                io_uring_prep_renameat(sqe, AT_FDCWD, file.path->c_str(), AT_FDCWD, file.target->c_str(), 0);
+                break;
+            case uring_file::done:
+                break;
+        }
+        io_uring_sqe_set_data(sqe, &file);
+    }
+
+    inline void xzarr_io_engine::advance(uring_file& file, int res)
+    {
+        if (res == -EINTR || res == -EAGAIN)
+        {
+            // resubmitted as is
+            return;
+        }
+        switch (file.stage)
+        {
+            case uring_file::open_file:
+                if (res < 0)
+                {
+                    if (!file.writing && (res == -ENOENT || res == -ENOTDIR))
+                    {
+                        file.found = false;
+                    }
+                    else
+                    {
+                        file.error = -res;
+                    }
+                    file.stage = uring_file::done;
+                }
+                else
+                {
+                    file.fd = res;
+                    file.stage = file.writing ? (file.size == 0 ? (file.sync ? uring_file::sync_file : uring_file::close_file) : uring_file::transfer)
+                                              : uring_file::stat_file;
+                }
+                break;
+            case uring_file::stat_file:
+                if (res < 0)
+                {
+                    file.error = -res;
+                    file.stage = uring_file::close_file;
+                }
+                else
+                {
+                    file.size = std::size_t(file.stx.stx_size);
+                    file.buffer->resize(file.size);
+                    file.stage = (file.size == 0) ? uring_file::close_file : uring_file::transfer;
+                }
+                break;
+            case uring_file::transfer:
+                if (res <= 0)
+                {
+                    // a file cannot shrink under a reader with atomic writes, a short read is an error
+                    file.error = (res < 0) ? -res : EIO;
+                    file.stage = uring_file::close_file;
+                }
+                else
+                {
+                    file.offset += std::size_t(res);
+                    if (file.offset == file.size)
+                    {
+                        file.stage = file.sync ? uring_file::sync_file : uring_file::close_file;
+                    }
+                }
+                break;
+            case uring_file::sync_file:
+                if (res < 0)
+                {
+                    file.error = -res;
+                }
+                file.stage = uring_file::close_file;
+                break;
+            case uring_file::close_file:
+                if (res < 0 && file.error == 0)
+                {
+                    file.error = -res;
+                }
+                file.fd = -1;
+                file.stage = (file.target != nullptr && file.error == 0) ? uring_file::rename_file : uring_file::done;
+                break;
+            case uring_file::rename_file:
+                if (res < 0)
+                {
+                    file.error = -res;
+                }
+                file.stage = uring_file::done;
+                break;
+            case uring_file::done:
+                break;
+        }
+    }
+
+    /**
+     * Waits for the completion of the submitted operations after a failure, since
+     * they refer to the files and buffers of the batch, and closes the files they
+     * opened. Prepared operations that were not submitted are dropped with the ring,
+     * which is set up again by the next batch.
+     */
+    inline void xzarr_io_engine::drain(std::vector<uring_file>& files)
+    {
+        while (m_in_flight != 0)
+        {
+            struct io_uring_cqe* cqe = nullptr;
+            int res = io_uring_wait_cqe(&m_ring, &cqe);
+            if (res == -EINTR)
+            {
+                continue;
+            }
+            if (res < 0)
+            {
+                // the ring is unusable, nothing more can be waited for
+                break;
+            }
+            uring_file& file = *static_cast<uring_file*>(io_uring_cqe_get_data(cqe));
+            if (file.stage == uring_file::open_file && cqe->res >= 0)
+            {
+                file.fd = cqe->res;
+            }
+            else if (file.stage == uring_file::close_file)
+            {
+                file.fd = -1;
+            }
+            io_uring_cqe_seen(&m_ring, cqe);
+            --m_in_flight;
+        }
+        for (auto& file: files)
+        {
+            if (file.fd >= 0)
+            {
+                ::close(file.fd);
+                file.fd = -1;
+            }
+            if (file.target != nullptr && file.stage != uring_file::done)
+            {
+                ::unlink(file.path->c_str());
+            }
+        }
+        exit_ring();
+    }
+
+    // each file in flight has exactly one operation in the ring
+    inline void xzarr_io_engine::run(std::vector<uring_file>& files)
+    {
+        m_queued = 0;
+        m_in_flight = 0;
+        std::size_t next = 0;
+        std::size_t active = 0;
+        try
+        {
+            while (next < files.size() || active != 0)
+            {
+                while (next < files.size() && active < m_queue_depth)
+                {
+                    prepare(files[next++]);
+                    ++active;
+                }
+                int res = 0;
+                submit(1, res);
+                if (res < 0 && res != -EINTR)
+                {
+                    XTENSOR_THROW(std::runtime_error, std::string("io_uring submission failed: ") + std::strerror(-res));
+                }
+                struct io_uring_cqe* cqe = nullptr;
+                while (io_uring_peek_cqe(&m_ring, &cqe) == 0)
+                {
+                    uring_file& file = *static_cast<uring_file*>(io_uring_cqe_get_data(cqe));
+                    int cqe_res = cqe->res;
+                    io_uring_cqe_seen(&m_ring, cqe);
+                    --m_in_flight;
+                    advance(file, cqe_res);
+                    if (file.stage == uring_file::done)
+                    {
+                        --active;
+                    }
+                    else
+                    {
+                        prepare(file);
+                    }
+                }
+            }
+        }
+        catch (...)
+        {
+            drain(files);
+            throw;
+        }
+    }
+#endif
+}
+
+#endif
@@ -0,0 +1,196 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_LZ4_HPP
+#define XTENSOR_ZARR_LZ4_HPP
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include <lz4.h>
+#include <lz4hc.h>
+
+#include "xtensor-io/xio_binary.hpp"
+#include "xzarr_common.hpp"
+
+namespace xt
+{
+    /**
+     * @class xzarr_lz4_config
+     * @brief LZ4 compressor configuration.
+     *
+     * Chunks are stored as in the numcodecs ``lz4`` codec: a little-endian
+     * 32-bit uncompressed size followed by an LZ4 block. A positive ``level``
+     * selects the LZ4 HC encoder, whose output is decoded by any LZ4 reader;
+     * it is therefore not part of the metadata. An optional dictionary can be
+     * provided, in which case it is stored (base64 encoded) in the metadata.
+     */
+    struct xzarr_lz4_config
+    {
+        std::string name;
+        std::string version;
+        bool big_endian;
+        int acceleration;
+        int level;
+        std::string dictionary;
+
+        xzarr_lz4_config()
+            : name("lz4")
+            , version(LZ4_versionString())
+            , big_endian(false)
+            , acceleration(1)
+            , level(0)
+        {
+        }
+
+        template <class T>
+        void write_to(T& j) const
+        {
+            j["acceleration"] = acceleration;
+            if (!dictionary.empty())
+            {
+                j["dictionary"] = base64_encode(dictionary);
+            }
+        }
+
+        template <class T>
+        void read_from(T& j)
+        {
+            if (j.contains("acceleration"))
+            {
+                acceleration = j["acceleration"];
+            }
+            if (j.contains("dictionary"))
+            {
+                dictionary = base64_decode(j["dictionary"].template get<std::string>());
+            }
+        }
+
+        bool will_dump(xfile_dirty& dirty)
+        {
+            return dirty.data_dirty;
+        }
+    };
+
+    namespace detail
+    {
+        // LZ4 only uses the last 64 KB of a dictionary
+        inline std::string lz4_dictionary_tail(const std::string& dictionary)
+        {
+            const std::size_t max_size = 64 * 1024;
+            if (dictionary.size() > max_size)
+            {
+                return dictionary.substr(dictionary.size() - max_size);
+            }
+            return dictionary;
+        }
+
+        inline std::string lz4_compress(const std::string& raw, const xzarr_lz4_config& config)
+        {
+            if (raw.size() > static_cast<std::size_t>(LZ4_MAX_INPUT_SIZE))
+            {
+                XTENSOR_THROW(std::runtime_error, "lz4 compression failed: chunk too large");
+            }
+            int src_size = static_cast<int>(raw.size());
+            int bound = LZ4_compressBound(src_size);
+            std::string compressed(static_cast<std::size_t>(bound) + 4, '\0');
+            std::uint32_t n = static_cast<std::uint32_t>(raw.size());
+            for (std::size_t i = 0; i < 4; ++i)
+            {
+                compressed[i] = static_cast<char>((n >> (8 * i)) & 0xFF);
+            }
+            char* dst = &compressed[4];
+            int size;
+            std::string dict = lz4_dictionary_tail(config.dictionary);
+            if (config.level > 0)
+            {
+                // the HC state is too large for the stack
+                std::unique_ptr<LZ4_streamHC_t, int (*)(LZ4_streamHC_t*)> stream(LZ4_createStreamHC(), &LZ4_freeStreamHC);
+                LZ4_resetStreamHC_fast(stream.get(), config.level);
+                if (!dict.empty())
+                {
+                    LZ4_loadDictHC(stream.get(), dict.data(), static_cast<int>(dict.size()));
+                }
+                size = LZ4_compress_HC_continue(stream.get(), raw.data(), dst, src_size, bound);
+            }
+            else
+            {
+                LZ4_stream_t stream;
+                LZ4_initStream(&stream, sizeof(stream));
+                if (!dict.empty())
+                {
+                    LZ4_loadDict(&stream, dict.data(), static_cast<int>(dict.size()));
+                }
+                size = LZ4_compress_fast_continue(&stream, raw.data(), dst, src_size, bound, config.acceleration);
+            }
+            if (size <= 0)
+            {
+                XTENSOR_THROW(std::runtime_error, "lz4 compression failed");
+            }
+            compressed.resize(static_cast<std::size_t>(size) + 4);
+            return compressed;
+        }
+
+        inline std::string lz4_decompress(const std::string& compressed, const xzarr_lz4_config& config)
+        {
+            if (compressed.size() < 4)
+            {
+                XTENSOR_THROW(std::runtime_error, "lz4 decompression failed: missing size header");
+            }
+            std::uint32_t n = 0;
+            for (std::size_t i = 0; i < 4; ++i)
+            {
+                n |= static_cast<std::uint32_t>(static_cast<unsigned char>(compressed[i])) << (8 * i);
+            }
+            if (n > static_cast<std::uint32_t>(std::numeric_limits<int>::max()))
+            {
+                XTENSOR_THROW(std::runtime_error, "lz4 decompression failed: invalid size header");
+            }
+            std::string raw(n, '\0');
+            if (n == 0)
+            {
+                return raw;
+            }
+            std::string dict = lz4_dictionary_tail(config.dictionary);
+            int size = LZ4_decompress_safe_usingDict(compressed.data() + 4, &raw[0],
+                                                     static_cast<int>(compressed.size() - 4), static_cast<int>(n),
+                                                     dict.data(), static_cast<int>(dict.size()));
+            if (size < 0 || static_cast<std::uint32_t>(size) != n)
+            {
+                XTENSOR_THROW(std::runtime_error, "lz4 decompression failed: corrupted block");
+            }
+            return raw;
+        }
+    }
+
+    template <class E>
+    void load_file(std::istream& stream, xexpression<E>& e, const xzarr_lz4_config& config)
+    {
+        std::istringstream raw(detail::lz4_decompress(read_stream(stream), config));
+        xio_binary_config binary_config;
+        binary_config.big_endian = config.big_endian;
+        load_file(raw, e, binary_config);
+    }
+
+    template <class E>
+    void dump_file(std::ostream& stream, const xexpression<E>& e, const xzarr_lz4_config& config)
+    {
+        std::ostringstream raw;
+        xio_binary_config binary_config;
+        binary_config.big_endian = config.big_endian;
+        dump_file(raw, e, binary_config);
+        std::string compressed = detail::lz4_compress(raw.str(), config);
+        stream.write(compressed.data(), static_cast<std::streamsize>(compressed.size()));
+    }
+}
+
+#endif
@@ -0,0 +1,179 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_MAP_HPP
+#define XTENSOR_ZARR_MAP_HPP
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "xtensor/xadapt.hpp"
+#include "xtensor/xarray.hpp"
+#include "xzarr_chunk_codec.hpp"
+#include "xzarr_chunk_stats.hpp"
+#include "xzarr_common.hpp"
+#include "xzarr_metadata.hpp"
+#include "xzarr_threading.hpp"
+
+namespace xt
+{
+    template <class T, class R, class src_store_type, class dst_store_type, class F>
+    void map_zarr_chunks(src_store_type& src_store, const std::string& src_path, dst_store_type& dst_store, const std::string& dst_path,
+                         std::size_t zarr_version_major, F&& fn, std::size_t nthreads = 0);
+
+    template <class T, class R, class store_type, class F>
+    void map_zarr_chunks(store_type store, const std::string& src_path, const std::string& dst_path, std::size_t zarr_version_major, F&& fn, std::size_t nthreads = 0);
+
+    /*************************************
+     * zarr chunk mapping implementation *
+     *************************************/
+
+    namespace detail
+    {
+        inline layout_type chunk_layout(const xzarr_array_metadata& metadata)
+        {
+            return metadata.chunk_memory_layout == 'F' ? layout_type::column_major : layout_type::row_major;
+        }
+    }
+
+    /**
+     * Computes an array from another one, possibly in another store, chunk by chunk.
+     *
+     * Both arrays must exist, with the same shape and chunk shape. Each chunk of
+     * the source is read and decoded once by one of up to ``nthreads`` workers,
+     * which calls ``fn(in, out)``: ``in`` is a read-only view of the decoded chunk,
+     * and ``out`` a view of the corresponding chunk of the destination, initialized
+     * with its fill value. Both views are ``xarray_adaptor`` objects with the shape
+     * and memory layout of the chunks, over buffers owned by the worker. The chunk
+     * of the destination is then encoded once and written to its store.
+     *
+     * Chunks are read and written in batches of a few chunks per worker, with
+     * read_zarr_chunks and write_zarr_chunks, so that stores with batched I/O
+     * (e.g. xzarr_file_system_store) transfer them at once. The statistics of the
+     * written chunks make up the chunk statistics index of the destination (see
+     * build_zarr_chunk_stats), stored once all the chunks are written.
+     *
+     * No chunk pool is involved, so that workers never share a chunk. Chunks at
+     * the boundary of the arrays are passed whole; their elements beyond the array
+     * shape are ignored. Missing chunks of the source are passed filled with its
+     * fill value. Chunked arrays of the destination opened before the mapping must
+     * be opened again to see the written chunks.
+     *
+     * @tparam T the value type of the source, matching its data type
+     * @tparam R the value type of the destination, matching its data type
+     * @param src_store the source store
+     * @param src_path the path of the source array
+     * @param dst_store the destination store
+     * @param dst_path the path of the destination array
+     * @param zarr_version_major the major version of the Zarr specification
+     * @param fn the function computing a chunk of the destination from a chunk of the source
+     * @param nthreads the number of threads (0 means the thread budget)
+     */
+    template <class T, class R, class src_store_type, class dst_store_type, class F>
+    inline void map_zarr_chunks(src_store_type& src_store, const std::string& src_path, dst_store_type& dst_store, const std::string& dst_path,
+                                std::size_t zarr_version_major, F&& fn, std::size_t nthreads)
+    {
+        auto src = read_zarr_array_metadata(src_store, src_path, zarr_version_major, false);
+        auto dst = read_zarr_array_metadata(dst_store, dst_path, zarr_version_major, false);
+        if (src.shape != dst.shape || src.chunk_shape != dst.chunk_shape)
+        {
+            XTENSOR_THROW(std::runtime_error, "Cannot map " + src_path + " to " + dst_path + ": arrays have different shapes or chunk shapes");
+        }
+        detail::check_value_type<T>(src);
+        detail::check_value_type<R>(dst);
+        const T src_fill = fill_value_as<T>(src.fill_value);
+        const R dst_fill = fill_value_as<R>(dst.fill_value);
+        const auto grid = src.grid_shape();
+        const std::size_t ndim = grid.size();
+        const std::size_t nchunks = src.chunk_count();
+        // all the chunks are written, and make up the index of a non-scalar destination
+        std::shared_ptr<detail::chunk_stats_sink> stats;
+        if (ndim != 0)
+        {
+            stats = std::make_shared<xzarr_chunk_stats_recorder<dst_store_type>>(dst_store, dst);
+            stats->begin_write();
+        }
+        else
+        {
+            detail::invalidate_chunk_stats(dst_store, dst);
+        }
+        const std::size_t batch = detail::chunk_batch_size(nthreads);
+        for (std::size_t begin = 0; begin < nchunks; begin += batch)
+        {
+            std::vector<std::vector<std::size_t>> indices(std::min(batch, nchunks - begin), std::vector<std::size_t>(ndim));
+            for (std::size_t i = 0; i < indices.size(); ++i)
+            {
+                std::size_t k = begin + i;
+                for (std::size_t d = ndim; d-- > 0;)
+                {
+                    indices[i][d] = k % grid[d];
+                    k /= grid[d];
+                }
+            }
+            std::vector<xarray<T>> in_chunks;
+            std::vector<bool> found;
+            read_zarr_chunks(src_store, src, indices, in_chunks, found, true, nthreads);
+            std::vector<std::string> out_bytes(indices.size());
+            std::vector<xzarr_chunk_stats> out_stats(indices.size());
+            xzarr_parallel_for(indices.size(), nthreads, [&](std::size_t i)
+            {
+                xarray<T>& in_chunk = in_chunks[i];
+                if (!found[i])
+                {
+                    in_chunk.fill(src_fill);
+                }
+                xarray<R> out_chunk(std::vector<std::size_t>{dst.chunk_size()}, dst_fill);
+                const auto& in_storage = in_chunk.storage();
+                const auto in = adapt<layout_type::dynamic>(in_storage, src.chunk_shape, detail::chunk_layout(src));
+                auto out = adapt<layout_type::dynamic>(out_chunk.storage(), dst.chunk_shape, detail::chunk_layout(dst));
+                fn(in, out);
+                out_bytes[i] = encode_zarr_chunk(dst, out_chunk);
+                if (stats)
+                {
+                    out_stats[i] = detail::chunk_stats(dst, indices[i], out_chunk.data());
+                }
+            });
+            detail::store_zarr_chunks(dst_store, dst, indices, out_bytes, nthreads);
+            if (stats)
+            {
+                for (std::size_t i = 0; i < indices.size(); ++i)
+                {
+                    stats->record(indices[i], out_stats[i]);
+                }
+            }
+        }
+        if (stats)
+        {
+            stats->flush();
+        }
+    }
+
+    /**
+     * Computes an array from another one of the same store, chunk by chunk.
+     *
+     * @tparam T the value type of the source, matching its data type
+     * @tparam R the value type of the destination, matching its data type
+     * @param store the store
+     * @param src_path the path of the source array
+     * @param dst_path the path of the destination array
+     * @param zarr_version_major the major version of the Zarr specification
+     * @param fn the function computing a chunk of the destination from a chunk of the source
+     * @param nthreads the number of threads (0 means the thread budget)
+     */
+    template <class T, class R, class store_type, class F>
+    inline void map_zarr_chunks(store_type store, const std::string& src_path, const std::string& dst_path, std::size_t zarr_version_major, F&& fn, std::size_t nthreads)
+    {
+        map_zarr_chunks<T, R>(store, src_path, store, dst_path, zarr_version_major, std::forward<F>(fn), nthreads);
+    }
+}
+
+#endif
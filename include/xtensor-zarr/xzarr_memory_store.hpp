@@ -0,0 +1,484 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_MEMORY_STORE_HPP
+#define XTENSOR_ZARR_MEMORY_STORE_HPP
+
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#include "xzarr_common.hpp"
+#include "xzarr_store_handler.hpp"
+
+namespace xt
+{
+    /**
+     * @class xzarr_memory_arena
+     * @brief Storage of the values of a memory store.
+     *
+     * Small values are packed in blocks of fixed size, which are released when
+     * all their values have been erased or overwritten; large values get a
+     * block of their own. The arena is not thread-safe.
+     */
+    class xzarr_memory_arena
+    {
+    public:
+
+        struct slot
+        {
+            char* data;
+            std::size_t size;
+            std::size_t block;
+        };
+
+        explicit xzarr_memory_arena(std::size_t block_size = std::size_t(1) << 20);
+
+        slot allocate(const char* data, std::size_t size);
+        void release(const slot& s);
+
+        std::size_t reserved_bytes() const;
+
+    private:
+
+        struct block
+        {
+            std::unique_ptr<char[]> data;
+            std::size_t capacity;
+            std::size_t used;
+            std::size_t live;
+        };
+
+        std::size_t new_block(std::size_t capacity);
+
+        std::size_t m_block_size;
+        std::vector<block> m_blocks;
+        std::vector<std::size_t> m_free_blocks;
+        std::size_t m_current;
+        std::size_t m_reserved;
+    };
+
+    class xzarr_memory_stream;
+
+    /**
+     * @class xzarr_memory_store
+     * @brief Zarr store handler for an in-memory store.
+     *
+     * The xzarr_memory_store class implements a thread-safe Zarr store kept in
+     * memory, for scratch arrays, caches and tests. Copies of a store share its
+     * content, which lives as long as one of them.
+     *
+     * @sa xzarr_hierarchy
+     */
+    class xzarr_memory_store
+    {
+    public:
+
+        template <class C>
+        using io_handler = xzarr_store_handler<xzarr_memory_store, C>;
+
+        explicit xzarr_memory_store(std::size_t block_size = std::size_t(1) << 20);
+
+        xzarr_memory_stream operator[](const std::string& key);
+        void list_dir(const std::string& prefix, std::vector<std::string>& keys, std::vector<std::string>& prefixes);
+        std::vector<std::string> list();
+        std::vector<std::string> list_prefix(const std::string& prefix);
+        void erase(const std::string& key);
+        void erase_prefix(const std::string& prefix);
+        void set(const std::string& key, const std::vector<char>& value);
+        void set(const std::string& key, const std::string& value);
+        std::string get(const std::string& key);
+        bool exists(const std::string& key);
+
+        std::size_t size();
+        std::size_t nbytes();
+
+        xzarr_memory_store get_io_config();
+        std::string get_root();
+
+    private:
+
+        struct state
+        {
+            explicit state(std::size_t block_size);
+
+            std::shared_timed_mutex mutex;
+            std::map<std::string, xzarr_memory_arena::slot> values;
+            xzarr_memory_arena arena;
+            std::size_t nbytes;
+        };
+
+        void assign(const std::string& key, const char* value, std::size_t size);
+
+        std::shared_ptr<state> p_state;
+
+        friend class xzarr_memory_stream;
+    };
+
+    class xzarr_memory_stream
+    {
+    public:
+
+        xzarr_memory_stream(const xzarr_memory_store& store, const std::string& key);
+        operator std::string() const;
+        bool read(std::string& bytes) const;
+        void operator=(const std::vector<char>& value);
+        void operator=(const std::string& value);
+        void erase();
+        bool exists();
+
+    private:
+
+        xzarr_memory_store m_store;
+        std::string m_key;
+    };
+
+    /*************************************
+     * xzarr_memory_arena implementation *
+     *************************************/
+
+    inline xzarr_memory_arena::xzarr_memory_arena(std::size_t block_size)
+        : m_block_size(block_size)
+        , m_current(std::size_t(-1))
+        , m_reserved(0)
+    {
+    }
+
+    inline std::size_t xzarr_memory_arena::new_block(std::size_t capacity)
+    {
+        block b;
+        b.data.reset(new char[capacity]);
+        b.capacity = capacity;
+        b.used = 0;
+        b.live = 0;
+        m_reserved += capacity;
+        if (m_free_blocks.empty())
+        {
+            m_blocks.push_back(std::move(b));
+            return m_blocks.size() - 1;
+        }
+        std::size_t i = m_free_blocks.back();
+        m_free_blocks.pop_back();
+        m_blocks[i] = std::move(b);
+        return i;
+    }
+
+    inline auto xzarr_memory_arena::allocate(const char* data, std::size_t size) -> slot
+    {
+        std::size_t i;
+        if (size > m_block_size / 4)
+        {
+            i = new_block(size == 0 ? 1 : size);
+        }
+        else
+        {
+            if (m_current == std::size_t(-1) || m_blocks[m_current].capacity - m_blocks[m_current].used < size)
+            {
+                std::size_t previous = m_current;
+                m_current = new_block(m_block_size);
+                // the previous block is kept until its last value is released
+                if (previous != std::size_t(-1) && m_blocks[previous].live == 0)
+                {
+                    release(slot{nullptr, 0, previous});
+                }
+            }
+            i = m_current;
+        }
+        block& b = m_blocks[i];
+        char* p = b.data.get() + b.used;
+        std::memcpy(p, data, size);
+        b.used += size;
+        ++b.live;
+        return slot{p, size, i};
+    }
+
+    inline void xzarr_memory_arena::release(const slot& s)
+    {
+        block& b = m_blocks[s.block];
+        if (s.data != nullptr)
+        {
+            --b.live;
+        }
+        if (b.live == 0)
+        {
+            if (s.block == m_current)
+            {
+                // reuse the current block from its start
+                b.used = 0;
+            }
+            else
+            {
+                m_reserved -= b.capacity;
+                b.data.reset();
+                b.capacity = 0;
+                b.used = 0;
+                m_free_blocks.push_back(s.block);
+            }
+        }
+    }
+
+    /**
+     * Returns the number of bytes reserved by the arena.
+     */
+    inline std::size_t xzarr_memory_arena::reserved_bytes() const
+    {
+        return m_reserved;
+    }
+
+    /**************************************
+     * xzarr_memory_stream implementation *
+     **************************************/
+
+    inline xzarr_memory_stream::xzarr_memory_stream(const xzarr_memory_store& store, const std::string& key)
+        : m_store(store)
+        , m_key(key)
+    {
+    }
+
+    inline xzarr_memory_stream::operator std::string() const
+    {
+        std::string bytes;
+        if (!read(bytes))
+        {
+            XTENSOR_THROW(std::runtime_error, "Key not found: " + m_key);
+        }
+        return bytes;
+    }
+
+    inline bool xzarr_memory_stream::read(std::string& bytes) const
+    {
+        auto& s = *m_store.p_state;
+        std::shared_lock<std::shared_timed_mutex> lock(s.mutex);
+        auto it = s.values.find(m_key);
+        if (it == s.values.end())
+        {
+            return false;
+        }
+        bytes.assign(it->second.data, it->second.size);
+        return true;
+    }
+
+    inline void xzarr_memory_stream::operator=(const std::vector<char>& value)
+    {
+        m_store.assign(m_key, value.data(), value.size());
+    }
+
+    inline void xzarr_memory_stream::operator=(const std::string& value)
+    {
+        m_store.assign(m_key, value.data(), value.size());
+    }
+
+    inline void xzarr_memory_stream::erase()
+    {
+        m_store.erase(m_key);
+    }
+
+    inline bool xzarr_memory_stream::exists()
+    {
+        return m_store.exists(m_key);
+    }
+
+    /*************************************
+     * xzarr_memory_store implementation *
+     *************************************/
+
+    inline xzarr_memory_store::state::state(std::size_t block_size)
+        : arena(block_size)
+        , nbytes(0)
+    {
+    }
+
+    /**
+     * Builds an empty memory store.
+     * @param block_size the size of the blocks in which small values are packed
+     */
+    inline xzarr_memory_store::xzarr_memory_store(std::size_t block_size)
+        : p_state(std::make_shared<state>(block_size))
+    {
+    }
+
+    inline void xzarr_memory_store::assign(const std::string& key, const char* value, std::size_t size)
+    {
+        std::string k = normalize_key(key);
+        auto& s = *p_state;
+        std::unique_lock<std::shared_timed_mutex> lock(s.mutex);
+        auto it = s.values.find(k);
+        if (it != s.values.end())
+        {
+            s.nbytes -= it->second.size;
+            s.arena.release(it->second);
+            it->second = s.arena.allocate(value, size);
+        }
+        else
+        {
+            s.values.insert(std::make_pair(k, s.arena.allocate(value, size)));
+        }
+        s.nbytes += size;
+    }
+
+    inline xzarr_memory_stream xzarr_memory_store::operator[](const std::string& key)
+    {
+        return xzarr_memory_stream(*this, normalize_key(key));
+    }
+
+    /**
+     * Store a (key, value) pair.
+     * @param key the key
+     * @param value the value
+     */
+    inline void xzarr_memory_store::set(const std::string& key, const std::vector<char>& value)
+    {
+        assign(key, value.data(), value.size());
+    }
+
+    /**
+     * Store a (key, value) pair.
+     * @param key the key
+     * @param value the value
+     */
+    inline void xzarr_memory_store::set(const std::string& key, const std::string& value)
+    {
+        assign(key, value.data(), value.size());
+    }
+
+    /**
+     * Retrieve the value associated with a given key.
+     * @param key the key to get the value from
+     *
+     * @return returns the value for the given key.
+     */
+    inline std::string xzarr_memory_store::get(const std::string& key)
+    {
+        return (*this)[key];
+    }
+
+    /**
+     * Returns true if the given key is in the store.
+     * @param key the key
+     */
+    inline bool xzarr_memory_store::exists(const std::string& key)
+    {
+        auto& s = *p_state;
+        std::shared_lock<std::shared_timed_mutex> lock(s.mutex);
+        return s.values.find(normalize_key(key)) != s.values.end();
+    }
+
+    /**
+     * Retrieve all keys and prefixes with a given prefix and which do not contain the character “/” after the given prefix.
+     *
+     * @param prefix the prefix
+     * @param keys set of keys to be returned by reference
+     * @param prefixes set of prefixes to be returned by reference
+     */
+    inline void xzarr_memory_store::list_dir(const std::string& prefix, std::vector<std::string>& keys, std::vector<std::string>& prefixes)
+    {
+        auto& s = *p_state;
+        std::shared_lock<std::shared_timed_mutex> lock(s.mutex);
+        list_dir_sorted(s.values, prefix, keys, prefixes);
+    }
+
+    /**
+     * Retrieve all keys from the store.
+     *
+     * @return returns a set of keys.
+     */
+    inline std::vector<std::string> xzarr_memory_store::list()
+    {
+        return list_prefix("");
+    }
+
+    /**
+     * Retrieve all keys with a given prefix from the store.
+     *
+     * @param prefix the prefix
+     *
+     * @return returns a set of keys with a given prefix.
+     */
+    inline std::vector<std::string> xzarr_memory_store::list_prefix(const std::string& prefix)
+    {
+        auto& s = *p_state;
+        std::shared_lock<std::shared_timed_mutex> lock(s.mutex);
+        return list_prefix_sorted(s.values, prefix);
+    }
+
+    /**
+     * Erase the given (key, value) pair from the store.
+     * @param key the key
+     */
+    inline void xzarr_memory_store::erase(const std::string& key)
+    {
+        auto& s = *p_state;
+        std::unique_lock<std::shared_timed_mutex> lock(s.mutex);
+        auto it = s.values.find(normalize_key(key));
+        if (it != s.values.end())
+        {
+            s.nbytes -= it->second.size;
+            s.arena.release(it->second);
+            s.values.erase(it);
+        }
+    }
+
+    /**
+     * Erase all the keys with the given prefix from the store.
+     * @param prefix the prefix
+     */
+    inline void xzarr_memory_store::erase_prefix(const std::string& prefix)
+    {
+        std::string p = normalize_key(prefix);
+        if (!p.empty())
+        {
+            p.push_back('/');
+        }
+        auto& s = *p_state;
+        std::unique_lock<std::shared_timed_mutex> lock(s.mutex);
+        auto it = s.values.lower_bound(p);
+        while (it != s.values.end() && it->first.compare(0, p.size(), p) == 0)
+        {
+            s.nbytes -= it->second.size;
+            s.arena.release(it->second);
+            it = s.values.erase(it);
+        }
+    }
+
+    /**
+     * Returns the number of keys in the store.
+     */
+    inline std::size_t xzarr_memory_store::size()
+    {
+        auto& s = *p_state;
+        std::shared_lock<std::shared_timed_mutex> lock(s.mutex);
+        return s.values.size();
+    }
+
+    /**
+     * Returns the total size of the values in the store, in bytes.
+     */
+    inline std::size_t xzarr_memory_store::nbytes()
+    {
+        auto& s = *p_state;
+        std::shared_lock<std::shared_timed_mutex> lock(s.mutex);
+        return s.nbytes;
+    }
+
+    inline xzarr_memory_store xzarr_memory_store::get_io_config()
+    {
+        return *this;
+    }
+
+    inline std::string xzarr_memory_store::get_root()
+    {
+        return "";
+    }
+}
+
+#endif
@@ -0,0 +1,515 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_METADATA_HPP
+#define XTENSOR_ZARR_METADATA_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+#include "xzarr_attrs.hpp"
+#include "xzarr_common.hpp"
+
+namespace xt
+{
+    /**
+     * @class xzarr_array_metadata
+     * @brief Parsed metadata of a Zarr array.
+     *
+     * The xzarr_array_metadata class holds the metadata of an array independently
+     * of the Zarr version, and knows the store keys of its metadata document and
+     * of its chunks. It allows tools that work on the stored chunks (e.g. rechunking
+     * or copying) to bypass the chunked array machinery.
+     */
+    struct xzarr_array_metadata
+    {
+        std::string path;
+        std::size_t zarr_version;
+        std::vector<std::size_t> shape;
+        std::vector<std::size_t> chunk_shape;
+        std::string dtype;
+        char chunk_memory_layout;
+        char chunk_separator;
+        std::string compressor;
+        nlohmann::json compressor_config;
+        nlohmann::json fill_value;
+        nlohmann::json attrs;
+        /// checksum of the stored chunks (empty if they have none), see xzarr_checksum_type
+        std::string checksum;
+
+        xzarr_array_metadata();
+
+        static xzarr_array_metadata parse(const nlohmann::json& j, const std::string& path, std::size_t zarr_version);
+        nlohmann::json dump() const;
+
+        std::string metadata_key() const;
+        std::string data_prefix() const;
+        template <class I>
+        std::string chunk_key(const I& index) const;
+        bool parse_chunk_key(const std::string& key, std::vector<std::size_t>& index) const;
+
+        std::string dtype_noendian() const;
+        char endianness() const;
+        std::size_t itemsize() const;
+        std::vector<std::size_t> grid_shape() const;
+        std::size_t chunk_count() const;
+        std::size_t chunk_size() const;
+    };
+
+    template <class store_type>
+    xzarr_array_metadata read_zarr_array_metadata(store_type& store, const std::string& path, std::size_t zarr_version, bool read_attrs = true);
+
+    template <class store_type>
+    void write_zarr_array_metadata(store_type& store, const xzarr_array_metadata& metadata);
+
+    template <class store_type>
+    std::vector<std::vector<std::size_t>> list_zarr_chunks(store_type& store, const xzarr_array_metadata& metadata);
+
+    namespace detail
+    {
+        // extension of the Zarr v3 metadata declaring the checksum of the chunks
+        const char* const checksum_extension = "https://purl.org/zarr/spec/extensions/checksum/1.0";
+
+        // key of the chunk statistics index of an array, see build_zarr_chunk_stats
+        inline std::string chunk_stats_key(const xzarr_array_metadata& metadata)
+        {
+            return metadata.data_prefix() + "/.zstats";
+        }
+
+        // the index no longer describes the chunks once one of them is written or erased
+        template <class store_type>
+        inline void invalidate_chunk_stats(store_type& store, const xzarr_array_metadata& metadata)
+        {
+            store[chunk_stats_key(metadata)].erase();
+        }
+    }
+
+    /**
+     * Returns the size in bytes of an element of the given Zarr data type (e.g. "<f8").
+     */
+    inline std::size_t dtype_itemsize(const std::string& dtype)
+    {
+        if (dtype == "bool" || dtype == "|b1")
+        {
+            return 1;
+        }
+        std::size_t i = dtype.find_first_of("0123456789");
+        if (i == std::string::npos)
+        {
+            XTENSOR_THROW(std::runtime_error, "Unknown data type: " + dtype);
+        }
+        return static_cast<std::size_t>(std::stoi(dtype.substr(i)));
+    }
+
+    /**
+     * Converts the JSON fill value of an array to its data type.
+     * A null fill value maps to zero.
+     */
+    template <class T>
+    inline T fill_value_as(const nlohmann::json& fill_value)
+    {
+        if (fill_value.is_null())
+        {
+            return T(0);
+        }
+        if (fill_value.is_string())
+        {
+            std::string s = fill_value;
+            if (s == "NaN")
+            {
+                return static_cast<T>(std::numeric_limits<double>::quiet_NaN());
+            }
+            if (s == "Infinity")
+            {
+                return static_cast<T>(std::numeric_limits<double>::infinity());
+            }
+            if (s == "-Infinity")
+            {
+                return static_cast<T>(-std::numeric_limits<double>::infinity());
+            }
+            XTENSOR_THROW(std::runtime_error, "Unsupported fill value: " + s);
+        }
+        if (fill_value.is_boolean())
+        {
+            return static_cast<T>(fill_value.get<bool>());
+        }
+        if (fill_value.is_number_float())
+        {
+            return static_cast<T>(fill_value.get<double>());
+        }
+        if (fill_value.is_number_unsigned())
+        {
+            return static_cast<T>(fill_value.get<std::uint64_t>());
+        }
+        return static_cast<T>(fill_value.get<std::int64_t>());
+    }
+
+    /***************************************
+     * xzarr_array_metadata implementation *
+     ***************************************/
+
+    inline xzarr_array_metadata::xzarr_array_metadata()
+        : zarr_version(3)
+        , chunk_memory_layout('C')
+        , chunk_separator('/')
+        , compressor("binary")
+        , compressor_config(nlohmann::json::object())
+        , fill_value(nlohmann::json())
+        , attrs(nlohmann::json::object())
+    {
+    }
+
+    /**
+     * Parses the metadata document of an array.
+     * @param j the metadata document (``.zarray`` for Zarr v2, ``.array.json`` for Zarr v3)
+     * @param path the path of the array in the hierarchy
+     * @param zarr_version the major version of the Zarr specification
+     *
+     * @return returns the parsed metadata. The attributes of Zarr v2 arrays are not part
+     * of the document and are left empty.
+     */
+    inline xzarr_array_metadata xzarr_array_metadata::parse(const nlohmann::json& j, const std::string& path, std::size_t zarr_version)
+    {
+        xzarr_array_metadata m;
+        m.path = path;
+        m.zarr_version = zarr_version;
+        nlohmann::json json_chunk_shape;
+        std::string chunk_memory_layout;
+        switch (zarr_version)
+        {
+            case 3:
+                json_chunk_shape = j["chunk_grid"]["chunk_shape"];
+                m.dtype = j["data_type"];
+                chunk_memory_layout = j["chunk_memory_layout"];
+                if (j.contains("compressor"))
+                {
+                    std::string compressor = j["compressor"]["codec"];
+                    std::size_t i;
+                    i = compressor.rfind('/');
+                    compressor = compressor.substr(0, i);
+                    i = compressor.rfind('/') + 1;
+                    m.compressor = compressor.substr(i, std::string::npos);
+                    m.compressor_config = j["compressor"]["configuration"];
+                }
+                m.chunk_separator = j["chunk_grid"]["separator"].get<std::string>()[0];
+                m.attrs = j["attributes"];
+                if (j.contains("extensions"))
+                {
+                    for (const auto& extension: j["extensions"])
+                    {
+                        if (extension.contains("extension") && extension["extension"] == detail::checksum_extension)
+                        {
+                            m.checksum = extension["configuration"]["type"];
+                        }
+                    }
+                }
+                break;
+            case 2:
+                json_chunk_shape = j["chunks"];
+                m.dtype = j["dtype"];
+                chunk_memory_layout = j["order"];
+                if (!j["compressor"].is_null())
+                {
+                    m.compressor = j["compressor"]["id"];
+                    m.compressor_config = j["compressor"];
+                    m.compressor_config.erase("id");
+                }
+                if (j.contains("dimension_separator"))
+                {
+                    m.chunk_separator = j["dimension_separator"].get<std::string>()[0];
+                }
+                else
+                {
+                    m.chunk_separator = '.';
+                }
+                if (j.contains("checksum"))
+                {
+                    m.checksum = j["checksum"];
+                }
+                break;
+            default:
+                XTENSOR_THROW(std::runtime_error, "Unsupported Zarr version: " + std::to_string(zarr_version));
+        }
+        m.chunk_memory_layout = chunk_memory_layout[0];
+        m.shape = j["shape"].get<std::vector<std::size_t>>();
+        m.chunk_shape = json_chunk_shape.get<std::vector<std::size_t>>();
+        m.fill_value = j["fill_value"];
+        return m;
+    }
+
+    /**
+     * Returns the metadata document of the array.
+     * For Zarr v2, the attributes are not part of the document.
+     */
+    inline nlohmann::json xzarr_array_metadata::dump() const
+    {
+        nlohmann::json j;
+        switch (zarr_version)
+        {
+            case 3:
+                j["chunk_grid"]["type"] = "regular";
+                j["chunk_grid"]["chunk_shape"] = chunk_shape;
+                j["chunk_grid"]["separator"] = std::string(1, chunk_separator);
+                j["data_type"] = dtype;
+                j["chunk_memory_layout"] = std::string(1, chunk_memory_layout);
+                if (compressor != "binary")
+                {
+                    j["compressor"]["codec"] = "https://purl.org/zarr/spec/codec/" + compressor + "/1.0";
+                    j["compressor"]["configuration"] = compressor_config;
+                }
+                j["attributes"] = attrs;
+                j["extensions"] = nlohmann::json::array();
+                if (!checksum.empty())
+                {
+                    // readers that cannot strip the digests must not read the chunks
+                    nlohmann::json extension;
+                    extension["extension"] = detail::checksum_extension;
+                    extension["must_understand"] = true;
+                    extension["configuration"]["type"] = checksum;
+                    j["extensions"].push_back(extension);
+                }
+                break;
+            case 2:
+                j["chunks"] = chunk_shape;
+                if (chunk_separator != '.')
+                {
+                    j["dimension_separator"] = std::string(1, chunk_separator);
+                }
+                j["dtype"] = dtype;
+                j["order"] = std::string(1, chunk_memory_layout);
+                if (compressor == "binary")
+                {
+                    j["compressor"] = nlohmann::json();
+                }
+                else
+                {
+                    j["compressor"] = compressor_config;
+                    j["compressor"]["id"] = compressor;
+                }
+                j["filters"] = nlohmann::json();
+                j["zarr_format"] = 2;
+                if (!checksum.empty())
+                {
+                    // the digests are in sidecar keys, which other readers ignore
+                    j["checksum"] = checksum;
+                }
+                break;
+            default:
+                break;
+        }
+        j["shape"] = shape;
+        j["fill_value"] = fill_value;
+        return j;
+    }
+
+    inline std::string xzarr_array_metadata::metadata_key() const
+    {
+        if (zarr_version == 3)
+        {
+            return "meta/root" + path + ".array.json";
+        }
+        return path + "/.zarray";
+    }
+
+    /**
+     * Returns the prefix of the store keys of the chunks.
+     */
+    inline std::string xzarr_array_metadata::data_prefix() const
+    {
+        if (zarr_version == 3)
+        {
+            return "data/root" + path;
+        }
+        return path;
+    }
+
+    /**
+     * Returns the store key of a chunk.
+     * @param index the index of the chunk in the chunk grid
+     */
+    template <class I>
+    inline std::string xzarr_array_metadata::chunk_key(const I& index) const
+    {
+        std::string key = data_prefix();
+        xzarr_index_path index_path;
+        index_path.set_directory(key);
+        index_path.set_separator(chunk_separator);
+        index_path.set_zarr_version(zarr_version);
+        index_path.index_to_path(index.cbegin(), index.cend(), key);
+        return key;
+    }
+
+    /**
+     * Parses the store key of a chunk.
+     * @param key the store key
+     * @param index the index of the chunk in the chunk grid, returned by reference
+     *
+     * @return returns false if the key is not the key of a chunk of the array.
+     */
+    inline bool xzarr_array_metadata::parse_chunk_key(const std::string& key, std::vector<std::size_t>& index) const
+    {
+        auto strip = [](const std::string& s)
+        {
+            std::size_t i = s.find_first_not_of('/');
+            return (i == std::string::npos) ? std::string() : s.substr(i);
+        };
+        std::string prefix = strip(data_prefix()) + '/';
+        std::string k = strip(key);
+        if (k.compare(0, prefix.size(), prefix) != 0)
+        {
+            return false;
+        }
+        std::string name = k.substr(prefix.size());
+        if (zarr_version == 3)
+        {
+            if (name.empty() || name[0] != 'c')
+            {
+                return false;
+            }
+            name = name.substr(1);
+        }
+        auto grid = grid_shape();
+        index.clear();
+        std::size_t pos = 0;
+        while (true)
+        {
+            std::size_t end = name.find(chunk_separator, pos);
+            std::string token = name.substr(pos, end - pos);
+            if (token.empty() || token.find_first_not_of("0123456789") != std::string::npos || index.size() == grid.size())
+            {
+                return false;
+            }
+            index.push_back(static_cast<std::size_t>(std::stoull(token)));
+            if (index.back() >= grid[index.size() - 1])
+            {
+                return false;
+            }
+            if (end == std::string::npos)
+            {
+                break;
+            }
+            pos = end + 1;
+        }
+        return index.size() == grid.size();
+    }
+
+    inline std::string xzarr_array_metadata::dtype_noendian() const
+    {
+        if ((dtype[0] == '<') || (dtype[0] == '>') || ((zarr_version == 2) && (dtype[0] == '|')))
+        {
+            return dtype.substr(1);
+        }
+        return dtype;
+    }
+
+    inline char xzarr_array_metadata::endianness() const
+    {
+        return dtype[0];
+    }
+
+    inline std::size_t xzarr_array_metadata::itemsize() const
+    {
+        return dtype_itemsize(dtype);
+    }
+
+    inline std::vector<std::size_t> xzarr_array_metadata::grid_shape() const
+    {
+        std::vector<std::size_t> grid(shape.size());
+        for (std::size_t d = 0; d < shape.size(); ++d)
+        {
+            grid[d] = (shape[d] + chunk_shape[d] - 1) / chunk_shape[d];
+        }
+        return grid;
+    }
+
+    inline std::size_t xzarr_array_metadata::chunk_count() const
+    {
+        auto grid = grid_shape();
+        std::size_t n = 1;
+        for (auto g: grid)
+        {
+            n *= g;
+        }
+        return n;
+    }
+
+    inline std::size_t xzarr_array_metadata::chunk_size() const
+    {
+        std::size_t n = 1;
+        for (auto c: chunk_shape)
+        {
+            n *= c;
+        }
+        return n;
+    }
+
+    /**
+     * Reads the metadata of an array from a store.
+     * The attributes of a Zarr v2 array live in a separate document, which is
+     * only read if read_attrs is true; they are part of the metadata document
+     * of a Zarr v3 array.
+     * @param store the store
+     * @param path the path of the array in the hierarchy
+     * @param zarr_version the major version of the Zarr specification
+     * @param read_attrs whether to read the attributes of a Zarr v2 array
+     */
+    template <class store_type>
+    inline xzarr_array_metadata read_zarr_array_metadata(store_type& store, const std::string& path, std::size_t zarr_version, bool read_attrs)
+    {
+        std::string key = (zarr_version == 3) ? "meta/root" + path + ".array.json" : path + "/.zarray";
+        std::string s = store[key];
+        auto m = xzarr_array_metadata::parse(nlohmann::json::parse(s), path, zarr_version);
+        if (zarr_version == 2 && read_attrs)
+        {
+            m.attrs = read_zarr_attrs(store, path, zarr_version);
+        }
+        return m;
+    }
+
+    /**
+     * Writes the metadata of an array to a store.
+     * The attributes of a Zarr v2 array are written to ``.zattrs`` if they are not empty.
+     */
+    template <class store_type>
+    inline void write_zarr_array_metadata(store_type& store, const xzarr_array_metadata& metadata)
+    {
+        store[metadata.metadata_key()] = metadata.dump().dump(4);
+        if ((metadata.zarr_version == 2) && !metadata.attrs.empty())
+        {
+            store[metadata.path + "/.zattrs"] = metadata.attrs.dump(4);
+        }
+    }
+
+    /**
+     * Returns the indices of the chunks of an array that are present in a store.
+     * The chunks are found by listing the chunk prefix of the array; errors of
+     * the store are not caught.
+     */
+    template <class store_type>
+    inline std::vector<std::vector<std::size_t>> list_zarr_chunks(store_type& store, const xzarr_array_metadata& metadata)
+    {
+        std::vector<std::vector<std::size_t>> chunks;
+        std::vector<std::size_t> index;
+        for (const auto& key: store.list_prefix(metadata.data_prefix()))
+        {
+            if (metadata.parse_chunk_key(key, index))
+            {
+                chunks.push_back(index);
+            }
+        }
+        std::sort(chunks.begin(), chunks.end());
+        return chunks;
+    }
+}
+
+#endif
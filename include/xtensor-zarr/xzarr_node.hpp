@@ -10,10 +10,18 @@
 #ifndef XTENSOR_ZARR_NODE_HPP
 #define XTENSOR_ZARR_NODE_HPP
 
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
 #include "nlohmann/json.hpp"
 #include "xzarr_array.hpp"
 #include "xzarr_group.hpp"
 #include "xzarr_common.hpp"
+#include "xzarr_threading.hpp"
 
 namespace xt
 {
@@ -31,6 +39,60 @@ namespace xt
         }
     }
 
+    namespace detail
+    {
+        inline const char* node_type_name(xzarr_node_type type)
+        {
+            switch (type)
+            {
+                case xzarr_node_type::array:
+                    return "array";
+                case xzarr_node_type::explicit_group:
+                    return "explicit_group";
+                default:
+                    return "implicit_group";
+            }
+        }
+
+        /**
+         * Lists the children of the group whose metadata keys are under full_path,
+         * classified from the listed keys alone: ".array.json" and ".group.json"
+         * keys are arrays and explicit groups, and the other prefixes are implicit
+         * groups.
+         */
+        template <class store_type>
+        inline std::map<std::string, xzarr_node_type> list_node_children(store_type& store, const std::string& full_path)
+        {
+            std::map<std::string, xzarr_node_type> children;
+            std::vector<std::string> keys;
+            std::vector<std::string> prefixes;
+            store.list_dir(full_path, keys, prefixes);
+            for (const auto& prefix: prefixes)
+            {
+                std::string name = prefix.substr(full_path.size());
+                // object stores list prefixes with their delimiter
+                while (!name.empty() && name.back() == '/')
+                {
+                    name.pop_back();
+                }
+                children.emplace(name, xzarr_node_type::implicit_group);
+            }
+            for (const auto& key: keys)
+            {
+                std::string name = key.substr(full_path.size());
+                if (endswith(name, ".array.json"))
+                {
+                    children[name.substr(0, name.size() - 11)] = xzarr_node_type::array;
+                }
+                else if (endswith(name, ".group.json"))
+                {
+                    children[name.substr(0, name.size() - 11)] = xzarr_node_type::explicit_group;
+                }
+            }
+            return children;
+        }
+    }
+
     template <class store_type>
     class xzarr_node
     {
@@ -42,10 +104,14 @@ namespace xt
         template <class shape_type, class O = xzarr_create_array_options<xio_binary_config>>
         zarray create_array(const std::string& name, shape_type shape, shape_type chunk_shape, const std::string& dtype, O o=O());
 
-        zarray get_array(std::size_t chunk_pool_size=1);
+        zarray get_array(std::size_t chunk_pool_size=1, std::size_t codec_threads=0, bool verify_checksums=true);
         xzarr_group<store_type> get_group();
         nlohmann::json get_children();
         nlohmann::json get_nodes();
+        template <class F>
+        void visit_nodes(F&& f);
+        template <class F>
+        void walk(F&& visitor, std::size_t nthreads = 0, bool read_metadata = true);
         xzarr_node<store_type> operator[](const std::string& name);
         bool is_group();
         bool is_array();
@@ -122,49 +188,31 @@ namespace xt
     zarray xzarr_node<store_type>::create_array(const std::string& name, shape_type shape, shape_type chunk_shape, const std::string& dtype, O o)
     {
         m_node_type = xzarr_node_type::array;
-        return create_zarr_array(m_store, m_path + '/' + name, shape, chunk_shape, dtype, o.chunk_memory_layout, o.chunk_separator, o.compressor, o.attrs, o.chunk_pool_size, o.fill_value, m_zarr_version_major);
+        return create_zarr_array(m_store, m_path + '/' + name, shape, chunk_shape, dtype, o.chunk_memory_layout, o.chunk_separator, o.compressor, o.attrs, o.chunk_pool_size, o.fill_value, m_zarr_version_major, o.codec_threads, o.checksum);
     }
 
     template <class store_type>
-    zarray xzarr_node<store_type>::get_array(std::size_t chunk_pool_size)
+    zarray xzarr_node<store_type>::get_array(std::size_t chunk_pool_size, std::size_t codec_threads, bool verify_checksums)
     {
         if (!is_array())
         {
             XTENSOR_THROW(std::runtime_error, "Node is not an array: " + m_path);
         }
-        return get_zarr_array(m_store, m_path, chunk_pool_size, m_zarr_version_major);
+        return get_zarr_array(m_store, m_path, chunk_pool_size, m_zarr_version_major, codec_threads, verify_checksums);
     }
 
     template <class store_type>
     nlohmann::json xzarr_node<store_type>::get_children()
     {
         nlohmann::json j;
-        std::vector<std::string> keys;
-        std::vector<std::string> prefixes;
         std::string full_path = "meta/root" + m_path;
         if (full_path.back() != '/')
         {
             full_path.push_back('/');
         }
-        m_store.list_dir(full_path, keys, prefixes);
-        for (const auto& prefix: prefixes)
+        for (const auto& child: detail::list_node_children(m_store, full_path))
         {
-            std::string name = prefix.substr(full_path.size());
-            j[name] = "implicit_group";
-        }
-        for (const auto& key: keys)
-        {
-            std::string name = key.substr(full_path.size());
-            // remove trailing ".array.json" or ".group.json"
-            name = name.substr(0, name.size() - 11);
-            if ((*this)[name].is_array())
-            {
-                j[name] = "array";
-            }
-            else
-            {
-                j[name] = "explicit_group";
-            }
+            j[child.first] = detail::node_type_name(child.second);
         }
         return j;
     }
@@ -173,40 +221,131 @@ namespace xt
     nlohmann::json xzarr_node<store_type>::get_nodes()
     {
         nlohmann::json j;
+        visit_nodes([&j](const std::string& name, xzarr_node_type type)
+        {
+            j[name] = detail::node_type_name(type);
+        });
+        return j;
+    }
+
+    /**
+     * Calls ``f(name, type)`` for each node under this node, with the name of
+     * the node relative to this node. The metadata keys are streamed from the
+     * store in lexicographic order (see visit_store_prefix), and only the nodes
+     * enclosing the current key are remembered, so that hierarchies of any size
+     * are visited in memory proportional to their depth.
+     * @param f the function to call
+     */
+    template <class store_type>
+    template <class F>
+    void xzarr_node<store_type>::visit_nodes(F&& f)
+    {
         std::string full_path = "meta/root" + m_path;
         if (full_path.back() != '/')
         {
             full_path.push_back('/');
         }
-        std::vector<std::string> keys = m_store.list_prefix(full_path);
-        for (auto key: keys)
+        // visited nodes whose descendants may still come, innermost last
+        std::vector<std::string> open;
+        visit_store_prefix(m_store, full_path, [&](const std::string& key)
         {
-            if (endswith(key, ".array.json"))
+            std::string relative_key = key.substr(full_path.size());
+            // the descendants of a node sort between "<node>/" and "<node>0"
+            while (!open.empty() && relative_key.compare(open.back() + char('/' + 1)) >= 0)
+            {
+                open.pop_back();
+            }
+            std::string name = relative_key;
+            bool is_node = endswith(name, ".array.json") || endswith(name, ".group.json");
+            if (is_node)
+            {
+                name.resize(name.size() - 11);
+            }
+            for (std::size_t i = name.find('/'); i != std::string::npos; i = name.find('/', i + 1))
+            {
+                std::string parent = name.substr(0, i);
+                if (std::find(open.begin(), open.end(), parent) == open.end())
+                {
+                    f(parent, xzarr_node_type::implicit_group);
+                    open.push_back(parent);
+                }
+            }
+            if (is_node)
             {
-                j[key.substr(full_path.size(), key.size() - 11 - full_path.size())] = "array";
+                f(name, endswith(relative_key, ".array.json") ? xzarr_node_type::array : xzarr_node_type::explicit_group);
+                open.push_back(name);
             }
-            else if (endswith(key, ".group.json"))
+        });
+    }
+
+    /**
+     * Walks the hierarchy under this node, one level at a time: the groups of
+     * a level are listed concurrently, and the metadata of their children are
+     * read concurrently. Nodes are classified from the listings, without
+     * probing the store for each of them.
+     *
+     * ``visitor(name, type, metadata)`` is called once for each node, with the
+     * name of the node relative to this node, and the content of its metadata
+     * document (null for implicit groups, or if read_metadata is false). It is
+     * called from several threads, but never concurrently, and the nodes of a
+     * level are visited before the nodes of the next level.
+     *
+     * @param visitor the function to call for each node
+     * @param nthreads the number of threads (0 means the thread budget)
+     * @param read_metadata whether to read the metadata documents of the nodes
+     */
+    template <class store_type>
+    template <class F>
+    void xzarr_node<store_type>::walk(F&& visitor, std::size_t nthreads, bool read_metadata)
+    {
+        using child_type = std::pair<std::string, xzarr_node_type>;
+        std::string root_path = "meta/root" + m_path;
+        if (root_path.back() != '/')
+        {
+            root_path.push_back('/');
+        }
+        std::mutex visitor_mutex;
+        // relative paths of the groups of the current level
+        std::vector<std::string> groups = {""};
+        while (!groups.empty())
+        {
+            std::vector<std::vector<child_type>> listings(groups.size());
+            xzarr_parallel_for(groups.size(), nthreads, [&](std::size_t i)
+            {
+                std::string full_path = groups[i].empty() ? root_path : root_path + groups[i] + '/';
+                for (const auto& child: detail::list_node_children(m_store, full_path))
+                {
+                    std::string name = groups[i].empty() ? child.first : groups[i] + '/' + child.first;
+                    listings[i].emplace_back(std::move(name), child.second);
+                }
+            });
+            std::vector<child_type> level;
+            for (auto& listing: listings)
             {
-                j[key.substr(full_path.size(), key.size() - 11 - full_path.size())] = "explicit_group";
+                std::move(listing.begin(), listing.end(), std::back_inserter(level));
             }
-            // now check for implicit groups
-            std::string name = key.substr(full_path.size(), key.size() - 11 - full_path.size());
-            while (true)
+            xzarr_parallel_for(level.size(), nthreads, [&](std::size_t i)
             {
-                std::size_t i = name.rfind('/');
-                if (i == std::string::npos)
+                nlohmann::json metadata;
+                const auto& child = level[i];
+                if (read_metadata && child.second != xzarr_node_type::implicit_group)
                 {
-                    break;
+                    const char* suffix = child.second == xzarr_node_type::array ? ".array.json" : ".group.json";
+                    std::string bytes = m_store[root_path + child.first + suffix];
+                    metadata = nlohmann::json::parse(bytes);
                 }
-                name = name.substr(0, i);
-                if (j.find(name) != j.end())
+                std::lock_guard<std::mutex> lock(visitor_mutex);
+                visitor(child.first, child.second, metadata);
+            });
+            groups.clear();
+            for (const auto& child: level)
+            {
+                if (child.second != xzarr_node_type::array)
                 {
-                    break;
+                    groups.push_back(child.first);
                 }
-                j[name] = "implicit_group";
             }
         }
-        return j;
     }
 
     template <class store_type>
@@ -0,0 +1,524 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_PARTITION_HPP
+#define XTENSOR_ZARR_PARTITION_HPP
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+#include "xzarr_chunk_stats.hpp"
+#include "xzarr_common.hpp"
+#include "xzarr_concurrent_writer.hpp"
+#include "xzarr_metadata.hpp"
+
+namespace xt
+{
+    /**
+     * @class xzarr_partition
+     * @brief Slab of the chunk grid of an array written by one worker.
+     *
+     * A partition is the block of chunks whose index along ``axis`` is in
+     * ``[first_chunk, last_chunk)``. Its bounds are chunk-aligned, so that
+     * workers never write to the same chunk.
+     */
+    struct xzarr_partition
+    {
+        std::size_t worker;
+        std::size_t nworkers;
+        std::size_t axis;
+        std::size_t first_chunk;
+        std::size_t last_chunk;
+        /// position of the first element of the partition in the array
+        std::vector<std::size_t> offset;
+        /// shape of the partition, clipped to the array shape
+        std::vector<std::size_t> shape;
+
+        nlohmann::json dump() const;
+    };
+
+    /**
+     * @class xzarr_partition_report
+     * @brief Outcome of finalize_partitions.
+     */
+    struct xzarr_partition_report
+    {
+        /// workers that did not commit their partition
+        std::vector<std::size_t> missing;
+        /// workers whose partition has chunks that are neither in the store nor marked as fill-only
+        std::vector<std::size_t> incomplete;
+
+        bool complete() const;
+    };
+
+    xzarr_partition make_partition(const xzarr_array_metadata& metadata, std::size_t worker, std::size_t nworkers, std::size_t axis = 0);
+
+    namespace detail
+    {
+        /**
+         * Statistics of the chunks written by a worker, kept in memory until
+         * they are committed with its marker.
+         */
+        class partition_chunk_stats : public chunk_stats_sink
+        {
+        public:
+
+            explicit partition_chunk_stats(const xzarr_array_metadata& metadata);
+
+            void begin_write() override;
+            void record(const std::vector<std::size_t>& index, const xzarr_chunk_stats& stats) override;
+            void record_path(const std::string& path, const xzarr_chunk_stats& stats) override;
+            void flush() override;
+
+            nlohmann::json dump();
+
+        private:
+
+            xzarr_array_metadata m_metadata;
+            std::mutex m_mutex;
+            std::map<std::vector<std::size_t>, xzarr_chunk_stats> m_chunks;
+        };
+    }
+
+    /**
+     * @class xzarr_partition_writer
+     * @brief Writer of the partition of an array owned by a worker process.
+     *
+     * The xzarr_partition_writer class lets the processes of a parallel job (e.g.
+     * the ranks of an MPI job or the tasks of a SLURM array) write disjoint slabs
+     * of an array created beforehand: each process only reads the metadata of the
+     * array, writes chunks of its own partition, then commits a marker with the
+     * chunks it deliberately left to the fill value (see mark_fill_chunk). The
+     * metadata document is never rewritten, so that the processes do not contend
+     * on it. finalize_partitions then checks that every worker committed its
+     * partition, and that every chunk of it is stored or marked as fill-only.
+     *
+     * Blocks are written through an xzarr_concurrent_writer, so that the threads
+     * of a worker may share its writer (or copies of it). The chunk statistics
+     * index of the array is left alone while the workers write: the statistics
+     * of the chunks of a worker are committed with its marker, and
+     * finalize_partitions stores them in the index.
+     *
+     * @tparam T the value type of the array, matching its data type
+     * @tparam store_type the type of the store
+     */
+    template <class T, class store_type>
+    class xzarr_partition_writer
+    {
+    public:
+
+        xzarr_partition_writer(store_type store, const std::string& path, std::size_t zarr_version_major,
+                               std::size_t worker, std::size_t nworkers, std::size_t axis = 0);
+
+        template <class E, class S>
+        void write(const xexpression<E>& data, const S& offset);
+
+        template <class S>
+        void mark_fill_chunk(const S& index);
+
+        void commit();
+
+        const xzarr_partition& partition() const;
+
+    private:
+
+        struct written_chunks
+        {
+            std::mutex mutex;
+            std::set<std::vector<std::size_t>> indices;
+            std::set<std::vector<std::size_t>> fill_indices;
+        };
+
+        store_type m_store;
+        xzarr_concurrent_writer<T, store_type> m_writer;
+        xzarr_partition m_partition;
+        std::shared_ptr<written_chunks> p_written;
+        std::shared_ptr<detail::partition_chunk_stats> p_stats;
+    };
+
+    template <class store_type>
+    xzarr_partition_report finalize_partitions(store_type store, const std::string& path, std::size_t zarr_version_major,
+                                               std::size_t nworkers, std::size_t axis = 0);
+
+    /**********************************
+     * xzarr_partition implementation *
+     **********************************/
+
+    namespace detail
+    {
+        inline std::string partition_marker_key(const xzarr_array_metadata& metadata, std::size_t worker)
+        {
+            return metadata.data_prefix() + "/.partitions/" + std::to_string(worker);
+        }
+
+        inline bool in_partition(const xzarr_partition& partition, const std::vector<std::size_t>& grid, const std::vector<std::size_t>& index)
+        {
+            bool inside = index.size() == grid.size();
+            for (std::size_t d = 0; inside && d < index.size(); ++d)
+            {
+                inside = index[d] < grid[d];
+            }
+            return inside && index[partition.axis] >= partition.first_chunk && index[partition.axis] < partition.last_chunk;
+        }
+    }
+
+    inline nlohmann::json xzarr_partition::dump() const
+    {
+        nlohmann::json j;
+        j["worker"] = worker;
+        j["nworkers"] = nworkers;
+        j["axis"] = axis;
+        j["first_chunk"] = first_chunk;
+        j["last_chunk"] = last_chunk;
+        return j;
+    }
+
+    inline bool xzarr_partition_report::complete() const
+    {
+        return missing.empty() && incomplete.empty();
+    }
+
+    /**
+     * Returns the partition of an array written by a worker.
+     * The chunks along ``axis`` are split into ``nworkers`` contiguous ranges,
+     * whose sizes differ by at most one chunk; workers beyond the number of
+     * chunks get an empty partition.
+     * @param metadata the metadata of the array
+     * @param worker the index of the worker, in ``[0, nworkers)``
+     * @param nworkers the number of workers
+     * @param axis the axis along which the array is split
+     */
+    inline xzarr_partition make_partition(const xzarr_array_metadata& metadata, std::size_t worker, std::size_t nworkers, std::size_t axis)
+    {
+        if (nworkers == 0 || worker >= nworkers || axis >= metadata.shape.size())
+        {
+            XTENSOR_THROW(std::runtime_error, "Invalid partition of array: " + metadata.path);
+        }
+        std::size_t nchunks = metadata.grid_shape()[axis];
+        std::size_t base = nchunks / nworkers;
+        std::size_t extra = nchunks % nworkers;
+        xzarr_partition p;
+        p.worker = worker;
+        p.nworkers = nworkers;
+        p.axis = axis;
+        p.first_chunk = worker * base + std::min(worker, extra);
+        p.last_chunk = p.first_chunk + base + (worker < extra ? 1 : 0);
+        p.offset.assign(metadata.shape.size(), 0);
+        p.shape = metadata.shape;
+        std::size_t chunk = metadata.chunk_shape[axis];
+        p.offset[axis] = std::min(p.first_chunk * chunk, metadata.shape[axis]);
+        p.shape[axis] = std::min(p.last_chunk * chunk, metadata.shape[axis]) - p.offset[axis];
+        return p;
+    }
+
+    /****************************************
+     * partition_chunk_stats implementation *
+     ****************************************/
+
+    namespace detail
+    {
+        inline partition_chunk_stats::partition_chunk_stats(const xzarr_array_metadata& metadata)
+            : m_metadata(metadata)
+        {
+        }
+
+        inline void partition_chunk_stats::begin_write()
+        {
+        }
+
+        inline void partition_chunk_stats::record(const std::vector<std::size_t>& index, const xzarr_chunk_stats& stats)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_chunks[index] = stats;
+        }
+
+        inline void partition_chunk_stats::record_path(const std::string& path, const xzarr_chunk_stats& stats)
+        {
+            std::vector<std::size_t> index;
+            if (m_metadata.parse_chunk_key(path, index))
+            {
+                record(index, stats);
+            }
+        }
+
+        inline void partition_chunk_stats::flush()
+        {
+        }
+
+        // the statistics of the chunks, in the columns of the index
+        inline nlohmann::json partition_chunk_stats::dump()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            nlohmann::json j;
+            j["indices"] = nlohmann::json::array();
+            j["min"] = nlohmann::json::array();
+            j["max"] = nlohmann::json::array();
+            j["count"] = nlohmann::json::array();
+            j["nan_count"] = nlohmann::json::array();
+            for (const auto& chunk: m_chunks)
+            {
+                j["indices"].push_back(chunk.first);
+                j["min"].push_back(stats_bound_json(chunk.second.min));
+                j["max"].push_back(stats_bound_json(chunk.second.max));
+                j["count"].push_back(chunk.second.count);
+                j["nan_count"].push_back(chunk.second.nan_count);
+            }
+            return j;
+        }
+
+        // reads the statistics committed by a worker, for the chunks of its partition
+        inline void read_partition_chunk_stats(const nlohmann::json& j, const xzarr_partition& partition, const std::vector<std::size_t>& grid,
+                                               std::map<std::vector<std::size_t>, xzarr_chunk_stats>& chunks)
+        {
+            const auto& indices = j["indices"];
+            const auto& min = j["min"];
+            const auto& max = j["max"];
+            const auto& count = j["count"];
+            const auto& nan_count = j["nan_count"];
+            if (min.size() != indices.size() || max.size() != indices.size() || count.size() != indices.size() || nan_count.size() != indices.size())
+            {
+                XTENSOR_THROW(std::runtime_error, "Invalid chunk statistics of worker " + std::to_string(partition.worker) + ": lists of different sizes");
+            }
+            for (std::size_t i = 0; i < indices.size(); ++i)
+            {
+                auto index = indices[i].get<std::vector<std::size_t>>();
+                if (in_partition(partition, grid, index))
+                {
+                    auto& stats = chunks[index];
+                    stats.min = stats_bound(min[i], -std::numeric_limits<double>::infinity());
+                    stats.max = stats_bound(max[i], std::numeric_limits<double>::infinity());
+                    stats.count = count[i].get<std::size_t>();
+                    stats.nan_count = nan_count[i].get<std::size_t>();
+                }
+            }
+        }
+    }
+
+    /*****************************************
+     * xzarr_partition_writer implementation *
+     *****************************************/
+
+    /**
+     * Opens the partition of an array owned by a worker.
+     * @param store the store
+     * @param path the path of the array
+     * @param zarr_version_major the major version of the Zarr specification
+     * @param worker the index of the worker, in ``[0, nworkers)``
+     * @param nworkers the number of workers
+     * @param axis the axis along which the array is split
+     */
+    template <class T, class store_type>
+    inline xzarr_partition_writer<T, store_type>::xzarr_partition_writer(store_type store, const std::string& path, std::size_t zarr_version_major,
+                                                                         std::size_t worker, std::size_t nworkers, std::size_t axis)
+        : m_store(store)
+        , m_writer(store, path, zarr_version_major)
+        , m_partition(make_partition(m_writer.metadata(), worker, nworkers, axis))
+        , p_written(std::make_shared<written_chunks>())
+        , p_stats(std::make_shared<detail::partition_chunk_stats>(m_writer.metadata()))
+    {
+        // the statistics are committed with the marker rather than merged into the index
+        m_writer.p_stats = p_stats;
+    }
+
+    /**
+     * Writes a block of the partition.
+     * @param data the block
+     * @param offset the position of the first element of the block in the array
+     */
+    template <class T, class store_type>
+    template <class E, class S>
+    inline void xzarr_partition_writer<T, store_type>::write(const xexpression<E>& data, const S& offset)
+    {
+        const auto& shape = data.derived_cast().shape();
+        const auto& m = m_writer.metadata();
+        std::vector<std::size_t> lo(offset.begin(), offset.end());
+        std::vector<std::size_t> hi(shape.begin(), shape.end());
+        if (lo.size() != m.shape.size() || hi.size() != m.shape.size())
+        {
+            XTENSOR_THROW(std::runtime_error, "Cannot write: block does not match the array dimension");
+        }
+        std::size_t axis = m_partition.axis;
+        for (std::size_t d = 0; d < hi.size(); ++d)
+        {
+            if (hi[d] == 0)
+            {
+                return;
+            }
+            hi[d] += lo[d];
+        }
+        if (lo[axis] < m_partition.offset[axis] || hi[axis] > m_partition.offset[axis] + m_partition.shape[axis])
+        {
+            XTENSOR_THROW(std::runtime_error, "Cannot write: block exceeds the partition of worker " + std::to_string(m_partition.worker));
+        }
+        m_writer.write(data, lo);
+        std::vector<std::size_t> first(lo.size());
+        std::vector<std::size_t> last(lo.size());
+        for (std::size_t d = 0; d < lo.size(); ++d)
+        {
+            first[d] = lo[d] / m.chunk_shape[d];
+            last[d] = (hi[d] - 1) / m.chunk_shape[d];
+        }
+        std::lock_guard<std::mutex> lock(p_written->mutex);
+        detail::for_each_chunk_index(first, last, [this](const std::vector<std::size_t>& index)
+        {
+            p_written->indices.insert(index);
+        });
+    }
+
+    /**
+     * Records that a chunk of the partition is deliberately not written, and
+     * keeps the fill value of the array.
+     * @param index the index of the chunk in the chunk grid
+     */
+    template <class T, class store_type>
+    template <class S>
+    inline void xzarr_partition_writer<T, store_type>::mark_fill_chunk(const S& index)
+    {
+        std::vector<std::size_t> i(index.begin(), index.end());
+        if (!detail::in_partition(m_partition, m_writer.metadata().grid_shape(), i))
+        {
+            XTENSOR_THROW(std::runtime_error, "Cannot mark chunk: not in the partition of worker " + std::to_string(m_partition.worker));
+        }
+        std::lock_guard<std::mutex> lock(p_written->mutex);
+        p_written->fill_indices.insert(i);
+    }
+
+    /**
+     * Commits the partition, once all its blocks are written.
+     * The marker of the worker records the number of chunks it wrote, the
+     * statistics of these chunks, and the chunks marked as fill-only.
+     */
+    template <class T, class store_type>
+    inline void xzarr_partition_writer<T, store_type>::commit()
+    {
+        std::lock_guard<std::mutex> lock(p_written->mutex);
+        nlohmann::json j = m_partition.dump();
+        j["chunks"] = p_written->indices.size();
+        j["fill_chunks"] = nlohmann::json::array();
+        for (const auto& index: p_written->fill_indices)
+        {
+            j["fill_chunks"].push_back(index);
+        }
+        j["chunk_stats"] = p_stats->dump();
+        m_store[detail::partition_marker_key(m_writer.metadata(), m_partition.worker)] = j.dump();
+    }
+
+    template <class T, class store_type>
+    inline const xzarr_partition& xzarr_partition_writer<T, store_type>::partition() const
+    {
+        return m_partition;
+    }
+
+    /**
+     * Checks that all the workers of a partitioned write committed their
+     * partition, and that every chunk of a committed partition (its range
+     * along ``axis`` times the full chunk grid along the other axes) is in
+     * the store or was marked as fill-only by its worker. The counts reported
+     * by the workers are not trusted.
+     *
+     * When the write is complete, the statistics committed by the workers make
+     * up the chunk statistics index of the array (the chunks they did not
+     * write, such as the fill-only ones, get unknown statistics), and the
+     * markers of the workers are erased. Otherwise, the index is erased.
+     * @param store the store
+     * @param path the path of the array
+     * @param zarr_version_major the major version of the Zarr specification
+     * @param nworkers the number of workers
+     * @param axis the axis along which the array is split
+     */
+    template <class store_type>
+    inline xzarr_partition_report finalize_partitions(store_type store, const std::string& path, std::size_t zarr_version_major,
+                                                      std::size_t nworkers, std::size_t axis)
+    {
+        auto m = read_zarr_array_metadata(store, path, zarr_version_major, false);
+        std::vector<xzarr_partition> partitions;
+        for (std::size_t worker = 0; worker < nworkers; ++worker)
+        {
+            partitions.push_back(make_partition(m, worker, nworkers, axis));
+        }
+        const auto listed = list_zarr_chunks(store, m);
+        const std::set<std::vector<std::size_t>> stored(listed.begin(), listed.end());
+        const auto grid = m.grid_shape();
+        const bool empty_grid = std::find(grid.begin(), grid.end(), std::size_t(0)) != grid.end();
+        std::map<std::vector<std::size_t>, xzarr_chunk_stats> chunks;
+        xzarr_partition_report report;
+        for (std::size_t worker = 0; worker < nworkers; ++worker)
+        {
+            std::string bytes;
+            if (!read_store_value(store, detail::partition_marker_key(m, worker), bytes))
+            {
+                report.missing.push_back(worker);
+                continue;
+            }
+            auto j = nlohmann::json::parse(bytes);
+            auto expected = partitions[worker].dump();
+            for (const auto& field: expected.items())
+            {
+                if (j[field.key()] != field.value())
+                {
+                    XTENSOR_THROW(std::runtime_error, "Partition marker of worker " + std::to_string(worker) + " does not match the partitioning");
+                }
+            }
+            const auto& p = partitions[worker];
+            if (empty_grid || p.first_chunk == p.last_chunk)
+            {
+                continue;
+            }
+            std::set<std::vector<std::size_t>> fill;
+            if (j.contains("fill_chunks"))
+            {
+                for (const auto& index: j["fill_chunks"])
+                {
+                    fill.insert(index.get<std::vector<std::size_t>>());
+                }
+            }
+            std::vector<std::size_t> first(grid.size(), 0);
+            std::vector<std::size_t> last(grid.size());
+            for (std::size_t d = 0; d < grid.size(); ++d)
+            {
+                last[d] = grid[d] - 1;
+            }
+            first[axis] = p.first_chunk;
+            last[axis] = p.last_chunk - 1;
+            bool complete = true;
+            detail::for_each_chunk_index(first, last, [&](const std::vector<std::size_t>& index)
+            {
+                complete = complete && (stored.count(index) != 0 || fill.count(index) != 0);
+            });
+            if (!complete)
+            {
+                report.incomplete.push_back(worker);
+            }
+            else if (j.contains("chunk_stats"))
+            {
+                detail::read_partition_chunk_stats(j["chunk_stats"], p, grid, chunks);
+            }
+        }
+        if (report.complete())
+        {
+            // the partitions cover the chunk grid, so that no previous index is needed
+            store[detail::chunk_stats_key(m)] = detail::merge_chunk_stats(m, nullptr, chunks).dump().dump();
+            store.erase_prefix(m.data_prefix() + "/.partitions");
+        }
+        else
+        {
+            detail::invalidate_chunk_stats(store, m);
+        }
+        return report;
+    }
+}
+
+#endif
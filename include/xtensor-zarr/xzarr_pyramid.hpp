@@ -0,0 +1,482 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_PYRAMID_HPP
+#define XTENSOR_ZARR_PYRAMID_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+#include "xtensor/xarray.hpp"
+#include "xzarr_attrs.hpp"
+#include "xzarr_chunk_codec.hpp"
+#include "xzarr_chunk_stats.hpp"
+#include "xzarr_common.hpp"
+#include "xzarr_metadata.hpp"
+#include "xzarr_rechunk.hpp"
+#include "xzarr_threading.hpp"
+
+namespace xt
+{
+    /**
+     * Downsampling of the blocks of elements of a pyramid level.
+     * - ``mean``: arithmetic mean of the block, rounded for integer data types
+     * - ``mode``: most frequent value of the block, the smallest one on ties
+     * - ``nearest``: first element of the block
+     */
+    enum class xzarr_downsampling { mean, mode, nearest };
+
+    /**
+     * @class xzarr_pyramid_options
+     * @brief Options of build_zarr_pyramid.
+     */
+    struct xzarr_pyramid_options
+    {
+        /// number of downsampled levels
+        std::size_t levels;
+        /// downsampling factor along each axis (empty means 2 along every axis)
+        std::vector<std::size_t> factors;
+        xzarr_downsampling method;
+        /// names of the axes in the multiscales attribute (empty means default names)
+        std::vector<std::string> axes;
+        /// whether the multiscales attribute is written to the parent group
+        bool write_multiscales;
+        /// number of threads (0 means the thread budget)
+        std::size_t nthreads;
+
+        xzarr_pyramid_options();
+    };
+
+    template <class store_type>
+    std::vector<std::string> build_zarr_pyramid(store_type store, const std::string& path, std::size_t zarr_version_major, const xzarr_pyramid_options& options = xzarr_pyramid_options());
+
+    /****************************************
+     * xzarr_pyramid_options implementation *
+     ****************************************/
+
+    inline xzarr_pyramid_options::xzarr_pyramid_options()
+        : levels(1)
+        , method(xzarr_downsampling::mean)
+        , write_multiscales(true)
+        , nthreads(0)
+    {
+    }
+
+    /*******************************
+     * zarr pyramid implementation *
+     *******************************/
+
+    namespace detail
+    {
+        inline std::string downsampling_name(xzarr_downsampling method)
+        {
+            switch (method)
+            {
+                case xzarr_downsampling::mode:
+                    return "mode";
+                case xzarr_downsampling::nearest:
+                    return "nearest";
+                default:
+                    return "mean";
+            }
+        }
+
+        inline void split_pyramid_path(const std::string& path, std::string& parent, std::string& name)
+        {
+            std::size_t i = path.find_last_of('/');
+            parent = (i == std::string::npos) ? std::string() : path.substr(0, i);
+            name = (i == std::string::npos) ? path : path.substr(i + 1);
+        }
+
+        // levels of an array named by a number n are named n + 1, n + 2... as in OME-Zarr
+        inline std::string pyramid_level_name(const std::string& name, std::size_t level)
+        {
+            if (level == 0)
+            {
+                return name;
+            }
+            if (!name.empty() && name.find_first_not_of("0123456789") == std::string::npos)
+            {
+                return std::to_string(std::stoull(name) + level);
+            }
+            return name + "_" + std::to_string(level);
+        }
+
+        // OME-Zarr axes are ordered as time, channel, then space
+        inline nlohmann::json pyramid_axes(const std::vector<std::string>& names, std::size_t ndim)
+        {
+            std::vector<std::string> axes = names;
+            if (axes.empty())
+            {
+                static const char* defaults[] = {"t", "c", "z", "y", "x"};
+                for (std::size_t d = 0; d < ndim; ++d)
+                {
+                    axes.push_back((ndim <= 5) ? defaults[5 - ndim + d] : "dim_" + std::to_string(d));
+                }
+            }
+            if (axes.size() != ndim)
+            {
+                XTENSOR_THROW(std::runtime_error, "Cannot build pyramid: axis names do not match the array dimension");
+            }
+            nlohmann::json j = nlohmann::json::array();
+            for (const auto& name: axes)
+            {
+                nlohmann::json axis = {{"name", name}};
+                if (name == "x" || name == "y" || name == "z")
+                {
+                    axis["type"] = "space";
+                }
+                else if (name == "t")
+                {
+                    axis["type"] = "time";
+                }
+                else if (name == "c")
+                {
+                    axis["type"] = "channel";
+                }
+                j.push_back(axis);
+            }
+            return j;
+        }
+
+        template <class T>
+        inline T downsample_cast(double value, std::true_type)
+        {
+            return static_cast<T>(std::round(value));
+        }
+
+        template <class T>
+        inline T downsample_cast(double value, std::false_type)
+        {
+            return static_cast<T>(value);
+        }
+
+        // NaN values are greater than the others, and equal to each other
+        template <class T>
+        inline bool downsample_less(const T& a, const T& b)
+        {
+            return (b != b) ? (a == a) : (a < b);
+        }
+
+        template <class T>
+        inline T downsample_mode(std::vector<T>& values)
+        {
+            std::sort(values.begin(), values.end(), downsample_less<T>);
+            T best = values.front();
+            std::size_t best_count = 0;
+            for (std::size_t i = 0; i < values.size();)
+            {
+                std::size_t j = i + 1;
+                while (j < values.size() && !downsample_less(values[i], values[j]))
+                {
+                    ++j;
+                }
+                if (j - i > best_count)
+                {
+                    best = values[i];
+                    best_count = j - i;
+                }
+                i = j;
+            }
+            return best;
+        }
+
+        /**
+         * Downsamples a block of elements, stored in row-major order, into a chunk.
+         * Rows of the output are computed along the last axis, from the rows of
+         * the block they cover, so that the sums of the mean run over contiguous
+         * elements; the blocks of elements at its end are truncated.
+         */
+        template <class T>
+        inline void downsample_block(xzarr_downsampling method, const T* block, const std::vector<std::size_t>& block_extent,
+                                     const std::vector<std::size_t>& factors, T* out, const std::vector<std::size_t>& out_strides,
+                                     const std::vector<std::size_t>& out_extent)
+        {
+            const std::size_t ndim = block_extent.size();
+            const auto block_strides = rechunk_strides(block_extent, 'C');
+            const std::size_t n = out_extent.back();
+            const std::size_t f = factors.back();
+            const std::size_t m = block_extent.back();
+            const std::size_t out_step = out_strides.back();
+            std::vector<std::size_t> zero(ndim - 1, 0);
+            std::vector<std::size_t> last(ndim - 1);
+            for (std::size_t d = 0; d + 1 < ndim; ++d)
+            {
+                last[d] = out_extent[d] - 1;
+            }
+            std::vector<double> sums(m);
+            std::vector<T> values;
+            std::vector<std::size_t> rows;
+            std::vector<std::size_t> first_row(ndim - 1);
+            std::vector<std::size_t> last_row(ndim - 1);
+            for_each_chunk_index(zero, last, [&](const std::vector<std::size_t>& index)
+            {
+                std::size_t o = 0;
+                for (std::size_t d = 0; d + 1 < ndim; ++d)
+                {
+                    o += index[d] * out_strides[d];
+                    first_row[d] = index[d] * factors[d];
+                    last_row[d] = std::min(first_row[d] + factors[d], block_extent[d]) - 1;
+                }
+                rows.clear();
+                if (method == xzarr_downsampling::nearest)
+                {
+                    rows.push_back(0);
+                    for (std::size_t d = 0; d + 1 < ndim; ++d)
+                    {
+                        rows.back() += first_row[d] * block_strides[d];
+                    }
+                }
+                else
+                {
+                    for_each_chunk_index(first_row, last_row, [&](const std::vector<std::size_t>& row)
+                    {
+                        std::size_t s = 0;
+                        for (std::size_t d = 0; d + 1 < ndim; ++d)
+                        {
+                            s += row[d] * block_strides[d];
+                        }
+                        rows.push_back(s);
+                    });
+                }
+
+                if (method == xzarr_downsampling::nearest)
+                {
+                    const T* p = block + rows.front();
+                    for (std::size_t k = 0; k < n; ++k)
+                    {
+                        out[o + k * out_step] = p[k * f];
+                    }
+                }
+                else if (method == xzarr_downsampling::mean)
+                {
+                    // the rows are summed element-wise first, in a loop that vectorizes
+                    std::fill(sums.begin(), sums.end(), 0.);
+                    for (auto s: rows)
+                    {
+                        const T* p = block + s;
+                        for (std::size_t i = 0; i < m; ++i)
+                        {
+                            sums[i] += static_cast<double>(p[i]);
+                        }
+                    }
+                    for (std::size_t k = 0; k < n; ++k)
+                    {
+                        const std::size_t end = std::min(k * f + f, m);
+                        double acc = 0.;
+                        for (std::size_t i = k * f; i < end; ++i)
+                        {
+                            acc += sums[i];
+                        }
+                        const double count = static_cast<double>((end - k * f) * rows.size());
+                        out[o + k * out_step] = downsample_cast<T>(acc / count, std::is_integral<T>());
+                    }
+                }
+                else
+                {
+                    for (std::size_t k = 0; k < n; ++k)
+                    {
+                        values.clear();
+                        const std::size_t end = std::min(k * f + f, m);
+                        for (auto s: rows)
+                        {
+                            values.insert(values.end(), block + s + k * f, block + s + end);
+                        }
+                        out[o + k * out_step] = downsample_mode(values);
+                    }
+                }
+            });
+        }
+
+        /**
+         * Computes a level of a pyramid from the previous one, chunk by chunk,
+         * on nthreads workers. Each worker gathers the block of the previous
+         * level covered by one chunk of the level, and downsamples it.
+         */
+        template <class T, class store_type>
+        inline void pyramid_level(store_type& store, const xzarr_array_metadata& src, const xzarr_array_metadata& dst,
+                                  const std::vector<std::size_t>& factors, xzarr_downsampling method, std::size_t nthreads)
+        {
+            const std::size_t ndim = src.shape.size();
+            const auto grid = dst.grid_shape();
+            const T src_fill = fill_value_as<T>(src.fill_value);
+            const T dst_fill = fill_value_as<T>(dst.fill_value);
+            const auto src_chunk_strides = rechunk_strides(src.chunk_shape, src.chunk_memory_layout);
+            const auto dst_chunk_strides = rechunk_strides(dst.chunk_shape, dst.chunk_memory_layout);
+            // all the chunks of the level are written, and make up its statistics index
+            xzarr_chunk_stats_recorder<store_type> stats(store, dst);
+            stats.begin_write();
+
+            xzarr_parallel_for(dst.chunk_count(), nthreads, [&](std::size_t task)
+            {
+                std::vector<std::size_t> index(ndim);
+                std::vector<std::size_t> out_extent(ndim);
+                std::vector<std::size_t> lo(ndim);
+                std::vector<std::size_t> hi(ndim);
+                std::vector<std::size_t> extent(ndim);
+                for (std::size_t d = ndim; d-- > 0;)
+                {
+                    index[d] = task % grid[d];
+                    task /= grid[d];
+                    std::size_t origin = index[d] * dst.chunk_shape[d];
+                    out_extent[d] = std::min(dst.chunk_shape[d], dst.shape[d] - origin);
+                    lo[d] = origin * factors[d];
+                    hi[d] = std::min(lo[d] + out_extent[d] * factors[d], src.shape[d]);
+                    extent[d] = hi[d] - lo[d];
+                }
+                const auto block_strides = rechunk_strides(extent, 'C');
+                xarray<T> block(std::vector<std::size_t>{rechunk_bytes(extent, 1)});
+
+                // gather the block from the chunks of the previous level
+                std::vector<std::size_t> first(ndim);
+                std::vector<std::size_t> last(ndim);
+                std::vector<std::size_t> src_offset(ndim);
+                std::vector<std::size_t> dst_offset(ndim);
+                std::vector<std::size_t> count(ndim);
+                for (std::size_t d = 0; d < ndim; ++d)
+                {
+                    first[d] = lo[d] / src.chunk_shape[d];
+                    last[d] = (hi[d] - 1) / src.chunk_shape[d];
+                }
+                xarray<T> chunk(std::vector<std::size_t>{src.chunk_size()});
+                for_each_chunk_index(first, last, [&](const std::vector<std::size_t>& src_index)
+                {
+                    for (std::size_t d = 0; d < ndim; ++d)
+                    {
+                        std::size_t origin = src_index[d] * src.chunk_shape[d];
+                        std::size_t begin = std::max(lo[d], origin);
+                        std::size_t end = std::min(hi[d], origin + src.chunk_shape[d]);
+                        src_offset[d] = begin - origin;
+                        dst_offset[d] = begin - lo[d];
+                        count[d] = end - begin;
+                    }
+                    if (read_zarr_chunk(store, src, src_index, chunk))
+                    {
+                        copy_block(chunk.data(), src_chunk_strides, src_offset, block.data(), block_strides, dst_offset, count);
+                    }
+                    else
+                    {
+                        fill_block(block.data(), block_strides, dst_offset, count, src_fill);
+                    }
+                });
+
+                xarray<T> out(std::vector<std::size_t>{dst.chunk_size()}, dst_fill);
+                downsample_block(method, block.data(), extent, factors, out.data(), dst_chunk_strides, out_extent);
+                store_zarr_chunk(store, dst, index, encode_zarr_chunk(dst, out));
+                stats.record(index, chunk_stats(dst, index, out.data()));
+            });
+            stats.flush();
+        }
+    }
+
+    /**
+     * Builds a multiscale pyramid of an array of a store.
+     *
+     * Each level is an array downsampled from the previous one by the factors of
+     * the options, in blocks of elements reduced by the downsampling method; the
+     * blocks at the end of an axis are truncated. Levels are sibling arrays of the
+     * source, named as in OME-Zarr when the name of the source is a number
+     * (``0``, ``1``, ``2``...) and by appending ``_1``, ``_2``... otherwise. They
+     * have the data type, compressor, memory layout and chunk shape of the source,
+     * with chunks no larger than their shape.
+     *
+     * Levels are computed in turn, chunk by chunk, by up to ``options.nthreads``
+     * workers. A worker holds one chunk of the level and the block of the previous
+     * level it covers, so that the memory does not depend on the array size. The
+     * metadata of a level is written once it is complete. Finally, the OME-Zarr
+     * ``multiscales`` attribute describing the source and its levels is written
+     * to the parent group of the source, which must be an explicit group.
+     *
+     * @param store the store
+     * @param path the path of the source array
+     * @param zarr_version_major the major version of the Zarr specification
+     * @param options the pyramid options
+     *
+     * @return returns the paths of the source and of its levels.
+     */
+    template <class store_type>
+    inline std::vector<std::string> build_zarr_pyramid(store_type store, const std::string& path, std::size_t zarr_version_major, const xzarr_pyramid_options& options)
+    {
+        auto source = read_zarr_array_metadata(store, path, zarr_version_major);
+        const std::size_t ndim = source.shape.size();
+        if (ndim == 0)
+        {
+            XTENSOR_THROW(std::runtime_error, "Cannot build the pyramid of a zero-dimensional array: " + path);
+        }
+        std::vector<std::size_t> factors = options.factors.empty() ? std::vector<std::size_t>(ndim, 2) : options.factors;
+        if (factors.size() != ndim || std::find(factors.begin(), factors.end(), std::size_t(0)) != factors.end())
+        {
+            XTENSOR_THROW(std::runtime_error, "Cannot build pyramid: factors must be positive, one per axis");
+        }
+        const nlohmann::json axes = detail::pyramid_axes(options.axes, ndim);
+
+        std::string parent;
+        std::string name;
+        detail::split_pyramid_path(source.path, parent, name);
+        std::vector<std::string> paths = {source.path};
+        nlohmann::json datasets = nlohmann::json::array();
+        std::vector<double> scale(ndim, 1.);
+        auto add_dataset = [&](const std::string& level_name)
+        {
+            nlohmann::json transformation;
+            transformation["type"] = "scale";
+            transformation["scale"] = scale;
+            nlohmann::json dataset;
+            dataset["path"] = level_name;
+            dataset["coordinateTransformations"] = nlohmann::json::array({transformation});
+            datasets.push_back(dataset);
+        };
+        add_dataset(name);
+
+        auto previous = source;
+        xzarr_dispatch_dtype(source.dtype_noendian(), [&](auto tag)
+        {
+            using value_type = typename decltype(tag)::type;
+            for (std::size_t level = 1; level <= options.levels; ++level)
+            {
+                auto current = source;
+                std::string level_name = detail::pyramid_level_name(name, level);
+                current.path = parent + "/" + level_name;
+                current.attrs = nlohmann::json::object();
+                for (std::size_t d = 0; d < ndim; ++d)
+                {
+                    current.shape[d] = (previous.shape[d] + factors[d] - 1) / factors[d];
+                    current.chunk_shape[d] = std::max<std::size_t>(std::min(source.chunk_shape[d], current.shape[d]), 1);
+                    scale[d] *= static_cast<double>(factors[d]);
+                }
+                detail::pyramid_level<value_type>(store, previous, current, factors, options.method, options.nthreads);
+                write_zarr_array_metadata(store, current);
+                paths.push_back(current.path);
+                add_dataset(level_name);
+                previous = current;
+            }
+        });
+
+        if (options.write_multiscales)
+        {
+            nlohmann::json multiscale;
+            multiscale["version"] = "0.4";
+            multiscale["name"] = name;
+            multiscale["axes"] = axes;
+            multiscale["datasets"] = datasets;
+            multiscale["type"] = detail::downsampling_name(options.method);
+            std::map<std::string, nlohmann::json> updates;
+            updates[parent]["multiscales"] = nlohmann::json::array({multiscale});
+            update_zarr_attrs(store, updates, zarr_version_major, 1);
+        }
+        return paths;
+    }
+}
+
+#endif
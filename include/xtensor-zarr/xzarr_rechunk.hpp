@@ -0,0 +1,486 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_RECHUNK_HPP
+#define XTENSOR_ZARR_RECHUNK_HPP
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "xtensor/xarray.hpp"
+#include "xzarr_chunk_codec.hpp"
+#include "xzarr_common.hpp"
+#include "xzarr_metadata.hpp"
+#include "xzarr_threading.hpp"
+
+namespace xt
+{
+    /**
+     * @class xzarr_rechunk_options
+     * @brief Options of the rechunking engine.
+     */
+    struct xzarr_rechunk_options
+    {
+        /// total memory (in bytes) the workers may use for their buffers
+        std::size_t max_mem;
+        /// number of workers (0 means the thread budget of xzarr_thread_policy)
+        std::size_t nthreads;
+        /// read amplification above which an intermediate array is considered
+        double max_read_amplification;
+        /// path of the intermediate array (empty means the target path with a suffix)
+        std::string temp_path;
+
+        xzarr_rechunk_options()
+            : max_mem(256 * 1024 * 1024)
+            , nthreads(0)
+            , max_read_amplification(2.)
+        {
+        }
+    };
+
+    /**
+     * @class xzarr_rechunk_plan
+     * @brief Execution plan of a rechunking.
+     *
+     * Each stage copies an array into another one by regions: a region is a block
+     * of whole output chunks, which is assembled in memory from the input chunks it
+     * overlaps, then encoded chunk by chunk. ``write_chunks`` are the regions of the
+     * last stage. When an intermediate array is used, the first stage copies the
+     * source into it by regions of ``read_chunks``.
+     */
+    struct xzarr_rechunk_plan
+    {
+        std::vector<std::size_t> read_chunks;
+        std::vector<std::size_t> intermediate_chunks;
+        std::vector<std::size_t> write_chunks;
+        bool use_intermediate;
+        double read_amplification;
+        std::size_t nthreads;
+    };
+
+    namespace detail
+    {
+        inline std::size_t rechunk_bytes(const std::vector<std::size_t>& shape, std::size_t itemsize)
+        {
+            std::size_t n = itemsize;
+            for (auto s: shape)
+            {
+                n *= s;
+            }
+            return n;
+        }
+
+        // grows chunks by integer factors, from the last axis, while the block fits in budget
+        inline std::vector<std::size_t> rechunk_consolidate(const std::vector<std::size_t>& chunks, const std::vector<std::size_t>& limits,
+                                                            const std::vector<std::size_t>& shape, std::size_t itemsize, std::size_t budget)
+        {
+            std::vector<std::size_t> out(chunks.size());
+            for (std::size_t d = 0; d < chunks.size(); ++d)
+            {
+                out[d] = std::min(chunks[d], shape[d]);
+            }
+            for (std::size_t d = chunks.size(); d-- > 0;)
+            {
+                std::size_t other = itemsize;
+                for (std::size_t e = 0; e < out.size(); ++e)
+                {
+                    if (e != d)
+                    {
+                        other *= out[e];
+                    }
+                }
+                std::size_t k_budget = std::max<std::size_t>(budget / other / chunks[d], 1);
+                std::size_t k_limit = (limits[d] >= shape[d]) ? (shape[d] + chunks[d] - 1) / chunks[d]
+                                                              : std::max<std::size_t>(limits[d] / chunks[d], 1);
+                out[d] = std::min(chunks[d] * std::min(k_budget, k_limit), shape[d]);
+            }
+            return out;
+        }
+
+        // bytes of input chunks decoded when copying by regions, relative to the stored size
+        inline double rechunk_amplification(const std::vector<std::size_t>& shape, const std::vector<std::size_t>& chunks,
+                                            const std::vector<std::size_t>& regions)
+        {
+            double amplification = 1.;
+            for (std::size_t d = 0; d < shape.size(); ++d)
+            {
+                std::size_t grid = (shape[d] + chunks[d] - 1) / chunks[d];
+                std::size_t decoded = 0;
+                for (std::size_t lo = 0; lo < shape[d]; lo += regions[d])
+                {
+                    std::size_t hi = std::min(lo + regions[d], shape[d]);
+                    decoded += (hi - 1) / chunks[d] - lo / chunks[d] + 1;
+                }
+                amplification *= static_cast<double>(decoded) / static_cast<double>(grid);
+            }
+            return amplification;
+        }
+
+        inline std::vector<std::size_t> rechunk_strides(const std::vector<std::size_t>& shape, char layout)
+        {
+            std::vector<std::size_t> strides(shape.size());
+            std::size_t stride = 1;
+            if (layout == 'F')
+            {
+                for (std::size_t d = 0; d < shape.size(); ++d)
+                {
+                    strides[d] = stride;
+                    stride *= shape[d];
+                }
+            }
+            else
+            {
+                for (std::size_t d = shape.size(); d-- > 0;)
+                {
+                    strides[d] = stride;
+                    stride *= shape[d];
+                }
+            }
+            return strides;
+        }
+
+        // calls f(src_position, dst_position) for each row of a block, rows running along the last axis
+        template <class F>
+        inline void for_each_block_row(const std::vector<std::size_t>& count,
+                                       const std::vector<std::size_t>& src_strides, const std::vector<std::size_t>& src_offset,
+                                       const std::vector<std::size_t>& dst_strides, const std::vector<std::size_t>& dst_offset,
+                                       F&& f)
+        {
+            std::size_t ndim = count.size();
+            if (std::find(count.begin(), count.end(), std::size_t(0)) != count.end())
+            {
+                return;
+            }
+            std::vector<std::size_t> index(ndim, 0);
+            for (;;)
+            {
+                std::size_t src_pos = 0;
+                std::size_t dst_pos = 0;
+                for (std::size_t d = 0; d < ndim; ++d)
+                {
+                    src_pos += (src_offset[d] + index[d]) * src_strides[d];
+                    dst_pos += (dst_offset[d] + index[d]) * dst_strides[d];
+                }
+                f(src_pos, dst_pos);
+                std::size_t d = ndim - 1;
+                while (d > 0 && ++index[d - 1] == count[d - 1])
+                {
+                    index[d - 1] = 0;
+                    --d;
+                }
+                if (d == 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        template <class T>
+        inline void copy_block(const T* src, const std::vector<std::size_t>& src_strides, const std::vector<std::size_t>& src_offset,
+                               T* dst, const std::vector<std::size_t>& dst_strides, const std::vector<std::size_t>& dst_offset,
+                               const std::vector<std::size_t>& count)
+        {
+            std::size_t last = count.size() - 1;
+            std::size_t n = count[last];
+            std::size_t src_step = src_strides[last];
+            std::size_t dst_step = dst_strides[last];
+            for_each_block_row(count, src_strides, src_offset, dst_strides, dst_offset, [&](std::size_t s, std::size_t d)
+            {
+                if (src_step == 1 && dst_step == 1)
+                {
+                    std::copy(src + s, src + s + n, dst + d);
+                }
+                else
+                {
+                    for (std::size_t i = 0; i < n; ++i)
+                    {
+                        dst[d + i * dst_step] = src[s + i * src_step];
+                    }
+                }
+            });
+        }
+
+        template <class T>
+        inline void fill_block(T* dst, const std::vector<std::size_t>& dst_strides, const std::vector<std::size_t>& dst_offset,
+                               const std::vector<std::size_t>& count, const T& value)
+        {
+            std::size_t last = count.size() - 1;
+            std::size_t n = count[last];
+            std::size_t dst_step = dst_strides[last];
+            for_each_block_row(count, dst_strides, dst_offset, dst_strides, dst_offset, [&](std::size_t, std::size_t d)
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                {
+                    dst[d + i * dst_step] = value;
+                }
+            });
+        }
+
+        // iterates over the chunk indices of a grid block [first, last]
+        template <class F>
+        inline void for_each_chunk_index(const std::vector<std::size_t>& first, const std::vector<std::size_t>& last, F&& f)
+        {
+            std::vector<std::size_t> index = first;
+            std::size_t ndim = index.size();
+            for (;;)
+            {
+                f(index);
+                std::size_t d = ndim;
+                while (d > 0 && index[d - 1] == last[d - 1])
+                {
+                    index[d - 1] = first[d - 1];
+                    --d;
+                }
+                if (d == 0)
+                {
+                    break;
+                }
+                ++index[d - 1];
+            }
+        }
+
+        /**
+         * Copies the chunks of an array to another array of the same shape and data type,
+         * region by region, on nthreads workers. Each output chunk belongs to exactly one
+         * region, so that workers never write to the same key.
+         */
+        template <class T, class src_store_type, class dst_store_type>
+        inline void rechunk_stage(src_store_type& src_store, const xzarr_array_metadata& src,
+                                  dst_store_type& dst_store, const xzarr_array_metadata& dst,
+                                  const std::vector<std::size_t>& region, std::size_t nthreads)
+        {
+            const std::size_t ndim = src.shape.size();
+            const std::vector<std::size_t>& shape = src.shape;
+            std::vector<std::size_t> region_grid(ndim);
+            std::size_t ntasks = 1;
+            for (std::size_t d = 0; d < ndim; ++d)
+            {
+                region_grid[d] = (shape[d] + region[d] - 1) / region[d];
+                ntasks *= region_grid[d];
+            }
+            const T src_fill = fill_value_as<T>(src.fill_value);
+            const T dst_fill = fill_value_as<T>(dst.fill_value);
+            const auto src_chunk_strides = rechunk_strides(src.chunk_shape, src.chunk_memory_layout);
+            const auto dst_chunk_strides = rechunk_strides(dst.chunk_shape, dst.chunk_memory_layout);
+            // the chunks are written without erasing the chunk statistics index each time
+            invalidate_chunk_stats(dst_store, dst);
+
+            xzarr_parallel_for(ntasks, nthreads, [&](std::size_t task)
+            {
+                std::vector<std::size_t> lo(ndim);
+                std::vector<std::size_t> hi(ndim);
+                std::vector<std::size_t> extent(ndim);
+                for (std::size_t d = ndim; d-- > 0;)
+                {
+                    lo[d] = (task % region_grid[d]) * region[d];
+                    hi[d] = std::min(lo[d] + region[d], shape[d]);
+                    extent[d] = hi[d] - lo[d];
+                    task /= region_grid[d];
+                }
+                const auto buffer_strides = rechunk_strides(extent, 'C');
+                xarray<T> buffer(std::vector<std::size_t>{rechunk_bytes(extent, 1)});
+
+                std::vector<std::size_t> first(ndim);
+                std::vector<std::size_t> last(ndim);
+                std::vector<std::size_t> src_offset(ndim);
+                std::vector<std::size_t> dst_offset(ndim);
+                std::vector<std::size_t> count(ndim);
+
+                // gather the region from the input chunks
+                for (std::size_t d = 0; d < ndim; ++d)
+                {
+                    first[d] = lo[d] / src.chunk_shape[d];
+                    last[d] = (hi[d] - 1) / src.chunk_shape[d];
+                }
+                xarray<T> chunk(std::vector<std::size_t>{src.chunk_size()});
+                for_each_chunk_index(first, last, [&](const std::vector<std::size_t>& index)
+                {
+                    for (std::size_t d = 0; d < ndim; ++d)
+                    {
+                        std::size_t origin = index[d] * src.chunk_shape[d];
+                        std::size_t begin = std::max(lo[d], origin);
+                        std::size_t end = std::min(hi[d], origin + src.chunk_shape[d]);
+                        src_offset[d] = begin - origin;
+                        dst_offset[d] = begin - lo[d];
+                        count[d] = end - begin;
+                    }
+                    if (read_zarr_chunk(src_store, src, index, chunk))
+                    {
+                        copy_block(chunk.data(), src_chunk_strides, src_offset, buffer.data(), buffer_strides, dst_offset, count);
+                    }
+                    else
+                    {
+                        fill_block(buffer.data(), buffer_strides, dst_offset, count, src_fill);
+                    }
+                });
+
+                // scatter the region to the output chunks
+                for (std::size_t d = 0; d < ndim; ++d)
+                {
+                    first[d] = lo[d] / dst.chunk_shape[d];
+                    last[d] = (hi[d] - 1) / dst.chunk_shape[d];
+                }
+                const std::vector<std::size_t> zero(ndim, 0);
+                for_each_chunk_index(first, last, [&](const std::vector<std::size_t>& index)
+                {
+                    for (std::size_t d = 0; d < ndim; ++d)
+                    {
+                        std::size_t origin = index[d] * dst.chunk_shape[d];
+                        src_offset[d] = origin - lo[d];
+                        count[d] = std::min(origin + dst.chunk_shape[d], shape[d]) - origin;
+                    }
+                    xarray<T> out(std::vector<std::size_t>{dst.chunk_size()}, dst_fill);
+                    copy_block(buffer.data(), buffer_strides, src_offset, out.data(), dst_chunk_strides, zero, count);
+                    store_zarr_chunk(dst_store, dst, index, encode_zarr_chunk(dst, out));
+                });
+            });
+        }
+    }
+
+    /**
+     * Plans the rechunking of an array.
+     *
+     * The planning follows the rechunker algorithm: output chunks are grouped into
+     * write regions as large as the per-worker memory allows. If reading the source
+     * by write regions decodes each source chunk more than ``max_read_amplification``
+     * times on average, a plan through an intermediate array is considered, whose
+     * chunks are the element-wise minimum of the consolidated read and write chunks.
+     *
+     * @param source the metadata of the source array
+     * @param target_chunk_shape the chunk shape of the target array
+     * @param options the rechunking options
+     */
+    template <class shape_type>
+    inline xzarr_rechunk_plan plan_rechunk(const xzarr_array_metadata& source, const shape_type& target_chunk_shape,
+                                           const xzarr_rechunk_options& options = xzarr_rechunk_options())
+    {
+        const std::vector<std::size_t>& shape = source.shape;
+        std::vector<std::size_t> target_chunks(target_chunk_shape.begin(), target_chunk_shape.end());
+        if (target_chunks.size() != shape.size() || shape.empty())
+        {
+            XTENSOR_THROW(std::runtime_error, "Cannot rechunk: target chunk shape does not match the array dimension");
+        }
+        if (std::find(target_chunks.begin(), target_chunks.end(), std::size_t(0)) != target_chunks.end())
+        {
+            XTENSOR_THROW(std::runtime_error, "Cannot rechunk: chunk sizes must be positive");
+        }
+        std::size_t itemsize = source.itemsize();
+
+        xzarr_rechunk_plan plan;
+        plan.nthreads = (options.nthreads == 0) ? xzarr_thread_policy::max_threads() : options.nthreads;
+        std::size_t budget = std::max<std::size_t>(options.max_mem / plan.nthreads, 1);
+        // a worker also holds one decoded input chunk and one output chunk
+        std::size_t chunk_buffers = detail::rechunk_bytes(source.chunk_shape, itemsize) + detail::rechunk_bytes(target_chunks, itemsize);
+        std::size_t region_budget = (budget > chunk_buffers) ? budget - chunk_buffers : 0;
+
+        plan.write_chunks = detail::rechunk_consolidate(target_chunks, shape, shape, itemsize, region_budget);
+        plan.read_chunks = plan.write_chunks;
+        plan.intermediate_chunks = target_chunks;
+        plan.use_intermediate = false;
+        plan.read_amplification = detail::rechunk_amplification(shape, source.chunk_shape, plan.write_chunks);
+
+        if (plan.read_amplification > options.max_read_amplification)
+        {
+            auto read_chunks = detail::rechunk_consolidate(source.chunk_shape, shape, shape, itemsize, region_budget);
+            std::vector<std::size_t> intermediate_chunks(shape.size());
+            for (std::size_t d = 0; d < shape.size(); ++d)
+            {
+                intermediate_chunks[d] = std::min(read_chunks[d], plan.write_chunks[d]);
+            }
+            auto stage_chunks = detail::rechunk_consolidate(intermediate_chunks, read_chunks, shape, itemsize, region_budget);
+            double amplification = detail::rechunk_amplification(shape, source.chunk_shape, stage_chunks)
+                                 + detail::rechunk_amplification(shape, intermediate_chunks, plan.write_chunks);
+            // the intermediate array is written once more than in a direct copy
+            if (amplification + 1. < plan.read_amplification)
+            {
+                plan.read_chunks = stage_chunks;
+                plan.intermediate_chunks = intermediate_chunks;
+                plan.use_intermediate = true;
+                plan.read_amplification = amplification;
+            }
+        }
+        return plan;
+    }
+
+    /**
+     * Rechunks an array of a store into a new array of another store (e.g. from
+     * a remote store to a local one), of the same Zarr version.
+     *
+     * The chunks are streamed through memory-bounded regions by parallel workers
+     * (see plan_rechunk), and the metadata of the target array is written last, so
+     * that the target array is not visible until it is complete. The target array
+     * has the data type, compressor, memory layout and attributes of the source.
+     * The intermediate array of the plan, if any, is written to the destination
+     * store and erased at the end.
+     *
+     * @param src_store the source store
+     * @param source_path the path of the source array
+     * @param dst_store the destination store
+     * @param target_path the path of the target array
+     * @param target_chunk_shape the chunk shape of the target array
+     * @param zarr_version_major the major version of the Zarr specification
+     * @param options the rechunking options
+     *
+     * @return returns the executed plan.
+     */
+    template <class src_store_type, class dst_store_type, class shape_type>
+    inline xzarr_rechunk_plan rechunk_zarr_array(src_store_type& src_store, const std::string& source_path,
+                                                 dst_store_type& dst_store, const std::string& target_path,
+                                                 const shape_type& target_chunk_shape, std::size_t zarr_version_major,
+                                                 const xzarr_rechunk_options& options = xzarr_rechunk_options())
+    {
+        auto source = read_zarr_array_metadata(src_store, source_path, zarr_version_major);
+        auto plan = plan_rechunk(source, target_chunk_shape, options);
+        auto target = source;
+        target.path = target_path;
+        target.chunk_shape.assign(target_chunk_shape.begin(), target_chunk_shape.end());
+        xzarr_dispatch_dtype(source.dtype_noendian(), [&](auto tag)
+        {
+            using value_type = typename decltype(tag)::type;
+            if (plan.use_intermediate)
+            {
+                auto intermediate = source;
+                intermediate.path = options.temp_path.empty() ? target_path + ".rechunk_intermediate" : options.temp_path;
+                intermediate.chunk_shape = plan.intermediate_chunks;
+                detail::rechunk_stage<value_type>(src_store, source, dst_store, intermediate, plan.read_chunks, plan.nthreads);
+                detail::rechunk_stage<value_type>(dst_store, intermediate, dst_store, target, plan.write_chunks, plan.nthreads);
+                dst_store.erase_prefix(intermediate.data_prefix());
+            }
+            else
+            {
+                detail::rechunk_stage<value_type>(src_store, source, dst_store, target, plan.write_chunks, plan.nthreads);
+            }
+        });
+        write_zarr_array_metadata(dst_store, target);
+        return plan;
+    }
+
+    /**
+     * Rechunks an array of a store into a new array of the same store.
+     *
+     * @param store the store
+     * @param source_path the path of the source array
+     * @param target_path the path of the target array
+     * @param target_chunk_shape the chunk shape of the target array
+     * @param zarr_version_major the major version of the Zarr specification
+     * @param options the rechunking options
+     *
+     * @return returns the executed plan.
+     */
+    template <class store_type, class shape_type>
+    inline xzarr_rechunk_plan rechunk_zarr_array(store_type store, const std::string& source_path, const std::string& target_path,
+                                                 const shape_type& target_chunk_shape, std::size_t zarr_version_major,
+                                                 const xzarr_rechunk_options& options = xzarr_rechunk_options())
+    {
+        return rechunk_zarr_array(store, source_path, store, target_path, target_chunk_shape, zarr_version_major, options);
+    }
+}
+
+#endif
@@ -0,0 +1,371 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_REDUCE_HPP
+#define XTENSOR_ZARR_REDUCE_HPP
+
+#include <algorithm>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "xtensor/xarray.hpp"
+#include "xzarr_chunk_codec.hpp"
+#include "xzarr_common.hpp"
+#include "xzarr_metadata.hpp"
+#include "xzarr_rechunk.hpp"
+#include "xzarr_threading.hpp"
+
+namespace xt
+{
+    /**
+     * Reduction computed by reduce_zarr_array.
+     * - ``sum``: sum of the elements
+     * - ``mean``: arithmetic mean of the elements
+     * - ``amax``: maximum of the elements, NaN if one of them is NaN
+     * - ``amin``: minimum of the elements, NaN if one of them is NaN
+     */
+    enum class xzarr_reducer { sum, mean, amax, amin };
+
+    template <class store_type, class A>
+    xarray<double> reduce_zarr_array(store_type store, const std::string& path, std::size_t zarr_version_major, xzarr_reducer reducer, const A& axes, std::size_t nthreads = 0);
+
+    template <class store_type>
+    double sum_zarr_array(store_type store, const std::string& path, std::size_t zarr_version_major, std::size_t nthreads = 0);
+
+    template <class store_type>
+    double mean_zarr_array(store_type store, const std::string& path, std::size_t zarr_version_major, std::size_t nthreads = 0);
+
+    template <class store_type>
+    double amax_zarr_array(store_type store, const std::string& path, std::size_t zarr_version_major, std::size_t nthreads = 0);
+
+    template <class store_type>
+    double amin_zarr_array(store_type store, const std::string& path, std::size_t zarr_version_major, std::size_t nthreads = 0);
+
+    /***************************************
+     * zarr array reduction implementation *
+     ***************************************/
+
+    namespace detail
+    {
+        inline double reduce_init(xzarr_reducer reducer)
+        {
+            switch (reducer)
+            {
+                case xzarr_reducer::amax:
+                    return -std::numeric_limits<double>::infinity();
+                case xzarr_reducer::amin:
+                    return std::numeric_limits<double>::infinity();
+                default:
+                    return 0.;
+            }
+        }
+
+        // a NaN accumulator stays NaN, and a NaN value makes it NaN
+        inline void reduce_combine(xzarr_reducer reducer, double& acc, double value)
+        {
+            switch (reducer)
+            {
+                case xzarr_reducer::amax:
+                    acc = (value > acc || value != value) ? value : acc;
+                    break;
+                case xzarr_reducer::amin:
+                    acc = (value < acc || value != value) ? value : acc;
+                    break;
+                default:
+                    acc += value;
+                    break;
+            }
+        }
+
+        /**
+         * Reduces a contiguous row. The loops keep four independent accumulators,
+         * so that the compiler can vectorize them without reordering a single
+         * floating-point sum.
+         */
+        template <class T>
+        inline double reduce_row(xzarr_reducer reducer, const T* p, std::size_t n)
+        {
+            std::size_t n4 = n - n % 4;
+            std::size_t i = 0;
+            if (reducer == xzarr_reducer::sum || reducer == xzarr_reducer::mean)
+            {
+                double a0 = 0., a1 = 0., a2 = 0., a3 = 0.;
+                for (; i < n4; i += 4)
+                {
+                    a0 += static_cast<double>(p[i]);
+                    a1 += static_cast<double>(p[i + 1]);
+                    a2 += static_cast<double>(p[i + 2]);
+                    a3 += static_cast<double>(p[i + 3]);
+                }
+                for (; i < n; ++i)
+                {
+                    a0 += static_cast<double>(p[i]);
+                }
+                return (a0 + a1) + (a2 + a3);
+            }
+            const bool is_max = (reducer == xzarr_reducer::amax);
+            double init = reduce_init(reducer);
+            double m0 = init, m1 = init, m2 = init, m3 = init;
+            std::size_t nans = 0;
+            for (; i < n4; i += 4)
+            {
+                double x0 = static_cast<double>(p[i]);
+                double x1 = static_cast<double>(p[i + 1]);
+                double x2 = static_cast<double>(p[i + 2]);
+                double x3 = static_cast<double>(p[i + 3]);
+                m0 = (is_max ? x0 > m0 : x0 < m0) ? x0 : m0;
+                m1 = (is_max ? x1 > m1 : x1 < m1) ? x1 : m1;
+                m2 = (is_max ? x2 > m2 : x2 < m2) ? x2 : m2;
+                m3 = (is_max ? x3 > m3 : x3 < m3) ? x3 : m3;
+                nans += (x0 != x0) + (x1 != x1) + (x2 != x2) + (x3 != x3);
+            }
+            for (; i < n; ++i)
+            {
+                double x = static_cast<double>(p[i]);
+                m0 = (is_max ? x > m0 : x < m0) ? x : m0;
+                nans += (x != x);
+            }
+            if (nans != 0)
+            {
+                return std::numeric_limits<double>::quiet_NaN();
+            }
+            reduce_combine(reducer, m0, m1);
+            reduce_combine(reducer, m2, m3);
+            reduce_combine(reducer, m0, m2);
+            return m0;
+        }
+
+        /**
+         * Reduces the elements of a chunk within the array shape into a partial
+         * result, whose reduced axes have a stride of zero.
+         */
+        template <class T>
+        inline void reduce_chunk(xzarr_reducer reducer, const T* data, std::vector<std::size_t> strides,
+                                 std::vector<std::size_t> extent, std::vector<std::size_t> partial_strides,
+                                 char layout, double* partial)
+        {
+            // rows run along the contiguous axis of the chunk
+            if (layout == 'F')
+            {
+                std::reverse(strides.begin(), strides.end());
+                std::reverse(extent.begin(), extent.end());
+                std::reverse(partial_strides.begin(), partial_strides.end());
+            }
+            const std::vector<std::size_t> zero(extent.size(), 0);
+            const std::size_t n = extent.back();
+            const std::size_t step = partial_strides.back();
+            for_each_block_row(extent, strides, zero, partial_strides, zero, [&](std::size_t s, std::size_t d)
+            {
+                if (step == 0)
+                {
+                    reduce_combine(reducer, partial[d], reduce_row(reducer, data + s, n));
+                }
+                else
+                {
+                    for (std::size_t i = 0; i < n; ++i)
+                    {
+                        reduce_combine(reducer, partial[d + i * step], static_cast<double>(data[s + i]));
+                    }
+                }
+            });
+        }
+    }
+
+    /**
+     * Reduces an array of a store along some of its axes.
+     *
+     * Each chunk is read and decoded once, in storage order, by up to ``nthreads``
+     * workers, and reduced into a partial result covering its own extent along the
+     * axes that are kept. Partial results are then combined into the result. Chunks
+     * are read in batches of a few chunks per worker with read_zarr_chunks; only the
+     * result and one batch are held in memory, so that arrays much larger than the
+     * memory can be reduced. Missing chunks count as filled with the fill value,
+     * without any decoding.
+     *
+     * The elements are converted to double precision, which is also the precision
+     * of the result; 64-bit integers above 2^53 are rounded.
+     *
+     * @param store the store
+     * @param path the path of the array
+     * @param zarr_version_major the major version of the Zarr specification
+     * @param reducer the reduction
+     * @param axes the axes to reduce (empty means all the axes)
+     * @param nthreads the number of threads (0 means the thread budget)
+     *
+     * @return returns the reduced array, whose shape is the shape of the array
+     * without the reduced axes.
+     */
+    template <class store_type, class A>
+    inline xarray<double> reduce_zarr_array(store_type store, const std::string& path, std::size_t zarr_version_major, xzarr_reducer reducer, const A& axes, std::size_t nthreads)
+    {
+        auto m = read_zarr_array_metadata(store, path, zarr_version_major, false);
+        const std::size_t ndim = m.shape.size();
+        if (ndim == 0)
+        {
+            XTENSOR_THROW(std::runtime_error, "Cannot reduce a zero-dimensional array: " + path);
+        }
+        std::vector<bool> reduced(ndim, axes.size() == 0);
+        for (auto axis: axes)
+        {
+            if (static_cast<std::size_t>(axis) >= ndim)
+            {
+                XTENSOR_THROW(std::runtime_error, "Cannot reduce: axis out of range for array " + path);
+            }
+            reduced[static_cast<std::size_t>(axis)] = true;
+        }
+        std::vector<std::size_t> result_shape;
+        std::size_t count = 1;
+        for (std::size_t d = 0; d < ndim; ++d)
+        {
+            if (reduced[d])
+            {
+                count *= m.shape[d];
+            }
+            else
+            {
+                result_shape.push_back(m.shape[d]);
+            }
+        }
+        const double init = detail::reduce_init(reducer);
+        xarray<double> result(result_shape, init);
+        if (count == 0 && (reducer == xzarr_reducer::amax || reducer == xzarr_reducer::amin))
+        {
+            XTENSOR_THROW(std::runtime_error, "Cannot reduce an empty selection with a maximum or minimum: " + path);
+        }
+
+        // strides of the result along all the axes, zero along the reduced ones
+        std::vector<std::size_t> result_strides(ndim, 0);
+        auto compact_strides = detail::rechunk_strides(result_shape, 'C');
+        for (std::size_t d = 0, k = 0; d < ndim; ++d)
+        {
+            if (!reduced[d])
+            {
+                result_strides[d] = compact_strides[k++];
+            }
+        }
+
+        const auto grid = m.grid_shape();
+        const std::size_t nchunks = (result.size() == 0) ? 0 : m.chunk_count();
+        const auto chunk_strides = detail::rechunk_strides(m.chunk_shape, m.chunk_memory_layout);
+        std::mutex mutex;
+        xzarr_dispatch_dtype(m.dtype_noendian(), [&](auto tag)
+        {
+            using value_type = typename decltype(tag)::type;
+            const value_type fill = fill_value_as<value_type>(m.fill_value);
+            const std::size_t batch = detail::chunk_batch_size(nthreads);
+            for (std::size_t begin = 0; begin < nchunks; begin += batch)
+            {
+                std::vector<std::vector<std::size_t>> indices(std::min(batch, nchunks - begin), std::vector<std::size_t>(ndim));
+                for (std::size_t i = 0; i < indices.size(); ++i)
+                {
+                    std::size_t k = begin + i;
+                    for (std::size_t d = ndim; d-- > 0;)
+                    {
+                        indices[i][d] = k % grid[d];
+                        k /= grid[d];
+                    }
+                }
+                std::vector<xarray<value_type>> chunks;
+                std::vector<bool> found;
+                read_zarr_chunks(store, m, indices, chunks, found, true, nthreads);
+                xzarr_parallel_for(indices.size(), nthreads, [&](std::size_t i)
+                {
+                    const std::vector<std::size_t>& index = indices[i];
+                    std::vector<std::size_t> origin(ndim);
+                    std::vector<std::size_t> extent(ndim);
+                    std::vector<std::size_t> partial_extent(ndim);
+                    for (std::size_t d = 0; d < ndim; ++d)
+                    {
+                        origin[d] = index[d] * m.chunk_shape[d];
+                        extent[d] = std::min(m.chunk_shape[d], m.shape[d] - origin[d]);
+                        partial_extent[d] = reduced[d] ? 1 : extent[d];
+                    }
+                    auto partial_strides = detail::rechunk_strides(partial_extent, 'C');
+                    for (std::size_t d = 0; d < ndim; ++d)
+                    {
+                        partial_strides[d] = reduced[d] ? 0 : partial_strides[d];
+                    }
+                    std::vector<double> partial(detail::rechunk_bytes(partial_extent, 1), init);
+
+                    xarray<value_type>& chunk = chunks[i];
+                    if (!found[i])
+                    {
+                        chunk.fill(fill);
+                    }
+                    detail::reduce_chunk(reducer, chunk.data(), chunk_strides, extent, partial_strides, m.chunk_memory_layout, partial.data());
+
+                    const std::vector<std::size_t> zero(ndim, 0);
+                    const std::size_t n = partial_extent.back();
+                    const std::size_t src_step = partial_strides.back();
+                    const std::size_t dst_step = result_strides.back();
+                    std::lock_guard<std::mutex> lock(mutex);
+                    detail::for_each_block_row(partial_extent, partial_strides, zero, result_strides, origin, [&](std::size_t s, std::size_t d)
+                    {
+                        for (std::size_t j = 0; j < n; ++j)
+                        {
+                            detail::reduce_combine(reducer, result.data()[d + j * dst_step], partial[s + j * src_step]);
+                        }
+                    });
+                });
+            }
+        });
+        if (reducer == xzarr_reducer::mean)
+        {
+            std::transform(result.data(), result.data() + result.size(), result.data(), [count](double v)
+            {
+                return v / static_cast<double>(count);
+            });
+        }
+        return result;
+    }
+
+    /**
+     * Returns the sum of the elements of an array of a store.
+     * @sa reduce_zarr_array
+     */
+    template <class store_type>
+    inline double sum_zarr_array(store_type store, const std::string& path, std::size_t zarr_version_major, std::size_t nthreads)
+    {
+        return reduce_zarr_array(store, path, zarr_version_major, xzarr_reducer::sum, std::vector<std::size_t>(), nthreads).data()[0];
+    }
+
+    /**
+     * Returns the mean of the elements of an array of a store.
+     * @sa reduce_zarr_array
+     */
+    template <class store_type>
+    inline double mean_zarr_array(store_type store, const std::string& path, std::size_t zarr_version_major, std::size_t nthreads)
+    {
+        return reduce_zarr_array(store, path, zarr_version_major, xzarr_reducer::mean, std::vector<std::size_t>(), nthreads).data()[0];
+    }
+
+    /**
+     * Returns the maximum of the elements of an array of a store.
+     * @sa reduce_zarr_array
+     */
+    template <class store_type>
+    inline double amax_zarr_array(store_type store, const std::string& path, std::size_t zarr_version_major, std::size_t nthreads)
+    {
+        return reduce_zarr_array(store, path, zarr_version_major, xzarr_reducer::amax, std::vector<std::size_t>(), nthreads).data()[0];
+    }
+
+    /**
+     * Returns the minimum of the elements of an array of a store.
+     * @sa reduce_zarr_array
+     */
+    template <class store_type>
+    inline double amin_zarr_array(store_type store, const std::string& path, std::size_t zarr_version_major, std::size_t nthreads)
+    {
+        return reduce_zarr_array(store, path, zarr_version_major, xzarr_reducer::amin, std::vector<std::size_t>(), nthreads).data()[0];
+    }
+}
+
+#endif
@@ -0,0 +1,172 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_REQUEST_LIMITER_HPP
+#define XTENSOR_ZARR_REQUEST_LIMITER_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <random>
+#include <thread>
+
+namespace xt
+{
+    /**
+     * @class xzarr_request_config
+     * @brief Configuration of the requests of the cloud stores.
+     */
+    struct xzarr_request_config
+    {
+        /// maximum number of requests in flight, shared by the copies of a store
+        std::size_t max_connections;
+        /// number of times a request is retried after a transient error
+        std::size_t max_retries;
+        /// upper bound of the delay before the first retry
+        std::chrono::milliseconds initial_backoff;
+        /// upper bound of the delay before a retry
+        std::chrono::milliseconds max_backoff;
+        /// size from which values are uploaded in parts (0 disables it)
+        std::size_t multipart_threshold;
+        /// size of the parts of an upload
+        std::size_t part_size;
+        /// number of threads uploading the parts of a value
+        std::size_t upload_threads;
+
+        xzarr_request_config()
+            : max_connections(16)
+            , max_retries(4)
+            , initial_backoff(100)
+            , max_backoff(10000)
+            , multipart_threshold(std::size_t(64) << 20)
+            , part_size(std::size_t(16) << 20)
+            , upload_threads(4)
+        {
+        }
+    };
+
+    /**
+     * @class xzarr_request_limiter
+     * @brief Concurrency limit and retries of the requests of a store.
+     *
+     * The xzarr_request_limiter class lets at most ``max_connections`` requests
+     * run at the same time, the other callers waiting for a slot, so that many
+     * threads reading chunks keep the connection pool busy without opening more
+     * connections than it holds. Requests failing with a transient error are
+     * retried after an exponential backoff with full jitter, outside of their
+     * slot, so that the retries of many threads do not come in bursts.
+     */
+    class xzarr_request_limiter
+    {
+    public:
+
+        explicit xzarr_request_limiter(const xzarr_request_config& config = xzarr_request_config());
+
+        template <class F, class R>
+        auto run(F&& request, R&& retryable);
+
+        const xzarr_request_config& config() const;
+
+    private:
+
+        class slot
+        {
+        public:
+
+            slot(xzarr_request_limiter& limiter);
+            ~slot();
+
+        private:
+
+            xzarr_request_limiter& m_limiter;
+        };
+
+        std::chrono::milliseconds backoff(std::size_t attempt) const;
+
+        xzarr_request_config m_config;
+        std::size_t m_active;
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+    };
+
+    /****************************************
+     * xzarr_request_limiter implementation *
+     ****************************************/
+
+    inline xzarr_request_limiter::xzarr_request_limiter(const xzarr_request_config& config)
+        : m_config(config)
+        , m_active(0)
+    {
+        m_config.max_connections = std::max(m_config.max_connections, std::size_t(1));
+    }
+
+    /**
+     * Runs a request when a slot is available, and retries it while it fails
+     * with a transient error.
+     * @param request the request, returning its outcome
+     * @param retryable a predicate telling if an outcome is a transient error
+     *
+     * @return returns the outcome of the last attempt.
+     */
+    template <class F, class R>
+    inline auto xzarr_request_limiter::run(F&& request, R&& retryable)
+    {
+        for (std::size_t attempt = 0; ; ++attempt)
+        {
+            {
+                slot s(*this);
+                auto outcome = request();
+                if (attempt == m_config.max_retries || !retryable(outcome))
+                {
+                    return outcome;
+                }
+            }
+            std::this_thread::sleep_for(backoff(attempt));
+        }
+    }
+
+    inline const xzarr_request_config& xzarr_request_limiter::config() const
+    {
+        return m_config;
+    }
+
+    inline std::chrono::milliseconds xzarr_request_limiter::backoff(std::size_t attempt) const
+    {
+        static thread_local std::minstd_rand engine(std::random_device{}());
+        auto bound = m_config.initial_backoff.count();
+        for (std::size_t i = 0; i < attempt && bound < m_config.max_backoff.count(); ++i)
+        {
+            bound *= 2;
+        }
+        bound = std::min(bound, m_config.max_backoff.count());
+        std::uniform_int_distribution<decltype(bound)> delay(0, bound);
+        return std::chrono::milliseconds(delay(engine));
+    }
+
+    inline xzarr_request_limiter::slot::slot(xzarr_request_limiter& limiter)
+        : m_limiter(limiter)
+    {
+        std::unique_lock<std::mutex> lock(m_limiter.m_mutex);
+        m_limiter.m_condition.wait(lock, [this]() { return m_limiter.m_active < m_limiter.m_config.max_connections; });
+        ++m_limiter.m_active;
+    }
+
+    inline xzarr_request_limiter::slot::~slot()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_limiter.m_mutex);
+            --m_limiter.m_active;
+        }
+        m_limiter.m_condition.notify_one();
+    }
+}
+
+#endif
@@ -0,0 +1,291 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_RESIZE_HPP
+#define XTENSOR_ZARR_RESIZE_HPP
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "xtensor/xarray.hpp"
+#include "xzarr_chunk_codec.hpp"
+#include "xzarr_common.hpp"
+#include "xzarr_metadata.hpp"
+#include "xzarr_rechunk.hpp"
+#include "xzarr_threading.hpp"
+
+namespace xt
+{
+    template <class store_type, class shape_type>
+    void resize_zarr_array(store_type store, const std::string& path, const shape_type& new_shape, std::size_t zarr_version_major, std::size_t nthreads = 0);
+
+    template <class store_type, class E>
+    std::size_t append_zarr_array(store_type store, const std::string& path, const xexpression<E>& data, std::size_t axis, std::size_t zarr_version_major, std::size_t nthreads = 0);
+
+    /**************************************
+     * zarr array resizing implementation *
+     **************************************/
+
+    namespace detail
+    {
+        // reads a chunk, or fills it with the fill value if it is not stored
+        template <class T, class store_type>
+        inline void read_chunk_or_fill(store_type& store, const xzarr_array_metadata& m, const std::vector<std::size_t>& index, xarray<T>& chunk, const T& fill)
+        {
+            if (!read_zarr_chunk(store, m, index, chunk))
+            {
+                chunk.fill(fill);
+            }
+        }
+
+        /**
+         * Resets to the fill value the elements of the stored boundary chunks that
+         * lie beyond the current shape along the axes that grow, so that stale
+         * values left by an earlier shrink do not reappear.
+         */
+        template <class T, class store_type>
+        inline void resize_boundary_chunks(store_type& store, const xzarr_array_metadata& m, const std::vector<std::size_t>& new_shape, std::size_t nthreads)
+        {
+            const std::size_t ndim = m.shape.size();
+            const auto grid = m.grid_shape();
+            if (std::find(grid.begin(), grid.end(), std::size_t(0)) != grid.end())
+            {
+                return;
+            }
+            std::vector<std::vector<std::size_t>> chunks;
+            std::vector<std::size_t> first(ndim, 0);
+            std::vector<std::size_t> last(ndim);
+            for (std::size_t d = 0; d < ndim; ++d)
+            {
+                // chunks beyond the new shape are erased instead
+                last[d] = std::min(grid[d], (new_shape[d] + m.chunk_shape[d] - 1) / m.chunk_shape[d]);
+                if (last[d] == 0)
+                {
+                    return;
+                }
+                --last[d];
+            }
+            for (std::size_t d = 0; d < ndim; ++d)
+            {
+                std::size_t boundary = m.shape[d] / m.chunk_shape[d];
+                if (new_shape[d] <= m.shape[d] || m.shape[d] % m.chunk_shape[d] == 0 || boundary > last[d])
+                {
+                    continue;
+                }
+                auto slab_first = first;
+                auto slab_last = last;
+                slab_first[d] = slab_last[d] = boundary;
+                for_each_chunk_index(slab_first, slab_last, [&](const std::vector<std::size_t>& index)
+                {
+                    chunks.push_back(index);
+                });
+            }
+            std::sort(chunks.begin(), chunks.end());
+            chunks.erase(std::unique(chunks.begin(), chunks.end()), chunks.end());
+
+            const T fill = fill_value_as<T>(m.fill_value);
+            const auto strides = rechunk_strides(m.chunk_shape, m.chunk_memory_layout);
+            xzarr_parallel_for(chunks.size(), nthreads, [&](std::size_t i)
+            {
+                const auto& index = chunks[i];
+                xarray<T> chunk(std::vector<std::size_t>{m.chunk_size()});
+                if (!read_zarr_chunk(store, m, index, chunk))
+                {
+                    return;
+                }
+                std::vector<std::size_t> offset(ndim, 0);
+                for (std::size_t d = 0; d < ndim; ++d)
+                {
+                    std::size_t origin = index[d] * m.chunk_shape[d];
+                    if (new_shape[d] > m.shape[d] && origin + m.chunk_shape[d] > m.shape[d])
+                    {
+                        std::vector<std::size_t> count = m.chunk_shape;
+                        offset[d] = m.shape[d] - origin;
+                        count[d] = m.chunk_shape[d] - offset[d];
+                        fill_block(chunk.data(), strides, offset, count, fill);
+                        offset[d] = 0;
+                    }
+                }
+                store_zarr_chunk(store, m, index, encode_zarr_chunk(m, chunk));
+            });
+        }
+
+        // erases the stored chunks lying entirely beyond a shape
+        template <class store_type>
+        inline void erase_chunks_beyond(store_type& store, const xzarr_array_metadata& m, const std::vector<std::size_t>& new_shape, std::size_t nthreads)
+        {
+            std::vector<std::vector<std::size_t>> chunks;
+            for (const auto& index: list_zarr_chunks(store, m))
+            {
+                for (std::size_t d = 0; d < index.size(); ++d)
+                {
+                    if (index[d] * m.chunk_shape[d] >= new_shape[d])
+                    {
+                        chunks.push_back(index);
+                        break;
+                    }
+                }
+            }
+            xzarr_parallel_for(chunks.size(), nthreads, [&](std::size_t i)
+            {
+                erase_stored_zarr_chunk(store, m, chunks[i]);
+            });
+        }
+    }
+
+    /**
+     * Changes the shape of an array of a store.
+     *
+     * Only the metadata document and the chunks at the boundary of the array are
+     * rewritten. When an axis grows, the elements of the boundary chunks beyond
+     * the current shape are reset to the fill value before the metadata is
+     * written, so that readers of the current shape never see a partial update.
+     * When an axis shrinks, the metadata is written first, then the chunks lying
+     * beyond the new shape are erased.
+     *
+     * Chunked arrays opened before the resize keep the previous shape and the
+     * chunks of their pool; they must be opened again to see the new shape.
+     *
+     * @param store the store
+     * @param path the path of the array
+     * @param new_shape the new shape of the array
+     * @param zarr_version_major the major version of the Zarr specification
+     * @param nthreads the number of threads (0 means the thread budget)
+     */
+    template <class store_type, class shape_type>
+    inline void resize_zarr_array(store_type store, const std::string& path, const shape_type& new_shape, std::size_t zarr_version_major, std::size_t nthreads)
+    {
+        auto m = read_zarr_array_metadata(store, path, zarr_version_major, false);
+        std::vector<std::size_t> shape(new_shape.begin(), new_shape.end());
+        if (shape.size() != m.shape.size())
+        {
+            XTENSOR_THROW(std::runtime_error, "Cannot resize: new shape does not match the array dimension");
+        }
+        // erased once for all the chunk writes below
+        detail::invalidate_chunk_stats(store, m);
+        xzarr_dispatch_dtype(m.dtype_noendian(), [&](auto tag)
+        {
+            using value_type = typename decltype(tag)::type;
+            detail::resize_boundary_chunks<value_type>(store, m, shape, nthreads);
+        });
+        auto resized = m;
+        resized.shape = shape;
+        write_zarr_array_metadata(store, resized);
+        detail::erase_chunks_beyond(store, m, shape, nthreads);
+    }
+
+    /**
+     * Appends data to an array of a store along an axis.
+     *
+     * The chunks receiving the data are written before the metadata document,
+     * so that readers of the current shape never see a partial append. The
+     * elements of these chunks beyond the new shape take the fill value.
+     *
+     * @param store the store
+     * @param path the path of the array
+     * @param data the data to append, whose shape matches the shape of the array except along axis
+     * @param axis the axis to append along
+     * @param zarr_version_major the major version of the Zarr specification
+     * @param nthreads the number of threads (0 means the thread budget)
+     *
+     * @return returns the previous extent of the array along axis.
+     */
+    template <class store_type, class E>
+    inline std::size_t append_zarr_array(store_type store, const std::string& path, const xexpression<E>& data, std::size_t axis, std::size_t zarr_version_major, std::size_t nthreads)
+    {
+        const E& e = data.derived_cast();
+        auto m = read_zarr_array_metadata(store, path, zarr_version_major, false);
+        const std::size_t ndim = m.shape.size();
+        std::vector<std::size_t> data_shape(e.shape().begin(), e.shape().end());
+        if (axis >= ndim || data_shape.size() != ndim)
+        {
+            XTENSOR_THROW(std::runtime_error, "Cannot append: data does not match the array dimension");
+        }
+        for (std::size_t d = 0; d < ndim; ++d)
+        {
+            if (d != axis && data_shape[d] != m.shape[d])
+            {
+                XTENSOR_THROW(std::runtime_error, "Cannot append: data shape does not match the array shape");
+            }
+        }
+        const std::size_t offset = m.shape[axis];
+        auto appended = m;
+        appended.shape[axis] += data_shape[axis];
+        // erased once for all the chunk writes below
+        detail::invalidate_chunk_stats(store, m);
+
+        xzarr_dispatch_dtype(m.dtype_noendian(), [&](auto tag)
+        {
+            using value_type = typename decltype(tag)::type;
+            auto grid = appended.grid_shape();
+            if (data_shape[axis] == 0 || std::find(grid.begin(), grid.end(), std::size_t(0)) != grid.end())
+            {
+                return;
+            }
+            xarray<value_type> values(data_shape);
+            std::copy(e.begin(), e.end(), values.begin());
+            const auto value_strides = detail::rechunk_strides(data_shape, 'C');
+            const auto chunk_strides = detail::rechunk_strides(m.chunk_shape, m.chunk_memory_layout);
+            const value_type fill = fill_value_as<value_type>(m.fill_value);
+
+            std::vector<std::size_t> first(ndim, 0);
+            std::vector<std::size_t> last(ndim);
+            for (std::size_t d = 0; d < ndim; ++d)
+            {
+                last[d] = grid[d] - 1;
+            }
+            first[axis] = offset / m.chunk_shape[axis];
+            std::vector<std::vector<std::size_t>> chunks;
+            detail::for_each_chunk_index(first, last, [&](const std::vector<std::size_t>& index)
+            {
+                chunks.push_back(index);
+            });
+
+            xzarr_parallel_for(chunks.size(), nthreads, [&](std::size_t i)
+            {
+                const auto& index = chunks[i];
+                xarray<value_type> chunk(std::vector<std::size_t>{m.chunk_size()});
+                std::vector<std::size_t> chunk_offset(ndim);
+                std::vector<std::size_t> value_offset(ndim);
+                std::vector<std::size_t> count(ndim);
+                std::size_t origin = index[axis] * m.chunk_shape[axis];
+                if (origin < offset)
+                {
+                    // boundary chunk: keep its elements within the current shape
+                    detail::read_chunk_or_fill(store, m, index, chunk, fill);
+                    std::vector<std::size_t> zero(ndim, 0);
+                    count = m.chunk_shape;
+                    zero[axis] = offset - origin;
+                    count[axis] = m.chunk_shape[axis] - zero[axis];
+                    detail::fill_block(chunk.data(), chunk_strides, zero, count, fill);
+                }
+                else
+                {
+                    chunk.fill(fill);
+                }
+                for (std::size_t d = 0; d < ndim; ++d)
+                {
+                    std::size_t chunk_origin = index[d] * m.chunk_shape[d];
+                    std::size_t begin = (d == axis) ? std::max(chunk_origin, offset) : chunk_origin;
+                    std::size_t end = std::min(chunk_origin + m.chunk_shape[d], appended.shape[d]);
+                    chunk_offset[d] = begin - chunk_origin;
+                    value_offset[d] = (d == axis) ? begin - offset : begin;
+                    count[d] = end - begin;
+                }
+                detail::copy_block(values.data(), value_strides, value_offset, chunk.data(), chunk_strides, chunk_offset, count);
+                detail::store_zarr_chunk(store, m, index, encode_zarr_chunk(m, chunk));
+            });
+        });
+        write_zarr_array_metadata(store, appended);
+        return offset;
+    }
+}
+
+#endif
@@ -0,0 +1,617 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_SQLITE_STORE_HPP
+#define XTENSOR_ZARR_SQLITE_STORE_HPP
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "sqlite3.h"
+#include "xzarr_common.hpp"
+#include "xzarr_store_handler.hpp"
+
+namespace xt
+{
+    /**
+     * @class xzarr_sqlite_config
+     * @brief Configuration of the SQLite store.
+     */
+    struct xzarr_sqlite_config
+    {
+        /// number of writes grouped in a transaction (1 commits each write)
+        std::size_t batch_size;
+        /// size of the memory mapping of the database file, in bytes (0 disables it)
+        std::size_t mmap_size;
+        /// open the database read-only
+        bool read_only;
+
+        xzarr_sqlite_config()
+            : batch_size(1000)
+            , mmap_size(std::size_t(1) << 30)
+            , read_only(false)
+        {
+        }
+    };
+
+    class xzarr_sqlite_stream;
+
+    /**
+     * @class xzarr_sqlite_store
+     * @brief Zarr store handler for an SQLite database.
+     *
+     * The xzarr_sqlite_store class implements a Zarr store in a single SQLite
+     * database, as a table of (key, value) pairs sorted by key, for arrays with
+     * many small chunks where a file per key is the bottleneck.
+     *
+     * Keys are listed with range scans of the primary key. Writes are grouped
+     * in transactions of ``batch_size`` writes, which are committed when full,
+     * on flush and when the last copy of the store is destroyed; reads through
+     * the store see the pending writes. The database file is memory-mapped up
+     * to ``mmap_size`` bytes, so that values are read from the page cache
+     * without going through ``read`` calls.
+     *
+     * Copies of a store share the same connection, which is serialized.
+     *
+     * @sa xzarr_hierarchy
+     */
+    class xzarr_sqlite_store
+    {
+    public:
+
+        template <class C>
+        using io_handler = xzarr_store_handler<xzarr_sqlite_store, C>;
+
+        explicit xzarr_sqlite_store(const std::string& path, const xzarr_sqlite_config& config = xzarr_sqlite_config());
+
+        xzarr_sqlite_stream operator[](const std::string& key);
+        void list_dir(const std::string& prefix, std::vector<std::string>& keys, std::vector<std::string>& prefixes);
+        std::vector<std::string> list();
+        std::vector<std::string> list_prefix(const std::string& prefix);
+        template <class F>
+        void visit_prefix(const std::string& prefix, F&& f);
+        void erase(const std::string& key);
+        void erase_prefix(const std::string& prefix);
+        void set(const std::string& key, const std::vector<char>& value);
+        void set(const std::string& key, const std::string& value);
+        std::string get(const std::string& key);
+        bool exists(const std::string& key);
+
+        template <class F>
+        bool visit(const std::string& key, F&& f);
+
+        void flush();
+
+        xzarr_sqlite_store get_io_config();
+        std::string get_root();
+
+    private:
+
+        enum statement_id { get_value, put_value, delete_value, delete_range, first_key, scan_range, begin_transaction, commit_transaction, statement_count };
+
+        struct state
+        {
+            ~state();
+
+            void check(int res, const char* what);
+            sqlite3_stmt* statement(statement_id id);
+            void write_started();
+            void commit();
+
+            std::string path;
+            xzarr_sqlite_config config;
+            sqlite3* db = nullptr;
+            sqlite3_stmt* statements[statement_count] = {};
+            std::size_t pending = 0;
+            std::mutex mutex;
+        };
+
+        // resets a statement when leaving the scope, whatever happens
+        class statement_guard
+        {
+        public:
+
+            statement_guard(sqlite3_stmt* stmt);
+            ~statement_guard();
+
+        private:
+
+            sqlite3_stmt* m_stmt;
+        };
+
+        static std::string prefix_end(const std::string& prefix);
+        void assign(const std::string& key, const char* value, std::size_t size);
+
+        std::shared_ptr<state> p_state;
+
+        friend class xzarr_sqlite_stream;
+    };
+
+    class xzarr_sqlite_stream
+    {
+    public:
+
+        xzarr_sqlite_stream(const xzarr_sqlite_store& store, const std::string& key);
+        operator std::string() const;
+        bool read(std::string& bytes) const;
+        void operator=(const std::vector<char>& value);
+        void operator=(const std::string& value);
+        void erase();
+        bool exists();
+
+    private:
+
+        xzarr_sqlite_store m_store;
+        std::string m_key;
+    };
+
+    /*************************************
+     * xzarr_sqlite_store implementation *
+     *************************************/
+
+    inline xzarr_sqlite_store::state::~state()
+    {
+        try
+        {
+            commit();
+        }
+        catch (...)
+        {
+        }
+        for (auto stmt: statements)
+        {
+            sqlite3_finalize(stmt);
+        }
+        sqlite3_close(db);
+    }
+
+    inline void xzarr_sqlite_store::state::check(int res, const char* what)
+    {
+        if (res != SQLITE_OK && res != SQLITE_DONE && res != SQLITE_ROW)
+        {
+            XTENSOR_THROW(std::runtime_error, std::string("SQLite store ") + what + " failed (" + path + "): " + sqlite3_errmsg(db));
+        }
+    }
+
+    inline sqlite3_stmt* xzarr_sqlite_store::state::statement(statement_id id)
+    {
+        static const char* sql[statement_count] = {
+            "SELECT value FROM zarr WHERE key = ?1",
+            "INSERT OR REPLACE INTO zarr (key, value) VALUES (?1, ?2)",
+            "DELETE FROM zarr WHERE key = ?1",
+            "DELETE FROM zarr WHERE key >= ?1 AND key < ?2",
+            "SELECT key FROM zarr WHERE key >= ?1 AND key < ?2 ORDER BY key LIMIT 1",
+            "SELECT key FROM zarr WHERE key >= ?1 AND key < ?2 ORDER BY key LIMIT ?3",
+            "BEGIN",
+            "COMMIT"
+        };
+        if (statements[id] == nullptr)
+        {
+            check(sqlite3_prepare_v2(db, sql[id], -1, &statements[id], nullptr), "prepare");
+        }
+        return statements[id];
+    }
+
+    inline void xzarr_sqlite_store::state::write_started()
+    {
+        if (pending == 0 && config.batch_size > 1)
+        {
+            sqlite3_stmt* stmt = statement(begin_transaction);
+            statement_guard guard(stmt);
+            check(sqlite3_step(stmt), "begin");
+        }
+        ++pending;
+    }
+
+    inline void xzarr_sqlite_store::state::commit()
+    {
+        if (pending != 0 && config.batch_size > 1)
+        {
+            sqlite3_stmt* stmt = statement(commit_transaction);
+            statement_guard guard(stmt);
+            check(sqlite3_step(stmt), "commit");
+        }
+        pending = 0;
+    }
+
+    inline xzarr_sqlite_store::statement_guard::statement_guard(sqlite3_stmt* stmt)
+        : m_stmt(stmt)
+    {
+    }
+
+    inline xzarr_sqlite_store::statement_guard::~statement_guard()
+    {
+        sqlite3_reset(m_stmt);
+        sqlite3_clear_bindings(m_stmt);
+    }
+
+    /**
+     * Opens or creates an SQLite store.
+     * @param path the path of the database file
+     * @param config the configuration of the store
+     */
+    inline xzarr_sqlite_store::xzarr_sqlite_store(const std::string& path, const xzarr_sqlite_config& config)
+        : p_state(std::make_shared<state>())
+    {
+        state& s = *p_state;
+        s.path = path;
+        s.config = config;
+        int flags = config.read_only ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+        // connections are serialized by the store
+        flags |= SQLITE_OPEN_NOMUTEX;
+        if (sqlite3_open_v2(path.c_str(), &s.db, flags, nullptr) != SQLITE_OK)
+        {
+            std::string message = s.db != nullptr ? sqlite3_errmsg(s.db) : "out of memory";
+            XTENSOR_THROW(std::runtime_error, "Could not open SQLite store " + path + ": " + message);
+        }
+        std::string pragmas = "PRAGMA mmap_size = " + std::to_string(config.mmap_size) + ";";
+        if (!config.read_only)
+        {
+            // readers of other connections are not blocked by the writes
+            pragmas += "PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL;"
+                       "CREATE TABLE IF NOT EXISTS zarr (key TEXT PRIMARY KEY, value BLOB) WITHOUT ROWID;";
+        }
+        s.check(sqlite3_exec(s.db, pragmas.c_str(), nullptr, nullptr, nullptr), "initialization");
+    }
+
+    // smallest string greater than all the strings starting with prefix
+    inline std::string xzarr_sqlite_store::prefix_end(const std::string& prefix)
+    {
+        std::string end = prefix;
+        while (!end.empty() && static_cast<unsigned char>(end.back()) == 0xFF)
+        {
+            end.pop_back();
+        }
+        if (end.empty())
+        {
+            // no upper bound
+            return std::string(1, char(0xFF)) + char(0xFF);
+        }
+        end.back() = char(static_cast<unsigned char>(end.back()) + 1);
+        return end;
+    }
+
+    inline void xzarr_sqlite_store::assign(const std::string& key, const char* value, std::size_t size)
+    {
+        std::string k = normalize_key(key);
+        state& s = *p_state;
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.write_started();
+        {
+            sqlite3_stmt* stmt = s.statement(put_value);
+            statement_guard guard(stmt);
+            sqlite3_bind_text(stmt, 1, k.data(), int(k.size()), SQLITE_STATIC);
+            sqlite3_bind_blob64(stmt, 2, value, sqlite3_uint64(size), SQLITE_STATIC);
+            s.check(sqlite3_step(stmt), "write");
+        }
+        if (s.pending >= s.config.batch_size)
+        {
+            s.commit();
+        }
+    }
+
+    inline xzarr_sqlite_stream xzarr_sqlite_store::operator[](const std::string& key)
+    {
+        return xzarr_sqlite_stream(*this, normalize_key(key));
+    }
+
+    /**
+     * Store a (key, value) pair.
+     * @param key the key
+     * @param value the value
+     */
+    inline void xzarr_sqlite_store::set(const std::string& key, const std::vector<char>& value)
+    {
+        assign(key, value.data(), value.size());
+    }
+
+    /**
+     * Store a (key, value) pair.
+     * @param key the key
+     * @param value the value
+     */
+    inline void xzarr_sqlite_store::set(const std::string& key, const std::string& value)
+    {
+        assign(key, value.data(), value.size());
+    }
+
+    /**
+     * Retrieve the value associated with a given key.
+     * @param key the key to get the value from
+     *
+     * @return returns the value for the given key.
+     */
+    inline std::string xzarr_sqlite_store::get(const std::string& key)
+    {
+        return (*this)[key];
+    }
+
+    /**
+     * Calls ``f(data, size)`` with the value associated with a given key, in
+     * place in the database pages (memory-mapped when possible), without copying it.
+     * The pointer is only valid during the call, and the store must not be used by ``f``.
+     * @param key the key
+     * @param f the function to call
+     *
+     * @return returns false if the key is not in the store.
+     */
+    template <class F>
+    inline bool xzarr_sqlite_store::visit(const std::string& key, F&& f)
+    {
+        std::string k = normalize_key(key);
+        state& s = *p_state;
+        std::lock_guard<std::mutex> lock(s.mutex);
+        sqlite3_stmt* stmt = s.statement(get_value);
+        statement_guard guard(stmt);
+        sqlite3_bind_text(stmt, 1, k.data(), int(k.size()), SQLITE_STATIC);
+        int res = sqlite3_step(stmt);
+        s.check(res, "read");
+        if (res != SQLITE_ROW)
+        {
+            return false;
+        }
+        const char* data = static_cast<const char*>(sqlite3_column_blob(stmt, 0));
+        std::size_t size = std::size_t(sqlite3_column_bytes(stmt, 0));
+        f(data, size);
+        return true;
+    }
+
+    /**
+     * Returns true if the given key is in the store.
+     * @param key the key
+     */
+    inline bool xzarr_sqlite_store::exists(const std::string& key)
+    {
+        return visit(key, [](const char*, std::size_t) {});
+    }
+
+    /**
+     * Retrieve all keys and prefixes with a given prefix and which do not contain the character “/” after the given prefix.
+     *
+     * Each prefix is skipped with a single index lookup, so that listing a
+     * group does not scan the chunks of its arrays.
+     *
+     * @param prefix the prefix
+     * @param keys set of keys to be returned by reference
+     * @param prefixes set of prefixes to be returned by reference
+     */
+    inline void xzarr_sqlite_store::list_dir(const std::string& prefix, std::vector<std::string>& keys, std::vector<std::string>& prefixes)
+    {
+        std::string p = normalize_key(prefix);
+        if (!p.empty())
+        {
+            p.push_back('/');
+        }
+        std::string last = prefix_end(p);
+        std::string first = p;
+        state& s = *p_state;
+        std::lock_guard<std::mutex> lock(s.mutex);
+        sqlite3_stmt* stmt = s.statement(first_key);
+        while (true)
+        {
+            std::string key;
+            {
+                statement_guard guard(stmt);
+                sqlite3_bind_text(stmt, 1, first.data(), int(first.size()), SQLITE_STATIC);
+                sqlite3_bind_text(stmt, 2, last.data(), int(last.size()), SQLITE_STATIC);
+                int res = sqlite3_step(stmt);
+                s.check(res, "list");
+                if (res != SQLITE_ROW)
+                {
+                    break;
+                }
+                key.assign(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)), std::size_t(sqlite3_column_bytes(stmt, 0)));
+            }
+            std::size_t i = key.find('/', p.size());
+            if (i == std::string::npos)
+            {
+                keys.push_back(key);
+                // next key
+                first = key + char(0);
+            }
+            else
+            {
+                std::string sub = key.substr(0, i);
+                prefixes.push_back(sub);
+                first = sub + char('/' + 1);
+            }
+        }
+    }
+
+    /**
+     * Retrieve all keys from the store.
+     *
+     * @return returns a set of keys.
+     */
+    inline std::vector<std::string> xzarr_sqlite_store::list()
+    {
+        return list_prefix("");
+    }
+
+    /**
+     * Retrieve all keys with a given prefix from the store.
+     *
+     * @param prefix the prefix
+     *
+     * @return returns a set of keys with a given prefix.
+     */
+    inline std::vector<std::string> xzarr_sqlite_store::list_prefix(const std::string& prefix)
+    {
+        std::vector<std::string> keys;
+        visit_prefix(prefix, [&keys](const std::string& key) { keys.push_back(key); });
+        return keys;
+    }
+
+    /**
+     * Calls ``f(key)`` for each key with a given prefix, in lexicographic order.
+     * The keys are read one page at a time, and the store is not locked while
+     * ``f`` runs, so that ``f`` can use it.
+     * @param prefix the prefix
+     * @param f the function to call
+     */
+    template <class F>
+    inline void xzarr_sqlite_store::visit_prefix(const std::string& prefix, F&& f)
+    {
+        std::string first = normalize_key(prefix);
+        if (!first.empty())
+        {
+            first.push_back('/');
+        }
+        std::string last = prefix_end(first);
+        std::vector<std::string> page;
+        const int page_size = 1024;
+        do
+        {
+            page.clear();
+            {
+                state& s = *p_state;
+                std::lock_guard<std::mutex> lock(s.mutex);
+                sqlite3_stmt* stmt = s.statement(scan_range);
+                statement_guard guard(stmt);
+                sqlite3_bind_text(stmt, 1, first.data(), int(first.size()), SQLITE_STATIC);
+                sqlite3_bind_text(stmt, 2, last.data(), int(last.size()), SQLITE_STATIC);
+                sqlite3_bind_int(stmt, 3, page_size);
+                int res;
+                while ((res = sqlite3_step(stmt)) == SQLITE_ROW)
+                {
+                    page.emplace_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)), std::size_t(sqlite3_column_bytes(stmt, 0)));
+                }
+                s.check(res, "list");
+            }
+            for (const auto& key: page)
+            {
+                f(key);
+            }
+            if (!page.empty())
+            {
+                // next key
+                first = page.back() + char(0);
+            }
+        }
+        while (page.size() == std::size_t(page_size));
+    }
+
+    /**
+     * Erase the given (key, value) pair from the store.
+     * @param key the key
+     */
+    inline void xzarr_sqlite_store::erase(const std::string& key)
+    {
+        std::string k = normalize_key(key);
+        state& s = *p_state;
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.write_started();
+        {
+            sqlite3_stmt* stmt = s.statement(delete_value);
+            statement_guard guard(stmt);
+            sqlite3_bind_text(stmt, 1, k.data(), int(k.size()), SQLITE_STATIC);
+            s.check(sqlite3_step(stmt), "erase");
+        }
+        if (s.pending >= s.config.batch_size)
+        {
+            s.commit();
+        }
+    }
+
+    /**
+     * Erase all the keys with the given prefix from the store.
+     * @param prefix the prefix
+     */
+    inline void xzarr_sqlite_store::erase_prefix(const std::string& prefix)
+    {
+        std::string p = normalize_key(prefix);
+        if (!p.empty())
+        {
+            p.push_back('/');
+        }
+        std::string last = prefix_end(p);
+        state& s = *p_state;
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.write_started();
+        {
+            sqlite3_stmt* stmt = s.statement(delete_range);
+            statement_guard guard(stmt);
+            sqlite3_bind_text(stmt, 1, p.data(), int(p.size()), SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, last.data(), int(last.size()), SQLITE_STATIC);
+            s.check(sqlite3_step(stmt), "erase");
+        }
+        s.commit();
+    }
+
+    /**
+     * Commits the pending writes.
+     */
+    inline void xzarr_sqlite_store::flush()
+    {
+        std::lock_guard<std::mutex> lock(p_state->mutex);
+        p_state->commit();
+    }
+
+    inline xzarr_sqlite_store xzarr_sqlite_store::get_io_config()
+    {
+        return *this;
+    }
+
+    inline std::string xzarr_sqlite_store::get_root()
+    {
+        return "";
+    }
+
+    /**************************************
+     * xzarr_sqlite_stream implementation *
+     **************************************/
+
+    inline xzarr_sqlite_stream::xzarr_sqlite_stream(const xzarr_sqlite_store& store, const std::string& key)
+        : m_store(store)
+        , m_key(key)
+    {
+    }
+
+    inline xzarr_sqlite_stream::operator std::string() const
+    {
+        std::string bytes;
+        if (!read(bytes))
+        {
+            XTENSOR_THROW(std::runtime_error, "Key not found: " + m_key);
+        }
+        return bytes;
+    }
+
+    inline bool xzarr_sqlite_stream::read(std::string& bytes) const
+    {
+        return const_cast<xzarr_sqlite_store&>(m_store).visit(m_key, [&bytes](const char* data, std::size_t size)
+        {
+            bytes.assign(data, size);
+        });
+    }
+
+    inline void xzarr_sqlite_stream::operator=(const std::vector<char>& value)
+    {
+        m_store.assign(m_key, value.data(), value.size());
+    }
+
+    inline void xzarr_sqlite_stream::operator=(const std::string& value)
+    {
+        m_store.assign(m_key, value.data(), value.size());
+    }
+
+    inline void xzarr_sqlite_stream::erase()
+    {
+        m_store.erase(m_key);
+    }
+
+    inline bool xzarr_sqlite_stream::exists()
+    {
+        return m_store.exists(m_key);
+    }
+}
+
+#endif
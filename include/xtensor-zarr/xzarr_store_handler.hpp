@@ -0,0 +1,237 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_STORE_HANDLER_HPP
+#define XTENSOR_ZARR_STORE_HANDLER_HPP
+
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <string>
+
+#include "xtensor-io/xio_binary.hpp"
+#include "xzarr_checksum.hpp"
+#include "xzarr_chunk_stats.hpp"
+#include "xzarr_common.hpp"
+
+namespace xt
+{
+    namespace detail
+    {
+        /**
+         * Input stream buffer over an existing buffer, so that chunks are
+         * decoded from the bytes read without another copy.
+         */
+        class xzarr_input_streambuf : public std::streambuf
+        {
+        public:
+
+            xzarr_input_streambuf(const std::string& buffer)
+            {
+                char* data = const_cast<char*>(buffer.data());
+                setg(data, data, data + buffer.size());
+            }
+
+        protected:
+
+            pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override
+            {
+                if (!(which & std::ios_base::in))
+                {
+                    return pos_type(off_type(-1));
+                }
+                off_type base = (dir == std::ios_base::beg) ? 0 : (dir == std::ios_base::cur) ? gptr() - eback() : egptr() - eback();
+                off_type pos = base + off;
+                if (pos < 0 || pos > egptr() - eback())
+                {
+                    return pos_type(off_type(-1));
+                }
+                setg(eback(), eback() + pos, egptr());
+                return pos_type(pos);
+            }
+
+            pos_type seekpos(pos_type pos, std::ios_base::openmode which) override
+            {
+                return seekoff(off_type(pos), std::ios_base::beg, which);
+            }
+        };
+
+        /**
+         * Output stream buffer appending to a string, whose capacity is kept
+         * between chunks.
+         */
+        class xzarr_output_streambuf : public std::streambuf
+        {
+        public:
+
+            xzarr_output_streambuf(std::string& buffer)
+                : m_buffer(buffer)
+            {
+            }
+
+        protected:
+
+            int_type overflow(int_type c) override
+            {
+                if (!traits_type::eq_int_type(c, traits_type::eof()))
+                {
+                    m_buffer.push_back(traits_type::to_char_type(c));
+                }
+                return traits_type::not_eof(c);
+            }
+
+            std::streamsize xsputn(const char* s, std::streamsize n) override
+            {
+                m_buffer.append(s, std::size_t(n));
+                return n;
+            }
+
+        private:
+
+            std::string& m_buffer;
+        };
+    }
+
+    /**
+     * @class xzarr_store_handler
+     * @brief Chunk I/O handler going through the key-value interface of a store.
+     *
+     * The xzarr_store_handler class reads and writes chunks with the ``operator[]``
+     * of a store, for stores whose values are not files (e.g. xzarr_memory_store).
+     * The I/O configuration is the store itself, whose copies must share their
+     * content. Chunk paths are turned into keys by removing the root of the store.
+     * A chunk is read with a single lookup, through the ``read(std::string&)``
+     * method of the stream, which returns false if the key is missing.
+     * With an xzarr_checksum_config, the digest of each chunk is written and
+     * checked along with it, and the statistics of each written chunk are
+     * given to the xzarr_chunk_stats_recorder of the array.
+     *
+     * @tparam store_type The type of the store
+     * @tparam C The format configuration (e.g. xio_gzip_config)
+     */
+    template <class store_type, class C>
+    class xzarr_store_handler
+    {
+    public:
+
+        using io_config = store_type;
+
+        template <class E>
+        void write(const xexpression<E>& expression, const std::string& path, xfile_dirty dirty);
+
+        template <class ET>
+        void read(ET& array, const std::string& path);
+
+        void configure(const C& format_config, const store_type& store);
+        void configure_io(const store_type& store);
+
+    private:
+
+        std::string get_key(const std::string& path) const;
+
+        C m_format_config;
+        std::shared_ptr<store_type> m_store;
+        std::string m_root;
+        std::string m_buffer;
+        std::shared_ptr<detail::chunk_stats_sink> p_stats;
+    };
+
+    /**************************************
+     * xzarr_store_handler implementation *
+     **************************************/
+
+    template <class store_type, class C>
+    template <class E>
+    inline void xzarr_store_handler<store_type, C>::write(const xexpression<E>& expression, const std::string& path, xfile_dirty dirty)
+    {
+        if (m_format_config.will_dump(dirty))
+        {
+            m_buffer.clear();
+            {
+                detail::xzarr_output_streambuf buffer(m_buffer);
+                std::ostream stream(&buffer);
+                dump_file(stream, expression, m_format_config);
+            }
+            std::string key = get_key(path);
+            xzarr_chunk_stats stats;
+            if (p_stats)
+            {
+                stats = detail::expression_stats(expression);
+                p_stats->begin_write();
+            }
+            const xzarr_checksum_options* checksum = detail::chunk_checksum(m_format_config);
+            if (checksum == nullptr)
+            {
+                (*m_store)[key] = m_buffer;
+            }
+            else
+            {
+                std::string digest = detail::seal_chunk(m_buffer, *checksum);
+                (*m_store)[key] = m_buffer;
+                if (checksum->sidecar)
+                {
+                    (*m_store)[detail::checksum_sidecar_key(key, checksum->type)] = digest;
+                }
+            }
+            if (p_stats)
+            {
+                p_stats->record_path(key, stats);
+            }
+        }
+    }
+
+    template <class store_type, class C>
+    template <class ET>
+    inline void xzarr_store_handler<store_type, C>::read(ET& array, const std::string& path)
+    {
+        // a missing chunk keeps the fill value
+        std::string key = get_key(path);
+        if ((*m_store)[key].read(m_buffer))
+        {
+            const xzarr_checksum_options* checksum = detail::chunk_checksum(m_format_config);
+            if (checksum != nullptr)
+            {
+                std::string digest;
+                bool has_digest = checksum->sidecar && checksum->verify && (*m_store)[detail::checksum_sidecar_key(key, checksum->type)].read(digest);
+                detail::open_chunk(m_buffer, *checksum, has_digest ? &digest : nullptr, key);
+            }
+            detail::xzarr_input_streambuf buffer(m_buffer);
+            std::istream stream(&buffer);
+            load_file<ET>(stream, array, m_format_config);
+        }
+    }
+
+    template <class store_type, class C>
+    inline void xzarr_store_handler<store_type, C>::configure(const C& format_config, const store_type& store)
+    {
+        m_format_config = format_config;
+        p_stats = detail::find_chunk_stats_sink(detail::chunk_stats_sink_id(m_format_config));
+        configure_io(store);
+    }
+
+    template <class store_type, class C>
+    inline void xzarr_store_handler<store_type, C>::configure_io(const store_type& store)
+    {
+        m_store = std::make_shared<store_type>(store);
+        m_root = m_store->get_root();
+    }
+
+    template <class store_type, class C>
+    inline std::string xzarr_store_handler<store_type, C>::get_key(const std::string& path) const
+    {
+        if (!m_root.empty() && path.size() > m_root.size() && path.compare(0, m_root.size(), m_root) == 0 && path[m_root.size()] == '/')
+        {
+            return path.substr(m_root.size() + 1);
+        }
+        return path;
+    }
+}
+
+#endif
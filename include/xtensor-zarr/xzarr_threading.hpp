@@ -0,0 +1,273 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_THREADING_HPP
+#define XTENSOR_ZARR_THREADING_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace xt
+{
+    /**
+     * @class xzarr_thread_policy
+     * @brief Process-wide thread budget shared by chunk-level and codec-level parallelism.
+     *
+     * Chunk-level workers (see xzarr_parallel_for) register themselves while they run,
+     * and codecs that can use internal threads (e.g. blosc) ask the policy how many
+     * threads they may use, so that the product of both never exceeds the budget.
+     * A codec called outside of a chunk-level worker (e.g. when the chunk pool of a
+     * zarray is read) registers its calling thread as a worker for the duration of
+     * the call, with a codec_scope, so that threads reading or writing chunks
+     * concurrently share the budget as well.
+     */
+    class xzarr_thread_policy
+    {
+    public:
+
+        static void set_max_threads(std::size_t n);
+        static std::size_t max_threads();
+        static std::size_t active_chunk_workers();
+        static std::size_t codec_threads(std::size_t requested = 0);
+
+        class chunk_workers_scope
+        {
+        public:
+            explicit chunk_workers_scope(std::size_t n);
+            ~chunk_workers_scope();
+
+            chunk_workers_scope(const chunk_workers_scope&) = delete;
+            chunk_workers_scope& operator=(const chunk_workers_scope&) = delete;
+
+        private:
+            std::size_t m_n;
+        };
+
+        class codec_scope
+        {
+        public:
+            codec_scope();
+            ~codec_scope();
+
+            codec_scope(const codec_scope&) = delete;
+            codec_scope& operator=(const codec_scope&) = delete;
+
+        private:
+            bool m_registered;
+        };
+
+        class worker_thread_scope
+        {
+        public:
+            worker_thread_scope();
+            ~worker_thread_scope();
+
+            worker_thread_scope(const worker_thread_scope&) = delete;
+            worker_thread_scope& operator=(const worker_thread_scope&) = delete;
+
+        private:
+            bool m_previous;
+        };
+
+    private:
+
+        static bool& in_chunk_worker();
+
+        static std::atomic<std::size_t>& max_threads_ref();
+        static std::atomic<std::size_t>& active_workers_ref();
+    };
+
+    /**************************************
+     * xzarr_thread_policy implementation *
+     **************************************/
+
+    inline std::atomic<std::size_t>& xzarr_thread_policy::max_threads_ref()
+    {
+        static std::atomic<std::size_t> n(std::max<std::size_t>(std::thread::hardware_concurrency(), 1));
+        return n;
+    }
+
+    inline std::atomic<std::size_t>& xzarr_thread_policy::active_workers_ref()
+    {
+        static std::atomic<std::size_t> n(0);
+        return n;
+    }
+
+    /**
+     * Sets the total number of threads xtensor-zarr may use.
+     * @param n the thread budget (0 means the hardware concurrency)
+     */
+    inline void xzarr_thread_policy::set_max_threads(std::size_t n)
+    {
+        if (n == 0)
+        {
+            n = std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+        }
+        max_threads_ref() = n;
+    }
+
+    inline std::size_t xzarr_thread_policy::max_threads()
+    {
+        return max_threads_ref();
+    }
+
+    inline std::size_t xzarr_thread_policy::active_chunk_workers()
+    {
+        return active_workers_ref();
+    }
+
+    /**
+     * Returns the number of internal threads a codec may use for one chunk.
+     * @param requested the number of threads requested for the array (0 for automatic)
+     *
+     * @return returns the requested number of threads, capped so that codec threads
+     * times active chunk workers does not exceed the thread budget.
+     */
+    inline std::size_t xzarr_thread_policy::codec_threads(std::size_t requested)
+    {
+        std::size_t workers = std::max<std::size_t>(active_chunk_workers(), 1);
+        std::size_t available = std::max<std::size_t>(max_threads() / workers, 1);
+        if (requested == 0)
+        {
+            return available;
+        }
+        return std::min(requested, available);
+    }
+
+    inline xzarr_thread_policy::chunk_workers_scope::chunk_workers_scope(std::size_t n)
+        : m_n(n)
+    {
+        active_workers_ref() += m_n;
+    }
+
+    inline xzarr_thread_policy::chunk_workers_scope::~chunk_workers_scope()
+    {
+        active_workers_ref() -= m_n;
+    }
+
+    inline bool& xzarr_thread_policy::in_chunk_worker()
+    {
+        static thread_local bool in_worker = false;
+        return in_worker;
+    }
+
+    /**
+     * Registers the calling thread as a chunk-level worker while a codec runs,
+     * unless it already is one.
+     */
+    inline xzarr_thread_policy::codec_scope::codec_scope()
+        : m_registered(!in_chunk_worker())
+    {
+        if (m_registered)
+        {
+            ++active_workers_ref();
+            in_chunk_worker() = true;
+        }
+    }
+
+    inline xzarr_thread_policy::codec_scope::~codec_scope()
+    {
+        if (m_registered)
+        {
+            in_chunk_worker() = false;
+            --active_workers_ref();
+        }
+    }
+
+    /**
+     * Marks the calling thread as a registered chunk-level worker.
+     */
+    inline xzarr_thread_policy::worker_thread_scope::worker_thread_scope()
+        : m_previous(in_chunk_worker())
+    {
+        in_chunk_worker() = true;
+    }
+
+    inline xzarr_thread_policy::worker_thread_scope::~worker_thread_scope()
+    {
+        in_chunk_worker() = m_previous;
+    }
+
+    /**
+     * Calls ``f(i)`` for ``i`` in ``[0, n)`` on up to ``nthreads`` threads.
+     * The workers are registered in xzarr_thread_policy while they run, and the first
+     * exception thrown by ``f`` is rethrown in the calling thread.
+     *
+     * @param n the number of tasks
+     * @param nthreads the number of threads (0 means the thread budget)
+     * @param f the task function
+     */
+    template <class F>
+    inline void xzarr_parallel_for(std::size_t n, std::size_t nthreads, F&& f)
+    {
+        if (nthreads == 0)
+        {
+            nthreads = xzarr_thread_policy::max_threads();
+        }
+        nthreads = std::min(nthreads, n);
+        if (nthreads <= 1)
+        {
+            for (std::size_t i = 0; i < n; ++i)
+            {
+                f(i);
+            }
+            return;
+        }
+        xzarr_thread_policy::chunk_workers_scope scope(nthreads);
+        std::atomic<std::size_t> next(0);
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        auto worker = [&]()
+        {
+            xzarr_thread_policy::worker_thread_scope thread_scope;
+            while (true)
+            {
+                std::size_t i = next++;
+                if (i >= n)
+                {
+                    break;
+                }
+                try
+                {
+                    f(i);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error)
+                    {
+                        error = std::current_exception();
+                    }
+                    next = n;
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        threads.reserve(nthreads - 1);
+        for (std::size_t t = 0; t + 1 < nthreads; ++t)
+        {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto& t: threads)
+        {
+            t.join();
+        }
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+#endif
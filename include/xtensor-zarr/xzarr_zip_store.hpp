@@ -0,0 +1,838 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_ZIP_STORE_HPP
+#define XTENSOR_ZARR_ZIP_STORE_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "zlib.h"
+#include "xzarr_common.hpp"
+#include "xzarr_store_handler.hpp"
+
+namespace xt
+{
+    namespace detail
+    {
+        inline void zip_put(std::string& out, std::uint64_t value, std::size_t nbytes)
+        {
+            for (std::size_t i = 0; i < nbytes; ++i)
+            {
+                out.push_back(char((value >> (8 * i)) & 0xFF));
+            }
+        }
+
+        inline std::uint64_t zip_get(const char* in, std::size_t nbytes)
+        {
+            std::uint64_t value = 0;
+            for (std::size_t i = 0; i < nbytes; ++i)
+            {
+                value |= std::uint64_t(static_cast<unsigned char>(in[i])) << (8 * i);
+            }
+            return value;
+        }
+
+        inline std::uint32_t zip_crc32(const char* data, std::size_t size)
+        {
+            return std::uint32_t(crc32_z(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(data), size));
+        }
+
+        constexpr std::uint32_t zip_local_header_signature = 0x04034b50;
+        constexpr std::uint32_t zip_central_header_signature = 0x02014b50;
+        constexpr std::uint32_t zip_end_signature = 0x06054b50;
+        constexpr std::uint32_t zip64_end_signature = 0x06064b50;
+        constexpr std::uint32_t zip64_locator_signature = 0x07064b50;
+        constexpr std::uint64_t zip32_max = 0xFFFFFFFF;
+        constexpr std::uint64_t zip16_max = 0xFFFF;
+    }
+
+    class xzarr_zip_stream;
+
+    /**
+     * @class xzarr_zip_store
+     * @brief Zarr store handler for a zip file.
+     *
+     * The xzarr_zip_store class implements a Zarr store in a single zip file,
+     * so that a hierarchy can be shipped or archived as one file instead of one
+     * file per chunk.
+     *
+     * - In read mode (``'r'``), the file is mapped in memory and its central
+     *   directory is used as an index of the keys; values must be stored
+     *   uncompressed, chunks being already compressed by their codec.
+     * - In write mode (``'w'``), the file is created and values are appended as
+     *   they are written; the central directory is written by flush, close or
+     *   the destruction of the last copy of the store.
+     * - In append mode (``'a'``), an existing file is opened for writing, new
+     *   values being appended after the existing ones.
+     *
+     * Overwritten and erased values are removed from the central directory but
+     * their bytes stay in the file. ZIP64 records are written when the file, a
+     * value or the number of values exceeds the limits of the zip format.
+     *
+     * @sa xzarr_hierarchy
+     */
+    class xzarr_zip_store
+    {
+    public:
+
+        template <class C>
+        using io_handler = xzarr_store_handler<xzarr_zip_store, C>;
+
+        explicit xzarr_zip_store(const std::string& path, char mode = 'r');
+
+        xzarr_zip_stream operator[](const std::string& key);
+        void list_dir(const std::string& prefix, std::vector<std::string>& keys, std::vector<std::string>& prefixes);
+        std::vector<std::string> list();
+        std::vector<std::string> list_prefix(const std::string& prefix);
+        void erase(const std::string& key);
+        void erase_prefix(const std::string& prefix);
+        void set(const std::string& key, const std::vector<char>& value);
+        void set(const std::string& key, const std::string& value);
+        std::string get(const std::string& key);
+        bool exists(const std::string& key);
+
+        void flush();
+        void close();
+
+        xzarr_zip_store get_io_config();
+        std::string get_root();
+
+    private:
+
+        struct entry
+        {
+            std::uint64_t header_offset;
+            std::uint64_t data_offset;
+            std::uint64_t size;
+            std::uint32_t crc;
+        };
+
+        struct state
+        {
+            ~state();
+
+            void read_at(char* buffer, std::size_t size, std::uint64_t offset);
+            void write_at(const char* buffer, std::size_t size, std::uint64_t offset);
+            void read_central_directory();
+            std::uint64_t data_offset(const entry& e);
+            void flush();
+            void close();
+
+            std::string path;
+            char mode;
+            int fd = -1;
+            const char* mapping = nullptr;
+            std::uint64_t file_size = 0;
+            std::uint64_t end = 0;
+            bool dirty = false;
+            std::map<std::string, entry> index;
+            std::mutex mutex;
+        };
+
+        void check_writable() const;
+        void assign(const std::string& key, const char* value, std::size_t size);
+
+        std::shared_ptr<state> p_state;
+
+        friend class xzarr_zip_stream;
+    };
+
+    class xzarr_zip_stream
+    {
+    public:
+
+        xzarr_zip_stream(const xzarr_zip_store& store, const std::string& key);
+        operator std::string() const;
+        bool read(std::string& bytes) const;
+        void operator=(const std::vector<char>& value);
+        void operator=(const std::string& value);
+        void erase();
+        bool exists();
+
+    private:
+
+        xzarr_zip_store m_store;
+        std::string m_key;
+    };
+
+    /**********************************
+     * xzarr_zip_store implementation *
+     **********************************/
+
+    inline xzarr_zip_store::state::~state()
+    {
+        try
+        {
+            close();
+        }
+        catch (...)
+        {
+        }
+    }
+
+    inline void xzarr_zip_store::state::read_at(char* buffer, std::size_t size, std::uint64_t offset)
+    {
+        if (offset + size > file_size)
+        {
+            XTENSOR_THROW(std::runtime_error, "Corrupted zip file: " + path);
+        }
+        if (mapping != nullptr)
+        {
+            std::memcpy(buffer, mapping + offset, size);
+            return;
+        }
+#if defined(_WIN32)
+        // the caller holds the mutex
+        _lseeki64(fd, __int64(offset), SEEK_SET);
+        std::size_t done = 0;
+        while (done < size)
+        {
+            int n = _read(fd, buffer + done, unsigned(std::min(size - done, std::size_t(1) << 30)));
+            if (n <= 0)
+            {
+                XTENSOR_THROW(std::runtime_error, "Could not read zip file: " + path);
+            }
+            done += std::size_t(n);
+        }
+#else
+        std::size_t done = 0;
+        while (done < size)
+        {
+            ssize_t n = ::pread(fd, buffer + done, size - done, off_t(offset + done));
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                XTENSOR_THROW(std::runtime_error, "Could not read zip file: " + path);
+            }
+            done += std::size_t(n);
+        }
+#endif
+    }
+
+    inline void xzarr_zip_store::state::write_at(const char* buffer, std::size_t size, std::uint64_t offset)
+    {
+#if defined(_WIN32)
+        _lseeki64(fd, __int64(offset), SEEK_SET);
+        std::size_t done = 0;
+        while (done < size)
+        {
+            int n = _write(fd, buffer + done, unsigned(std::min(size - done, std::size_t(1) << 30)));
+            if (n <= 0)
+            {
+                XTENSOR_THROW(std::runtime_error, "Could not write zip file: " + path);
+            }
+            done += std::size_t(n);
+        }
+#else
+        std::size_t done = 0;
+        while (done < size)
+        {
+            ssize_t n = ::pwrite(fd, buffer + done, size - done, off_t(offset + done));
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                XTENSOR_THROW(std::runtime_error, "Could not write zip file: " + path);
+            }
+            done += std::size_t(n);
+        }
+#endif
+        if (offset + size > file_size)
+        {
+            file_size = offset + size;
+        }
+    }
+
+    inline void xzarr_zip_store::state::read_central_directory()
+    {
+        // the end of central directory record is followed by a comment of at most 65535 bytes
+        std::uint64_t tail_size = std::min<std::uint64_t>(file_size, 22 + detail::zip16_max);
+        std::string tail(tail_size, '\0');
+        read_at(&tail[0], tail.size(), file_size - tail_size);
+        std::size_t eocd = std::string::npos;
+        for (std::size_t i = tail.size() >= 22 ? tail.size() - 22 + 1 : 0; i-- > 0;)
+        {
+            if (detail::zip_get(&tail[i], 4) == detail::zip_end_signature)
+            {
+                eocd = i;
+                break;
+            }
+        }
+        if (eocd == std::string::npos)
+        {
+            XTENSOR_THROW(std::runtime_error, "Not a zip file: " + path);
+        }
+        std::uint64_t count = detail::zip_get(&tail[eocd + 10], 2);
+        std::uint64_t cd_size = detail::zip_get(&tail[eocd + 12], 4);
+        std::uint64_t cd_offset = detail::zip_get(&tail[eocd + 16], 4);
+        if (count == detail::zip16_max || cd_size == detail::zip32_max || cd_offset == detail::zip32_max)
+        {
+            std::uint64_t eocd_offset = file_size - tail_size + eocd;
+            if (eocd_offset < 20)
+            {
+                XTENSOR_THROW(std::runtime_error, "Corrupted zip file: " + path);
+            }
+            char locator[20];
+            read_at(locator, 20, eocd_offset - 20);
+            if (detail::zip_get(locator, 4) != detail::zip64_locator_signature)
+            {
+                XTENSOR_THROW(std::runtime_error, "Corrupted zip file: " + path);
+            }
+            char record[56];
+            read_at(record, 56, detail::zip_get(locator + 8, 8));
+            if (detail::zip_get(record, 4) != detail::zip64_end_signature)
+            {
+                XTENSOR_THROW(std::runtime_error, "Corrupted zip file: " + path);
+            }
+            count = detail::zip_get(record + 32, 8);
+            cd_size = detail::zip_get(record + 40, 8);
+            cd_offset = detail::zip_get(record + 48, 8);
+        }
+
+        std::string cd(cd_size, '\0');
+        read_at(&cd[0], cd.size(), cd_offset);
+        std::size_t pos = 0;
+        for (std::uint64_t n = 0; n < count; ++n)
+        {
+            if (pos + 46 > cd.size() || detail::zip_get(&cd[pos], 4) != detail::zip_central_header_signature)
+            {
+                XTENSOR_THROW(std::runtime_error, "Corrupted zip file: " + path);
+            }
+            const char* h = &cd[pos];
+            std::uint64_t method = detail::zip_get(h + 10, 2);
+            entry e;
+            e.crc = std::uint32_t(detail::zip_get(h + 16, 4));
+            std::uint64_t compressed_size = detail::zip_get(h + 20, 4);
+            e.size = detail::zip_get(h + 24, 4);
+            std::size_t name_size = std::size_t(detail::zip_get(h + 28, 2));
+            std::size_t extra_size = std::size_t(detail::zip_get(h + 30, 2));
+            std::size_t comment_size = std::size_t(detail::zip_get(h + 32, 2));
+            e.header_offset = detail::zip_get(h + 42, 4);
+            e.data_offset = 0;
+            if (pos + 46 + name_size + extra_size + comment_size > cd.size())
+            {
+                XTENSOR_THROW(std::runtime_error, "Corrupted zip file: " + path);
+            }
+            std::string name(h + 46, name_size);
+            // ZIP64 extended information: only the saturated fields are present, in this order
+            const char* extra = h + 46 + name_size;
+            for (std::size_t i = 0; i + 4 <= extra_size;)
+            {
+                std::uint64_t id = detail::zip_get(extra + i, 2);
+                std::size_t len = std::size_t(detail::zip_get(extra + i + 2, 2));
+                if (id == 1)
+                {
+                    const char* field = extra + i + 4;
+                    if (e.size == detail::zip32_max)
+                    {
+                        e.size = detail::zip_get(field, 8);
+                        field += 8;
+                    }
+                    if (compressed_size == detail::zip32_max)
+                    {
+                        compressed_size = detail::zip_get(field, 8);
+                        field += 8;
+                    }
+                    if (e.header_offset == detail::zip32_max)
+                    {
+                        e.header_offset = detail::zip_get(field, 8);
+                    }
+                }
+                i += 4 + len;
+            }
+            pos += 46 + name_size + extra_size + comment_size;
+            if (!name.empty() && name.back() == '/')
+            {
+                // directory entry
+                continue;
+            }
+            if (method != 0 || compressed_size != e.size)
+            {
+                XTENSOR_THROW(std::runtime_error, "Compressed zip entries are not supported, store values uncompressed: " + name);
+            }
+            index[normalize_key(name)] = e;
+        }
+        end = cd_offset;
+    }
+
+    inline std::uint64_t xzarr_zip_store::state::data_offset(const entry& e)
+    {
+        if (e.data_offset != 0)
+        {
+            return e.data_offset;
+        }
+        // the local header may have another extra field than the central directory
+        char header[30];
+        read_at(header, 30, e.header_offset);
+        if (detail::zip_get(header, 4) != detail::zip_local_header_signature)
+        {
+            XTENSOR_THROW(std::runtime_error, "Corrupted zip file: " + path);
+        }
+        return e.header_offset + 30 + detail::zip_get(header + 26, 2) + detail::zip_get(header + 28, 2);
+    }
+
+    inline void xzarr_zip_store::state::flush()
+    {
+        if (!dirty)
+        {
+            return;
+        }
+        std::string cd;
+        for (const auto& kv: index)
+        {
+            const entry& e = kv.second;
+            bool zip64 = e.size >= detail::zip32_max || e.header_offset >= detail::zip32_max;
+            std::string extra;
+            if (zip64)
+            {
+                detail::zip_put(extra, 1, 2);
+                detail::zip_put(extra, 24, 2);
+                detail::zip_put(extra, e.size, 8);
+                detail::zip_put(extra, e.size, 8);
+                detail::zip_put(extra, e.header_offset, 8);
+            }
+            detail::zip_put(cd, detail::zip_central_header_signature, 4);
+            detail::zip_put(cd, 45, 2);                       // version made by
+            detail::zip_put(cd, zip64 ? 45 : 20, 2);          // version needed
+            detail::zip_put(cd, 0, 2);                        // flags
+            detail::zip_put(cd, 0, 2);                        // stored
+            detail::zip_put(cd, 0, 2);                        // time
+            detail::zip_put(cd, 0x21, 2);                     // date (1980-01-01)
+            detail::zip_put(cd, e.crc, 4);
+            detail::zip_put(cd, zip64 ? detail::zip32_max : e.size, 4);
+            detail::zip_put(cd, zip64 ? detail::zip32_max : e.size, 4);
+            detail::zip_put(cd, kv.first.size(), 2);
+            detail::zip_put(cd, extra.size(), 2);
+            detail::zip_put(cd, 0, 2);                        // comment
+            detail::zip_put(cd, 0, 2);                        // disk
+            detail::zip_put(cd, 0, 2);                        // internal attributes
+            detail::zip_put(cd, 0, 4);                        // external attributes
+            detail::zip_put(cd, zip64 ? detail::zip32_max : e.header_offset, 4);
+            cd += kv.first;
+            cd += extra;
+        }
+        std::uint64_t cd_offset = end;
+        std::uint64_t count = index.size();
+        bool zip64 = count >= detail::zip16_max || cd.size() >= detail::zip32_max || cd_offset >= detail::zip32_max;
+        if (zip64)
+        {
+            std::uint64_t record_offset = cd_offset + cd.size();
+            detail::zip_put(cd, detail::zip64_end_signature, 4);
+            detail::zip_put(cd, 44, 8);                       // size of the remaining record
+            detail::zip_put(cd, 45, 2);
+            detail::zip_put(cd, 45, 2);
+            detail::zip_put(cd, 0, 4);
+            detail::zip_put(cd, 0, 4);
+            detail::zip_put(cd, count, 8);
+            detail::zip_put(cd, count, 8);
+            detail::zip_put(cd, record_offset - cd_offset, 8);
+            detail::zip_put(cd, cd_offset, 8);
+            detail::zip_put(cd, detail::zip64_locator_signature, 4);
+            detail::zip_put(cd, 0, 4);
+            detail::zip_put(cd, record_offset, 8);
+            detail::zip_put(cd, 1, 4);
+            std::size_t cd_size = std::size_t(record_offset - cd_offset);
+            detail::zip_put(cd, detail::zip_end_signature, 4);
+            detail::zip_put(cd, 0, 4);
+            detail::zip_put(cd, detail::zip16_max, 2);
+            detail::zip_put(cd, detail::zip16_max, 2);
+            detail::zip_put(cd, cd_size >= detail::zip32_max ? detail::zip32_max : cd_size, 4);
+            detail::zip_put(cd, detail::zip32_max, 4);
+            detail::zip_put(cd, 0, 2);
+        }
+        else
+        {
+            std::size_t cd_size = cd.size();
+            detail::zip_put(cd, detail::zip_end_signature, 4);
+            detail::zip_put(cd, 0, 4);
+            detail::zip_put(cd, count, 2);
+            detail::zip_put(cd, count, 2);
+            detail::zip_put(cd, cd_size, 4);
+            detail::zip_put(cd, cd_offset, 4);
+            detail::zip_put(cd, 0, 2);
+        }
+        write_at(cd.data(), cd.size(), end);
+        // a previous central directory may have been longer
+        file_size = end + cd.size();
+#if defined(_WIN32)
+        _chsize_s(fd, __int64(file_size));
+#else
+        if (::ftruncate(fd, off_t(file_size)) != 0)
+        {
+            XTENSOR_THROW(std::runtime_error, "Could not write zip file: " + path);
+        }
+#endif
+        dirty = false;
+    }
+
+    inline void xzarr_zip_store::state::close()
+    {
+        if (fd == -1)
+        {
+            return;
+        }
+        flush();
+#if defined(_WIN32)
+        _close(fd);
+#else
+        if (mapping != nullptr)
+        {
+            ::munmap(const_cast<char*>(mapping), std::size_t(file_size));
+            mapping = nullptr;
+        }
+        ::close(fd);
+#endif
+        fd = -1;
+    }
+
+    /**
+     * Opens a zip store.
+     * @param path the path of the zip file
+     * @param mode ``'r'`` to read an existing file, ``'w'`` to create a file
+     * (overwriting an existing one), ``'a'`` to add values to an existing file
+     */
+    inline xzarr_zip_store::xzarr_zip_store(const std::string& path, char mode)
+        : p_state(std::make_shared<state>())
+    {
+        state& s = *p_state;
+        s.path = path;
+        s.mode = mode;
+        int flags;
+        switch (mode)
+        {
+            case 'r':
+                flags = O_RDONLY;
+                break;
+            case 'w':
+                flags = O_RDWR | O_CREAT | O_TRUNC;
+                break;
+            case 'a':
+                flags = O_RDWR;
+                break;
+            default:
+                XTENSOR_THROW(std::runtime_error, "Unknown zip store mode: " + std::string(1, mode));
+        }
+#if defined(_WIN32)
+        s.fd = _open(path.c_str(), flags | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        s.fd = ::open(path.c_str(), flags | O_CLOEXEC, 0666);
+#endif
+        if (s.fd == -1)
+        {
+            XTENSOR_THROW(std::runtime_error, "Could not open zip file: " + path);
+        }
+        if (mode == 'w')
+        {
+            s.dirty = true;
+            return;
+        }
+#if defined(_WIN32)
+        s.file_size = std::uint64_t(_lseeki64(s.fd, 0, SEEK_END));
+#else
+        struct stat st;
+        ::fstat(s.fd, &st);
+        s.file_size = std::uint64_t(st.st_size);
+        if (mode == 'r' && s.file_size != 0)
+        {
+            void* p = ::mmap(nullptr, std::size_t(s.file_size), PROT_READ, MAP_SHARED, s.fd, 0);
+            if (p != MAP_FAILED)
+            {
+                ::madvise(p, std::size_t(s.file_size), MADV_RANDOM);
+                s.mapping = static_cast<const char*>(p);
+            }
+        }
+#endif
+        s.read_central_directory();
+    }
+
+    inline void xzarr_zip_store::check_writable() const
+    {
+        if (p_state->mode == 'r')
+        {
+            XTENSOR_THROW(std::runtime_error, "Zip store is read-only: " + p_state->path);
+        }
+        if (p_state->fd == -1)
+        {
+            XTENSOR_THROW(std::runtime_error, "Zip store is closed: " + p_state->path);
+        }
+    }
+
+    inline void xzarr_zip_store::assign(const std::string& key, const char* value, std::size_t size)
+    {
+        check_writable();
+        std::string name = normalize_key(key);
+        entry e;
+        e.size = size;
+        e.crc = detail::zip_crc32(value, size);
+        bool zip64 = size >= detail::zip32_max;
+        std::string header;
+        detail::zip_put(header, detail::zip_local_header_signature, 4);
+        detail::zip_put(header, zip64 ? 45 : 20, 2);
+        detail::zip_put(header, 0, 2);
+        detail::zip_put(header, 0, 2);
+        detail::zip_put(header, 0, 2);
+        detail::zip_put(header, 0x21, 2);
+        detail::zip_put(header, e.crc, 4);
+        detail::zip_put(header, zip64 ? detail::zip32_max : size, 4);
+        detail::zip_put(header, zip64 ? detail::zip32_max : size, 4);
+        detail::zip_put(header, name.size(), 2);
+        detail::zip_put(header, zip64 ? 20 : 0, 2);
+        header += name;
+        if (zip64)
+        {
+            detail::zip_put(header, 1, 2);
+            detail::zip_put(header, 16, 2);
+            detail::zip_put(header, size, 8);
+            detail::zip_put(header, size, 8);
+        }
+        state& s = *p_state;
+        std::lock_guard<std::mutex> lock(s.mutex);
+        e.header_offset = s.end;
+        e.data_offset = s.end + header.size();
+        s.write_at(header.data(), header.size(), s.end);
+        s.write_at(value, size, e.data_offset);
+        s.end = e.data_offset + size;
+        s.index[name] = e;
+        s.dirty = true;
+    }
+
+    inline xzarr_zip_stream xzarr_zip_store::operator[](const std::string& key)
+    {
+        return xzarr_zip_stream(*this, normalize_key(key));
+    }
+
+    /**
+     * Store a (key, value) pair.
+     * @param key the key
+     * @param value the value
+     */
+    inline void xzarr_zip_store::set(const std::string& key, const std::vector<char>& value)
+    {
+        assign(key, value.data(), value.size());
+    }
+
+    /**
+     * Store a (key, value) pair.
+     * @param key the key
+     * @param value the value
+     */
+    inline void xzarr_zip_store::set(const std::string& key, const std::string& value)
+    {
+        assign(key, value.data(), value.size());
+    }
+
+    /**
+     * Retrieve the value associated with a given key.
+     * @param key the key to get the value from
+     *
+     * @return returns the value for the given key.
+     */
+    inline std::string xzarr_zip_store::get(const std::string& key)
+    {
+        return (*this)[key];
+    }
+
+    /**
+     * Returns true if the given key is in the store.
+     * @param key the key
+     */
+    inline bool xzarr_zip_store::exists(const std::string& key)
+    {
+        std::lock_guard<std::mutex> lock(p_state->mutex);
+        return p_state->index.find(normalize_key(key)) != p_state->index.end();
+    }
+
+    /**
+     * Retrieve all keys and prefixes with a given prefix and which do not contain the character “/” after the given prefix.
+     *
+     * @param prefix the prefix
+     * @param keys set of keys to be returned by reference
+     * @param prefixes set of prefixes to be returned by reference
+     */
+    inline void xzarr_zip_store::list_dir(const std::string& prefix, std::vector<std::string>& keys, std::vector<std::string>& prefixes)
+    {
+        std::lock_guard<std::mutex> lock(p_state->mutex);
+        list_dir_sorted(p_state->index, prefix, keys, prefixes);
+    }
+
+    /**
+     * Retrieve all keys from the store.
+     *
+     * @return returns a set of keys.
+     */
+    inline std::vector<std::string> xzarr_zip_store::list()
+    {
+        return list_prefix("");
+    }
+
+    /**
+     * Retrieve all keys with a given prefix from the store.
+     *
+     * @param prefix the prefix
+     *
+     * @return returns a set of keys with a given prefix.
+     */
+    inline std::vector<std::string> xzarr_zip_store::list_prefix(const std::string& prefix)
+    {
+        std::lock_guard<std::mutex> lock(p_state->mutex);
+        return list_prefix_sorted(p_state->index, prefix);
+    }
+
+    /**
+     * Erase the given (key, value) pair from the store.
+     * The bytes of the value stay in the file.
+     * @param key the key
+     */
+    inline void xzarr_zip_store::erase(const std::string& key)
+    {
+        check_writable();
+        std::lock_guard<std::mutex> lock(p_state->mutex);
+        if (p_state->index.erase(normalize_key(key)) != 0)
+        {
+            p_state->dirty = true;
+        }
+    }
+
+    /**
+     * Erase all the keys with the given prefix from the store.
+     * @param prefix the prefix
+     */
+    inline void xzarr_zip_store::erase_prefix(const std::string& prefix)
+    {
+        check_writable();
+        std::lock_guard<std::mutex> lock(p_state->mutex);
+        for (const auto& key: list_prefix_sorted(p_state->index, prefix))
+        {
+            p_state->index.erase(key);
+            p_state->dirty = true;
+        }
+    }
+
+    /**
+     * Writes the central directory, so that the file is a valid zip file
+     * with the values written so far. Values can still be added afterwards.
+     */
+    inline void xzarr_zip_store::flush()
+    {
+        std::lock_guard<std::mutex> lock(p_state->mutex);
+        if (p_state->fd != -1)
+        {
+            p_state->flush();
+        }
+    }
+
+    /**
+     * Writes the central directory and closes the file.
+     */
+    inline void xzarr_zip_store::close()
+    {
+        std::lock_guard<std::mutex> lock(p_state->mutex);
+        p_state->close();
+    }
+
+    inline xzarr_zip_store xzarr_zip_store::get_io_config()
+    {
+        return *this;
+    }
+
+    inline std::string xzarr_zip_store::get_root()
+    {
+        return "";
+    }
+
+    /***********************************
+     * xzarr_zip_stream implementation *
+     ***********************************/
+
+    inline xzarr_zip_stream::xzarr_zip_stream(const xzarr_zip_store& store, const std::string& key)
+        : m_store(store)
+        , m_key(key)
+    {
+    }
+
+    inline xzarr_zip_stream::operator std::string() const
+    {
+        std::string bytes;
+        if (!read(bytes))
+        {
+            XTENSOR_THROW(std::runtime_error, "Key not found: " + m_key);
+        }
+        return bytes;
+    }
+
+    inline bool xzarr_zip_stream::read(std::string& bytes) const
+    {
+        auto& s = *m_store.p_state;
+        // in read mode, the index and the mapping never change
+        std::unique_lock<std::mutex> lock(s.mutex, std::defer_lock);
+        if (s.mapping == nullptr)
+        {
+            lock.lock();
+        }
+        auto it = s.index.find(m_key);
+        if (it == s.index.end())
+        {
+            return false;
+        }
+        if (s.fd == -1)
+        {
+            XTENSOR_THROW(std::runtime_error, "Zip store is closed: " + s.path);
+        }
+        const auto& e = it->second;
+        bytes.resize(std::size_t(e.size));
+        s.read_at(&bytes[0], bytes.size(), s.data_offset(e));
+        return true;
+    }
+
+    inline void xzarr_zip_stream::operator=(const std::vector<char>& value)
+    {
+        m_store.assign(m_key, value.data(), value.size());
+    }
+
+    inline void xzarr_zip_stream::operator=(const std::string& value)
+    {
+        m_store.assign(m_key, value.data(), value.size());
+    }
+
+    inline void xzarr_zip_stream::erase()
+    {
+        m_store.erase(m_key);
+    }
+
+    inline bool xzarr_zip_stream::exists()
+    {
+        return m_store.exists(m_key);
+    }
+}
+
+#endif
@@ -0,0 +1,181 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#ifndef XTENSOR_ZARR_ZSTD_HPP
+#define XTENSOR_ZARR_ZSTD_HPP
+
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include <zstd.h>
+
+#include "xtensor-io/xio_binary.hpp"
+#include "xzarr_common.hpp"
+
+namespace xt
+{
+    /**
+     * @class xzarr_zstd_config
+     * @brief Zstandard compressor configuration.
+     *
+     * The metadata is compatible with the numcodecs ``zstd`` codec. An optional
+     * trained dictionary can be provided, in which case it is stored (base64
+     * encoded) in the compressor configuration so that readers can decode the chunks.
+     */
+    struct xzarr_zstd_config
+    {
+        std::string name;
+        std::string version;
+        bool big_endian;
+        int level;
+        std::string dictionary;
+
+        xzarr_zstd_config()
+            : name("zstd")
+            , version(ZSTD_versionString())
+            , big_endian(false)
+            , level(1)
+        {
+        }
+
+        template <class T>
+        void write_to(T& j) const
+        {
+            j["level"] = level;
+            if (!dictionary.empty())
+            {
+                j["dictionary"] = base64_encode(dictionary);
+            }
+        }
+
+        template <class T>
+        void read_from(T& j)
+        {
+            if (j.contains("level"))
+            {
+                level = j["level"];
+            }
+            if (j.contains("dictionary"))
+            {
+                dictionary = base64_decode(j["dictionary"].template get<std::string>());
+            }
+        }
+
+        bool will_dump(xfile_dirty& dirty)
+        {
+            return dirty.data_dirty;
+        }
+    };
+
+    namespace detail
+    {
+        // compression contexts are expensive to create, keep one per thread
+        inline ZSTD_CCtx* zstd_cctx()
+        {
+            thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> ctx(ZSTD_createCCtx(), &ZSTD_freeCCtx);
+            return ctx.get();
+        }
+
+        inline ZSTD_DCtx* zstd_dctx()
+        {
+            thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> ctx(ZSTD_createDCtx(), &ZSTD_freeDCtx);
+            return ctx.get();
+        }
+
+        inline void zstd_check(std::size_t code, const std::string& what)
+        {
+            if (ZSTD_isError(code))
+            {
+                XTENSOR_THROW(std::runtime_error, what + ": " + ZSTD_getErrorName(code));
+            }
+        }
+
+        inline std::string zstd_compress(const std::string& raw, const xzarr_zstd_config& config)
+        {
+            std::string compressed(ZSTD_compressBound(raw.size()), '\0');
+            std::size_t size = ZSTD_compress_usingDict(zstd_cctx(),
+                                                       &compressed[0], compressed.size(),
+                                                       raw.data(), raw.size(),
+                                                       config.dictionary.data(), config.dictionary.size(),
+                                                       config.level);
+            zstd_check(size, "zstd compression failed");
+            compressed.resize(size);
+            return compressed;
+        }
+
+        inline std::string zstd_decompress(const std::string& compressed, const xzarr_zstd_config& config)
+        {
+            unsigned long long content_size = ZSTD_getFrameContentSize(compressed.data(), compressed.size());
+            if (content_size == ZSTD_CONTENTSIZE_ERROR)
+            {
+                XTENSOR_THROW(std::runtime_error, "zstd decompression failed: not a zstd frame");
+            }
+            ZSTD_DCtx* dctx = zstd_dctx();
+            if (content_size != ZSTD_CONTENTSIZE_UNKNOWN)
+            {
+                std::string raw(static_cast<std::size_t>(content_size), '\0');
+                std::size_t size = ZSTD_decompress_usingDict(dctx,
+                                                             &raw[0], raw.size(),
+                                                             compressed.data(), compressed.size(),
+                                                             config.dictionary.data(), config.dictionary.size());
+                zstd_check(size, "zstd decompression failed");
+                raw.resize(size);
+                return raw;
+            }
+            // frames written in streaming mode do not record their content size
+            zstd_check(ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters), "zstd decompression failed");
+            zstd_check(ZSTD_DCtx_loadDictionary(dctx, config.dictionary.data(), config.dictionary.size()), "zstd decompression failed");
+            std::string raw;
+            std::string buffer(ZSTD_DStreamOutSize(), '\0');
+            ZSTD_inBuffer input = {compressed.data(), compressed.size(), 0};
+            // a frame is complete when ZSTD_decompressStream returns 0; buffered
+            // output can remain after the whole input is consumed
+            for (;;)
+            {
+                ZSTD_outBuffer output = {&buffer[0], buffer.size(), 0};
+                std::size_t in_pos = input.pos;
+                std::size_t remaining = ZSTD_decompressStream(dctx, &output, &input);
+                zstd_check(remaining, "zstd decompression failed");
+                raw.append(buffer.data(), output.pos);
+                if (remaining == 0 && input.pos == input.size)
+                {
+                    break;
+                }
+                if (output.pos == 0 && input.pos == in_pos)
+                {
+                    XTENSOR_THROW(std::runtime_error, "zstd decompression failed: truncated frame");
+                }
+            }
+            return raw;
+        }
+    }
+
+    template <class E>
+    void load_file(std::istream& stream, xexpression<E>& e, const xzarr_zstd_config& config)
+    {
+        std::istringstream raw(detail::zstd_decompress(read_stream(stream), config));
+        xio_binary_config binary_config;
+        binary_config.big_endian = config.big_endian;
+        load_file(raw, e, binary_config);
+    }
+
+    template <class E>
+    void dump_file(std::ostream& stream, const xexpression<E>& e, const xzarr_zstd_config& config)
+    {
+        std::ostringstream raw;
+        xio_binary_config binary_config;
+        binary_config.big_endian = config.big_endian;
+        dump_file(raw, e, binary_config);
+        std::string compressed = detail::zstd_compress(raw.str(), config);
+        stream.write(compressed.data(), static_cast<std::streamsize>(compressed.size()));
+    }
+}
+
+#endif
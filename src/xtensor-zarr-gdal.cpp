@@ -5,10 +5,24 @@ namespace xt
     template XTENSOR_ZARR_API void xzarr_register_compressor<xzarr_file_system_store, xio_gzip_config>();
     template XTENSOR_ZARR_API void xzarr_register_compressor<xzarr_file_system_store, xio_zlib_config>();
     template XTENSOR_ZARR_API void xzarr_register_compressor<xzarr_file_system_store, xio_blosc_config>();
+    template XTENSOR_ZARR_API void xzarr_register_compressor<xzarr_file_system_store, xzarr_zstd_config>();
+    template XTENSOR_ZARR_API void xzarr_register_compressor<xzarr_file_system_store, xzarr_lz4_config>();
+    template XTENSOR_ZARR_API void xzarr_register_compressor<xzarr_file_system_store, xzarr_blosc_config>();
     template class XTENSOR_ZARR_API xchunked_array_factory<xzarr_file_system_store>;
 
     template XTENSOR_ZARR_API void xzarr_register_compressor<xzarr_gdal_store, xio_gzip_config>();
     template XTENSOR_ZARR_API void xzarr_register_compressor<xzarr_gdal_store, xio_zlib_config>();
     template XTENSOR_ZARR_API void xzarr_register_compressor<xzarr_gdal_store, xio_blosc_config>();
+    template XTENSOR_ZARR_API void xzarr_register_compressor<xzarr_gdal_store, xzarr_zstd_config>();
+    template XTENSOR_ZARR_API void xzarr_register_compressor<xzarr_gdal_store, xzarr_lz4_config>();
+    template XTENSOR_ZARR_API void xzarr_register_compressor<xzarr_gdal_store, xzarr_blosc_config>();
     template class XTENSOR_ZARR_API xchunked_array_factory<xzarr_gdal_store>;
+
+    template XTENSOR_ZARR_API void xzarr_register_compressor<xzarr_memory_store, xio_gzip_config>();
+    template XTENSOR_ZARR_API void xzarr_register_compressor<xzarr_memory_store, xio_zlib_config>();
+    template XTENSOR_ZARR_API void xzarr_register_compressor<xzarr_memory_store, xio_blosc_config>();
+    template XTENSOR_ZARR_API void xzarr_register_compressor<xzarr_memory_store, xzarr_zstd_config>();
+    template XTENSOR_ZARR_API void xzarr_register_compressor<xzarr_memory_store, xzarr_lz4_config>();
+    template XTENSOR_ZARR_API void xzarr_register_compressor<xzarr_memory_store, xzarr_blosc_config>();
+    template class XTENSOR_ZARR_API xchunked_array_factory<xzarr_memory_store>;
 }
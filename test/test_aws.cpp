@@ -7,6 +7,8 @@
 * The full license is in the file LICENSE, distributed with this software. *
 ****************************************************************************/
 
+#include <cstdlib>
+
 #include "xtensor-io/xio_binary.hpp"
 #include "xtensor-zarr/xzarr_aws_store.hpp"
 
@@ -64,4 +66,41 @@ namespace xt
 
         Aws::ShutdownAPI(options);
     }
+
+    // runs against an S3-compatible server (e.g. MinIO) whose endpoint and bucket
+    // are given by XTENSOR_ZARR_S3_ENDPOINT and XTENSOR_ZARR_S3_BUCKET, with the
+    // credentials of the environment
+    TEST(aws, aws_store_multipart)
+    {
+        const char* endpoint = std::getenv("XTENSOR_ZARR_S3_ENDPOINT");
+        const char* bucket = std::getenv("XTENSOR_ZARR_S3_BUCKET");
+        if (endpoint == nullptr || bucket == nullptr)
+        {
+            return;
+        }
+
+        Aws::SDKOptions options;
+        Aws::InitAPI(options);
+        {
+            xzarr_request_config config;
+            config.multipart_threshold = std::size_t(8) << 20;
+            config.part_size = std::size_t(5) << 20;
+            Aws::Client::ClientConfiguration client_config = xzarr_aws_client_configuration(config);
+            client_config.endpointOverride = endpoint;
+            client_config.scheme = Aws::Http::Scheme::HTTP;
+            Aws::S3::S3Client client(client_config, Aws::Client::AWSAuthV4Signer::PayloadSigningPolicy::Never, false);
+
+            xzarr_aws_store s(std::string(bucket) + "/multipart", client, config);
+            std::string value(std::size_t(12) << 20, '\0');
+            for (std::size_t i = 0; i < value.size(); ++i)
+            {
+                value[i] = static_cast<char>(i * 7 + i / 4096);
+            }
+            s["large"] = value;
+            s["small"] = std::string("small");
+            EXPECT_EQ(s.get("large"), value);
+            EXPECT_EQ(s.get("small"), "small");
+        }
+        Aws::ShutdownAPI(options);
+    }
 }
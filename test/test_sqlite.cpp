@@ -0,0 +1,71 @@
+/***************************************************************************
+* Copyright (c) Wolf Vollprecht, Sylvain Corlay and Johan Mabille          *
+* Copyright (c) QuantStack                                                 *
+*                                                                          *
+* Distributed under the terms of the BSD 3-Clause License.                 *
+*                                                                          *
+* The full license is in the file LICENSE, distributed with this software. *
+****************************************************************************/
+
+#include <cstdio>
+
+#include "xtensor-zarr/xzarr_hierarchy.hpp"
+#include "xtensor-zarr/xzarr_memory_store.hpp"
+#include "xtensor-zarr/xzarr_sqlite_store.hpp"
+
+#include "gtest/gtest.h"
+
+namespace xt
+{
+    TEST(sqlite, sqlite_store)
+    {
+        std::remove("h_xtensor.sqlite");
+        xzarr_sqlite_config config;
+        config.batch_size = 3;
+        xzarr_sqlite_store s("h_xtensor.sqlite", config);
+        s["a/b/k"] = std::string("v");
+        s["a/b/c/k"] = std::string("w");
+        s["a/b.z"] = std::string("z");
+        s["a/b0"] = std::string();
+        EXPECT_EQ(std::string(s["/a//b/k"]), "v");
+        EXPECT_EQ(std::string(s["a/b0"]), "");
+        EXPECT_THROW(s.get("a/x"), std::runtime_error);
+
+        std::vector<std::string> keys, prefixes;
+        s.list_dir("a", keys, prefixes);
+        std::vector<std::string> ref_keys = {"a/b.z", "a/b0"};
+        std::vector<std::string> ref_prefixes = {"a/b"};
+        EXPECT_EQ(keys, ref_keys);
+        EXPECT_EQ(prefixes, ref_prefixes);
+        std::vector<std::string> ref = {"a/b/c/k", "a/b/k"};
+        EXPECT_EQ(s.list_prefix("a/b"), ref);
+
+        std::size_t size = 0;
+        EXPECT_TRUE(s.visit("a/b/c/k", [&size](const char*, std::size_t n) { size = n; }));
+        EXPECT_EQ(size, 1u);
+        s.erase_prefix("a/b");
+        EXPECT_EQ(s.list().size(), 2u);
+    }
+
+    TEST(sqlite, sqlite_hierarchy)
+    {
+        std::remove("h_xtensor_hierarchy.sqlite");
+        xarray<double> ref = arange(4 * 4).reshape({4, 4});
+        {
+            xzarr_memory_store src_store;
+            auto src = create_zarr_hierarchy(src_store);
+            src.create_array("/arthur/dent", std::vector<size_t>({4, 4}), std::vector<size_t>({2, 4}), "<f8");
+            src.get_concurrent_writer<double>("/arthur/dent").write(ref, std::vector<size_t>({0, 0}));
+            xzarr_sqlite_store s("h_xtensor_hierarchy.sqlite");
+            auto h = create_zarr_hierarchy(s);
+            src.copy_array("/arthur/dent", h);
+        }
+        xzarr_sqlite_config config;
+        config.read_only = true;
+        xzarr_sqlite_store s("h_xtensor_hierarchy.sqlite", config);
+        auto h = get_zarr_hierarchy(s);
+        EXPECT_EQ(h.get_children("/arthur")["dent"], "array");
+        auto a = h.get_array("/arthur/dent").get_array<double>();
+        EXPECT_EQ(xt::view(a, xt::range(0, 4), xt::range(0, 4)), ref);
+    }
+}
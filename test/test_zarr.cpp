@@ -7,14 +7,35 @@
 * The full license is in the file LICENSE, distributed with this software. *
 ****************************************************************************/
 
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <thread>
 #include <vector>
 
+#if !defined(_WIN32)
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
 #include "xtensor/xview.hpp"
 #include "xtensor-io/xio_gzip.hpp"
 #include "xtensor-io/xio_binary.hpp"
 #include "xtensor-zarr/xzarr_hierarchy.hpp"
 #include "xtensor-zarr/xzarr_file_system_store.hpp"
+#include "xtensor-zarr/xzarr_memory_store.hpp"
+#include "xtensor-zarr/xzarr_zip_store.hpp"
+#include "xtensor-zarr/xzarr_request_limiter.hpp"
 #include "xtensor-zarr/xzarr_compressor.hpp"
+#include "xtensor-zarr/xzarr_zstd.hpp"
+#include "xtensor-zarr/xzarr_lz4.hpp"
+#include "xtensor-zarr/xzarr_blosc.hpp"
+#include "xtensor-zarr/xzarr_threading.hpp"
+#include "xtensor-zarr/xzarr_chunk_advisor.hpp"
+#include "xtensor-zarr/xzarr_rechunk.hpp"
+#include "xtensor-zarr/xzarr_copy.hpp"
 
 #include "gtest/gtest.h"
 
@@ -142,6 +163,98 @@ namespace xt
         EXPECT_EQ(fs::exists("store1/path_to"), false);
     }
 
+    TEST(xzarr_hierarchy, store_list_missing_prefix)
+    {
+        fs::remove_all("store_list");
+        xzarr_file_system_store s("store_list");
+        EXPECT_TRUE(s.list_prefix("data/root/arthur").empty());
+        xzarr_array_metadata m;
+        m.path = "/arthur/dent";
+        m.zarr_version = 3;
+        m.shape = {4, 4};
+        m.chunk_shape = {2, 2};
+        m.dtype = "<f8";
+        write_zarr_array_metadata(s, m);
+        EXPECT_TRUE(list_zarr_chunks(s, m).empty());
+    }
+
+    TEST(xzarr_hierarchy, store_atomic_write)
+    {
+        fs::remove_all("store2");
+        xzarr_file_system_config config;
+        config.fsync = xzarr_fsync_policy::batched;
+        config.fsync_batch_size = 2;
+        xzarr_file_system_store store2("store2", config);
+        store2["path_to/key1"] = "some data";
+        store2["path_to/key1"] = "some new data";
+        store2["path_to/key2"] = "some more data";
+        store2.sync();
+        EXPECT_EQ(std::string(store2["path_to/key1"]), "some new data");
+        // check that no temporary file is left behind
+        std::vector<std::string> keys, prefixes;
+        store2.list_dir("path_to", keys, prefixes);
+        EXPECT_EQ(keys.size(), 2u);
+    }
+
+#if !defined(_WIN32)
+    TEST(xzarr_hierarchy, store_temporary_path_fork)
+    {
+        // a forked child shares the state of its parent, but not its temporary file names
+        detail::temporary_path("key");
+        int fds[2];
+        ASSERT_EQ(pipe(fds), 0);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            std::string name = detail::temporary_path("key");
+            ssize_t n = write(fds[1], name.data(), name.size());
+            _exit(n == ssize_t(name.size()) ? 0 : 1);
+        }
+        close(fds[1]);
+        std::string parent_name = detail::temporary_path("key");
+        std::string child_name(256, '\0');
+        ssize_t n = read(fds[0], &child_name[0], child_name.size());
+        close(fds[0]);
+        int status = 0;
+        waitpid(pid, &status, 0);
+        ASSERT_GT(n, 0);
+        child_name.resize(std::size_t(n));
+        EXPECT_NE(child_name, parent_name);
+    }
+#endif
+
+    TEST(xzarr_hierarchy, store_directory_cache)
+    {
+        fs::remove_all("store3");
+        xzarr_file_system_config config;
+        config.read_advice = xzarr_read_advice::sequential;
+        xzarr_file_system_store store3("store3", config);
+        store3["path_to/key1"] = "some data";
+        // the cached directory is removed behind the store
+        fs::remove_all("store3/path_to");
+        store3["path_to/key1"] = "some more data";
+        EXPECT_EQ(std::string(store3["path_to/key1"]), "some more data");
+        store3["path_to/empty"] = "";
+        EXPECT_EQ(std::string(store3["path_to/empty"]), "");
+    }
+
+    TEST(xzarr_hierarchy, store_get_set_many)
+    {
+        fs::remove_all("store4");
+        xzarr_file_system_store store4("store4");
+        std::vector<std::string> keys = {"path_to/key1", "path_to/key2", "other/key3"};
+        std::vector<std::string> values = {"some data", "", "even more data"};
+        store4.set_many(keys, values);
+        keys.push_back("path_to/missing");
+        std::vector<std::string> res;
+        std::vector<bool> found;
+        store4.get_many(keys, res, found);
+        EXPECT_EQ(found, std::vector<bool>({true, true, true, false}));
+        EXPECT_EQ(res[0], values[0]);
+        EXPECT_EQ(res[1], values[1]);
+        EXPECT_EQ(res[2], values[2]);
+    }
+
     TEST(xzarr_hierarchy, write_v2)
     {
         std::vector<size_t> shape = {4, 4};
@@ -158,6 +271,9 @@ namespace xt
         o.chunk_pool_size = pool_size;
         o.fill_value = fill_value;
         zarray z1 = h.create_array("/arthur/dent", shape, chunk_shape, "<f8", o);
+        // opening the array does not read .zattrs, the attributes are loaded on first access
+        EXPECT_TRUE(h.get_array("/arthur/dent").get_metadata()["zarr"].is_null());
+        EXPECT_EQ(h.get_attrs("/arthur/dent"), attrs);
     }
 
     TEST(xzarr_hierarchy, array_default_params)
@@ -167,4 +283,841 @@ namespace xt
         auto h = create_zarr_hierarchy("test.zr3");
         auto z = h.create_array("/foo", shape, chunk_shape, "<f8");
     }
+
+    template <class C>
+    void compressor_round_trip(C config)
+    {
+        xarray<double> ref = arange(4 * 5).reshape({4, 5});
+        std::ostringstream out;
+        dump_file(out, ref, config);
+        std::istringstream in(out.str());
+        xarray<double> res = zeros<double>({4, 5});
+        load_file(in, res, config);
+        EXPECT_EQ(res, ref);
+    }
+
+    TEST(xzarr_compressor, zstd)
+    {
+        xzarr_zstd_config c;
+        c.level = 5;
+        compressor_round_trip(c);
+        c.dictionary = std::string(256, 'x');
+        compressor_round_trip(c);
+        nlohmann::json j;
+        c.write_to(j);
+        xzarr_zstd_config c2;
+        c2.read_from(j);
+        EXPECT_EQ(c2.level, 5);
+        EXPECT_EQ(c2.dictionary, c.dictionary);
+    }
+
+    TEST(xzarr_compressor, zstd_streaming_frame)
+    {
+        // frames written in streaming mode have no content size, and decompress
+        // to more than one output buffer
+        std::string raw(4 * ZSTD_DStreamOutSize() + 17, 'x');
+        std::string compressed(ZSTD_compressBound(raw.size()), '\0');
+        ZSTD_CCtx* cctx = ZSTD_createCCtx();
+        ZSTD_inBuffer input = {raw.data(), raw.size(), 0};
+        ZSTD_outBuffer output = {&compressed[0], compressed.size(), 0};
+        ZSTD_compressStream2(cctx, &output, &input, ZSTD_e_continue);
+        ZSTD_inBuffer end = {nullptr, 0, 0};
+        EXPECT_EQ(ZSTD_compressStream2(cctx, &output, &end, ZSTD_e_end), 0u);
+        ZSTD_freeCCtx(cctx);
+        compressed.resize(output.pos);
+        ASSERT_EQ(ZSTD_getFrameContentSize(compressed.data(), compressed.size()), ZSTD_CONTENTSIZE_UNKNOWN);
+        EXPECT_EQ(detail::zstd_decompress(compressed, xzarr_zstd_config()), raw);
+        EXPECT_THROW(detail::zstd_decompress(compressed.substr(0, compressed.size() - 4), xzarr_zstd_config()), std::runtime_error);
+    }
+
+    TEST(xzarr_compressor, lz4)
+    {
+        xzarr_lz4_config c;
+        compressor_round_trip(c);
+        c.level = 9;
+        compressor_round_trip(c);
+    }
+
+    struct other_binary_config : xio_binary_config
+    {
+    };
+
+    TEST(xzarr_compressor, codec_registry)
+    {
+        // the same codec can be registered again, another codec under the same name cannot
+        EXPECT_NO_THROW(xchunk_codec_factory<double>::add_codec(xio_binary_config()));
+        EXPECT_THROW(xchunk_codec_factory<double>::add_codec(other_binary_config()), std::runtime_error);
+    }
+
+    // registers a compressor unless a previous test did
+    template <class store_type, class format_config>
+    void register_compressor_once()
+    {
+        if (!xcompressor_factory<store_type, double>::has_compressor(format_config().name))
+        {
+            xzarr_register_compressor<store_type, format_config>();
+        }
+    }
+
+    TEST(xzarr_hierarchy, write_v2_zstd)
+    {
+        register_compressor_once<xzarr_file_system_store, xzarr_zstd_config>();
+        std::vector<size_t> shape = {4, 4};
+        std::vector<size_t> chunk_shape = {2, 2};
+        auto h = create_zarr_hierarchy("h_xtensor_zstd.zr2", "2");
+        xzarr_create_array_options<xzarr_zstd_config> o;
+        o.compressor.level = 3;
+        o.fill_value = 1.5;
+        h.create_array("/arthur/dent", shape, chunk_shape, "<f8", o);
+        auto j = nlohmann::json::parse(std::string(xzarr_file_system_store("h_xtensor_zstd.zr2")["arthur/dent/.zarray"]));
+        EXPECT_EQ(j["compressor"]["id"], "zstd");
+        EXPECT_EQ(j["compressor"]["level"], 3);
+        zarray z = h.get_array("/arthur/dent");
+        EXPECT_EQ(z.get_array<double>()(3, 3), 1.5);
+
+        // numcodecs writes the zstd checksum flag as a boolean in the compressor configuration
+        j["compressor"]["checksum"] = false;
+        xzarr_file_system_store("h_xtensor_zstd.zr2")["arthur/dent/.zarray"] = j.dump();
+        zarray z2;
+        EXPECT_NO_THROW(z2 = h.get_array("/arthur/dent"));
+        EXPECT_EQ(z2.get_array<double>()(3, 3), 1.5);
+    }
+
+    TEST(xzarr_compressor, blosc_threads)
+    {
+        xzarr_blosc_config c;
+        c.cname = "zstd";
+        c.nthreads = 4;
+        compressor_round_trip(c);
+        c.shuffle = -1;
+        compressor_round_trip(c);
+    }
+
+    TEST(xzarr_threading, policy)
+    {
+        xzarr_thread_policy::set_max_threads(8);
+        EXPECT_EQ(xzarr_thread_policy::codec_threads(), 8u);
+        std::vector<std::size_t> codec_threads(16);
+        xzarr_parallel_for(codec_threads.size(), 4, [&](std::size_t i)
+        {
+            codec_threads[i] = xzarr_thread_policy::codec_threads();
+        });
+        for (auto n: codec_threads)
+        {
+            EXPECT_EQ(n, 2u);
+        }
+        EXPECT_EQ(xzarr_thread_policy::active_chunk_workers(), 0u);
+        EXPECT_EQ(xzarr_thread_policy::codec_threads(3), 3u);
+
+        // codecs called outside of chunk workers (e.g. from the chunk pool of a
+        // zarray) share the budget with each other
+        std::vector<std::size_t> pool_threads(2);
+        std::atomic<std::size_t> ready(0);
+        std::atomic<std::size_t> done(0);
+        auto read_chunk = [&](std::size_t i)
+        {
+            xzarr_thread_policy::codec_scope scope;
+            ++ready;
+            while (ready < 2)
+            {
+                std::this_thread::yield();
+            }
+            pool_threads[i] = xzarr_thread_policy::codec_threads();
+            ++done;
+            while (done < 2)
+            {
+                std::this_thread::yield();
+            }
+        };
+        std::thread t0(read_chunk, 0);
+        std::thread t1(read_chunk, 1);
+        t0.join();
+        t1.join();
+        EXPECT_EQ(pool_threads, std::vector<std::size_t>({4, 4}));
+        xzarr_parallel_for(4, 4, [&](std::size_t)
+        {
+            xzarr_thread_policy::codec_scope scope;
+            EXPECT_LE(xzarr_thread_policy::codec_threads(), 2u);
+        });
+        EXPECT_EQ(xzarr_thread_policy::active_chunk_workers(), 0u);
+        xzarr_thread_policy::set_max_threads(0);
+    }
+
+    TEST(xzarr_hierarchy, create_array_autotuned)
+    {
+        std::vector<size_t> shape = {64, 64};
+        std::vector<size_t> chunk_shape = {16, 16};
+        xarray<double> sample = arange(64 * 64).reshape({64, 64});
+        auto h = create_zarr_hierarchy("h_xtensor_autotune.zr2", "2");
+        xzarr_autotune_options tuning;
+        tuning.max_sample_chunks = 4;
+        h.create_array_autotuned("/arthur/dent", shape, chunk_shape, "<f8", sample, tuning);
+        xzarr_file_system_store s("h_xtensor_autotune.zr2");
+        auto meta = nlohmann::json::parse(std::string(s["arthur/dent/.zarray"]));
+        auto attrs = nlohmann::json::parse(std::string(s["arthur/dent/.zattrs"]));
+        auto tuning_attrs = attrs["compressor_tuning"];
+        EXPECT_EQ(tuning_attrs["sample_chunks"], 4);
+        std::size_t selected = tuning_attrs["selected"];
+        EXPECT_EQ(meta["compressor"]["id"], tuning_attrs["trials"][selected]["compressor"]);
+        // the sample must match the data type of the array
+        EXPECT_THROW(h.create_array_autotuned("/arthur/mismatch", shape, chunk_shape, "<i4", sample, tuning), std::runtime_error);
+    }
+
+    TEST(xzarr_chunk_advisor, access_patterns)
+    {
+        std::vector<size_t> shape = {1000, 1000};
+        auto rows = advise_chunk_shape(shape, "<f8", {xzarr_access(xzarr_access_pattern::row_scan)});
+        EXPECT_EQ(rows.chunk_shape[1], 1000u);
+        EXPECT_EQ(rows.projections["row_scan"]["requests"], 1);
+        auto both = advise_chunk_shape(shape, "<f8", {xzarr_access(xzarr_access_pattern::row_scan),
+                                                      xzarr_access(xzarr_access_pattern::column_scan)});
+        EXPECT_EQ(both.chunk_shape[0], both.chunk_shape[1]);
+        EXPECT_EQ(both.shard_shape, both.chunk_shape);
+
+        std::vector<size_t> series_shape = {100000, 720, 1440};
+        auto series = advise_chunk_shape(series_shape, "<f4", {xzarr_access(xzarr_access_pattern::time_series)},
+                                         xzarr_store_kind::object_store);
+        EXPECT_EQ(series.chunk_shape[0], 100000u);
+        EXPECT_GE(series.chunk_bytes, xzarr_store_cost_model::for_store(xzarr_store_kind::object_store).min_chunk_bytes);
+        EXPECT_GT(series.shard_shape[2], series.chunk_shape[2]);
+    }
+
+    TEST(xzarr_chunk_advisor, calibrate)
+    {
+        xzarr_file_system_store s("h_xtensor_calibrate.zr3");
+        auto model = xzarr_store_cost_model::calibrate(s, xzarr_store_kind::file_system, 2);
+        EXPECT_GT(model.bandwidth, 0.);
+        EXPECT_GE(model.latency, 0.);
+        EXPECT_FALSE(s[".xzarr_calibration/small"].exists());
+    }
+
+    TEST(xzarr_hierarchy, rechunk)
+    {
+        // rows of the source array are single chunks, rechunked into columns
+        auto h = create_zarr_hierarchy("h_xtensor_rechunk.zr2", "2");
+        xzarr_file_system_store s("h_xtensor_rechunk.zr2");
+        xzarr_array_metadata m;
+        m.path = "/arthur/dent";
+        m.zarr_version = 2;
+        m.shape = {16, 16};
+        m.chunk_shape = {1, 16};
+        m.dtype = "<f8";
+        m.chunk_separator = '.';
+        write_zarr_array_metadata(s, m);
+        for (std::size_t i = 0; i < 16; ++i)
+        {
+            xarray<double> row = arange<double>(i * 16, (i + 1) * 16);
+            s[m.chunk_key(std::vector<std::size_t>{i, 0})] = xchunk_codec_factory<double>::encode("binary", row, m.compressor_config, false);
+        }
+
+        std::vector<size_t> chunk_shape = {16, 1};
+        xzarr_rechunk_options o;
+        // two workers, each holding a row chunk, a column chunk and a 16x4 region
+        o.max_mem = 2 * (16 + 16 + 16 * 4) * sizeof(double);
+        o.nthreads = 2;
+        auto plan = plan_rechunk(m, chunk_shape, o);
+        EXPECT_TRUE(plan.use_intermediate);
+        zarray z = h.rechunk("/arthur/dent", "/ford/prefect", chunk_shape, o);
+        auto a = z.get_array<double>();
+        xarray<double> ref = arange(16 * 16).reshape({16, 16});
+        EXPECT_EQ(xt::view(a, xt::range(0, 16), xt::range(0, 16)), ref);
+        auto meta = nlohmann::json::parse(std::string(s["ford/prefect/.zarray"]));
+        EXPECT_EQ(meta["chunks"], nlohmann::json(chunk_shape));
+        EXPECT_FALSE(s["ford/prefect.rechunk_intermediate/0.0"].exists());
+
+        // into another hierarchy, the intermediate array being in the destination store
+        xzarr_memory_store s2;
+        auto h2 = create_zarr_hierarchy(s2, "2");
+        auto a2 = h.rechunk("/arthur/dent", h2, "/zaphod", chunk_shape, o).get_array<double>();
+        EXPECT_EQ(xt::view(a2, xt::range(0, 16), xt::range(0, 16)), ref);
+        EXPECT_TRUE(s2["zaphod/.zarray"].exists());
+        EXPECT_FALSE(s2["zaphod.rechunk_intermediate/0.0"].exists());
+        EXPECT_FALSE(s["zaphod/.zarray"].exists());
+    }
+
+    TEST(xzarr_hierarchy, resize_append)
+    {
+        xzarr_memory_store s;
+        auto h = create_zarr_hierarchy(s);
+        xzarr_create_array_options<xio_binary_config> o;
+        o.fill_value = -1.;
+        std::vector<size_t> shape = {0, 3};
+        std::vector<size_t> chunk_shape = {2, 2};
+        h.create_array("/sensor", shape, chunk_shape, "<f8", o);
+        xarray<double> rows = arange(3 * 3).reshape({3, 3});
+        h.append("/sensor", rows, 0);
+        auto z = h.append("/sensor", rows, 0);
+        auto a = z.get_array<double>();
+        EXPECT_EQ(xt::view(a, xt::range(0, 3), xt::range(0, 3)), rows);
+        EXPECT_EQ(xt::view(a, xt::range(3, 6), xt::range(0, 3)), rows);
+
+        // shrinking erases the chunks beyond the new shape, and growing again
+        // resets the boundary chunks to the fill value
+        h.resize("/sensor", std::vector<size_t>({1, 2}));
+        EXPECT_EQ(s.list_prefix("data/root/sensor").size(), 1u);
+        z = h.resize("/sensor", std::vector<size_t>({3, 3}));
+        auto b = z.get_array<double>();
+        xarray<double> ref = {{0., 1., -1.}, {-1., -1., -1.}, {-1., -1., -1.}};
+        EXPECT_EQ(xt::view(b, xt::range(0, 3), xt::range(0, 3)), ref);
+    }
+
+    TEST(xzarr_hierarchy, concurrent_writer)
+    {
+        xzarr_memory_store s;
+        auto h = create_zarr_hierarchy(s);
+        std::vector<size_t> shape = {30, 10};
+        std::vector<size_t> chunk_shape = {4, 4};
+        h.create_array("/arthur/dent", shape, chunk_shape, "<f8");
+        auto w = h.get_concurrent_writer<double>("/arthur/dent", 4);
+        EXPECT_THROW(h.get_concurrent_writer<float>("/arthur/dent"), std::runtime_error);
+
+        // rows of one chunk are written by different threads
+        xarray<double> ref = arange(30 * 10).reshape({30, 10});
+        xzarr_parallel_for(std::size_t(30), std::size_t(6), [&](std::size_t i)
+        {
+            xarray<double> row = xt::view(ref, xt::range(i, i + 1), xt::range(0, 10));
+            w.write(row, std::vector<size_t>({i, 0}));
+        });
+        auto a = h.get_array("/arthur/dent").get_array<double>();
+        EXPECT_EQ(xt::view(a, xt::range(0, 30), xt::range(0, 10)), ref);
+    }
+
+#if !defined(_WIN32)
+    TEST(xzarr_hierarchy, partitioned_write)
+    {
+        auto h = create_zarr_hierarchy("h_xtensor_partition.zr3");
+        xzarr_file_system_store s("h_xtensor_partition.zr3");
+        std::vector<size_t> shape = {10, 6};
+        std::vector<size_t> chunk_shape = {3, 4};
+        h.create_array("/arthur/dent", shape, chunk_shape, "<f8");
+        xarray<double> ref = arange(10 * 6).reshape({10, 6});
+
+        // each process writes its slab, the second one does not commit it
+        std::size_t nworkers = 3;
+        std::vector<pid_t> pids;
+        for (std::size_t worker = 0; worker < nworkers; ++worker)
+        {
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                try
+                {
+                    auto w = h.get_partition_writer<double>("/arthur/dent", worker, nworkers);
+                    const auto& p = w.partition();
+                    xarray<double> slab = xt::view(ref, xt::range(p.offset[0], p.offset[0] + p.shape[0]), xt::range(0, 6));
+                    w.write(slab, p.offset);
+                    if (worker != 1)
+                    {
+                        w.commit();
+                    }
+                }
+                catch (...)
+                {
+                    _exit(1);
+                }
+                _exit(0);
+            }
+            pids.push_back(pid);
+        }
+        for (auto pid: pids)
+        {
+            int status = 0;
+            waitpid(pid, &status, 0);
+            EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        }
+        auto report = h.finalize_partitions("/arthur/dent", nworkers);
+        EXPECT_EQ(report.missing, std::vector<size_t>({1}));
+
+        auto w = h.get_partition_writer<double>("/arthur/dent", 1, nworkers);
+        EXPECT_THROW(w.write(ref, std::vector<size_t>({0, 0})), std::runtime_error);
+        w.commit();
+        EXPECT_TRUE(h.finalize_partitions("/arthur/dent", nworkers).complete());
+        EXPECT_FALSE(s["data/root/arthur/dent/.partitions/0"].exists());
+        // the statistics committed with the markers make up the index
+        xzarr_chunk_stats_index index;
+        ASSERT_TRUE(read_zarr_chunk_stats(s, "/arthur/dent", 3, index));
+        EXPECT_EQ(index.chunks[0].max, 15.);
+        EXPECT_EQ(index.chunks[0].count, 12u);
+        // the second slab was written by a writer that did not commit it
+        EXPECT_TRUE(std::isinf(index.chunks[4].max));
+        auto a = h.get_array("/arthur/dent").get_array<double>();
+        EXPECT_EQ(xt::view(a, xt::range(0, 10), xt::range(0, 6)), ref);
+    }
+#endif
+
+    TEST(xzarr_hierarchy, partitioned_write_validation)
+    {
+        xzarr_memory_store s;
+        auto h = create_zarr_hierarchy(s);
+        std::vector<size_t> shape = {10, 6};
+        std::vector<size_t> chunk_shape = {3, 4};
+        h.create_array("/arthur/dent", shape, chunk_shape, "<f8");
+
+        // worker 0 commits a partial slab, whatever the number of chunks it reports
+        auto w0 = h.get_partition_writer<double>("/arthur/dent", 0, 2);
+        xarray<double> rows(std::vector<size_t>({3, 6}), 1.);
+        w0.write(rows, std::vector<size_t>({0, 0}));
+        w0.commit();
+        s["data/root/arthur/dent/.partitions/0"] = std::string(
+            "{\"worker\": 0, \"nworkers\": 2, \"axis\": 0, \"first_chunk\": 0, \"last_chunk\": 2, \"chunks\": 4}");
+        // worker 1 leaves its whole slab to the fill value
+        auto w1 = h.get_partition_writer<double>("/arthur/dent", 1, 2);
+        for (size_t i = 2; i < 4; ++i)
+        {
+            for (size_t j = 0; j < 2; ++j)
+            {
+                w1.mark_fill_chunk(std::vector<size_t>({i, j}));
+            }
+        }
+        EXPECT_THROW(w1.mark_fill_chunk(std::vector<size_t>({1, 0})), std::runtime_error);
+        w1.commit();
+        auto report = h.finalize_partitions("/arthur/dent", 2);
+        EXPECT_EQ(report.missing, std::vector<size_t>());
+        EXPECT_EQ(report.incomplete, std::vector<size_t>({0}));
+
+        w0.mark_fill_chunk(std::vector<size_t>({1, 0}));
+        w0.mark_fill_chunk(std::vector<size_t>({1, 1}));
+        w0.commit();
+        EXPECT_TRUE(h.finalize_partitions("/arthur/dent", 2).complete());
+    }
+
+    // writes the first four rows of a 5x4 array in 2x3 chunks with arange(16);
+    // the last row is not written and keeps the fill value
+    xarray<double> write_partial_rows(xzarr_hierarchy<xzarr_memory_store>& h, const std::string& path, double fill_value)
+    {
+        xzarr_create_array_options<xio_binary_config> o;
+        o.fill_value = fill_value;
+        std::vector<size_t> shape = {5, 4};
+        std::vector<size_t> chunk_shape = {2, 3};
+        h.create_array(path, shape, chunk_shape, "<f8", o);
+        xarray<double> rows = arange(4 * 4).reshape({4, 4});
+        h.get_concurrent_writer<double>(path).write(rows, std::vector<size_t>({0, 0}));
+        return rows;
+    }
+
+    TEST(xzarr_hierarchy, reduce)
+    {
+        xzarr_memory_store s;
+        auto h = create_zarr_hierarchy(s);
+        write_partial_rows(h, "/arthur/dent", 1.);
+
+        EXPECT_EQ(sum_zarr_array(s, "/arthur/dent", 3), 124.);
+        EXPECT_EQ(mean_zarr_array(s, "/arthur/dent", 3, 2), 6.2);
+        EXPECT_EQ(amax_zarr_array(s, "/arthur/dent", 3), 15.);
+        EXPECT_EQ(amin_zarr_array(s, "/arthur/dent", 3), 0.);
+        xarray<double> col_sums = {25., 29., 33., 37.};
+        EXPECT_EQ(h.reduce("/arthur/dent", xzarr_reducer::sum, {0}, 4), col_sums);
+        xarray<double> row_max = {3., 7., 11., 15., 1.};
+        EXPECT_EQ(h.reduce("/arthur/dent", xzarr_reducer::amax, {1}), row_max);
+        EXPECT_THROW(h.reduce("/arthur/dent", xzarr_reducer::sum, {2}), std::runtime_error);
+    }
+
+    TEST(xzarr_hierarchy, map_chunks)
+    {
+        xzarr_memory_store s;
+        auto h = create_zarr_hierarchy(s);
+        xarray<double> rows = write_partial_rows(h, "/arthur/dent", 1.);
+        std::vector<size_t> shape = {5, 4};
+        std::vector<size_t> chunk_shape = {2, 3};
+        h.create_array("/tricia/mcmillan", shape, chunk_shape, "<f4");
+
+        h.map_chunks<double, float>("/arthur/dent", "/tricia/mcmillan", [](const auto& in, auto& out)
+        {
+            out = 2. * in;
+        }, 2);
+        auto a = h.get_array("/tricia/mcmillan").get_array<float>();
+        xarray<float> ref(std::vector<size_t>({5, 4}), 2.f);
+        xt::view(ref, xt::range(0, 4), xt::all()) = 2.f * rows;
+        EXPECT_EQ(xt::view(a, xt::range(0, 5), xt::range(0, 4)), ref);
+        EXPECT_THROW(h.map_chunks<float>("/arthur/dent", "/tricia/mcmillan", [](const auto&, auto&) {}), std::runtime_error);
+
+        // into an array of another hierarchy, of the same Zarr version
+        xzarr_memory_store s2;
+        auto h2 = create_zarr_hierarchy(s2);
+        h2.create_array("/tricia/mcmillan", shape, chunk_shape, "<f4");
+        h.map_chunks<double, float>("/arthur/dent", h2, "/tricia/mcmillan", [](const auto& in, auto& out)
+        {
+            out = 2. * in;
+        });
+        auto a2 = h2.get_array("/tricia/mcmillan").get_array<float>();
+        EXPECT_EQ(xt::view(a2, xt::range(0, 5), xt::range(0, 4)), ref);
+        xzarr_memory_store s3;
+        auto h3 = create_zarr_hierarchy(s3, "2");
+        h3.create_array("/tricia/mcmillan", shape, chunk_shape, "<f8");
+        EXPECT_THROW(h.map_chunks<double>("/arthur/dent", h3, "/tricia/mcmillan", [](const auto&, auto&) {}), std::runtime_error);
+        h.create_array("/ford/prefect", std::vector<size_t>({5, 5}), chunk_shape, "<f8");
+        EXPECT_THROW(h.map_chunks<double>("/arthur/dent", "/ford/prefect", [](const auto&, auto&) {}), std::runtime_error);
+    }
+
+    TEST(xzarr_hierarchy, map_chunks_batched_io)
+    {
+        // chunks are read and written in batches with the get_many/set_many of the store
+        fs::remove_all("h_map.zr3");
+        auto h = create_zarr_hierarchy("h_map.zr3");
+        std::vector<size_t> shape = {9, 9};
+        std::vector<size_t> chunk_shape = {2, 2};
+        h.create_array("/arthur/dent", shape, chunk_shape, "<f8");
+        h.create_array("/tricia/mcmillan", shape, chunk_shape, "<f8");
+        xarray<double> a = arange(9 * 9).reshape({9, 9});
+        h.get_concurrent_writer<double>("/arthur/dent").write(a, std::vector<size_t>({0, 0}));
+
+        h.map_chunks<double>("/arthur/dent", "/tricia/mcmillan", [](const auto& in, auto& out)
+        {
+            out = in + 1.;
+        }, 2);
+        auto b = h.get_array("/tricia/mcmillan").get_array<double>();
+        xarray<double> ref = a + 1.;
+        EXPECT_EQ(xt::view(b, xt::range(0, 9), xt::range(0, 9)), ref);
+    }
+
+    TEST(xzarr_hierarchy, chunk_stats)
+    {
+        xzarr_memory_store s;
+        auto h = create_zarr_hierarchy(s);
+        write_partial_rows(h, "/arthur/dent", -1.);
+
+        // the writer stored the statistics of the chunks it wrote, the last chunk row is unknown
+        xzarr_chunk_stats_index written;
+        ASSERT_TRUE(read_zarr_chunk_stats(s, "/arthur/dent", 3, written));
+        EXPECT_EQ(written.chunks[2].max, 14.);
+        EXPECT_TRUE(std::isinf(written.chunks[5].max));
+        auto partial = h.query("/arthur/dent", 9., 11.);
+        EXPECT_EQ(partial.scanned_chunks, 4u);
+        EXPECT_EQ(partial.skipped_chunks, 2u);
+        auto index = h.build_chunk_stats("/arthur/dent", 2);
+        ASSERT_EQ(index.chunks.size(), 6u);
+        EXPECT_EQ(index.chunks[2].min, 8.);
+        EXPECT_EQ(index.chunks[2].max, 14.);
+        EXPECT_EQ(index.chunks[2].count, 6u);
+        EXPECT_EQ(index.chunks[5].count, 1u);
+        auto result = h.query("/arthur/dent", 9., 11.);
+        EXPECT_EQ(result.scanned_chunks, 2u);
+        EXPECT_EQ(result.skipped_chunks, 4u);
+        EXPECT_EQ(result.indices, std::vector<size_t>({9, 10, 11}));
+        EXPECT_EQ(result.values, partial.values);
+        EXPECT_EQ(h.query("/arthur/dent", -1., -1.).indices, std::vector<size_t>({16, 17, 18, 19}));
+
+        // the index is erased by the first write, and merged with the written chunks on flush
+        auto w = h.get_concurrent_writer<double>("/arthur/dent");
+        xarray<double> block(std::vector<size_t>({2, 3}), 100.);
+        w.write(block, std::vector<size_t>({0, 0}));
+        EXPECT_FALSE(s["data/root/arthur/dent/.zstats"].exists());
+        w.flush();
+        ASSERT_TRUE(read_zarr_chunk_stats(s, "/arthur/dent", 3, written));
+        EXPECT_EQ(written.chunks[0].max, 100.);
+        EXPECT_EQ(written.chunks[5].count, 1u);
+        auto updated = h.query("/arthur/dent", 99., 101.);
+        EXPECT_EQ(updated.indices, std::vector<size_t>({0, 1, 2, 4, 5, 6}));
+        EXPECT_EQ(updated.skipped_chunks, 5u);
+    }
+
+    TEST(xzarr_hierarchy, pyramid)
+    {
+        xzarr_memory_store s;
+        auto h = create_zarr_hierarchy(s);
+        h.create_group("/arthur");
+        write_partial_rows(h, "/arthur/0", 1.);
+
+        xzarr_pyramid_options o;
+        o.levels = 2;
+        auto paths = h.build_pyramid("/arthur/0", o);
+        EXPECT_EQ(paths, std::vector<std::string>({"/arthur/0", "/arthur/1", "/arthur/2"}));
+        auto a = h.get_array("/arthur/1").get_array<double>();
+        ASSERT_EQ(a.shape(), std::vector<size_t>({3, 2}));
+        // the truncated blocks of the last row only hold the fill value
+        xarray<double> ref = {{2.5, 4.5}, {10.5, 12.5}, {1., 1.}};
+        EXPECT_EQ(xt::view(a, xt::range(0, 3), xt::range(0, 2)), ref);
+        auto multiscales = read_zarr_attrs(s, "/arthur", 3)["multiscales"];
+        ASSERT_EQ(multiscales.size(), 1u);
+        EXPECT_EQ(multiscales[0]["datasets"].size(), 3u);
+        EXPECT_EQ(multiscales[0]["datasets"][2]["path"], "2");
+
+        o.levels = 1;
+        o.method = xzarr_downsampling::nearest;
+        h.build_pyramid("/arthur/0", o);
+        auto b = h.get_array("/arthur/1").get_array<double>();
+        xarray<double> nearest = {{0., 2.}, {8., 10.}, {1., 1.}};
+        EXPECT_EQ(xt::view(b, xt::range(0, 3), xt::range(0, 2)), nearest);
+    }
+
+    TEST(xzarr_checksum, digests)
+    {
+        EXPECT_EQ(crc32c("123456789", 9), 0xE3069283u);
+        EXPECT_EQ(xxhash64("", 0), 0xEF46DB3751D8E999ull);
+        EXPECT_EQ(xxhash64("abc", 3), 0x44BC2CF5AD770999ull);
+        std::string data(1000, 'x');
+        EXPECT_EQ(crc32c(data.data() + 500, 500, crc32c(data.data(), 500)), crc32c(data.data(), data.size()));
+    }
+
+    TEST(xzarr_hierarchy, checksum)
+    {
+        for (std::string version: {"2", "3"})
+        {
+            xzarr_memory_store s;
+            auto h = create_zarr_hierarchy(s, version);
+            xzarr_create_array_options<xio_binary_config> o;
+            o.checksum = "crc32c";
+            std::vector<size_t> shape = {4, 4};
+            std::vector<size_t> chunk_shape = {2, 2};
+            h.create_array("/arthur/dent", shape, chunk_shape, "<f8", o);
+            xarray<double> ref = arange(4 * 4).reshape({4, 4});
+            h.get_concurrent_writer<double>("/arthur/dent").write(ref, std::vector<size_t>({0, 0}));
+            auto a = h.get_array("/arthur/dent").get_array<double>();
+            EXPECT_EQ(xt::view(a, xt::range(0, 4), xt::range(0, 4)), ref);
+
+            // Zarr v2 digests are in sidecar keys, Zarr v3 digests follow the chunks
+            std::string key = (version == "2") ? "arthur/dent/0.0" : "data/root/arthur/dent/c0/0";
+            EXPECT_EQ(s[key + ".crc32c"].exists(), version == "2");
+            std::string bytes = s[key];
+            EXPECT_EQ(bytes.size(), (version == "2") ? 32u : 36u);
+            bytes[0] ^= 1;
+            s[key] = bytes;
+            EXPECT_THROW(h.get_array("/arthur/dent").get_array<double>()(0, 0), std::runtime_error);
+            // without verification, the corrupted value is read
+            double expected = 0.;
+            std::memcpy(&expected, bytes.data(), sizeof(double));
+            double value = 0.;
+            EXPECT_NO_THROW(value = h.get_array("/arthur/dent", 1, 0, false).get_array<double>()(0, 0));
+            EXPECT_EQ(value, expected);
+            EXPECT_NE(value, ref(0, 0));
+        }
+        xzarr_memory_store s;
+        auto h = create_zarr_hierarchy(s);
+        xzarr_create_array_options<xio_binary_config> o;
+        o.checksum = "md5";
+        EXPECT_THROW(h.create_array("/foo", std::vector<size_t>({4}), std::vector<size_t>({2}), "<f8", o), std::runtime_error);
+    }
+
+    // writes a 4x4 Zarr v3 array "/arthur/dent" made of two chunks of rows
+    template <class store_type>
+    void write_copy_source(store_type& s)
+    {
+        create_zarr_hierarchy(s);
+        xzarr_array_metadata m;
+        m.path = "/arthur/dent";
+        m.zarr_version = 3;
+        m.shape = {4, 4};
+        m.chunk_shape = {2, 4};
+        m.dtype = "<f8";
+        write_zarr_array_metadata(s, m);
+        for (std::size_t i = 0; i < 2; ++i)
+        {
+            xarray<double> chunk = arange<double>(i * 8, (i + 1) * 8);
+            s[m.chunk_key(std::vector<std::size_t>{i, 0})] = xchunk_codec_factory<double>::encode("binary", chunk, m.compressor_config, false);
+        }
+    }
+
+    TEST(xzarr_hierarchy, copy_array)
+    {
+        register_compressor_once<xzarr_file_system_store, xzarr_zstd_config>();
+        auto h2 = create_zarr_hierarchy("h_xtensor_copy.zr2", "2");
+        xzarr_file_system_store s2("h_xtensor_copy.zr2");
+        xzarr_array_metadata m;
+        m.path = "/arthur/dent";
+        m.zarr_version = 2;
+        m.shape = {4, 4};
+        m.chunk_shape = {2, 4};
+        m.dtype = "<f8";
+        m.chunk_separator = '.';
+        write_zarr_array_metadata(s2, m);
+        for (std::size_t i = 0; i < 2; ++i)
+        {
+            xarray<double> chunk = arange<double>(i * 8, (i + 1) * 8);
+            s2[m.chunk_key(std::vector<std::size_t>{i, 0})] = xchunk_codec_factory<double>::encode("binary", chunk, m.compressor_config, false);
+        }
+
+        // same codec: chunks are renamed from v2 to v3 keys
+        auto h3 = create_zarr_hierarchy("h_xtensor_copy.zr3");
+        xzarr_file_system_store s3("h_xtensor_copy.zr3");
+        auto stats = h2.copy_array("/arthur/dent", h3);
+        EXPECT_EQ(stats.copied, 2u);
+        EXPECT_TRUE(s3["data/root/arthur/dent/c1/0"].exists());
+        xarray<double> ref = arange(4 * 4).reshape({4, 4});
+        auto a = h3.get_array("/arthur/dent").get_array<double>();
+        EXPECT_EQ(xt::view(a, xt::range(0, 4), xt::range(0, 4)), ref);
+
+        // another codec: chunks are transcoded, and resuming skips the existing ones
+        xzarr_copy_options o;
+        o.compressor = "zstd";
+        o.compressor_config = {{"level", 3}};
+        stats = h3.copy_array("/arthur/dent", h3, "/ford/prefect", o);
+        EXPECT_EQ(stats.transcoded, 2u);
+        s3["data/root/ford/prefect/c1/0"].erase();
+        o.resume = true;
+        stats = h3.copy_array("/arthur/dent", h3, "/ford/prefect", o);
+        EXPECT_EQ(stats.transcoded, 1u);
+        EXPECT_EQ(stats.skipped, 1u);
+        auto b = h3.get_array("/ford/prefect").get_array<double>();
+        EXPECT_EQ(xt::view(b, xt::range(0, 4), xt::range(0, 4)), ref);
+    }
+
+    TEST(xzarr_hierarchy, memory_store)
+    {
+        xzarr_memory_store src_store;
+        write_copy_source(src_store);
+        auto src = get_zarr_hierarchy(src_store);
+        xzarr_memory_store s;
+        auto h = create_zarr_hierarchy(s);
+        auto stats = src.copy_array("/arthur/dent", h);
+        EXPECT_EQ(stats.copied, 2u);
+        EXPECT_TRUE(s["data/root/arthur/dent/c1/0"].exists());
+        EXPECT_EQ(h.get_children("/arthur")["dent"], "array");
+        xarray<double> ref = arange(4 * 4).reshape({4, 4});
+        auto a = h.get_array("/arthur/dent").get_array<double>();
+        EXPECT_EQ(xt::view(a, xt::range(0, 4), xt::range(0, 4)), ref);
+
+        // copies of the store share its content
+        xzarr_memory_store s2 = s;
+        s2.erase_prefix("data/root/arthur");
+        EXPECT_FALSE(s["data/root/arthur/dent/c1/0"].exists());
+        EXPECT_EQ(s.list_prefix("data").size(), 0u);
+    }
+
+    TEST(xzarr_hierarchy, copy_hierarchy_v3_to_v2)
+    {
+        xzarr_memory_store s3;
+        write_copy_source(s3);
+        auto h3 = get_zarr_hierarchy(s3);
+        h3.create_group("", {{"answer", 42}});
+        xzarr_memory_store s2;
+        auto h2 = create_zarr_hierarchy(s2, "2");
+        auto stats = h3.copy_hierarchy(h2);
+        EXPECT_EQ(stats.copied, 2u);
+        // the root attributes are at the top level, and the implicit group "/arthur" becomes explicit
+        EXPECT_EQ(nlohmann::json::parse(std::string(s2[".zattrs"])), nlohmann::json({{"answer", 42}}));
+        EXPECT_TRUE(s2[".zgroup"].exists());
+        EXPECT_TRUE(s2["arthur/.zgroup"].exists());
+        EXPECT_TRUE(s2["arthur/dent/.zarray"].exists());
+    }
+
+    TEST(xzarr_hierarchy, visit_nodes)
+    {
+        xzarr_memory_store s;
+        auto h = create_zarr_hierarchy(s);
+        for (auto key: {"meta/root/x.group.json", "meta/root/x.y/a.array.json", "meta/root/x/a.array.json", "meta/root/x/b/c.array.json"})
+        {
+            s[key] = std::string("{}");
+        }
+        EXPECT_EQ(h.get_nodes().dump(), "{\"x\":\"explicit_group\",\"x.y\":\"implicit_group\",\"x.y/a\":\"array\",\"x/a\":\"array\",\"x/b\":\"implicit_group\",\"x/b/c\":\"array\"}");
+
+        // each node is visited once, in lexicographic order
+        std::vector<std::string> names;
+        xzarr_node<xzarr_memory_store>(s, "/x", 3).visit_nodes([&names](const std::string& name, xzarr_node_type)
+        {
+            names.push_back(name);
+        });
+        std::vector<std::string> ref = {"a", "b", "b/c"};
+        EXPECT_EQ(names, ref);
+    }
+
+    TEST(xzarr_hierarchy, walk)
+    {
+        xzarr_memory_store s;
+        auto h = create_zarr_hierarchy(s);
+        h.create_group("/x");
+        for (auto key: {"meta/root/x/a.array.json", "meta/root/x/b/c.array.json", "meta/root/y/d.array.json"})
+        {
+            s[key] = std::string("{\"name\": \"") + key + "\"}";
+        }
+        EXPECT_EQ(h.get_children("/x").dump(), "{\"a\":\"array\",\"b\":\"implicit_group\"}");
+
+        std::map<std::string, std::string> nodes;
+        std::size_t nmetadata = 0;
+        h.walk("/", [&](const std::string& name, xzarr_node_type type, const nlohmann::json& metadata)
+        {
+            nodes[name] = detail::node_type_name(type);
+            if (type == xzarr_node_type::array)
+            {
+                EXPECT_EQ(metadata["name"], "meta/root/" + name + ".array.json");
+            }
+            nmetadata += metadata.is_null() ? 0 : 1;
+        }, 4);
+        EXPECT_EQ(nlohmann::json(nodes), h.get_nodes());
+        EXPECT_EQ(nmetadata, 4u);
+    }
+
+    TEST(xzarr_hierarchy, attrs)
+    {
+        xzarr_memory_store s3;
+        auto h3 = create_zarr_hierarchy(s3);
+        h3.create_group("/x", {{"a", 1}});
+        s3["meta/root/x/y.array.json"] = std::string("{\"attributes\": {\"b\": 2}}");
+        EXPECT_EQ(h3.get_attrs("/x"), nlohmann::json({{"a", 1}}));
+        EXPECT_EQ(h3.get_attrs("/z"), nlohmann::json::object());
+        h3.update_attrs({{"/x", {{"a", nullptr}, {"c", 3}}}, {"/x/y", {{"d", 4}}}}, 2);
+        auto attrs = h3.get_attrs({"/x", "/x/y"}, 2);
+        EXPECT_EQ(attrs["/x"], nlohmann::json({{"c", 3}}));
+        EXPECT_EQ(attrs["/x/y"], nlohmann::json({{"b", 2}, {"d", 4}}));
+        EXPECT_THROW(h3.set_attrs("/z", {{"e", 5}}), std::runtime_error);
+
+        // Zarr v2 attributes are only read when asked for
+        xzarr_memory_store s2;
+        auto h2 = create_zarr_hierarchy(s2, "2");
+        s2["x/.zarray"] = std::string("{}");
+        EXPECT_EQ(h2.get_attrs("/x"), nlohmann::json::object());
+        h2.update_attrs({{"/x", {{"a", 1}}}});
+        EXPECT_EQ(nlohmann::json::parse(std::string(s2["x/.zattrs"])), nlohmann::json({{"a", 1}}));
+        EXPECT_EQ(xzarr_group<xzarr_memory_store>(s2, "x", 2).attrs(), nlohmann::json({{"a", 1}}));
+
+        // loaded attributes are kept, and shared by the copies of a hierarchy
+        auto h2_copy = h2;
+        s2["x/.zattrs"] = std::string("{\"b\": 2}");
+        EXPECT_EQ(h2_copy.get_attrs("/x"), nlohmann::json({{"b", 2}}));
+        s2["x/.zattrs"] = std::string("{\"c\": 3}");
+        EXPECT_EQ(h2.get_attrs("/x"), nlohmann::json({{"b", 2}}));
+        h2.set_attrs("/x", {{"d", 4}});
+        EXPECT_EQ(h2_copy.get_attrs("/x"), nlohmann::json({{"d", 4}}));
+    }
+
+    TEST(xzarr_hierarchy, zip_store)
+    {
+        {
+            xzarr_memory_store src_store;
+            write_copy_source(src_store);
+            auto src = get_zarr_hierarchy(src_store);
+            xzarr_zip_store s("h_xtensor.zip", 'w');
+            auto h = create_zarr_hierarchy(s);
+            src.copy_array("/arthur/dent", h);
+        }
+        xzarr_zip_store s("h_xtensor.zip");
+        auto h = get_zarr_hierarchy(s);
+        EXPECT_EQ(h.get_nodes().dump(), "{\"arthur\":\"implicit_group\",\"arthur/dent\":\"array\"}");
+        xarray<double> ref = arange(4 * 4).reshape({4, 4});
+        auto a = h.get_array("/arthur/dent").get_array<double>();
+        EXPECT_EQ(xt::view(a, xt::range(0, 4), xt::range(0, 4)), ref);
+        EXPECT_THROW(s["zarr.json"] = std::string("{}"), std::runtime_error);
+    }
+
+    TEST(xzarr_request_limiter, run)
+    {
+        xzarr_request_config config;
+        config.max_connections = 2;
+        config.max_retries = 3;
+        config.initial_backoff = std::chrono::milliseconds(1);
+        xzarr_request_limiter limiter(config);
+
+        std::atomic<int> active(0);
+        std::atomic<int> peak(0);
+        xzarr_parallel_for(std::size_t(64), std::size_t(8), [&](std::size_t)
+        {
+            limiter.run([&]()
+            {
+                int n = ++active;
+                int p = peak;
+                while (n > p && !peak.compare_exchange_weak(p, n))
+                {
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+                --active;
+                return 0;
+            }, [](int) { return false; });
+        });
+        EXPECT_LE(peak.load(), 2);
+
+        // transient errors are retried, up to max_retries times
+        int attempts = 0;
+        EXPECT_EQ(limiter.run([&]() { return ++attempts; }, [](int n) { return n < 3; }), 3);
+        attempts = 0;
+        EXPECT_EQ(limiter.run([&]() { return ++attempts; }, [](int) { return true; }), 4);
+    }
 }